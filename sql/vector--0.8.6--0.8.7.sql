@@ -294,3 +294,13 @@ COMMENT ON OPERATOR <> (sparsevec, sparsevec) IS 'not equal';
 COMMENT ON OPERATOR >= (sparsevec, sparsevec) IS 'greater than or equal';
 
 COMMENT ON OPERATOR > (sparsevec, sparsevec) IS 'greater than';
+
+CREATE FUNCTION hnsw_clean_pending_list(regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION hnsw_clean_pending_list(regclass) IS 'move tuples from hnsw pending list into graph';
+
+CREATE FUNCTION hnsw_compact(regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION hnsw_compact(regclass) IS 'move hnsw elements into free space and truncate empty pages';
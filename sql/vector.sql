@@ -392,6 +392,18 @@ CREATE FUNCTION hnsw_sparsevec_support(internal) RETURNS internal
 
 COMMENT ON FUNCTION hnsw_sparsevec_support(internal) IS 'hnsw sparsevec support';
 
+-- access method functions
+
+CREATE FUNCTION hnsw_clean_pending_list(regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION hnsw_clean_pending_list(regclass) IS 'move tuples from hnsw pending list into graph';
+
+CREATE FUNCTION hnsw_compact(regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION hnsw_compact(regclass) IS 'move hnsw elements into free space and truncate empty pages';
+
 -- vector opclasses
 
 CREATE OPERATOR CLASS vector_ops
@@ -37,6 +37,7 @@ int			hnsw_iterative_scan;
 int			hnsw_max_scan_tuples;
 double		hnsw_scan_mem_multiplier;
 int			hnsw_lock_tranche_id;
+int			hnsw_pending_list_limit;
 static relopt_kind hnsw_relopt_kind;
 
 /*
@@ -89,6 +90,10 @@ HnswInit(void)
 					  HNSW_DEFAULT_M, HNSW_MIN_M, HNSW_MAX_M, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "ef_construction", "Size of the dynamic candidate list for construction",
 					  HNSW_DEFAULT_EF_CONSTRUCTION, HNSW_MIN_EF_CONSTRUCTION, HNSW_MAX_EF_CONSTRUCTION, AccessExclusiveLock);
+	add_bool_reloption(hnsw_relopt_kind, "fastupdate", "Enables fast update with a pending list",
+					   false, ShareUpdateExclusiveLock);
+	add_bool_reloption(hnsw_relopt_kind, "reverse_edges", "Tracks reverse edges so vacuum only repairs affected elements (takes effect on REINDEX)",
+					   false, AccessExclusiveLock);
 
 	DefineCustomIntVariable("hnsw.ef_search", "Sets the size of the dynamic candidate list for search",
 							"Valid range is 1..1000.", &hnsw_ef_search,
@@ -108,6 +113,11 @@ HnswInit(void)
 							 NULL, &hnsw_scan_mem_multiplier,
 							 1, 1, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	/* Same default as gin_pending_list_limit */
+	DefineCustomIntVariable("hnsw.pending_list_limit", "Sets the max size of the pending list for fastupdate",
+							NULL, &hnsw_pending_list_limit,
+							HNSW_DEFAULT_PENDING_LIST_LIMIT, HNSW_MIN_PENDING_LIST_LIMIT, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("hnsw");
 }
 
@@ -164,7 +174,7 @@ hnswcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	genericcostestimate(root, path, loop_count, &costs);
 
 	index = index_open(path->indexinfo->indexoid, NoLock);
-	HnswGetMetaPageInfo(index, &m, NULL);
+	HnswGetMetaPageInfo(index, &m, NULL, NULL);
 	index_close(index, NoLock);
 
 	/*
@@ -241,6 +251,8 @@ hnswoptions(Datum reloptions, bool validate)
 	static const relopt_parse_elt tab[] = {
 		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
 		{"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
+		{"fastupdate", RELOPT_TYPE_BOOL, offsetof(HnswOptions, fastupdate)},
+		{"reverse_edges", RELOPT_TYPE_BOOL, offsetof(HnswOptions, reverseEdges)},
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
@@ -10,6 +10,7 @@
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
+#include "port/atomics.h"
 #include "storage/bufpage.h"
 #include "storage/condition_variable.h"
 #include "storage/lwlock.h"
@@ -38,10 +39,29 @@ typedef Pointer Item;
 #define HNSW_NORM_PROC 2
 #define HNSW_TYPE_INFO_PROC 3
 
-#define HNSW_VERSION	1
+#define HNSW_VERSION	2
 #define HNSW_MAGIC_NUMBER 0xA953A953
+
+/* Version that added a distance for each neighbor */
+#define HNSW_NEIGHBOR_DISTANCES_VERSION	2
+
+/* Version that added the pending list */
+#define HNSW_PENDING_LIST_VERSION	2
+
+/* Version that added insert pages for each stripe */
+#define HNSW_INSERT_STRIPES_VERSION	2
+
+/* Version that added reverse edges */
+#define HNSW_REVERSE_EDGES_VERSION	2
+
+/* Version that replaced the scan lock with shared memory counters */
+#define HNSW_SCAN_SLOTS_VERSION	2
 #define HNSW_PAGE_ID	0xFF90
 
+/* Page flags */
+#define HNSW_REVERSE_PAGE	(1 << 0)	/* reverse edges or directory */
+#define HNSW_COMPACTING		(1 << 1)	/* metapage while elements are moved */
+
 /* Preserved page numbers */
 #define HNSW_METAPAGE_BLKNO	0
 #define HNSW_HEAD_BLKNO		1	/* first element page */
@@ -49,6 +69,8 @@ typedef Pointer Item;
 /* Must correspond to page numbers since page lock is used */
 #define HNSW_UPDATE_LOCK 	0
 #define HNSW_SCAN_LOCK		1
+#define HNSW_PENDING_LOCK	2
+#define HNSW_PENDING_SCAN_LOCK	3
 
 /* HNSW parameters */
 #define HNSW_DEFAULT_M	16
@@ -60,10 +82,22 @@ typedef Pointer Item;
 #define HNSW_DEFAULT_EF_SEARCH	40
 #define HNSW_MIN_EF_SEARCH		1
 #define HNSW_MAX_EF_SEARCH		1000
+#define HNSW_DEFAULT_PENDING_LIST_LIMIT	4096
+#define HNSW_MIN_PENDING_LIST_LIMIT	64
+
+/* Concurrent inserts are spread across this many insert pages */
+#define HNSW_INSERT_STRIPES	8
+
+/* Pending tuples (or pages) added to the graph together */
+#define HNSW_INSERT_BATCH_SIZE	64
+
+/* Reverse edges are partitioned by the block of the target */
+#define HNSW_REVERSE_BUCKETS	512
 
 /* Tuple types */
 #define HNSW_ELEMENT_TUPLE_TYPE  1
 #define HNSW_NEIGHBOR_TUPLE_TYPE 2
+#define HNSW_PENDING_TUPLE_TYPE 3
 
 /* Make graph robust against non-HOT updates */
 #define HNSW_HEAPTIDS 10
@@ -79,12 +113,20 @@ typedef Pointer Item;
 #define HNSW_TUPLE_ALLOC_SIZE BLCKSZ
 
 #define HNSW_ELEMENT_TUPLE_SIZE(size)	MAXALIGN(add_size(offsetof(HnswElementTupleData, data), size))
-#define HNSW_NEIGHBOR_TUPLE_SIZE(level, m)	MAXALIGN(add_size(offsetof(HnswNeighborTupleData, indextids), mul_size(sizeof(ItemPointerData), mul_size(add_size(level, 2), (Size) (m)))))
+#define HNSW_PENDING_TUPLE_SIZE(size)	MAXALIGN(add_size(offsetof(HnswPendingTupleData, data), size))
+#define HNSW_NEIGHBOR_COUNT(level, m)	mul_size(add_size(level, 2), (Size) (m))
+#define HNSW_NEIGHBOR_DISTANCES_OFFSET(count)	INTALIGN(add_size(offsetof(HnswNeighborTupleData, indextids), mul_size(sizeof(ItemPointerData), (Size) (count))))
+#define HNSW_NEIGHBOR_TUPLE_SIZE(level, m, distances)	((distances) ? \
+	MAXALIGN(add_size(HNSW_NEIGHBOR_DISTANCES_OFFSET(HNSW_NEIGHBOR_COUNT(level, m)), mul_size(sizeof(float), HNSW_NEIGHBOR_COUNT(level, m)))) : \
+	MAXALIGN(add_size(offsetof(HnswNeighborTupleData, indextids), mul_size(sizeof(ItemPointerData), HNSW_NEIGHBOR_COUNT(level, m)))))
 
 #define HNSW_NEIGHBOR_ARRAY_SIZE(lm)	add_size(offsetof(HnswNeighborArray, items), mul_size(sizeof(HnswCandidate), (Size) (lm)))
 
 #define HnswPageGetOpaque(page)	((HnswPageOpaque) PageGetSpecialPointer(page))
 #define HnswPageGetMeta(page)	((HnswMetaPageData *) PageGetContents(page))
+#define HnswPageGetReverseDir(page)	((HnswReverseDirData *) PageGetContents(page))
+#define HnswPageGetReverseEdges(page)	((HnswReverseEdge *) PageGetContents(page))
+#define HnswReversePageCount(page)	((((PageHeader) (page))->pd_lower - (PageGetContents(page) - (char *) (page))) / sizeof(HnswReverseEdge))
 
 #ifdef HNSW_BENCH
 #define HnswBench(name, code) \
@@ -116,8 +158,10 @@ typedef Pointer Item;
 
 #if PG_VERSION_NUM >= 190000
 #define palloc_array_checked(type, count) ((type *) palloc_array(type, count))
+#define palloc0_array_checked(type, count) ((type *) palloc0_array(type, count))
 #else
 #define palloc_array_checked(type, count) ((type *) palloc(mul_size(sizeof(type), count)))
+#define palloc0_array_checked(type, count) ((type *) palloc0(mul_size(sizeof(type), count)))
 #endif
 
 #define HnswIsElementTuple(tup) ((tup)->type == HNSW_ELEMENT_TUPLE_TYPE)
@@ -129,8 +173,16 @@ typedef Pointer Item;
 /* Optimal ML from paper */
 #define HnswGetMl(m) (1 / log(m))
 
-/* Ensure fits on page and in uint8 */
-#define HnswGetMaxLevel(m) Min(((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData)) - offsetof(HnswNeighborTupleData, indextids) - sizeof(ItemIdData)) / sizeof(ItemPointerData) / (Size) (m)) - 2, 63)
+/* Ensure fits on page (with neighbor distances and padding) and in uint8 */
+#define HnswGetMaxLevel(m) Min(((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData)) - offsetof(HnswNeighborTupleData, indextids) - sizeof(ItemIdData) - MAXIMUM_ALIGNOF - sizeof(float)) / (sizeof(ItemPointerData) + sizeof(float)) / (Size) (m)) - 2, 63)
+
+/* Neighbor distances are stored after neighbor TIDs */
+#define HnswHasNeighborDistances(version) ((version) >= HNSW_NEIGHBOR_DISTANCES_VERSION)
+#define HnswHasPendingList(version) ((version) >= HNSW_PENDING_LIST_VERSION)
+#define HnswHasInsertStripes(version) ((version) >= HNSW_INSERT_STRIPES_VERSION)
+#define HnswHasReverseEdges(version) ((version) >= HNSW_REVERSE_EDGES_VERSION)
+#define HnswHasScanSlots(version) ((version) >= HNSW_SCAN_SLOTS_VERSION)
+#define HnswNeighborTupleDistances(ntup) ((float *) ((char *) (ntup) + HNSW_NEIGHBOR_DISTANCES_OFFSET((ntup)->count)))
 
 #define HnswGetSearchCandidate(membername, ptr) pairingheap_container(HnswSearchCandidate, membername, ptr)
 #define HnswGetSearchCandidateConst(membername, ptr) pairingheap_const_container(HnswSearchCandidate, membername, ptr)
@@ -157,6 +209,7 @@ extern int	hnsw_iterative_scan;
 extern int	hnsw_max_scan_tuples;
 extern double hnsw_scan_mem_multiplier;
 extern int	hnsw_lock_tranche_id;
+extern int	hnsw_pending_list_limit;
 
 typedef enum HnswIterativeScanMode
 {
@@ -227,6 +280,8 @@ typedef struct HnswOptions
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			m;				/* number of connections */
 	int			efConstruction; /* size of dynamic candidate list */
+	bool		fastupdate;		/* use pending list for inserts */
+	bool		reverseEdges;	/* track reverse edges for vacuum */
 }			HnswOptions;
 
 typedef struct HnswGraph
@@ -300,8 +355,19 @@ typedef struct HnswSupport
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
 	Oid			collation;
+	struct distancehash_hash *distances;
+	bool		distancesInMemory;
 }			HnswSupport;
 
+typedef struct HnswInsertState
+{
+	const		HnswTypeInfo *typeInfo;
+	bool		fastupdate;
+	FmgrInfo	procinfo;
+	FmgrInfo	normprocinfo;
+	HnswSupport support;
+}			HnswInsertState;
+
 typedef struct HnswQuery
 {
 	Datum		value;
@@ -356,6 +422,12 @@ typedef struct HnswMetaPageData
 	OffsetNumber entryOffno;
 	int16		entryLevel;
 	BlockNumber insertPage;
+	BlockNumber pendingHead;
+	BlockNumber pendingTail;
+	uint32		pendingPages;
+	BlockNumber insertPages[HNSW_INSERT_STRIPES];
+	BlockNumber reverseDir;
+	BlockNumber compactBlkno;
 }			HnswMetaPageData;
 
 typedef HnswMetaPageData * HnswMetaPage;
@@ -363,7 +435,7 @@ typedef HnswMetaPageData * HnswMetaPage;
 typedef struct HnswPageOpaqueData
 {
 	BlockNumber nextblkno;
-	uint16		unused;
+	uint16		flags;
 	uint16		page_id;		/* for identification of HNSW indexes */
 }			HnswPageOpaqueData;
 
@@ -393,6 +465,62 @@ typedef struct HnswNeighborTupleData
 
 typedef HnswNeighborTupleData * HnswNeighborTuple;
 
+typedef struct HnswPendingTupleData
+{
+	uint8		type;
+	uint8		unused;
+	uint16		unused2;
+	ItemPointerData heaptid;
+	uint16		unused3;
+	Vector		data;
+}			HnswPendingTupleData;
+
+typedef HnswPendingTupleData * HnswPendingTuple;
+
+/* Neighbor tuple of source contains target */
+typedef struct HnswReverseEdge
+{
+	ItemPointerData target;
+	ItemPointerData source;
+}			HnswReverseEdge;
+
+typedef struct HnswReverseBucketData
+{
+	BlockNumber head;
+	BlockNumber tail;
+}			HnswReverseBucketData;
+
+typedef struct HnswReverseDirData
+{
+	BlockNumber freeHead;
+	HnswReverseBucketData buckets[HNSW_REVERSE_BUCKETS];
+}			HnswReverseDirData;
+
+/* Sorted array of index TIDs with a memory limit */
+typedef struct HnswTidSet
+{
+	ItemPointerData *tids;
+	int64		length;
+	int64		maxLength;
+	int64		limit;
+}			HnswTidSet;
+
+typedef struct HnswPendingItem
+{
+	ItemPointerData heaptid;
+	double		distance;
+}			HnswPendingItem;
+
+typedef struct HnswMetaPageInfo
+{
+	uint32		version;
+	uint16		flags;
+	int			m;
+	HnswElement entryPoint;
+	BlockNumber pendingHead;
+	BlockNumber pendingTail;
+}			HnswMetaPageInfo;
+
 typedef union
 {
 	struct pointerhash_hash *pointers;
@@ -419,6 +547,15 @@ typedef struct HnswScanOpaqueData
 	double		previousDistance;
 	Size		maxMemory;
 	MemoryContext tmpCtx;
+	bool		scanLock;
+
+	/* Pending list */
+	HnswPendingItem *pending;
+	int			pendingLength;
+	int			pendingIndex;
+
+	/* Heap TIDs from the pending list or already returned */
+	struct tidhash_hash *returnedTids;
 
 	/* Support functions */
 	HnswSupport support;
@@ -437,12 +574,14 @@ typedef struct HnswVacuumState
 	/* Settings */
 	int			m;
 	int			efConstruction;
+	bool		neighborDistances;
 
 	/* Support functions */
 	HnswSupport support;
 
 	/* Variables */
-	struct tidhash_hash *deleting;
+	HnswTidSet	deleting;
+	BlockNumber reverseDir;
 	BufferAccessStrategy bas;
 	HnswNeighborTuple ntup;
 	HnswElementData highestPoint;
@@ -452,9 +591,25 @@ typedef struct HnswVacuumState
 	MemoryContext tmpCtx;
 }			HnswVacuumState;
 
+typedef struct HnswVacuumShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	BlockNumber nblocks;
+	int64		ndeleting;
+
+	/* Mutable state */
+	pg_atomic_uint32 nextBlkno;
+}			HnswVacuumShared;
+
+#define HnswVacuumSharedDeleting(shared) \
+	(ItemPointerData *) ((char *) (shared) + MAXALIGN(sizeof(HnswVacuumShared)))
+
 /* Methods */
 int			HnswGetM(Relation index);
 int			HnswGetEfConstruction(Relation index);
+bool		HnswGetFastUpdate(Relation index);
+bool		HnswGetReverseEdges(Relation index);
 FmgrInfo   *HnswOptionalProcInfo(Relation index, uint16 procnum);
 void		HnswInitSupport(HnswSupport * support, Relation index);
 Datum		HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value);
@@ -464,28 +619,56 @@ void		HnswInitPage(Buffer buf, Page page);
 void		HnswInit(void);
 List	   *HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation index, HnswSupport * support, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples);
 HnswElement HnswGetEntryPoint(Relation index);
-void		HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint);
+void		HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint, bool *neighborDistances);
+void		HnswReadMetaPageInfo(Relation index, HnswMetaPageInfo * info);
 void	   *HnswAlloc(HnswAllocator * allocator, Size size);
 HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int maxLevel, HnswAllocator * alloc);
 HnswElement HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno);
 void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, HnswSupport * support, int m, int efConstruction, bool existing);
 HnswSearchCandidate *HnswEntryCandidate(char *base, HnswElement entryPoint, HnswQuery * q, Relation index, HnswSupport * support, bool loadVec);
 void		HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building);
-void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m);
+Size		HnswGetFreeSlotSpace(Page page, BlockNumber blkno);
+bool		HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size etupSize, Size ntupSize, Buffer *nbuf, Page *npage, OffsetNumber *freeOffno, OffsetNumber *freeNeighborOffno, BlockNumber *newInsertPage, uint8 *tupleVersion);
+void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m, bool distances);
 void		HnswAddHeapTid(HnswElement element, ItemPointer heaptid);
 HnswNeighborArray *HnswInitNeighborArray(int lm, HnswAllocator * allocator);
 void		HnswInitNeighbors(char *base, HnswElement element, int m, HnswAllocator * alloc);
 bool		HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building);
-void		HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool building);
+void		HnswInsertTuplesOnDisk(Relation index, HnswSupport * support, Datum *values, ItemPointerData *heaptids, int ntuples, bool building);
+void		HnswUpdateNeighborOnDisk(HnswElement element, HnswElement newElement, float distance, int idx, int m, int lm, int lc, bool distances, Relation index, bool building);
+void		HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool distances, bool building);
+void		HnswUpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m);
+bool		HnswFindDuplicateInMemory(char *base, HnswElement element);
 void		HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHeaptids, bool loadVec);
 void		HnswLoadElement(HnswElement element, double *distance, HnswQuery * q, Relation index, HnswSupport * support, bool loadVec, double *maxDistance);
 bool		HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo * typeInfo, HnswSupport * support);
 void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element);
 void		HnswUpdateConnection(char *base, HnswNeighborArray * neighbors, HnswElement newElement, float distance, int lm, int *updateIdx, Relation index, HnswSupport * support);
-bool		HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, int m, int lm, int lc);
+void		HnswMergeNeighbors(char *base, HnswNeighborArray * neighbors, HnswNeighborArray * other, int lm, HnswSupport * support);
+bool		HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, float *distances, Relation index, int m, int lm, int lc);
 void		HnswInitLockTranche(void);
+void		HnswTidSetInit(HnswTidSet * set, int64 limit);
+void		HnswTidSetAdd(HnswTidSet * set, ItemPointer tid);
+void		HnswTidSetSort(HnswTidSet * set);
+bool		HnswTidSetContains(HnswTidSet * set, ItemPointer tid);
+void		HnswTidSetReset(HnswTidSet * set);
+void		HnswWaitForScans(Relation index);
+void		HnswInitDistanceCache(HnswSupport * support, bool inMemory);
+void		HnswFreeDistanceCache(HnswSupport * support);
+bool		HnswGetCachedDistance(HnswSupport * support, HnswElement a, HnswElement b, float *distance);
+void		HnswCacheDistance(HnswSupport * support, HnswElement a, HnswElement b, float distance);
+bool		HnswInsertPending(Relation index, Datum value, ItemPointer heaptid, bool *flush);
+int64		HnswFlushPendingList(Relation index, HnswSupport * support, bool wait, IndexBulkDeleteCallback callback, void *callback_state, IndexBulkDeleteResult *stats);
+HnswPendingItem *HnswScanPendingList(Relation index, HnswSupport * support, Datum value, BlockNumber head, int *length);
+BlockNumber HnswGetReverseDir(Relation index);
+BlockNumber HnswCreateReverseDir(Relation index, ForkNumber forkNum);
+void		HnswAddReverseEdges(Relation index, BlockNumber dirBlkno, HnswReverseEdge * edges, int nedges, ForkNumber forkNum, bool building);
+void		HnswAddElementReverseEdges(Relation index, BlockNumber dirBlkno, HnswElement * elements, int nelements, bool building);
+ItemPointerData *HnswGetReverseCandidates(Relation index, BlockNumber dirBlkno, HnswTidSet * deleting, BufferAccessStrategy bas, int64 *ncandidates);
+void		HnswCompactReverseEdges(Relation index, BlockNumber dirBlkno, HnswTidSet * deleting, BufferAccessStrategy bas);
 const		HnswTypeInfo *HnswGetTypeInfo(Relation index);
 PGDLLEXPORT void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
 IndexBuildResult *hnswbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -553,4 +736,24 @@ typedef struct OffsetHashEntry
 #define SH_DECLARE
 #include "lib/simplehash.h"
 
+typedef struct HnswPairKey
+{
+	uint64		a;
+	uint64		b;
+}			HnswPairKey;
+
+typedef struct DistanceHashEntry
+{
+	HnswPairKey key;
+	float		distance;
+	char		status;
+}			DistanceHashEntry;
+
+#define SH_PREFIX distancehash
+#define SH_ELEMENT_TYPE DistanceHashEntry
+#define SH_KEY_TYPE HnswPairKey
+#define SH_SCOPE extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
 #endif
@@ -109,6 +109,13 @@ CreateMetaPage(HnswBuildState * buildstate)
 	metap->entryOffno = InvalidOffsetNumber;
 	metap->entryLevel = -1;
 	metap->insertPage = InvalidBlockNumber;
+	metap->pendingHead = InvalidBlockNumber;
+	metap->pendingTail = InvalidBlockNumber;
+	metap->pendingPages = 0;
+	for (int i = 0; i < HNSW_INSERT_STRIPES; i++)
+		metap->insertPages[i] = InvalidBlockNumber;
+	metap->reverseDir = InvalidBlockNumber;
+	metap->compactBlkno = InvalidBlockNumber;
 	((PageHeader) page)->pd_lower =
 		(LocationIndex) (((char *) metap + sizeof(HnswMetaPageData)) - (char *) page);
 
@@ -190,7 +197,7 @@ CreateGraphPages(HnswBuildState * buildstate)
 
 		/* Calculate sizes */
 		etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
-		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, buildstate->m);
+		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, buildstate->m, true);
 		combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 
 		/* Initial size check */
@@ -268,7 +275,7 @@ WriteNeighborTuples(HnswBuildState * buildstate)
 		HnswElement element = HnswPtrAccess(base, iter);
 		Buffer		buf;
 		Page		page;
-		Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+		Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m, true);
 
 		/* Update iterator */
 		iter = element->next;
@@ -284,7 +291,7 @@ WriteNeighborTuples(HnswBuildState * buildstate)
 		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 		page = BufferGetPage(buf);
 
-		HnswSetNeighborTuple(base, ntup, element, m);
+		HnswSetNeighborTuple(base, ntup, element, m, true);
 
 		if (!PageIndexTupleOverwrite(page, element->neighborOffno, (Item) ntup, ntupSize))
 			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
@@ -297,6 +304,67 @@ WriteNeighborTuples(HnswBuildState * buildstate)
 	pfree(ntup);
 }
 
+/*
+ * Write reverse edges
+ */
+static void
+WriteReverseEdges(HnswBuildState * buildstate)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	HnswElementPtr iter = buildstate->graph->head;
+	char	   *base = buildstate->hnswarea;
+	int			maxEdges = 65536;
+	HnswReverseEdge *edges;
+	int			nedges = 0;
+	BlockNumber reverseDir;
+
+	reverseDir = HnswCreateReverseDir(index, forkNum);
+
+	/* Allocate once */
+	edges = palloc(maxEdges * sizeof(HnswReverseEdge));
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+		ItemPointerData tid;
+
+		/* Update iterator */
+		iter = element->next;
+
+		ItemPointerSet(&tid, element->blkno, element->offno);
+
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			for (int i = 0; i < neighbors->length; i++)
+			{
+				HnswElement neighborElement = HnswPtrAccess(base, neighbors->items[i].element);
+
+				/* Flush when full */
+				if (nedges == maxEdges)
+				{
+					/* Can take a while, so ensure we can interrupt */
+					CHECK_FOR_INTERRUPTS();
+
+					HnswAddReverseEdges(index, reverseDir, edges, nedges, forkNum, true);
+					nedges = 0;
+				}
+
+				ItemPointerSet(&edges[nedges].target, neighborElement->blkno, neighborElement->offno);
+				edges[nedges].source = tid;
+				nedges++;
+			}
+		}
+	}
+
+	if (nedges > 0)
+		HnswAddReverseEdges(index, reverseDir, edges, nedges, forkNum, true);
+
+	pfree(edges);
+}
+
 /*
  * Flush pages
  */
@@ -311,6 +379,10 @@ FlushPages(HnswBuildState * buildstate)
 	CreateGraphPages(buildstate);
 	WriteNeighborTuples(buildstate);
 
+	/* Graph is complete, so only one direction is needed */
+	if (HnswGetReverseEdges(buildstate->index))
+		WriteReverseEdges(buildstate);
+
 	buildstate->graph->flushed = true;
 	MemoryContextReset(buildstate->graphCtx);
 }
@@ -339,8 +411,8 @@ AddDuplicateInMemory(HnswElement element, HnswElement dup)
 /*
  * Find duplicate element
  */
-static bool
-FindDuplicateInMemory(char *base, HnswElement element)
+bool
+HnswFindDuplicateInMemory(char *base, HnswElement element)
 {
 	HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, 0);
 	Datum		value = HnswGetValue(base, element);
@@ -378,8 +450,8 @@ AddElementInMemory(char *base, HnswGraph * graph, HnswElement element)
 /*
  * Update neighbors
  */
-static void
-UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
+void
+HnswUpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
 {
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -417,14 +489,14 @@ UpdateGraphInMemory(HnswSupport * support, HnswElement element, int m, HnswEleme
 	char	   *base = buildstate->hnswarea;
 
 	/* Look for duplicate */
-	if (FindDuplicateInMemory(base, element))
+	if (HnswFindDuplicateInMemory(base, element))
 		return;
 
 	/* Add element */
 	AddElementInMemory(base, graph, element);
 
 	/* Update neighbors */
-	UpdateNeighborsInMemory(base, support, element, m);
+	HnswUpdateNeighborsInMemory(base, support, element, m);
 
 	/* Update entry point if needed (already have lock) */
 	if (entryPoint == NULL || element->level > entryPoint->level)
@@ -469,12 +541,17 @@ InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 		entryPoint = HnswPtrAccess(base, graph->entryPoint);
 	}
 
+	/* Remember distances between elements for this insert */
+	HnswInitDistanceCache(support, true);
+
 	/* Find neighbors for element */
 	HnswFindElementNeighbors(base, element, entryPoint, NULL, support, m, efConstruction, false);
 
 	/* Update graph in memory */
 	UpdateGraphInMemory(support, element, m, entryPoint, buildstate);
 
+	HnswFreeDistanceCache(support);
+
 	/* Release entry lock */
 	LWLockRelease(entryLock);
 }
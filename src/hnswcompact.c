@@ -0,0 +1,1440 @@
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/generic_xlog.h"
+#include "access/xlog.h"
+#include "catalog/pg_class.h"
+#include "catalog/storage.h"
+#include "commands/vacuum.h"
+#include "fmgr.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/freespace.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#if PG_VERSION_NUM >= 180000
+#define vacuum_delay_point() vacuum_delay_point(false)
+#endif
+
+/* Same as truncating tables in vacuum */
+#define HNSW_COMPACT_LOCK_WAIT_INTERVAL	50	/* ms */
+#define HNSW_COMPACT_LOCK_TIMEOUT	5000	/* ms */
+
+/* Initial number of reverse edges and number to add at a time */
+#define HNSW_COMPACT_EDGES	65536
+
+/*
+ * Compaction moves live elements from the last pages of the index into free
+ * space on earlier pages, so the last pages can be truncated. It holds a
+ * share row exclusive lock on the index, which blocks inserts, vacuum, and
+ * other compactions, but not scans.
+ *
+ * Elements are copied first, and then neighbor tuples are rewritten to point
+ * to the copies. Scans may reach both copies in the meantime, so a flag on
+ * the metapage tells them to skip heap TIDs that were already returned.
+ * After in-flight scans finish, the old copies are marked as deleted.
+ * Truncating requires an access exclusive lock, since iterative scans keep
+ * element locations between iterations, so it is skipped if the lock is not
+ * available.
+ *
+ * If compaction fails, the flag stays set, along with the first page that
+ * elements were moved from. The next compaction finds elements on or after
+ * that page with the same heap TIDs as another element, and frees one copy
+ * the same way before clearing the flag.
+ *
+ * Neighbor tuples are on the same page as their element or the next page.
+ * Moving elements preserves this, since copies only use space on a single
+ * page or the slots of a deleted element.
+ */
+
+typedef struct HnswMovedElement
+{
+	ItemPointerData oldtid;
+	ItemPointerData newtid;
+}			HnswMovedElement;
+
+typedef struct HnswCompactState
+{
+	/* Info */
+	Relation	index;
+	BufferAccessStrategy bas;
+
+	/* Settings */
+	int			m;
+	bool		neighborDistances;
+	BlockNumber reverseDir;
+
+	/* Pages */
+	BlockNumber nblocks;
+	BlockNumber *chain;
+	BlockNumber nchain;
+	BlockNumber firstTail;
+	BlockNumber cutoff;
+	BlockNumber cursor;
+	Size	   *freeSpace;
+	Size		minSize;
+
+	/* Moved elements */
+	HnswMovedElement *moved;
+	int64		nmoved;
+	int64		maxMoved;
+	tidhash_hash *newTids;
+
+	/* Reverse edges */
+	HnswReverseEdge *edges;
+	int64		nedges;
+	int64		maxEdges;
+}			HnswCompactState;
+
+typedef struct HnswCopyCandidate
+{
+	ItemPointerData heaptid;
+	ItemPointerData tid;
+	BlockNumber neighborPage;
+	bool		freed;
+}			HnswCopyCandidate;
+
+typedef struct HnswNeighborRewrite
+{
+	ItemPointerData neighbortid;
+	uint8		level;
+	int			idx;
+	ItemPointerData newtid;
+	float		distance;
+}			HnswNeighborRewrite;
+
+/*
+ * Compare moved elements by old TID
+ */
+static int
+CompareMovedElements(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const HnswMovedElement *) a)->oldtid, (ItemPointer) &((const HnswMovedElement *) b)->oldtid);
+}
+
+/*
+ * Find a moved element by old TID
+ */
+static HnswMovedElement *
+FindMovedElement(HnswCompactState * state, ItemPointer oldtid)
+{
+	HnswMovedElement key;
+
+	key.oldtid = *oldtid;
+	return bsearch(&key, state->moved, state->nmoved, sizeof(HnswMovedElement), CompareMovedElements);
+}
+
+/*
+ * Get the space used by a live element, including its neighbor tuple
+ */
+static Size
+ElementSpace(HnswCompactState * state, ItemId itemid, HnswElementTuple etup)
+{
+	return ItemIdGetLength(itemid) + HNSW_NEIGHBOR_TUPLE_SIZE(etup->level, state->m, state->neighborDistances) + 2 * sizeof(ItemIdData);
+}
+
+/*
+ * Choose the last pages to truncate
+ *
+ * The pages after the cutoff must be the end of the element page chain, and
+ * their live elements must fit into the free space of the pages before it.
+ */
+static bool
+PlanCompaction(HnswCompactState * state)
+{
+	Relation	index = state->index;
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	Size	   *liveSpace;
+	int64	   *liveCount;
+	Size		totalFree = 0;
+	Size		tailFree = 0;
+	Size		tailLive = 0;
+	int64		tailCount = 0;
+	int64		movable = 0;
+	BlockNumber minBlkno = InvalidBlockNumber;
+	BlockNumber maxBlkno = 0;
+
+	state->nblocks = RelationGetNumberOfBlocks(index);
+	state->chain = palloc_array_checked(BlockNumber, state->nblocks);
+	state->freeSpace = palloc0_array_checked(Size, state->nblocks);
+	liveSpace = palloc0_array_checked(Size, state->nblocks);
+	liveCount = palloc0_array_checked(int64, state->nblocks);
+	state->nchain = 0;
+	state->minSize = BLCKSZ;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		vacuum_delay_point();
+
+		if (state->nchain >= state->nblocks)
+			elog(ERROR, "hnsw index is not valid");
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		state->freeSpace[blkno] = PageGetExactFreeSpace(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, itemid);
+
+			/* Skip neighbor tuples */
+			if (!HnswIsElementTuple(etup))
+				continue;
+
+			if (etup->deleted)
+				state->freeSpace[blkno] += ElementSpace(state, itemid, etup);
+			else
+			{
+				Size		space = ElementSpace(state, itemid, etup);
+
+				liveSpace[state->nchain] += space;
+				liveCount[state->nchain]++;
+
+				/* Used to skip pages without space for any element */
+				state->minSize = Min(state->minSize, space);
+			}
+		}
+
+		totalFree += state->freeSpace[blkno];
+		state->chain[state->nchain++] = blkno;
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Never truncate the first element page */
+	state->firstTail = state->nchain;
+	for (int64 i = (int64) state->nchain - 1; i >= 1; i--)
+	{
+		blkno = state->chain[i];
+		minBlkno = Min(minBlkno, blkno);
+		maxBlkno = Max(maxBlkno, blkno);
+		tailFree += state->freeSpace[blkno];
+		tailLive += liveSpace[i];
+		tailCount += liveCount[i];
+
+		if (tailLive > totalFree - tailFree || tailCount > state->maxMoved)
+			break;
+
+		/* Pages must be the last blocks of the relation */
+		if (maxBlkno == state->nblocks - 1 && state->nchain - i == state->nblocks - minBlkno)
+		{
+			state->firstTail = i;
+			state->cutoff = minBlkno;
+			movable = tailCount;
+		}
+	}
+
+	/* Elements on the page before may have neighbor tuples after the cutoff */
+	if (state->firstTail < state->nchain)
+		state->moved = palloc_array_checked(HnswMovedElement, movable + liveCount[state->firstTail - 1]);
+
+	pfree(liveSpace);
+	pfree(liveCount);
+
+	return state->firstTail < state->nchain;
+}
+
+/*
+ * Try to add a copy of an element to a page
+ */
+static bool
+PlaceElement(HnswCompactState * state, BlockNumber blkno, HnswElementTuple etup, Size etupSize, HnswNeighborTuple ntup, Size ntupSize, ItemPointer newtid)
+{
+	Relation	index = state->index;
+	Size		combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
+	Buffer		buf;
+	Page		page;
+	Buffer		nbuf = InvalidBuffer;
+	Page		npage;
+	GenericXLogState *xlogstate;
+	OffsetNumber offno;
+	OffsetNumber neighborOffno;
+	BlockNumber unusedPage = InvalidBlockNumber;
+	uint8		tupleVersion;
+	bool		overwrite;
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	xlogstate = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+
+	if (PageGetFreeSpace(page) >= combinedSize)
+	{
+		nbuf = buf;
+		npage = page;
+		offno = OffsetNumberNext(PageGetMaxOffsetNumber(page));
+		neighborOffno = OffsetNumberNext(offno);
+	}
+	else if (HnswFreeOffset(index, buf, page, NULL, etupSize, ntupSize, &nbuf, &npage, &offno, &neighborOffno, &unusedPage, &tupleVersion))
+	{
+		/* Neighbor tuple of a deleted element at the end of the chain */
+		if (BufferGetBlockNumber(nbuf) >= state->cutoff)
+		{
+			if (nbuf != buf)
+				UnlockReleaseBuffer(nbuf);
+			nbuf = InvalidBuffer;
+		}
+		else
+		{
+			if (nbuf != buf)
+				npage = GenericXLogRegisterBuffer(xlogstate, nbuf, 0);
+
+			etup->version = tupleVersion;
+			ntup->version = tupleVersion;
+		}
+	}
+	else
+		nbuf = InvalidBuffer;
+
+	if (!BufferIsValid(nbuf))
+	{
+		/* Any copy of this size will not fit */
+		state->freeSpace[blkno] = Min(state->freeSpace[blkno], combinedSize - 1);
+
+		GenericXLogAbort(xlogstate);
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	ItemPointerSet(&etup->neighbortid, BufferGetBlockNumber(nbuf), neighborOffno);
+
+	overwrite = offno <= PageGetMaxOffsetNumber(page);
+	if (overwrite)
+	{
+		if (!PageIndexTupleOverwrite(page, offno, (Item) etup, etupSize))
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		if (!PageIndexTupleOverwrite(npage, neighborOffno, (Item) ntup, ntupSize))
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+	else
+	{
+		if (PageAddItem(page, (Item) etup, etupSize, InvalidOffsetNumber, false, false) != offno)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		if (PageAddItem(npage, (Item) ntup, ntupSize, InvalidOffsetNumber, false, false) != neighborOffno)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+
+	state->freeSpace[blkno] = Max(PageGetFreeSpace(page), HnswGetFreeSlotSpace(page, blkno));
+
+	GenericXLogFinish(xlogstate);
+	UnlockReleaseBuffer(buf);
+	if (nbuf != buf)
+		UnlockReleaseBuffer(nbuf);
+
+	ItemPointerSet(newtid, blkno, offno);
+	return true;
+}
+
+/*
+ * Get a page before the cutoff with a neighbor, to keep neighbors together
+ */
+static BlockNumber
+GetNeighborPage(HnswCompactState * state, HnswNeighborTuple ntup, int level)
+{
+	/* Neighbors at layer 0 are last */
+	for (int i = level * state->m; i < ntup->count; i++)
+	{
+		ItemPointer indextid = &ntup->indextids[i];
+
+		if (ItemPointerIsValid(indextid) && ItemPointerGetBlockNumber(indextid) < state->cutoff)
+			return ItemPointerGetBlockNumber(indextid);
+	}
+
+	return InvalidBlockNumber;
+}
+
+/*
+ * Copy an element to a page before the cutoff
+ */
+static bool
+MoveElement(HnswCompactState * state, BlockNumber blkno, OffsetNumber offno)
+{
+	Relation	index = state->index;
+	Buffer		buf;
+	Page		page;
+	ItemId		itemid;
+	HnswElementTuple etup;
+	HnswNeighborTuple ntup;
+	Size		etupSize;
+	Size		ntupSize;
+	BlockNumber neighborPage;
+	OffsetNumber neighborOffno;
+	BlockNumber preferredPage;
+	ItemPointerData newtid;
+	bool		placed = false;
+	bool		found;
+
+	/* Copy tuples (inserts and vacuum are blocked, so they will not change) */
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	itemid = PageGetItemId(page, offno);
+	etupSize = ItemIdGetLength(itemid);
+	etup = palloc(etupSize);
+	memcpy(etup, PageGetItem(page, itemid), etupSize);
+	UnlockReleaseBuffer(buf);
+
+	neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+	neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	itemid = PageGetItemId(page, neighborOffno);
+	ntupSize = ItemIdGetLength(itemid);
+	ntup = palloc(ntupSize);
+	memcpy(ntup, PageGetItem(page, itemid), ntupSize);
+	UnlockReleaseBuffer(buf);
+
+	/* Try the page of a neighbor first */
+	preferredPage = GetNeighborPage(state, ntup, etup->level);
+	if (BlockNumberIsValid(preferredPage) && state->freeSpace[preferredPage] >= etupSize + ntupSize + sizeof(ItemIdData))
+		placed = PlaceElement(state, preferredPage, etup, etupSize, ntup, ntupSize, &newtid);
+
+	/* Skip pages without space for any element */
+	while (state->cursor < state->firstTail && state->freeSpace[state->chain[state->cursor]] < state->minSize)
+		state->cursor++;
+
+	for (BlockNumber i = state->cursor; !placed && i < state->firstTail; i++)
+	{
+		BlockNumber targetPage = state->chain[i];
+
+		if (targetPage == preferredPage || state->freeSpace[targetPage] < etupSize + ntupSize + sizeof(ItemIdData))
+			continue;
+
+		placed = PlaceElement(state, targetPage, etup, etupSize, ntup, ntupSize, &newtid);
+	}
+
+	pfree(etup);
+	pfree(ntup);
+
+	if (!placed)
+		return false;
+
+	ItemPointerSet(&state->moved[state->nmoved].oldtid, blkno, offno);
+	state->moved[state->nmoved].newtid = newtid;
+	state->nmoved++;
+
+	tidhash_insert(state->newTids, newtid, &found);
+
+	return true;
+}
+
+/*
+ * Copy live elements after the cutoff
+ */
+static void
+MoveElements(HnswCompactState * state)
+{
+	Relation	index = state->index;
+
+	/* Start from the end, so the cutoff can be moved if space runs out */
+	/* Also check the page before for neighbor tuples after the cutoff */
+	for (int64 i = (int64) state->nchain - 1; i >= (int64) state->firstTail - 1; i--)
+	{
+		BlockNumber blkno = state->chain[i];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		OffsetNumber offnos[MaxOffsetNumber];
+		int			noffnos = 0;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (!HnswIsElementTuple(etup) || etup->deleted)
+				continue;
+
+			if (blkno < state->cutoff && ItemPointerGetBlockNumber(&etup->neighbortid) < state->cutoff)
+				continue;
+
+			offnos[noffnos++] = offno;
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		for (int j = 0; j < noffnos; j++)
+		{
+			CHECK_FOR_INTERRUPTS();
+
+			if (!MoveElement(state, blkno, offnos[j]))
+				return;
+		}
+	}
+}
+
+/*
+ * Add a reverse edge for a rewritten neighbor
+ *
+ * Edges are kept in memory and added after truncating, since adding them can
+ * extend the index
+ */
+static void
+AddReverseEdge(HnswCompactState * state, ItemPointer target, ItemPointer source)
+{
+	if (!BlockNumberIsValid(state->reverseDir))
+		return;
+
+	if (state->nedges == state->maxEdges)
+	{
+		state->maxEdges *= 2;
+		state->edges = repalloc_huge(state->edges, mul_size(sizeof(HnswReverseEdge), state->maxEdges));
+	}
+
+	state->edges[state->nedges].target = *target;
+	state->edges[state->nedges].source = *source;
+	state->nedges++;
+}
+
+/*
+ * Add reverse edges for rewritten neighbors
+ */
+static void
+AddReverseEdges(HnswCompactState * state)
+{
+	for (int64 i = 0; i < state->nedges; i += HNSW_COMPACT_EDGES)
+	{
+		int			n = (int) Min(state->nedges - i, HNSW_COMPACT_EDGES);
+
+		HnswAddReverseEdges(state->index, state->reverseDir, &state->edges[i], n, MAIN_FORKNUM, false);
+	}
+
+	state->nedges = 0;
+}
+
+/*
+ * Point a neighbor slot to the copy of a moved element
+ */
+static void
+RewriteNeighbor(HnswCompactState * state, HnswNeighborRewrite * rewrite)
+{
+	HnswElementData element;
+	HnswElementData newElement;
+	int			level = rewrite->level;
+	int			lc;
+	int			idx;
+
+	memset(&element, 0, sizeof(HnswElementData));
+	element.level = level;
+	element.neighborPage = ItemPointerGetBlockNumber(&rewrite->neighbortid);
+	element.neighborOffno = ItemPointerGetOffsetNumber(&rewrite->neighbortid);
+
+	memset(&newElement, 0, sizeof(HnswElementData));
+	newElement.blkno = ItemPointerGetBlockNumber(&rewrite->newtid);
+	newElement.offno = ItemPointerGetOffsetNumber(&rewrite->newtid);
+
+	/* Layer 0 is last and has twice as many slots */
+	if (rewrite->idx < level * state->m)
+	{
+		lc = level - rewrite->idx / state->m;
+		idx = rewrite->idx % state->m;
+	}
+	else
+	{
+		lc = 0;
+		idx = rewrite->idx - level * state->m;
+	}
+
+	HnswUpdateNeighborOnDisk(&element, &newElement, rewrite->distance, idx, state->m, HnswGetLayerM(state->m, lc), lc, state->neighborDistances, state->index, false);
+}
+
+/*
+ * Point neighbors and the entry point to the copies
+ */
+static void
+RewriteNeighbors(HnswCompactState * state)
+{
+	Relation	index = state->index;
+	HnswElement entryPoint;
+
+	qsort(state->moved, state->nmoved, sizeof(HnswMovedElement), CompareMovedElements);
+
+	/* Update entry point */
+	entryPoint = HnswGetEntryPoint(index);
+	if (entryPoint != NULL)
+	{
+		ItemPointerData entrytid;
+		HnswMovedElement *moved;
+
+		ItemPointerSet(&entrytid, entryPoint->blkno, entryPoint->offno);
+		moved = FindMovedElement(state, &entrytid);
+		if (moved != NULL)
+		{
+			entryPoint->blkno = ItemPointerGetBlockNumber(&moved->newtid);
+			entryPoint->offno = ItemPointerGetOffsetNumber(&moved->newtid);
+			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint, InvalidBlockNumber, MAIN_FORKNUM, false);
+		}
+	}
+
+	for (BlockNumber i = 0; i < state->nchain; i++)
+	{
+		BlockNumber blkno = state->chain[i];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		List	   *rewrites = NIL;
+		ListCell   *lc;
+
+		vacuum_delay_point();
+
+		/* Inserts and vacuum are blocked, so tuples will not change */
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			HnswNeighborTuple ntup;
+			Buffer		nbuf;
+			Page		npage;
+			BlockNumber neighborPage;
+			OffsetNumber neighborOffno;
+			ItemPointerData tid;
+			bool		sourceMoved;
+
+			/* Skip neighbor tuples */
+			if (!HnswIsElementTuple(etup))
+				continue;
+
+			/* Skip deleted tuples */
+			if (etup->deleted)
+				continue;
+
+			/* Skip old copies */
+			ItemPointerSet(&tid, blkno, offno);
+			if (FindMovedElement(state, &tid) != NULL)
+				continue;
+
+			sourceMoved = tidhash_lookup(state->newTids, tid) != NULL;
+
+			/* Get neighbor page */
+			neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+			neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
+
+			if (neighborPage == blkno)
+			{
+				nbuf = buf;
+				npage = page;
+			}
+			else
+			{
+				nbuf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, state->bas);
+				LockBuffer(nbuf, BUFFER_LOCK_SHARE);
+				npage = BufferGetPage(nbuf);
+			}
+
+			ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, neighborOffno));
+
+			for (int j = 0; j < ntup->count; j++)
+			{
+				ItemPointer indextid = &ntup->indextids[j];
+				HnswMovedElement *moved;
+
+				if (!ItemPointerIsValid(indextid))
+					continue;
+
+				moved = FindMovedElement(state, indextid);
+				if (moved != NULL)
+				{
+					HnswNeighborRewrite *rewrite = palloc_object(HnswNeighborRewrite);
+
+					rewrite->neighbortid = etup->neighbortid;
+					rewrite->level = etup->level;
+					rewrite->idx = j;
+					rewrite->newtid = moved->newtid;
+					rewrite->distance = state->neighborDistances ? HnswNeighborTupleDistances(ntup)[j] : 0;
+					rewrites = lappend(rewrites, rewrite);
+
+					AddReverseEdge(state, &moved->newtid, &tid);
+				}
+				else if (sourceMoved)
+					AddReverseEdge(state, indextid, &tid);
+			}
+
+			if (nbuf != buf)
+				UnlockReleaseBuffer(nbuf);
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		/* Use the same path as inserts, which also supports compact WAL */
+		foreach(lc, rewrites)
+			RewriteNeighbor(state, (HnswNeighborRewrite *) lfirst(lc));
+
+		list_free_deep(rewrites);
+	}
+}
+
+/*
+ * Mark old copies as deleted
+ */
+static void
+FreeOldElements(HnswCompactState * state)
+{
+	Relation	index = state->index;
+	int64		i = 0;
+
+	/* Scans that started before the neighbors were rewritten must finish */
+	HnswWaitForScans(index);
+
+	while (i < state->nmoved)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&state->moved[i].oldtid);
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *xlogstate;
+		bool		updated = false;
+		Size		freeSlotSpace;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBufferForCleanup(buf);
+
+		xlogstate = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+
+		for (; i < state->nmoved && ItemPointerGetBlockNumber(&state->moved[i].oldtid) == blkno; i++)
+		{
+			OffsetNumber offno = ItemPointerGetOffsetNumber(&state->moved[i].oldtid);
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			HnswNeighborTuple ntup;
+			Buffer		nbuf;
+			Page		npage;
+			BlockNumber neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+			OffsetNumber neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
+
+			if (neighborPage == blkno)
+			{
+				nbuf = buf;
+				npage = page;
+			}
+			else
+			{
+				nbuf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, state->bas);
+				LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
+				npage = GenericXLogRegisterBuffer(xlogstate, nbuf, 0);
+			}
+
+			ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, neighborOffno));
+
+			/* Overwrite element and neighbors, same as vacuum */
+			etup->deleted = 1;
+			for (int j = 0; j < HNSW_HEAPTIDS; j++)
+				ItemPointerSetInvalid(&etup->heaptids[j]);
+			memset(&etup->data, 0, VARSIZE_ANY(&etup->data));
+
+			for (int j = 0; j < ntup->count; j++)
+				ItemPointerSetInvalid(&ntup->indextids[j]);
+
+			/* Increment version for iterative scans */
+			etup->version++;
+			if (etup->version > 15)
+				etup->version = 1;
+			ntup->version = etup->version;
+
+			updated = true;
+
+			/* Commit and prepare new xlog */
+			if (nbuf != buf)
+			{
+				GenericXLogFinish(xlogstate);
+				UnlockReleaseBuffer(nbuf);
+
+				xlogstate = GenericXLogStart(index);
+				page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+				updated = false;
+			}
+		}
+
+		freeSlotSpace = HnswGetFreeSlotSpace(page, blkno);
+
+		if (updated)
+			GenericXLogFinish(xlogstate);
+		else
+			GenericXLogAbort(xlogstate);
+		UnlockReleaseBuffer(buf);
+
+		/* Record free slots so inserts can find them */
+		RecordPageWithFreeSpace(index, blkno, freeSlotSpace);
+	}
+
+	/* Make free slots visible to searches of the free space map */
+	IndexFreeSpaceMapVacuum(index);
+
+	/* Remove reverse edges for old copies */
+	if (BlockNumberIsValid(state->reverseDir))
+	{
+		HnswTidSet	oldTids;
+
+		HnswTidSetInit(&oldTids, state->nmoved);
+		for (int64 j = 0; j < state->nmoved; j++)
+			HnswTidSetAdd(&oldTids, &state->moved[j].oldtid);
+		HnswTidSetSort(&oldTids);
+
+		HnswCompactReverseEdges(index, state->reverseDir, &oldTids, state->bas);
+		if (oldTids.tids != NULL)
+			pfree(oldTids.tids);
+	}
+}
+
+/*
+ * Get the first page that can be truncated
+ *
+ * Elements that could not be moved keep their pages, along with the pages
+ * of their neighbor tuples.
+ */
+static BlockNumber
+GetTruncateCutoff(HnswCompactState * state)
+{
+	Relation	index = state->index;
+	BlockNumber cutoff = state->cutoff;
+
+	for (BlockNumber i = state->firstTail - 1; i < state->nchain; i++)
+	{
+		BlockNumber blkno = state->chain[i];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (!HnswIsElementTuple(etup) || etup->deleted)
+				continue;
+
+			cutoff = Max(cutoff, blkno + 1);
+			cutoff = Max(cutoff, ItemPointerGetBlockNumber(&etup->neighbortid) + 1);
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return cutoff;
+}
+
+/*
+ * Unlink the pages to truncate from the last page that is kept
+ */
+static void
+UnlinkPages(HnswCompactState * state, BlockNumber blkno, BlockNumber cutoff)
+{
+	Relation	index = state->index;
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *xlogstate;
+	OffsetNumber maxoffno;
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	xlogstate = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	HnswPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+
+	/* Deleted elements can no longer reuse neighbor tuples that are removed */
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+		if (HnswIsElementTuple(etup) && etup->deleted && ItemPointerGetBlockNumber(&etup->neighbortid) >= cutoff)
+			ItemPointerSetInvalid(&etup->neighbortid);
+	}
+
+	GenericXLogFinish(xlogstate);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Truncate pages after the cutoff
+ */
+static BlockNumber
+TruncatePages(HnswCompactState * state)
+{
+	Relation	index = state->index;
+	BlockNumber cutoff;
+	BlockNumber lastPage = InvalidBlockNumber;
+	int			waited = 0;
+
+	/* Pages added after planning may be after the cutoff */
+	if (RelationGetNumberOfBlocks(index) != state->nblocks)
+		return 0;
+
+	/* Wait for scans, which may still read pages after the cutoff */
+	while (!ConditionalLockRelation(index, AccessExclusiveLock))
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (waited >= HNSW_COMPACT_LOCK_TIMEOUT)
+		{
+			ereport(DEBUG1,
+					(errmsg("\"%s\": stopping truncate due to conflicting lock request",
+							RelationGetRelationName(index))));
+			return 0;
+		}
+
+		pg_usleep(HNSW_COMPACT_LOCK_WAIT_INTERVAL * 1000L);
+		waited += HNSW_COMPACT_LOCK_WAIT_INTERVAL;
+	}
+
+	cutoff = GetTruncateCutoff(state);
+
+	for (BlockNumber i = 0; i < state->nchain && state->chain[i] < cutoff; i++)
+		lastPage = state->chain[i];
+
+	if (cutoff < state->nblocks)
+	{
+		UnlinkPages(state, lastPage, cutoff);
+
+		/* Insert pages may be after the cutoff */
+		HnswUpdateMetaPage(index, 0, NULL, lastPage, MAIN_FORKNUM, false);
+
+		RelationTruncate(index, cutoff);
+	}
+
+	UnlockRelation(index, AccessExclusiveLock);
+
+	return state->nblocks - cutoff;
+}
+
+/*
+ * Set or clear the flag for scans to skip heap TIDs already returned
+ *
+ * The first page that elements are moved from is kept for recovery.
+ */
+static void
+SetCompacting(Relation index, bool compacting, BlockNumber compactBlkno)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *xlogstate;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	xlogstate = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+
+	if (compacting)
+	{
+		HnswMetaPage metap = HnswPageGetMeta(page);
+
+		HnswPageGetOpaque(page)->flags |= HNSW_COMPACTING;
+		metap->compactBlkno = compactBlkno;
+
+		/* Indexes built by earlier versions do not include the field */
+		((PageHeader) page)->pd_lower =
+			(LocationIndex) (((char *) metap + sizeof(HnswMetaPageData)) - (char *) page);
+	}
+	else
+		HnswPageGetOpaque(page)->flags &= ~HNSW_COMPACTING;
+
+	GenericXLogFinish(xlogstate);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Check if a previous compaction failed
+ */
+static bool
+IsCompacting(Relation index, BlockNumber *compactBlkno)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	bool		compacting;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	compacting = (HnswPageGetOpaque(page)->flags & HNSW_COMPACTING) != 0;
+
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(HnswMetaPageData)) - (char *) page)
+		*compactBlkno = metap->compactBlkno;
+	else
+		*compactBlkno = InvalidBlockNumber;
+
+	UnlockReleaseBuffer(buf);
+
+	return compacting;
+}
+
+/*
+ * Compare copy candidates by first heap TID and then TID
+ */
+static int
+CompareCopyCandidates(const void *a, const void *b)
+{
+	const HnswCopyCandidate *ca = (const HnswCopyCandidate *) a;
+	const HnswCopyCandidate *cb = (const HnswCopyCandidate *) b;
+	int			cmp = ItemPointerCompare((ItemPointer) &ca->heaptid, (ItemPointer) &cb->heaptid);
+
+	if (cmp != 0)
+		return cmp;
+
+	return ItemPointerCompare((ItemPointer) &ca->tid, (ItemPointer) &cb->tid);
+}
+
+/*
+ * Find the first copy candidate with a heap TID
+ */
+static HnswCopyCandidate *
+FindCopyCandidate(HnswCopyCandidate * candidates, int64 ncandidates, ItemPointer heaptid)
+{
+	int64		lo = 0;
+	int64		hi = ncandidates;
+
+	while (lo < hi)
+	{
+		int64		mid = lo + (hi - lo) / 2;
+
+		if (ItemPointerCompare(&candidates[mid].heaptid, heaptid) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ncandidates || !ItemPointerEquals(&candidates[lo].heaptid, heaptid))
+		return NULL;
+
+	return &candidates[lo];
+}
+
+/*
+ * Check if an element is the copy to keep
+ *
+ * Copies are placed before the cutoff and old copies have neighbor tuples
+ * after it, so keep the element with the earlier neighbor page.
+ */
+static bool
+KeepCopy(BlockNumber neighborPage, ItemPointer tid, HnswCopyCandidate * other)
+{
+	if (neighborPage != other->neighborPage)
+		return neighborPage < other->neighborPage;
+
+	return ItemPointerCompare(tid, &other->tid) < 0;
+}
+
+/*
+ * Add heap TIDs of the copy to free to the copy to keep
+ *
+ * Inserts after the failed compaction may have added heap TIDs to either
+ * copy. Returns false if they do not fit.
+ */
+static bool
+MergeHeapTids(HnswCompactState * state, ItemPointer keeptid, ItemPointer freetid)
+{
+	Relation	index = state->index;
+	ItemPointerData heaptids[HNSW_HEAPTIDS];
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *xlogstate;
+	HnswElementTuple etup;
+	int			n = 0;
+	bool		updated = false;
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, ItemPointerGetBlockNumber(freetid), RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(freetid)));
+	memcpy(heaptids, etup->heaptids, sizeof(heaptids));
+	UnlockReleaseBuffer(buf);
+
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, ItemPointerGetBlockNumber(keeptid), RBM_NORMAL, state->bas);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	xlogstate = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(xlogstate, buf, 0);
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(keeptid)));
+
+	while (n < HNSW_HEAPTIDS && ItemPointerIsValid(&etup->heaptids[n]))
+		n++;
+
+	for (int i = 0; i < HNSW_HEAPTIDS && ItemPointerIsValid(&heaptids[i]); i++)
+	{
+		bool		found = false;
+
+		for (int j = 0; j < n; j++)
+		{
+			if (ItemPointerEquals(&etup->heaptids[j], &heaptids[i]))
+			{
+				found = true;
+				break;
+			}
+		}
+
+		if (found)
+			continue;
+
+		if (n == HNSW_HEAPTIDS)
+		{
+			GenericXLogAbort(xlogstate);
+			UnlockReleaseBuffer(buf);
+			return false;
+		}
+
+		etup->heaptids[n++] = heaptids[i];
+		updated = true;
+	}
+
+	if (updated)
+		GenericXLogFinish(xlogstate);
+	else
+		GenericXLogAbort(xlogstate);
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+/*
+ * Get live elements on or after the first page that elements were moved from
+ */
+static HnswCopyCandidate *
+GetCopyCandidates(HnswCompactState * state, BlockNumber compactBlkno, int64 *ncandidates)
+{
+	Relation	index = state->index;
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	HnswCopyCandidate *candidates;
+	int64		maxCandidates = MaxOffsetNumber;
+	bool		inRegion = !BlockNumberIsValid(compactBlkno);
+
+	state->nblocks = RelationGetNumberOfBlocks(index);
+	state->chain = palloc_array_checked(BlockNumber, state->nblocks);
+	state->nchain = 0;
+
+	candidates = palloc_array_checked(HnswCopyCandidate, maxCandidates);
+	*ncandidates = 0;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		vacuum_delay_point();
+
+		if (state->nchain >= state->nblocks)
+			elog(ERROR, "hnsw index is not valid");
+
+		state->chain[state->nchain++] = blkno;
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		if (blkno == compactBlkno)
+			inRegion = true;
+
+		for (OffsetNumber offno = FirstOffsetNumber; inRegion && offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			HnswCopyCandidate *candidate;
+
+			if (!HnswIsElementTuple(etup) || etup->deleted || !ItemPointerIsValid(&etup->heaptids[0]))
+				continue;
+
+			if (*ncandidates == maxCandidates)
+			{
+				maxCandidates *= 2;
+				candidates = repalloc_huge(candidates, mul_size(sizeof(HnswCopyCandidate), maxCandidates));
+			}
+
+			candidate = &candidates[(*ncandidates)++];
+			candidate->heaptid = etup->heaptids[0];
+			ItemPointerSet(&candidate->tid, blkno, offno);
+			candidate->neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+			candidate->freed = false;
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	qsort(candidates, *ncandidates, sizeof(HnswCopyCandidate), CompareCopyCandidates);
+
+	return candidates;
+}
+
+/*
+ * Free copies left by a compaction that failed
+ *
+ * Returns false if copies remain, in which case the flag stays set.
+ */
+static bool
+RecoverCompaction(HnswCompactState * state, BlockNumber compactBlkno)
+{
+	Relation	index = state->index;
+	HnswCopyCandidate *candidates;
+	int64		ncandidates;
+	bool		recovered = true;
+
+	candidates = GetCopyCandidates(state, compactBlkno, &ncandidates);
+	state->moved = palloc_array_checked(HnswMovedElement, ncandidates);
+
+	for (BlockNumber i = 0; i < state->nchain; i++)
+	{
+		BlockNumber blkno = state->chain[i];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		int64		start = state->nmoved;
+		int64		nmerged = start;
+
+		vacuum_delay_point();
+
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, state->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			HnswCopyCandidate *candidate;
+			HnswCopyCandidate *end;
+			ItemPointerData tid;
+			BlockNumber neighborPage;
+
+			if (!HnswIsElementTuple(etup) || etup->deleted || !ItemPointerIsValid(&etup->heaptids[0]))
+				continue;
+
+			candidate = FindCopyCandidate(candidates, ncandidates, &etup->heaptids[0]);
+			if (candidate == NULL)
+				continue;
+
+			ItemPointerSet(&tid, blkno, offno);
+			neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+
+			/* Each group is handled from the copy to keep */
+			for (end = candidate; end < candidates + ncandidates && ItemPointerEquals(&end->heaptid, &etup->heaptids[0]); end++)
+			{
+				if (!ItemPointerEquals(&end->tid, &tid) && !KeepCopy(neighborPage, &tid, end))
+					break;
+			}
+
+			if (end < candidates + ncandidates && ItemPointerEquals(&end->heaptid, &etup->heaptids[0]))
+				continue;
+
+			for (; candidate < end; candidate++)
+			{
+				if (candidate->freed || ItemPointerEquals(&candidate->tid, &tid))
+					continue;
+
+				candidate->freed = true;
+				state->moved[state->nmoved].oldtid = candidate->tid;
+				state->moved[state->nmoved].newtid = tid;
+				state->nmoved++;
+			}
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		/* Merge heap TIDs after releasing the lock */
+		for (int64 j = start; j < state->nmoved; j++)
+		{
+			HnswMovedElement *moved = &state->moved[j];
+			bool		found;
+
+			/* Keep both copies if heap TIDs do not fit */
+			if (!MergeHeapTids(state, &moved->newtid, &moved->oldtid))
+			{
+				recovered = false;
+				continue;
+			}
+
+			/* Reverse edges for the copy were never added */
+			tidhash_insert(state->newTids, moved->newtid, &found);
+
+			state->moved[nmerged++] = *moved;
+		}
+		state->nmoved = nmerged;
+	}
+
+	if (state->nmoved > 0)
+	{
+		HnswBench("RewriteNeighbors", RewriteNeighbors(state));
+		HnswBench("FreeOldElements", FreeOldElements(state));
+	}
+
+	if (recovered)
+		SetCompacting(index, false, InvalidBlockNumber);
+
+	/* Add now, since the next compaction may move the copies */
+	if (state->nedges > 0)
+		HnswBench("AddReverseEdges", AddReverseEdges(state));
+
+	pfree(candidates);
+	pfree(state->chain);
+	pfree(state->moved);
+	state->moved = NULL;
+	state->nmoved = 0;
+	tidhash_reset(state->newTids);
+
+	return recovered;
+}
+
+/*
+ * Initialize the compact state
+ */
+static void
+InitCompactState(HnswCompactState * state, Relation index)
+{
+	Size		elementSize;
+
+	state->index = index;
+	state->bas = GetAccessStrategy(BAS_BULKREAD);
+	state->reverseDir = HnswGetReverseDir(index);
+	state->cursor = 0;
+	state->nmoved = 0;
+	state->nedges = 0;
+	state->maxEdges = HNSW_COMPACT_EDGES;
+
+	HnswGetMetaPageInfo(index, &state->m, NULL, &state->neighborDistances);
+
+	/* Limit elements moved in a single call */
+	/* Each moved element adds about 4 * m reverse edges at layer 0 */
+	elementSize = sizeof(HnswMovedElement) + 2 * sizeof(TidHashEntry);
+	if (BlockNumberIsValid(state->reverseDir))
+		elementSize += 4 * state->m * sizeof(HnswReverseEdge);
+	state->maxMoved = (int64) maintenance_work_mem * 1024 / (int64) elementSize;
+	state->maxMoved = Min(state->maxMoved, (int64) (MaxAllocSize / sizeof(HnswMovedElement)) - MaxOffsetNumber);
+	state->moved = NULL;
+	state->newTids = tidhash_create(CurrentMemoryContext, 256, NULL);
+
+	if (BlockNumberIsValid(state->reverseDir))
+		state->edges = palloc_array_checked(HnswReverseEdge, HNSW_COMPACT_EDGES);
+	else
+		state->edges = NULL;
+}
+
+/*
+ * Move elements from the last pages into free space and truncate them
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_compact);
+Datum
+hnsw_compact(PG_FUNCTION_ARGS)
+{
+	Oid			indexoid = PG_GETARG_OID(0);
+	Relation	index;
+	HnswSupport support;
+	HnswCompactState state;
+	BlockNumber compactBlkno;
+	bool		recovered = true;
+	BlockNumber truncated = 0;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("HNSW indexes cannot be compacted during recovery.")));
+
+	/* Block inserts, vacuum, and other compactions, but not scans */
+	index = index_open(indexoid, ShareRowExclusiveLock);
+
+	if (index->rd_rel->relkind != RELKIND_INDEX || index->rd_indam->aminsert != hnswinsert)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	if (RELATION_IS_OTHER_TEMP(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot access temporary indexes of other sessions")));
+
+	/* Same privileges as vacuum */
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexoid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexoid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(index));
+
+	/* Move pending tuples into graph first */
+	HnswInitSupport(&support, index);
+	HnswFlushPendingList(index, &support, true, NULL, NULL, NULL);
+
+	InitCompactState(&state, index);
+
+	/* Finish a compaction that failed before moving more elements */
+	if (IsCompacting(index, &compactBlkno))
+	{
+		HnswBench("RecoverCompaction", recovered = RecoverCompaction(&state, compactBlkno));
+
+		if (!recovered)
+			ereport(WARNING,
+					(errmsg("could not remove all copies left by a failed compaction of \"%s\"", RelationGetRelationName(index)),
+					 errhint("REINDEX the index.")));
+	}
+
+	if (recovered && PlanCompaction(&state))
+	{
+		/* Scans reading the graph before the flag was set must finish */
+		SetCompacting(index, true, state.chain[state.firstTail - 1]);
+		HnswWaitForScans(index);
+
+		HnswBench("MoveElements", MoveElements(&state));
+
+		if (state.nmoved > 0)
+		{
+			HnswBench("RewriteNeighbors", RewriteNeighbors(&state));
+			HnswBench("FreeOldElements", FreeOldElements(&state));
+		}
+
+		/* Old copies are no longer reachable */
+		SetCompacting(index, false, InvalidBlockNumber);
+
+		HnswBench("TruncatePages", truncated = TruncatePages(&state));
+
+		/* Add after truncating, since new reverse edge pages extend the index */
+		if (state.nedges > 0)
+			HnswBench("AddReverseEdges", AddReverseEdges(&state));
+	}
+
+	FreeAccessStrategy(state.bas);
+	index_close(index, ShareRowExclusiveLock);
+
+	PG_RETURN_INT64(truncated);
+}
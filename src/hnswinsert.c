@@ -3,23 +3,35 @@
 #include "access/genam.h"
 #include "access/generic_xlog.h"
 #include "hnsw.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
 #include "storage/bufmgr.h"
+#include "storage/freespace.h"
 #include "storage/lmgr.h"
 #include "storage/lwlock.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "vectorxlog.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
 #endif
 
 /*
- * Get the insert page
+ * Get the stripe for the current backend
+ */
+static int
+GetInsertStripe(void)
+{
+	return MyProcPid % HNSW_INSERT_STRIPES;
+}
+
+/*
+ * Get the insert page for a stripe, along with the pages used by other stripes
  */
 static BlockNumber
-GetInsertPage(Relation index)
+GetInsertPage(Relation index, int stripe, BlockNumber *stripePage, BlockNumber *otherPages)
 {
 	Buffer		buf;
 	Page		page;
@@ -32,6 +44,24 @@ GetInsertPage(Relation index)
 	metap = HnswPageGetMeta(page);
 
 	insertPage = metap->insertPage;
+	*stripePage = insertPage;
+
+	for (int i = 0; i < HNSW_INSERT_STRIPES; i++)
+		otherPages[i] = InvalidBlockNumber;
+
+	if (HnswHasInsertStripes(metap->version))
+	{
+		*stripePage = metap->insertPages[stripe];
+
+		if (BlockNumberIsValid(*stripePage))
+			insertPage = *stripePage;
+
+		for (int i = 0; i < HNSW_INSERT_STRIPES; i++)
+		{
+			if (i != stripe)
+				otherPages[i] = metap->insertPages[i];
+		}
+	}
 
 	UnlockReleaseBuffer(buf);
 
@@ -39,9 +69,78 @@ GetInsertPage(Relation index)
 }
 
 /*
- * Check for a free offset
+ * Update the insert page for a stripe
+ */
+static void
+UpdateInsertPage(Relation index, int stripe, BlockNumber insertPage, bool building)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	HnswMetaPage metap;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	metap = HnswPageGetMeta(page);
+	if (HnswHasInsertStripes(metap->version))
+		metap->insertPages[stripe] = insertPage;
+	else
+		metap->insertPage = insertPage;
+
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Check if a page is the insert page of another stripe
  */
 static bool
+IsOtherStripePage(BlockNumber *otherPages, BlockNumber blkno)
+{
+	for (int i = 0; i < HNSW_INSERT_STRIPES; i++)
+	{
+		if (otherPages[i] == blkno)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Get the next page without an exclusive lock
+ */
+static BlockNumber
+GetNextPage(Relation index, BlockNumber blkno)
+{
+	Buffer		buf;
+	BlockNumber nextblkno;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	nextblkno = HnswPageGetOpaque(BufferGetPage(buf))->nextblkno;
+	UnlockReleaseBuffer(buf);
+
+	return nextblkno;
+}
+
+/*
+ * Check for a free offset
+ */
+bool
 HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size etupSize, Size ntupSize, Buffer *nbuf, Page *npage, OffsetNumber *freeOffno, OffsetNumber *freeNeighborOffno, BlockNumber *newInsertPage, uint8 *tupleVersion)
 {
 	OffsetNumber offno;
@@ -56,7 +155,8 @@ HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size
 		if (!HnswIsElementTuple(etup))
 			continue;
 
-		if (etup->deleted)
+		/* Skip deleted tuples whose neighbor tuple was truncated */
+		if (etup->deleted && ItemPointerIsValid(&etup->neighbortid))
 		{
 			BlockNumber elementPage = BufferGetBlockNumber(buf);
 			BlockNumber neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
@@ -115,6 +215,28 @@ HnswFreeOffset(Relation index, Buffer buf, Page page, HnswElement element, Size
 	return false;
 }
 
+/*
+ * Check if a page from the free space map has elements
+ *
+ * The map is not crash-safe, so it can point to other types of pages
+ */
+static bool
+IsElementPage(Page page, BlockNumber blkno)
+{
+	HnswPageOpaque opaque = HnswPageGetOpaque(page);
+	HnswElementTuple etup;
+
+	if (blkno == HNSW_METAPAGE_BLKNO || opaque->page_id != HNSW_PAGE_ID || (opaque->flags & HNSW_REVERSE_PAGE) != 0)
+		return false;
+
+	/* Element pages are never empty, and pending pages only have pending tuples */
+	if (PageGetMaxOffsetNumber(page) < FirstOffsetNumber)
+		return false;
+
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber));
+	return HnswIsElementTuple(etup) || HnswIsNeighborTuple(etup);
+}
+
 /*
  * Add a new page
  */
@@ -142,7 +264,7 @@ HnswInsertAppendPage(Relation index, Buffer *nbuf, Page *npage, GenericXLogState
  * Add to element and neighbor pages
  */
 static void
-AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, BlockNumber *updatedInsertPage, bool building)
+AddElementOnDisk(Relation index, HnswElement e, int m, bool distances, BlockNumber insertPage, BlockNumber *otherPages, BlockNumber *updatedInsertPage, bool building)
 {
 	Buffer		buf;
 	Page		page;
@@ -161,14 +283,18 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	OffsetNumber freeNeighborOffno = InvalidOffsetNumber;
 	BlockNumber newInsertPage = InvalidBlockNumber;
 	uint8		tupleVersion;
+	bool		appendOnly = false;
+	BlockNumber fsmPage = InvalidBlockNumber;
+	Size		fsmSize;
+	Size		freeSlotSpace = 0;
 	char	   *base = NULL;
 
 	/* Calculate sizes */
 	etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(HnswPtrAccess(base, e->value)));
-	ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m);
+	ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m, distances);
 	combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 	maxSize = HNSW_MAX_SIZE;
-	minCombinedSize = etupSize + HNSW_NEIGHBOR_TUPLE_SIZE(0, m) + sizeof(ItemIdData);
+	minCombinedSize = etupSize + HNSW_NEIGHBOR_TUPLE_SIZE(0, m, distances) + sizeof(ItemIdData);
 
 	/* Prepare element tuple */
 	etup = palloc0(etupSize);
@@ -176,11 +302,37 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 
 	/* Prepare neighbor tuple */
 	ntup = palloc0(ntupSize);
-	HnswSetNeighborTuple(base, ntup, e, m);
+	HnswSetNeighborTuple(base, ntup, e, m, distances);
+
+	/* Free slots have space for both tuples when they share a page */
+	fsmSize = combinedSize <= maxSize ? etupSize + ntupSize : etupSize;
+
+	/* Try a page with a free slot from vacuum first */
+	if (!building)
+	{
+		fsmPage = GetPageWithFreeSpace(index, fsmSize);
+		if (BlockNumberIsValid(fsmPage))
+			currentPage = fsmPage;
+	}
 
 	/* Find a page (or two if needed) to insert the tuples */
 	for (;;)
 	{
+		/* Leave insert pages of other stripes to them */
+		if (currentPage != fsmPage && IsOtherStripePage(otherPages, currentPage))
+		{
+			BlockNumber nextPage = GetNextPage(index, currentPage);
+
+			if (BlockNumberIsValid(nextPage))
+			{
+				currentPage = nextPage;
+				continue;
+			}
+
+			/* Start a new page for this stripe if last page */
+			appendOnly = true;
+		}
+
 		buf = ReadBuffer(index, currentPage);
 		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 
@@ -195,14 +347,37 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 			page = GenericXLogRegisterBuffer(state, buf, 0);
 		}
 
+		/* Skip a page that no longer has elements */
+		if (currentPage == fsmPage && !IsElementPage(page, currentPage))
+		{
+			if (!building)
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+
+			fsmPage = RecordAndGetPageWithFreeSpace(index, fsmPage, 0, fsmSize);
+			currentPage = BlockNumberIsValid(fsmPage) ? fsmPage : insertPage;
+			continue;
+		}
+
+		/* Another backend may have added a page in the meantime */
+		if (appendOnly && BlockNumberIsValid(HnswPageGetOpaque(page)->nextblkno))
+		{
+			if (!building)
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+			currentPage = GetNextPage(index, currentPage);
+			appendOnly = false;
+			continue;
+		}
+
 		/* Keep track of first page where element at level 0 can fit */
-		if (!BlockNumberIsValid(newInsertPage) && PageGetFreeSpace(page) >= minCombinedSize)
+		if (!appendOnly && currentPage != fsmPage && !BlockNumberIsValid(newInsertPage) && PageGetFreeSpace(page) >= minCombinedSize)
 			newInsertPage = currentPage;
 
 		/* First, try the fastest path */
 		/* Space for both tuples on the current page */
 		/* This can split existing tuples in rare cases */
-		if (PageGetFreeSpace(page) >= combinedSize)
+		if (!appendOnly && PageGetFreeSpace(page) >= combinedSize)
 		{
 			nbuf = buf;
 			npage = page;
@@ -210,7 +385,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 		}
 
 		/* Next, try space from a deleted element */
-		if (HnswFreeOffset(index, buf, page, e, etupSize, ntupSize, &nbuf, &npage, &freeOffno, &freeNeighborOffno, &newInsertPage, &tupleVersion))
+		if (!appendOnly && HnswFreeOffset(index, buf, page, e, etupSize, ntupSize, &nbuf, &npage, &freeOffno, &freeNeighborOffno, &newInsertPage, &tupleVersion))
 		{
 			if (nbuf != buf)
 			{
@@ -227,9 +402,22 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 			break;
 		}
 
+		/* Slot was reused or is too small, so try the next page with one */
+		if (currentPage == fsmPage)
+		{
+			if (!building)
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+
+			fsmPage = RecordAndGetPageWithFreeSpace(index, fsmPage, 0, fsmSize);
+			currentPage = BlockNumberIsValid(fsmPage) ? fsmPage : insertPage;
+			newInsertPage = InvalidBlockNumber;
+			continue;
+		}
+
 		/* Finally, try space for element only if last page */
 		/* Skip if both tuples can fit on the same page */
-		if (combinedSize > maxSize && PageGetFreeSpace(page) >= etupSize && !BlockNumberIsValid(HnswPageGetOpaque(page)->nextblkno))
+		if (!appendOnly && combinedSize > maxSize && PageGetFreeSpace(page) >= etupSize && !BlockNumberIsValid(HnswPageGetOpaque(page)->nextblkno))
 		{
 			HnswInsertAppendPage(index, &nbuf, &npage, state, page, building);
 			break;
@@ -328,6 +516,10 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
 	}
 
+	/* Get remaining space from other free slots */
+	if (e->blkno == fsmPage)
+		freeSlotSpace = HnswGetFreeSlotSpace(page, fsmPage);
+
 	/* Commit */
 	if (building)
 	{
@@ -341,22 +533,28 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	if (nbuf != buf)
 		UnlockReleaseBuffer(nbuf);
 
-	/* Update the insert page */
-	if (BlockNumberIsValid(newInsertPage) && newInsertPage != insertPage)
+	/* Free slots are outside of the stripe, so keep its insert page */
+	if (e->blkno == fsmPage)
+	{
+		RecordPageWithFreeSpace(index, fsmPage, freeSlotSpace);
+		*updatedInsertPage = InvalidBlockNumber;
+	}
+	else
 		*updatedInsertPage = newInsertPage;
 }
 
 /*
- * Load neighbors
+ * Load neighbors and optionally their distances
  */
 static HnswNeighborArray *
-HnswLoadNeighbors(HnswElement element, Relation index, int m, int lm, int lc)
+HnswLoadNeighbors(HnswElement element, Relation index, int m, int lm, int lc, bool distances)
 {
 	char	   *base = NULL;
 	HnswNeighborArray *neighbors = HnswInitNeighborArray(lm, NULL);
 	ItemPointerData indextids[HNSW_MAX_M * 2];
+	float		ndistances[HNSW_MAX_M * 2];
 
-	if (!HnswLoadNeighborTids(element, indextids, index, m, lm, lc))
+	if (!HnswLoadNeighborTids(element, indextids, distances ? ndistances : NULL, index, m, lm, lc))
 		return neighbors;
 
 	for (int i = 0; i < lm; i++)
@@ -371,6 +569,8 @@ HnswLoadNeighbors(HnswElement element, Relation index, int m, int lm, int lc)
 		e = HnswInitElementFromBlock(ItemPointerGetBlockNumber(indextid), ItemPointerGetOffsetNumber(indextid));
 		hc = &neighbors->items[neighbors->length++];
 		HnswPtrStore(base, hc->element, e);
+		if (distances)
+			hc->distance = ndistances[i];
 	}
 
 	return neighbors;
@@ -380,25 +580,42 @@ HnswLoadNeighbors(HnswElement element, Relation index, int m, int lm, int lc)
  * Load elements for insert
  */
 static void
-LoadElementsForInsert(HnswNeighborArray * neighbors, HnswQuery * q, int *idx, Relation index, HnswSupport * support)
+LoadElementsForInsert(HnswElement element, HnswNeighborArray * neighbors, bool distances, int *idx, Relation index, HnswSupport * support)
 {
 	char	   *base = NULL;
+	HnswQuery	q;
+
+	q.value = HnswGetValue(base, element);
 
 	for (int i = 0; i < neighbors->length; i++)
 	{
 		HnswCandidate *hc = &neighbors->items[i];
-		HnswElement element = HnswPtrAccess(base, hc->element);
-		double		distance;
+		HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+		float		cachedDistance;
 
-		HnswLoadElement(element, &distance, q, index, support, true, NULL);
-		hc->distance = (float) distance;
-
-		/* Prune element if being deleted */
-		if (element->heaptidsLength == 0)
+		if (distances)
 		{
-			*idx = i;
-			break;
+			/* Distance is stored in neighbor tuple */
+			HnswLoadElement(neighborElement, NULL, NULL, index, support, true, NULL);
+			HnswCacheDistance(support, element, neighborElement, hc->distance);
+		}
+		else if (HnswGetCachedDistance(support, element, neighborElement, &cachedDistance))
+		{
+			HnswLoadElement(neighborElement, NULL, NULL, index, support, true, NULL);
+			hc->distance = cachedDistance;
+		}
+		else
+		{
+			double		distance;
+
+			HnswLoadElement(neighborElement, &distance, &q, index, support, true, NULL);
+			hc->distance = (float) distance;
+			HnswCacheDistance(support, element, neighborElement, hc->distance);
 		}
+
+		/* Prune first element being deleted */
+		if (neighborElement->heaptidsLength == 0 && *idx == -1)
+			*idx = i;
 	}
 }
 
@@ -406,7 +623,7 @@ LoadElementsForInsert(HnswNeighborArray * neighbors, HnswQuery * q, int *idx, Re
  * Get update index
  */
 static int
-GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int m, int lm, int lc, Relation index, HnswSupport * support, MemoryContext updateCtx)
+GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int m, int lm, int lc, bool distances, Relation index, HnswSupport * support, MemoryContext updateCtx)
 {
 	char	   *base = NULL;
 	int			idx = -1;
@@ -418,7 +635,7 @@ GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int
 	 * selecting neighbors can take time. Could use optimistic locking to
 	 * retry if another update occurs before getting exclusive lock.
 	 */
-	neighbors = HnswLoadNeighbors(element, index, m, lm, lc);
+	neighbors = HnswLoadNeighbors(element, index, m, lm, lc, distances);
 
 	/*
 	 * Could improve performance for vacuuming by checking neighbors against
@@ -431,11 +648,7 @@ GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int
 		idx = -2;
 	else
 	{
-		HnswQuery	q;
-
-		q.value = HnswGetValue(base, element);
-
-		LoadElementsForInsert(neighbors, &q, &idx, index, support);
+		LoadElementsForInsert(element, neighbors, distances, &idx, index, support);
 
 		if (idx == -1)
 			HnswUpdateConnection(base, neighbors, newElement, distance, lm, &idx, index, support);
@@ -470,8 +683,8 @@ ConnectionExists(HnswElement e, HnswNeighborTuple ntup, int startIdx, int lm)
 /*
  * Update neighbor
  */
-static void
-UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m, int lm, int lc, Relation index, bool building)
+void
+HnswUpdateNeighborOnDisk(HnswElement element, HnswElement newElement, float distance, int idx, int m, int lm, int lc, bool distances, Relation index, bool building)
 {
 	Buffer		buf;
 	Page		page;
@@ -479,11 +692,12 @@ UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m
 	HnswNeighborTuple ntup;
 	int			startIdx;
 	OffsetNumber offno = element->neighborOffno;
+	bool		compactWal = !building && VectorXLogEnabled(index);
 
 	/* Register page */
 	buf = ReadBuffer(index, element->neighborPage);
 	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-	if (building)
+	if (building || compactWal)
 	{
 		state = NULL;
 		page = BufferGetPage(buf);
@@ -524,16 +738,23 @@ UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m
 	{
 		ItemPointer indextid = &ntup->indextids[idx];
 
-		/* Update neighbor on the buffer */
-		ItemPointerSet(indextid, newElement->blkno, newElement->offno);
-
-		/* Commit */
-		if (building)
-			MarkBufferDirty(buf);
+		if (compactWal)
+			HnswXLogSetNeighbor(index, buf, offno, idx, newElement->blkno, newElement->offno, distances, distance);
 		else
-			GenericXLogFinish(state);
+		{
+			/* Update neighbor on the buffer */
+			ItemPointerSet(indextid, newElement->blkno, newElement->offno);
+			if (distances)
+				HnswNeighborTupleDistances(ntup)[idx] = distance;
+
+			/* Commit */
+			if (building)
+				MarkBufferDirty(buf);
+			else
+				GenericXLogFinish(state);
+		}
 	}
-	else if (!building)
+	else if (state != NULL)
 		GenericXLogAbort(state);
 
 	UnlockReleaseBuffer(buf);
@@ -543,7 +764,7 @@ UpdateNeighborOnDisk(HnswElement element, HnswElement newElement, int idx, int m
  * Update neighbors
  */
 void
-HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool building)
+HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool distances, bool building)
 {
 	char	   *base = NULL;
 
@@ -566,13 +787,16 @@ HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e,
 			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
 			int			idx;
 
-			idx = GetUpdateIndex(neighborElement, e, hc->distance, m, lm, lc, index, support, updateCtx);
+			/* Distance is known from finding neighbors */
+			HnswCacheDistance(support, e, neighborElement, hc->distance);
+
+			idx = GetUpdateIndex(neighborElement, e, hc->distance, m, lm, lc, distances, index, support, updateCtx);
 
 			/* New element was not selected as a neighbor */
 			if (idx == -1)
 				continue;
 
-			UpdateNeighborOnDisk(neighborElement, e, idx, m, lm, lc, index, building);
+			HnswUpdateNeighborOnDisk(neighborElement, e, hc->distance, idx, m, lm, lc, distances, index, building);
 		}
 	}
 
@@ -611,6 +835,15 @@ AddDuplicateOnDisk(Relation index, HnswElement element, HnswElement dup, bool bu
 	{
 		if (!ItemPointerIsValid(&etup->heaptids[i]))
 			break;
+
+		/* Already added by a pending list flush that did not finish */
+		if (ItemPointerEquals(&etup->heaptids[i], &element->heaptids[0]))
+		{
+			if (!building)
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+			return true;
+		}
 	}
 
 	/* Either being deleted or we lost our chance to another backend */
@@ -666,8 +899,12 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
  * Update graph on disk
  */
 static void
-UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, int m, HnswElement entryPoint, bool building)
+UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, int m, bool distances, HnswElement entryPoint, BlockNumber reverseDir, bool building)
 {
+	int			stripe = GetInsertStripe();
+	BlockNumber stripePage;
+	BlockNumber otherPages[HNSW_INSERT_STRIPES];
+	BlockNumber insertPage;
 	BlockNumber newInsertPage = InvalidBlockNumber;
 
 	/* Look for duplicate */
@@ -675,110 +912,926 @@ UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, in
 		return;
 
 	/* Add element */
-	AddElementOnDisk(index, element, m, GetInsertPage(index), &newInsertPage, building);
+	insertPage = GetInsertPage(index, stripe, &stripePage, otherPages);
+	AddElementOnDisk(index, element, m, distances, insertPage, otherPages, &newInsertPage, building);
 
 	/* Update insert page if needed */
-	if (BlockNumberIsValid(newInsertPage))
-		HnswUpdateMetaPage(index, 0, NULL, newInsertPage, MAIN_FORKNUM, building);
+	if (BlockNumberIsValid(newInsertPage) && newInsertPage != stripePage)
+		UpdateInsertPage(index, stripe, newInsertPage, building);
 
 	/* Update neighbors */
-	HnswUpdateNeighborsOnDisk(index, support, element, m, building);
+	HnswUpdateNeighborsOnDisk(index, support, element, m, distances, building);
 
-	/* Update entry point if needed */
+	/* Record edges for vacuum */
+	if (BlockNumberIsValid(reverseDir))
+		HnswAddElementReverseEdges(index, reverseDir, &element, 1, building);
+
+	/* Update entry point if needed (only if still greater with concurrent inserts) */
 	if (entryPoint == NULL || element->level > entryPoint->level)
 		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, building);
 }
 
 /*
- * Insert a tuple into the index
+ * Insert a single element
  */
-bool
-HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building)
+static void
+InsertElementOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, int m, bool distances, HnswElement entryPoint, BlockNumber reverseDir, int efConstruction, bool building, MemoryContext tmpCtx)
 {
-	HnswElement entryPoint;
-	HnswElement element;
-	int			m;
-	int			efConstruction = HnswGetEfConstruction(index);
-	LOCKMODE	lockmode = ShareLock;
 	char	   *base = NULL;
-
-	/*
-	 * Get a shared lock. This allows vacuum to ensure no in-flight inserts
-	 * before repairing graph. Use a page lock so it does not interfere with
-	 * buffer lock (or reads when vacuuming).
-	 */
-	LockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-	/* Get m and entry point */
-	HnswGetMetaPageInfo(index, &m, &entryPoint);
+	HnswElement element;
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
 
 	/* Create an element */
 	element = HnswInitElement(base, heaptid, m, HnswGetMl(m), HnswGetMaxLevel(m), NULL);
 	HnswPtrStore(base, element->value, (char *) DatumGetPointer(value));
 
-	/* Prevent concurrent inserts when likely updating entry point */
-	if (entryPoint == NULL || element->level > entryPoint->level)
-	{
-		/* Release shared lock */
-		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-		/* Get exclusive lock */
-		lockmode = ExclusiveLock;
-		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-		/* Get latest entry point after lock is acquired */
-		entryPoint = HnswGetEntryPoint(index);
-	}
+	/* Remember distances between elements for this insert */
+	HnswInitDistanceCache(support, false);
 
 	/* Find neighbors for element */
 	HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, false);
 
 	/* Update graph on disk */
-	UpdateGraphOnDisk(index, support, element, m, entryPoint, building);
+	UpdateGraphOnDisk(index, support, element, m, distances, entryPoint, reverseDir, building);
 
-	/* Release lock */
-	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	HnswFreeDistanceCache(support);
 
-	return true;
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(tmpCtx);
 }
 
 /*
- * Insert a tuple into the index
+ * Copy an element loaded from disk, along with its value
  */
-static void
-HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid)
+static HnswElement
+CopyDiskElement(HnswElement element)
 {
-	Datum		value;
-	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
-	HnswSupport support;
+	char	   *base = NULL;
+	HnswElement copy = HnswInitElementFromBlock(element->blkno, element->offno);
+	Datum		value = HnswGetValue(base, element);
 
-	HnswInitSupport(&support, index);
+	copy->level = element->level;
+	copy->deleted = element->deleted;
+	copy->version = element->version;
+	copy->neighborPage = element->neighborPage;
+	copy->neighborOffno = element->neighborOffno;
+	copy->heaptidsLength = element->heaptidsLength;
+	memcpy(copy->heaptids, element->heaptids, sizeof(element->heaptids));
+	HnswPtrStore(base, copy->value, (char *) DatumGetPointer(datumCopy(value, false, -1)));
 
-	/* Form index value */
-	if (!HnswFormIndexValue(&value, values, isnull, typeInfo, &support))
-		return;
+	return copy;
+}
+
+/*
+ * Find neighbors on disk for an element of a batch
+ *
+ * Returns false if the element was added to an existing element instead
+ */
+static bool
+FindDiskNeighbors(Relation index, HnswSupport * support, HnswElement element, HnswElement entryPoint, int m, int efConstruction, bool building, MemoryContext tmpCtx)
+{
+	char	   *base = NULL;
+	bool		duplicate;
+	MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	HnswInitDistanceCache(support, false);
+	HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, false);
+	HnswFreeDistanceCache(support);
+
+	duplicate = FindDuplicateOnDisk(index, element, building);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Copy neighbors out of the temporary context */
+	if (!duplicate)
+	{
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			for (int i = 0; i < neighbors->length; i++)
+				HnswPtrStore(base, neighbors->items[i].element, CopyDiskElement(HnswPtrAccess(base, neighbors->items[i].element)));
+		}
+	}
 
-	HnswInsertTupleOnDisk(index, &support, value, heaptid, false);
+	MemoryContextReset(tmpCtx);
+
+	return !duplicate;
 }
 
 /*
- * Insert a tuple into the index
+ * Check if an element has neighbors that are not on disk yet
  */
-bool
-hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
-		   Relation heap, IndexUniqueCheck checkUnique
-#if PG_VERSION_NUM >= 140000
-		   ,bool indexUnchanged
-#endif
-		   ,IndexInfo *indexInfo
-)
+static bool
+HasNewNeighbors(HnswElement e)
 {
-	MemoryContext oldCtx;
-	MemoryContext insertCtx;
+	char	   *base = NULL;
 
-	/* Skip nulls */
-	if (isnull[0])
-		return false;
+	for (int lc = e->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			if (!BlockNumberIsValid(HnswPtrAccess(base, neighbors->items[i].element)->blkno))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Compare elements by neighbor page
+ */
+static int
+CompareNeighborPages(const void *a, const void *b)
+{
+	BlockNumber pa = (*(const HnswElement *) a)->neighborPage;
+	BlockNumber pb = (*(const HnswElement *) b)->neighborPage;
+
+	if (pa < pb)
+		return -1;
+	if (pa > pb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Set connections to elements added after their neighbor tuple, writing each
+ * page once
+ */
+static void
+SetNewNeighbors(Relation index, HnswElement * elements, int nelements, int m, bool distances, bool building)
+{
+	char	   *base = NULL;
+	bool		compactWal = !building && VectorXLogEnabled(index);
+	int			start = 0;
+
+	qsort(elements, nelements, sizeof(HnswElement), CompareNeighborPages);
+
+	while (start < nelements)
+	{
+		BlockNumber blkno = elements[start]->neighborPage;
+		int			end = start;
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+
+		while (end < nelements && elements[end]->neighborPage == blkno)
+			end++;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		if (building || compactWal)
+		{
+			state = NULL;
+			page = BufferGetPage(buf);
+		}
+		else
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+		}
+
+		for (int i = start; i < end; i++)
+		{
+			HnswElement e = elements[i];
+			HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, e->neighborOffno));
+			int			idx = 0;
+
+			/* Make robust to issues */
+			if (!HnswIsNeighborTuple(ntup) || ntup->count != HNSW_NEIGHBOR_COUNT(e->level, m))
+				continue;
+
+			for (int lc = e->level; lc >= 0; lc--)
+			{
+				HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+				for (int j = 0; j < neighbors->length; j++)
+				{
+					HnswCandidate *hc = &neighbors->items[j];
+					HnswElement hce = HnswPtrAccess(base, hc->element);
+
+					if (ItemPointerIsValid(&ntup->indextids[idx + j]))
+						continue;
+
+					if (compactWal)
+						HnswXLogSetNeighbor(index, buf, e->neighborOffno, idx + j, hce->blkno, hce->offno, distances, hc->distance);
+					else
+						ItemPointerSet(&ntup->indextids[idx + j], hce->blkno, hce->offno);
+				}
+
+				idx += HnswGetLayerM(m, lc);
+			}
+		}
+
+		/* Commit */
+		if (building)
+			MarkBufferDirty(buf);
+		else if (!compactWal)
+			GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+
+		start = end;
+	}
+}
+
+/*
+ * Connection from an element on disk to an element of a batch
+ */
+typedef struct HnswBatchUpdate
+{
+	HnswElement neighbor;
+	HnswElement element;
+	float		distance;
+	int			lc;
+}			HnswBatchUpdate;
+
+/*
+ * Slot of a neighbor tuple to write
+ */
+typedef struct HnswSlotUpdate
+{
+	HnswElement neighbor;
+	int			lc;
+	int			idx;			/* -2 for a free slot */
+	ItemPointerData oldtid;
+	HnswElement element;
+	float		distance;
+}			HnswSlotUpdate;
+
+/*
+ * Compare updates by neighbor tuple, layer, and distance
+ */
+static int
+CompareBatchUpdates(const void *a, const void *b)
+{
+	const		HnswBatchUpdate *ua = (const HnswBatchUpdate *) a;
+	const		HnswBatchUpdate *ub = (const HnswBatchUpdate *) b;
+
+	if (ua->neighbor->neighborPage != ub->neighbor->neighborPage)
+		return ua->neighbor->neighborPage < ub->neighbor->neighborPage ? -1 : 1;
+
+	if (ua->neighbor->neighborOffno != ub->neighbor->neighborOffno)
+		return ua->neighbor->neighborOffno < ub->neighbor->neighborOffno ? -1 : 1;
+
+	if (ua->lc != ub->lc)
+		return ua->lc > ub->lc ? -1 : 1;
+
+	if (ua->distance != ub->distance)
+		return ua->distance < ub->distance ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Check if updates are for the same neighbor tuple and layer
+ */
+static inline bool
+SameNeighborLayer(HnswBatchUpdate * a, HnswBatchUpdate * b)
+{
+	return a->neighbor->neighborPage == b->neighbor->neighborPage && a->neighbor->neighborOffno == b->neighbor->neighborOffno && a->lc == b->lc;
+}
+
+/*
+ * Get the index of the first element being deleted
+ */
+static int
+GetDeletedIndex(HnswNeighborArray * neighbors)
+{
+	char	   *base = NULL;
+
+	for (int i = 0; i < neighbors->length; i++)
+	{
+		if (HnswPtrAccess(base, neighbors->items[i].element)->heaptidsLength == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Select the connections of a neighbor for elements of a batch
+ *
+ * Returns the number of slots to write
+ */
+static int
+GetUpdateSlots(HnswBatchUpdate * updates, int nupdates, int m, bool distances, Relation index, HnswSupport * support, HnswSlotUpdate * slots)
+{
+	char	   *base = NULL;
+	HnswElement neighbor = updates[0].neighbor;
+	int			lc = updates[0].lc;
+	int			lm = HnswGetLayerM(m, lc);
+	HnswNeighborArray *neighbors;
+	ItemPointerData oldtids[HNSW_MAX_M * 2];
+	int			length;
+	int			nslots = 0;
+
+	/* Get latest neighbors since they may have changed */
+	neighbors = HnswLoadNeighbors(neighbor, index, m, lm, lc, distances);
+	length = neighbors->length;
+
+	for (int i = 0; i < length; i++)
+	{
+		HnswElement e = HnswPtrAccess(base, neighbors->items[i].element);
+
+		ItemPointerSet(&oldtids[i], e->blkno, e->offno);
+	}
+
+	/* Load before adding elements from the batch */
+	if (length + nupdates > lm)
+	{
+		int			unused = -1;
+
+		LoadElementsForInsert(neighbor, neighbors, distances, &unused, index, support);
+	}
+
+	for (int i = 0; i < nupdates; i++)
+	{
+		HnswBatchUpdate *update = &updates[i];
+		int			idx;
+
+		HnswCacheDistance(support, neighbor, update->element, update->distance);
+
+		if (neighbors->length < lm)
+			idx = neighbors->length++;
+		else
+		{
+			idx = GetDeletedIndex(neighbors);
+
+			/* Replace element being deleted */
+			if (idx == -1)
+			{
+				HnswUpdateConnection(base, neighbors, update->element, update->distance, lm, NULL, index, support);
+				continue;
+			}
+		}
+
+		HnswPtrStore(base, neighbors->items[idx].element, update->element);
+		neighbors->items[idx].distance = update->distance;
+	}
+
+	/* Get changed slots */
+	for (int i = 0; i < neighbors->length; i++)
+	{
+		HnswCandidate *hc = &neighbors->items[i];
+		HnswElement e = HnswPtrAccess(base, hc->element);
+		HnswSlotUpdate *slot;
+
+		if (i < length && ItemPointerGetBlockNumber(&oldtids[i]) == e->blkno && ItemPointerGetOffsetNumber(&oldtids[i]) == e->offno)
+			continue;
+
+		slot = &slots[nslots++];
+		slot->neighbor = neighbor;
+		slot->lc = lc;
+		slot->element = e;
+		slot->distance = hc->distance;
+		if (i < length)
+		{
+			slot->idx = i;
+			slot->oldtid = oldtids[i];
+		}
+		else
+		{
+			slot->idx = -2;
+			ItemPointerSetInvalid(&slot->oldtid);
+		}
+	}
+
+	return nslots;
+}
+
+/*
+ * Write slots of neighbor tuples on a page
+ */
+static void
+WriteUpdateSlots(Relation index, BlockNumber blkno, HnswSlotUpdate * slots, int nslots, int m, bool distances, bool building)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	bool		compactWal = !building && VectorXLogEnabled(index);
+	bool		updated = false;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building || compactWal)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	for (int i = 0; i < nslots; i++)
+	{
+		HnswSlotUpdate *slot = &slots[i];
+		HnswElement neighbor = slot->neighbor;
+		HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, neighbor->neighborOffno));
+		int			lm = HnswGetLayerM(m, slot->lc);
+		int			startIdx = (neighbor->level - slot->lc) * m;
+		int			idx = -1;
+
+		/* Skip if neighbor tuple was replaced */
+		if (ntup->version != neighbor->version || ntup->count != HNSW_NEIGHBOR_COUNT(neighbor->level, m))
+			continue;
+
+		/* Check for existing connection */
+		if (ConnectionExists(slot->element, ntup, startIdx, lm))
+			continue;
+
+		if (slot->idx == -2)
+		{
+			/* Find free offset if still exists */
+			for (int j = 0; j < lm; j++)
+			{
+				if (!ItemPointerIsValid(&ntup->indextids[startIdx + j]))
+				{
+					idx = startIdx + j;
+					break;
+				}
+			}
+		}
+		else if (ItemPointerEquals(&ntup->indextids[startIdx + slot->idx], &slot->oldtid))
+		{
+			/* Skip if changed by another backend since loaded */
+			idx = startIdx + slot->idx;
+		}
+
+		if (idx < 0)
+			continue;
+
+		if (compactWal)
+			HnswXLogSetNeighbor(index, buf, neighbor->neighborOffno, idx, slot->element->blkno, slot->element->offno, distances, slot->distance);
+		else
+		{
+			ItemPointerSet(&ntup->indextids[idx], slot->element->blkno, slot->element->offno);
+			if (distances)
+				HnswNeighborTupleDistances(ntup)[idx] = slot->distance;
+		}
+
+		updated = true;
+	}
+
+	/* Commit */
+	if (building)
+	{
+		if (updated)
+			MarkBufferDirty(buf);
+	}
+	else if (!compactWal)
+	{
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+	}
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Connect neighbors on disk to elements of a batch, writing each page once
+ */
+static void
+UpdateBatchNeighborsOnDisk(Relation index, HnswSupport * support, HnswBatchUpdate * updates, int nupdates, int m, bool distances, bool building)
+{
+	int			start = 0;
+
+	/* Use separate memory context to improve performance for larger vectors */
+	MemoryContext updateCtx = GenerationContextCreate(CurrentMemoryContext,
+													  "Hnsw insert update context",
+#if PG_VERSION_NUM >= 150000
+													  128 * 1024, 128 * 1024,
+#endif
+													  128 * 1024);
+
+	qsort(updates, nupdates, sizeof(HnswBatchUpdate), CompareBatchUpdates);
+
+	while (start < nupdates)
+	{
+		BlockNumber blkno = updates[start].neighbor->neighborPage;
+		int			end = start;
+		HnswSlotUpdate *slots;
+		int			nslots = 0;
+		MemoryContext oldCtx;
+
+		while (end < nupdates && updates[end].neighbor->neighborPage == blkno)
+			end++;
+
+		oldCtx = MemoryContextSwitchTo(updateCtx);
+
+		/* Each update changes at most one slot */
+		slots = palloc_array_checked(HnswSlotUpdate, (Size) (end - start));
+
+		/* Select connections before locking the page since this can take time */
+		HnswInitDistanceCache(support, false);
+		for (int i = start; i < end;)
+		{
+			int			j = i + 1;
+
+			while (j < end && SameNeighborLayer(&updates[i], &updates[j]))
+				j++;
+
+			nslots += GetUpdateSlots(&updates[i], j - i, m, distances, index, support, &slots[nslots]);
+			i = j;
+		}
+		HnswFreeDistanceCache(support);
+
+		MemoryContextSwitchTo(oldCtx);
+
+		if (nslots > 0)
+			WriteUpdateSlots(index, blkno, slots, nslots, m, distances, building);
+
+		MemoryContextReset(updateCtx);
+		start = end;
+	}
+
+	MemoryContextDelete(updateCtx);
+}
+
+/*
+ * Insert a batch of elements
+ *
+ * Each element searches the graph on disk once. Connections within the batch
+ * are found in memory with the same code as in-memory builds and merged with
+ * the connections on disk. Elements are then added in a single pass over the
+ * insert pages, and each neighbor page on disk is written once.
+ */
+static void
+InsertBatchOnDisk(Relation index, HnswSupport * support, Datum *values, ItemPointerData *heaptids, int ntuples, int m, bool distances, HnswElement entryPoint, BlockNumber reverseDir, int efConstruction, bool building)
+{
+	char	   *base = NULL;
+	HnswElement *elements = palloc_array_checked(HnswElement, (Size) ntuples);
+	HnswNeighborArrayPtr **diskNeighbors = palloc_array_checked(HnswNeighborArrayPtr *, (Size) ntuples);
+	HnswElement *newNeighbors;
+	HnswBatchUpdate *updates = NULL;
+	int			nelements = 0;
+	int			nadded = 0;
+	int			nnew = 0;
+	int			nupdates = 0;
+	int			maxUpdates = 0;
+	HnswElement memEntryPoint = NULL;
+	int			stripe = GetInsertStripe();
+	BlockNumber stripePage;
+	BlockNumber otherPages[HNSW_INSERT_STRIPES];
+	BlockNumber insertPage;
+	BlockNumber updatedInsertPage = InvalidBlockNumber;
+	MemoryContext tmpCtx;
+	MemoryContext oldCtx;
+
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "Hnsw insert batch temporary context",
+								   ALLOCSET_DEFAULT_SIZES);
+
+	/* Find neighbors on disk */
+	for (int i = 0; i < ntuples; i++)
+	{
+		HnswElement element;
+
+		CHECK_FOR_INTERRUPTS();
+
+		element = HnswInitElement(base, &heaptids[i], m, HnswGetMl(m), HnswGetMaxLevel(m), NULL);
+		element->blkno = InvalidBlockNumber;
+		element->offno = InvalidOffsetNumber;
+		HnswPtrStore(base, element->value, (char *) DatumGetPointer(values[i]));
+
+		if (!FindDiskNeighbors(index, support, element, entryPoint, m, efConstruction, building, tmpCtx))
+			continue;
+
+		/* Keep neighbors on disk for merging */
+		diskNeighbors[nelements] = HnswPtrAccess(base, element->neighbors);
+		HnswInitNeighbors(base, element, m, NULL);
+		elements[nelements++] = element;
+	}
+
+	/* Find neighbors within the batch */
+	HnswInitLockTranche();
+	for (int i = 0; i < nelements; i++)
+		LWLockInitialize(&elements[i]->lock, hnsw_lock_tranche_id);
+
+	for (int i = 0; i < nelements; i++)
+	{
+		HnswElement element = elements[i];
+		bool		duplicate = false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		oldCtx = MemoryContextSwitchTo(tmpCtx);
+		HnswInitDistanceCache(support, true);
+
+		if (memEntryPoint != NULL)
+		{
+			HnswFindElementNeighbors(base, element, memEntryPoint, NULL, support, m, efConstruction, false);
+			duplicate = HnswFindDuplicateInMemory(base, element);
+		}
+
+		if (!duplicate)
+			HnswUpdateNeighborsInMemory(base, support, element, m);
+
+		HnswFreeDistanceCache(support);
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(tmpCtx);
+
+		if (duplicate)
+		{
+			/* Heap TID was added to the other element */
+			elements[i] = NULL;
+			continue;
+		}
+
+		if (memEntryPoint == NULL || element->level > memEntryPoint->level)
+			memEntryPoint = element;
+	}
+
+	/* Merge with neighbors on disk */
+	for (int i = 0; i < nelements; i++)
+	{
+		HnswElement element = elements[i];
+
+		if (element == NULL)
+			continue;
+
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			oldCtx = MemoryContextSwitchTo(tmpCtx);
+			HnswInitDistanceCache(support, true);
+			HnswMergeNeighbors(base, neighbors, HnswPtrAccess(base, diskNeighbors[i][lc]), HnswGetLayerM(m, lc), support);
+			HnswFreeDistanceCache(support);
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(tmpCtx);
+
+			/* Elements on disk need a connection back */
+			for (int j = 0; j < neighbors->length; j++)
+			{
+				HnswCandidate *hc = &neighbors->items[j];
+				HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+
+				if (!BlockNumberIsValid(neighborElement->blkno))
+					continue;
+
+				if (nupdates == maxUpdates)
+				{
+					maxUpdates = maxUpdates == 0 ? 256 : maxUpdates * 2;
+					if (nupdates == 0)
+						updates = palloc_array_checked(HnswBatchUpdate, (Size) maxUpdates);
+					else
+						updates = repalloc(updates, mul_size(sizeof(HnswBatchUpdate), (Size) maxUpdates));
+				}
+
+				updates[nupdates].neighbor = neighborElement;
+				updates[nupdates].element = element;
+				updates[nupdates].distance = hc->distance;
+				updates[nupdates].lc = lc;
+				nupdates++;
+			}
+		}
+	}
+
+	/* Remove duplicates */
+	for (int i = 0; i < nelements; i++)
+	{
+		if (elements[i] != NULL)
+			elements[nadded++] = elements[i];
+	}
+
+	/* Add elements */
+	newNeighbors = palloc_array_checked(HnswElement, (Size) Max(nadded, 1));
+	insertPage = GetInsertPage(index, stripe, &stripePage, otherPages);
+	for (int i = 0; i < nadded; i++)
+	{
+		HnswElement element = elements[i];
+		BlockNumber newInsertPage = InvalidBlockNumber;
+
+		/* Connections to later elements are set once they are added */
+		if (HasNewNeighbors(element))
+			newNeighbors[nnew++] = element;
+
+		AddElementOnDisk(index, element, m, distances, insertPage, otherPages, &newInsertPage, building);
+
+		if (BlockNumberIsValid(newInsertPage))
+			insertPage = updatedInsertPage = newInsertPage;
+	}
+
+	/* Update insert page if needed */
+	if (BlockNumberIsValid(updatedInsertPage) && updatedInsertPage != stripePage)
+		UpdateInsertPage(index, stripe, updatedInsertPage, building);
+
+	/* Set connections within the batch */
+	if (nnew > 0)
+		SetNewNeighbors(index, newNeighbors, nnew, m, distances, building);
+
+	/* Update neighbors on disk */
+	if (nupdates > 0)
+		UpdateBatchNeighborsOnDisk(index, support, updates, nupdates, m, distances, building);
+
+	/* Record edges for vacuum */
+	if (BlockNumberIsValid(reverseDir) && nadded > 0)
+		HnswAddElementReverseEdges(index, reverseDir, elements, nadded, building);
+
+	/* Update entry point if needed (only if still greater with concurrent inserts) */
+	if (memEntryPoint != NULL && (entryPoint == NULL || memEntryPoint->level > entryPoint->level))
+		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, memEntryPoint, InvalidBlockNumber, MAIN_FORKNUM, building);
+
+	MemoryContextDelete(tmpCtx);
+}
+
+/*
+ * Insert tuples into the index
+ *
+ * The update lock is held for the whole batch, so the metapage only needs to
+ * be read again when the entry point may change
+ */
+void
+HnswInsertTuplesOnDisk(Relation index, HnswSupport * support, Datum *values, ItemPointerData *heaptids, int ntuples, bool building)
+{
+	HnswElement entryPoint;
+	int			m;
+	bool		distances;
+	BlockNumber reverseDir;
+	int			efConstruction = HnswGetEfConstruction(index);
+	LOCKMODE	lockmode = ShareLock;
+	int			start = 0;
+	MemoryContext tmpCtx;
+
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "Hnsw insert temporary context",
+								   ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * Get a shared lock. This allows vacuum to ensure no in-flight inserts
+	 * before repairing graph. Use a page lock so it does not interfere with
+	 * buffer lock (or reads when vacuuming).
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+	/* Get m and entry point */
+	HnswGetMetaPageInfo(index, &m, &entryPoint, &distances);
+	reverseDir = HnswGetReverseDir(index);
+
+	/*
+	 * Prevent concurrent inserts when there is no entry point, since elements
+	 * inserted at the same time would not be connected. Otherwise, the entry
+	 * point is updated with a check on the metapage, so concurrent inserts do
+	 * not need to wait. With a race, elements are still connected at levels
+	 * up to the previous entry point.
+	 */
+	while (entryPoint == NULL && start < ntuples)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (lockmode == ShareLock)
+		{
+			/* Release shared lock */
+			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+			/* Get exclusive lock */
+			lockmode = ExclusiveLock;
+			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		}
+		else
+		{
+			InsertElementOnDisk(index, support, values[start], &heaptids[start], m, distances, NULL, reverseDir, efConstruction, building, tmpCtx);
+			start++;
+		}
+
+		/* Get latest entry point after lock is acquired */
+		entryPoint = HnswGetEntryPoint(index);
+	}
+
+	/* Allow concurrent inserts for the rest of the batch */
+	if (lockmode == ExclusiveLock && start < ntuples)
+	{
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		lockmode = ShareLock;
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		entryPoint = HnswGetEntryPoint(index);
+	}
+
+	if (ntuples - start == 1)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		InsertElementOnDisk(index, support, values[start], &heaptids[start], m, distances, entryPoint, reverseDir, efConstruction, building, tmpCtx);
+	}
+	else if (ntuples - start > 1)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+		InsertBatchOnDisk(index, support, &values[start], &heaptids[start], ntuples - start, m, distances, entryPoint, reverseDir, efConstruction, building);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	/* Release lock */
+	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+	MemoryContextDelete(tmpCtx);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building)
+{
+	HnswInsertTuplesOnDisk(index, support, &value, heaptid, 1, building);
+
+	return true;
+}
+
+/*
+ * Get the insert state, which is cached for the statement
+ */
+static HnswInsertState *
+GetInsertState(Relation index, IndexInfo *indexInfo)
+{
+	HnswInsertState *insertstate = (HnswInsertState *) indexInfo->ii_AmCache;
+	MemoryContext oldCtx;
+
+	if (insertstate != NULL)
+		return insertstate;
+
+	oldCtx = MemoryContextSwitchTo(indexInfo->ii_Context);
+
+	insertstate = palloc0_object(HnswInsertState);
+	insertstate->typeInfo = HnswGetTypeInfo(index);
+	insertstate->fastupdate = HnswGetFastUpdate(index);
+
+	/* Copy support functions so they do not depend on the relcache entry */
+	HnswInitSupport(&insertstate->support, index);
+	fmgr_info_copy(&insertstate->procinfo, insertstate->support.procinfo, indexInfo->ii_Context);
+	insertstate->support.procinfo = &insertstate->procinfo;
+	if (insertstate->support.normprocinfo != NULL)
+	{
+		fmgr_info_copy(&insertstate->normprocinfo, insertstate->support.normprocinfo, indexInfo->ii_Context);
+		insertstate->support.normprocinfo = &insertstate->normprocinfo;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	indexInfo->ii_AmCache = insertstate;
+	return insertstate;
+}
+
+/*
+ * Insert a tuple into the index
+ */
+static void
+HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, HnswInsertState * insertstate)
+{
+	Datum		value;
+	HnswSupport *support = &insertstate->support;
+
+	/* Form index value */
+	if (!HnswFormIndexValue(&value, values, isnull, insertstate->typeInfo, support))
+		return;
+
+	if (insertstate->fastupdate)
+	{
+		bool		flush = false;
+
+		if (HnswInsertPending(index, value, heaptid, &flush))
+		{
+			/* Skip if another backend is flushing */
+			if (flush)
+				HnswFlushPendingList(index, support, false, NULL, NULL, NULL);
+
+			return;
+		}
+	}
+
+	HnswInsertTupleOnDisk(index, support, value, heaptid, false);
+}
+
+/*
+ * Insert a tuple into the index
+ */
+bool
+hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
+		   Relation heap, IndexUniqueCheck checkUnique
+#if PG_VERSION_NUM >= 140000
+		   ,bool indexUnchanged
+#endif
+		   ,IndexInfo *indexInfo
+)
+{
+	MemoryContext oldCtx;
+	MemoryContext insertCtx;
+	HnswInsertState *insertstate;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return false;
+
+	insertstate = GetInsertState(index, indexInfo);
 
 	/* Create memory context */
 	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
@@ -787,7 +1840,7 @@ hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
 	oldCtx = MemoryContextSwitchTo(insertCtx);
 
 	/* Insert tuple */
-	HnswInsertTuple(index, values, isnull, heap_tid);
+	HnswInsertTuple(index, values, isnull, heap_tid, insertstate);
 
 	/* Delete memory context */
 	MemoryContextSwitchTo(oldCtx);
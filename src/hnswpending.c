@@ -0,0 +1,639 @@
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/generic_xlog.h"
+#include "access/itup.h"
+#include "access/xlog.h"
+#include "catalog/pg_class.h"
+#include "fmgr.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+/*
+ * The pending list is a chain of pages separate from the element pages.
+ * Inserts with fastupdate append tuples to the tail page, and a flush moves
+ * them into the graph. Pages emptied by a flush are moved after the tail to
+ * be reused.
+ */
+
+/*
+ * Check if the pending list should be flushed
+ */
+static bool
+PendingListFull(HnswMetaPage metap)
+{
+	return (Size) metap->pendingPages * BLCKSZ > (Size) hnsw_pending_list_limit * 1024;
+}
+
+/*
+ * Add a new page
+ */
+static Buffer
+PendingAppendPage(Relation index, GenericXLogState *state, Page *page)
+{
+	Buffer		buf;
+
+	LockRelationForExtension(index, ExclusiveLock);
+	buf = HnswNewBuffer(index, MAIN_FORKNUM);
+	UnlockRelationForExtension(index, ExclusiveLock);
+
+	*page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+	HnswInitPage(buf, *page);
+
+	return buf;
+}
+
+/*
+ * Add a tuple to a page
+ */
+static void
+AddPendingTuple(Relation index, Page page, HnswPendingTuple ptup, Size ptupSize)
+{
+	if (PageAddItem(page, (Item) ptup, ptupSize, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+}
+
+/*
+ * Add a tuple to the pending list
+ *
+ * Returns false if the index does not have a pending list
+ */
+bool
+HnswInsertPending(Relation index, Datum value, ItemPointer heaptid, bool *flush)
+{
+	Size		valueSize = VARSIZE_ANY(DatumGetPointer(value));
+	Size		ptupSize = HNSW_PENDING_TUPLE_SIZE(valueSize);
+	HnswPendingTuple ptup;
+	Buffer		metabuf;
+	Page		metapage;
+	HnswMetaPage metap;
+	Buffer		buf;
+	Buffer		tailbuf = InvalidBuffer;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber tail;
+
+	/* Use the graph for tuples that need a page to themselves */
+	if (ptupSize > HNSW_MAX_SIZE / 2)
+		return false;
+
+	/* Form tuple */
+	ptup = palloc0(ptupSize);
+	ptup->type = HNSW_PENDING_TUPLE_TYPE;
+	ptup->heaptid = *heaptid;
+	memcpy(&ptup->data, DatumGetPointer(value), valueSize);
+
+	/* Get a shared lock on the metapage */
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(metabuf));
+
+	if (!HnswHasPendingList(metap->version))
+	{
+		UnlockReleaseBuffer(metabuf);
+		pfree(ptup);
+		return false;
+	}
+
+	/* Try the tail page first, which only changes with an exclusive lock */
+	tail = metap->pendingTail;
+	if (BlockNumberIsValid(tail))
+	{
+		buf = ReadBuffer(index, tail);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		if (PageGetFreeSpace(BufferGetPage(buf)) >= ptupSize)
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			AddPendingTuple(index, page, ptup, ptupSize);
+			GenericXLogFinish(state);
+			UnlockReleaseBuffer(buf);
+
+			*flush = PendingListFull(metap);
+			UnlockReleaseBuffer(metabuf);
+			pfree(ptup);
+			return true;
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Get an exclusive lock to move the tail */
+	LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+
+	state = GenericXLogStart(index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	metap = HnswPageGetMeta(metapage);
+
+	/* Tail may have changed before the lock was acquired */
+	tail = metap->pendingTail;
+	if (!BlockNumberIsValid(tail))
+	{
+		buf = PendingAppendPage(index, state, &page);
+		metap->pendingHead = BufferGetBlockNumber(buf);
+		metap->pendingTail = BufferGetBlockNumber(buf);
+		metap->pendingPages = 1;
+	}
+	else
+	{
+		Page		tailpage;
+
+		tailbuf = ReadBuffer(index, tail);
+		LockBuffer(tailbuf, BUFFER_LOCK_EXCLUSIVE);
+		tailpage = GenericXLogRegisterBuffer(state, tailbuf, 0);
+
+		if (PageGetFreeSpace(tailpage) >= ptupSize)
+		{
+			buf = tailbuf;
+			page = tailpage;
+			tailbuf = InvalidBuffer;
+		}
+		else
+		{
+			BlockNumber nextblkno = HnswPageGetOpaque(tailpage)->nextblkno;
+
+			if (BlockNumberIsValid(nextblkno))
+			{
+				/* Reuse a page emptied by a flush */
+				buf = ReadBuffer(index, nextblkno);
+				LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+				page = GenericXLogRegisterBuffer(state, buf, 0);
+			}
+			else
+			{
+				buf = PendingAppendPage(index, state, &page);
+				HnswPageGetOpaque(tailpage)->nextblkno = BufferGetBlockNumber(buf);
+			}
+
+			metap->pendingTail = BufferGetBlockNumber(buf);
+			metap->pendingPages++;
+		}
+	}
+
+	AddPendingTuple(index, page, ptup, ptupSize);
+	*flush = PendingListFull(metap);
+
+	/* Commit */
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(tailbuf))
+		UnlockReleaseBuffer(tailbuf);
+	UnlockReleaseBuffer(metabuf);
+
+	pfree(ptup);
+	return true;
+}
+
+/*
+ * Move the tail to a new page so pages up to the current tail can be flushed
+ * without concurrent changes
+ */
+static bool
+RotatePendingList(Relation index, BlockNumber *head, BlockNumber *last)
+{
+	Buffer		metabuf;
+	Page		metapage;
+	HnswMetaPage metap;
+	Buffer		tailbuf;
+	Page		tailpage;
+	Buffer		newbuf = InvalidBuffer;
+	GenericXLogState *state;
+	BlockNumber nextblkno;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+
+	state = GenericXLogStart(index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	metap = HnswPageGetMeta(metapage);
+
+	if (!HnswHasPendingList(metap->version) || !BlockNumberIsValid(metap->pendingTail))
+	{
+		GenericXLogAbort(state);
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	tailbuf = ReadBuffer(index, metap->pendingTail);
+	LockBuffer(tailbuf, BUFFER_LOCK_EXCLUSIVE);
+	tailpage = GenericXLogRegisterBuffer(state, tailbuf, 0);
+
+	/* Nothing to flush */
+	if (metap->pendingHead == metap->pendingTail && PageIsEmpty(tailpage))
+	{
+		GenericXLogAbort(state);
+		UnlockReleaseBuffer(tailbuf);
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	nextblkno = HnswPageGetOpaque(tailpage)->nextblkno;
+	if (!BlockNumberIsValid(nextblkno))
+	{
+		Page		newpage;
+
+		newbuf = PendingAppendPage(index, state, &newpage);
+		nextblkno = BufferGetBlockNumber(newbuf);
+		HnswPageGetOpaque(tailpage)->nextblkno = nextblkno;
+	}
+
+	*head = metap->pendingHead;
+	*last = metap->pendingTail;
+
+	metap->pendingTail = nextblkno;
+	metap->pendingPages++;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(tailbuf);
+	UnlockReleaseBuffer(metabuf);
+
+	return true;
+}
+
+/*
+ * Remove all tuples from a page, keeping its place in the list
+ */
+static void
+EmptyPendingPage(Relation index, BlockNumber blkno)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber nextblkno;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	nextblkno = HnswPageGetOpaque(page)->nextblkno;
+	HnswInitPage(buf, page);
+	HnswPageGetOpaque(page)->nextblkno = nextblkno;
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Move emptied pages after the end of the list to be reused
+ */
+static void
+RelinkPendingList(Relation index, BlockNumber head, BlockNumber last, uint32 flushedPages)
+{
+	Buffer		metabuf;
+	Page		metapage;
+	HnswMetaPage metap;
+	Buffer		lastbuf;
+	Page		lastpage;
+	Buffer		endbuf;
+	Page		endpage;
+	GenericXLogState *state;
+	BlockNumber endblkno;
+
+	/* Wait for scans walking the list, which could follow the old links */
+	LockPage(index, HNSW_PENDING_SCAN_LOCK, ExclusiveLock);
+
+	/* Exclusive lock prevents changes to links */
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+
+	/* Find end of list, which is after the tail */
+	endblkno = HnswPageGetMeta(BufferGetPage(metabuf))->pendingTail;
+	for (;;)
+	{
+		Buffer		buf = ReadBuffer(index, endblkno);
+		BlockNumber nextblkno;
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		nextblkno = HnswPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		UnlockReleaseBuffer(buf);
+
+		if (!BlockNumberIsValid(nextblkno))
+			break;
+
+		endblkno = nextblkno;
+	}
+
+	Assert(endblkno != last);
+
+	state = GenericXLogStart(index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	metap = HnswPageGetMeta(metapage);
+
+	lastbuf = ReadBuffer(index, last);
+	LockBuffer(lastbuf, BUFFER_LOCK_EXCLUSIVE);
+	lastpage = GenericXLogRegisterBuffer(state, lastbuf, 0);
+
+	endbuf = ReadBuffer(index, endblkno);
+	LockBuffer(endbuf, BUFFER_LOCK_EXCLUSIVE);
+	endpage = GenericXLogRegisterBuffer(state, endbuf, 0);
+
+	/* Head is the page after the flushed pages */
+	metap->pendingHead = HnswPageGetOpaque(lastpage)->nextblkno;
+	metap->pendingPages -= flushedPages;
+
+	HnswPageGetOpaque(lastpage)->nextblkno = InvalidBlockNumber;
+	HnswPageGetOpaque(endpage)->nextblkno = head;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(endbuf);
+	UnlockReleaseBuffer(lastbuf);
+	UnlockReleaseBuffer(metabuf);
+
+	UnlockPage(index, HNSW_PENDING_SCAN_LOCK, ExclusiveLock);
+}
+
+/*
+ * Move tuples from the pending list into the graph
+ *
+ * Tuples are added to the graph before their page is emptied, so scans that
+ * read the pending list before the graph do not miss them. Uses the same
+ * on-disk insert path as builds that exceed maintenance_work_mem, which checks
+ * for duplicates, so a flush interrupted by a crash can be retried. Emptied
+ * pages stay linked until scans that started before the flush finish.
+ *
+ * Returns the number of tuples added to the graph
+ */
+int64
+HnswFlushPendingList(Relation index, HnswSupport * support, bool wait, IndexBulkDeleteCallback callback, void *callback_state, IndexBulkDeleteResult *stats)
+{
+	BlockNumber head;
+	BlockNumber last;
+	BlockNumber blkno;
+	uint32		flushedPages = 0;
+	int64		inserted = 0;
+	BlockNumber *blknos;
+	Datum	   *values;
+	ItemPointerData *heaptids;
+	int			npages = 0;
+	int			ntuples = 0;
+	MemoryContext tmpCtx;
+	MemoryContext oldCtx;
+
+	/* Only one backend flushes at a time */
+	if (wait)
+		LockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+	else if (!ConditionalLockPage(index, HNSW_PENDING_LOCK, ExclusiveLock))
+		return 0;
+
+	if (!RotatePendingList(index, &head, &last))
+	{
+		UnlockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+		return 0;
+	}
+
+	/* Batch can exceed the size by the tuples on one page */
+	blknos = palloc_array_checked(BlockNumber, HNSW_INSERT_BATCH_SIZE);
+	values = palloc_array_checked(Datum, HNSW_INSERT_BATCH_SIZE + MaxIndexTuplesPerPage);
+	heaptids = palloc_array_checked(ItemPointerData, HNSW_INSERT_BATCH_SIZE + MaxIndexTuplesPerPage);
+
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "Hnsw pending list temporary context",
+								   ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	blkno = head;
+	for (;;)
+	{
+		Buffer		buf;
+		Page		page;
+		BlockNumber nextblkno;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Copy page so no buffer locks are held during inserts */
+		page = palloc(BLCKSZ);
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		memcpy(page, BufferGetPage(buf), BLCKSZ);
+		UnlockReleaseBuffer(buf);
+
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswPendingTuple ptup = (HnswPendingTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			/* Skip dead tuples when vacuuming */
+			if (callback != NULL && callback(&ptup->heaptid, callback_state))
+			{
+				if (stats != NULL)
+					stats->tuples_removed++;
+				continue;
+			}
+
+			values[ntuples] = PointerGetDatum(&ptup->data);
+			heaptids[ntuples] = ptup->heaptid;
+			ntuples++;
+		}
+
+		blknos[npages++] = blkno;
+
+		/*
+		 * Insert tuples from several pages as a batch. Pages are copied until
+		 * then, so this also bounds memory.
+		 */
+		if (ntuples >= HNSW_INSERT_BATCH_SIZE || npages == HNSW_INSERT_BATCH_SIZE || blkno == last)
+		{
+			if (ntuples > 0)
+				HnswInsertTuplesOnDisk(index, support, values, heaptids, ntuples, false);
+			inserted += ntuples;
+
+			for (int i = 0; i < npages; i++)
+				EmptyPendingPage(index, blknos[i]);
+			flushedPages += npages;
+
+			npages = 0;
+			ntuples = 0;
+			MemoryContextReset(tmpCtx);
+		}
+
+		if (blkno == last)
+			break;
+
+		blkno = nextblkno;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(tmpCtx);
+	pfree(blknos);
+	pfree(values);
+	pfree(heaptids);
+
+	RelinkPendingList(index, head, last, flushedPages);
+
+	UnlockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+
+	return inserted;
+}
+
+/*
+ * Compare items by distance
+ */
+static int
+CompareItems(const void *a, const void *b)
+{
+	double		d1 = ((const HnswPendingItem *) a)->distance;
+	double		d2 = ((const HnswPendingItem *) b)->distance;
+
+	if (d1 < d2)
+		return -1;
+
+	if (d1 > d2)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get the distance to every tuple in the pending list, sorted by distance
+ *
+ * The head is from the metapage info read at the start of the scan
+ */
+HnswPendingItem *
+HnswScanPendingList(Relation index, HnswSupport * support, Datum value, BlockNumber head, int *length)
+{
+	Buffer		buf;
+	HnswMetaPage metap;
+	BlockNumber blkno;
+	BlockNumber tail;
+	HnswPendingItem *items;
+	int			maxLength = 64;
+	int			n = 0;
+
+	*length = 0;
+
+	/* Tuples added after the scan started are not visible */
+	if (!BlockNumberIsValid(head))
+		return NULL;
+
+	/*
+	 * Prevent a concurrent flush from relinking the list while it is walked.
+	 * Flushed pages are emptied only after their tuples are in the graph, so
+	 * tuples are still found.
+	 */
+	LockPage(index, HNSW_PENDING_SCAN_LOCK, ShareLock);
+
+	/* Head may have changed before the lock was acquired */
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(buf));
+	blkno = metap->pendingHead;
+	tail = metap->pendingTail;
+	UnlockReleaseBuffer(buf);
+
+	items = palloc_array_checked(HnswPendingItem, maxLength);
+
+	/* Tuples added after the tail are not visible to the scan */
+	while (BlockNumberIsValid(blkno))
+	{
+		Page		page;
+		OffsetNumber maxoffno;
+		BlockNumber nextblkno;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswPendingTuple ptup = (HnswPendingTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			if (n == maxLength)
+			{
+				maxLength *= 2;
+				items = repalloc_huge(items, mul_size(sizeof(HnswPendingItem), maxLength));
+			}
+
+			items[n].heaptid = ptup->heaptid;
+
+			if (DatumGetPointer(value) == NULL)
+				items[n].distance = 0;
+			else
+				items[n].distance = DatumGetFloat8(FunctionCall2Coll(support->procinfo, support->collation, value, PointerGetDatum(&ptup->data)));
+
+			n++;
+		}
+
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+
+		if (blkno == tail)
+			break;
+
+		blkno = nextblkno;
+	}
+
+	UnlockPage(index, HNSW_PENDING_SCAN_LOCK, ShareLock);
+
+	qsort(items, n, sizeof(HnswPendingItem), CompareItems);
+
+	*length = n;
+	return items;
+}
+
+/*
+ * Move tuples from the pending list into the graph
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_clean_pending_list);
+Datum
+hnsw_clean_pending_list(PG_FUNCTION_ARGS)
+{
+	Oid			indexoid = PG_GETARG_OID(0);
+	Relation	index;
+	HnswSupport support;
+	int64		inserted;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("HNSW pending list cannot be cleaned up during recovery.")));
+
+	index = index_open(indexoid, RowExclusiveLock);
+
+	if (index->rd_rel->relkind != RELKIND_INDEX || index->rd_indam->aminsert != hnswinsert)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	if (RELATION_IS_OTHER_TEMP(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot access temporary indexes of other sessions")));
+
+	/* Same privileges as vacuum */
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexoid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexoid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(index));
+
+	HnswInitSupport(&support, index);
+
+	inserted = HnswFlushPendingList(index, &support, true, NULL, NULL, NULL);
+
+	index_close(index, RowExclusiveLock);
+
+	PG_RETURN_INT64(inserted);
+}
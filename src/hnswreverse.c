@@ -0,0 +1,673 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "commands/vacuum.h"
+#include "common/hashfn.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/rel.h"
+
+#if PG_VERSION_NUM >= 180000
+#define vacuum_delay_point() vacuum_delay_point(false)
+#endif
+
+/*
+ * Reverse edges are stored in chains of pages separate from the element
+ * pages, with a chain for each bucket. The directory page has the head and
+ * tail of each chain. Edges are only appended to the tail page, and vacuum
+ * only removes edges from pages before the tail, so they do not conflict.
+ *
+ * Edges are recorded in both directions for every neighbor of an inserted or
+ * repaired element, since these are the only ways edges are added. This
+ * gives a superset of the elements that point to each element, so vacuum can
+ * repair just those elements instead of scanning the entire graph.
+ */
+
+/*
+ * Get the bucket for a target
+ */
+static int
+ReverseBucket(ItemPointer target)
+{
+	return murmurhash32(ItemPointerGetBlockNumber(target)) % HNSW_REVERSE_BUCKETS;
+}
+
+/*
+ * Compare edges by bucket, then target and source
+ */
+static int
+CompareReverseEdges(const void *a, const void *b)
+{
+	const		HnswReverseEdge *ea = (const HnswReverseEdge *) a;
+	const		HnswReverseEdge *eb = (const HnswReverseEdge *) b;
+	int			ba = ReverseBucket((ItemPointer) &ea->target);
+	int			bb = ReverseBucket((ItemPointer) &eb->target);
+	int			cmp;
+
+	if (ba != bb)
+		return ba < bb ? -1 : 1;
+
+	cmp = ItemPointerCompare((ItemPointer) &ea->target, (ItemPointer) &eb->target);
+	if (cmp != 0)
+		return cmp;
+
+	return ItemPointerCompare((ItemPointer) &ea->source, (ItemPointer) &eb->source);
+}
+
+/*
+ * Compare item pointers
+ */
+static int
+CompareItemPointers(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+/*
+ * Init a reverse edge page
+ */
+static void
+InitReversePage(Buffer buf, Page page)
+{
+	HnswInitPage(buf, page);
+	HnswPageGetOpaque(page)->flags = HNSW_REVERSE_PAGE;
+	((PageHeader) page)->pd_lower = PageGetContents(page) - (char *) page;
+}
+
+/*
+ * Get the reverse edge directory from the metapage
+ */
+BlockNumber
+HnswGetReverseDir(Relation index)
+{
+	Buffer		buf;
+	HnswMetaPage metap;
+	BlockNumber reverseDir = InvalidBlockNumber;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(buf));
+
+	if (HnswHasReverseEdges(metap->version))
+		reverseDir = metap->reverseDir;
+
+	UnlockReleaseBuffer(buf);
+
+	return reverseDir;
+}
+
+/*
+ * Create the reverse edge directory
+ *
+ * Only called during index build
+ */
+BlockNumber
+HnswCreateReverseDir(Relation index, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	HnswReverseDirData *dir;
+	Buffer		metabuf;
+	BlockNumber dirBlkno;
+
+	buf = HnswNewBuffer(index, forkNum);
+	page = BufferGetPage(buf);
+	HnswInitPage(buf, page);
+	HnswPageGetOpaque(page)->flags = HNSW_REVERSE_PAGE;
+
+	dir = HnswPageGetReverseDir(page);
+	dir->freeHead = InvalidBlockNumber;
+	for (int i = 0; i < HNSW_REVERSE_BUCKETS; i++)
+	{
+		dir->buckets[i].head = InvalidBlockNumber;
+		dir->buckets[i].tail = InvalidBlockNumber;
+	}
+	((PageHeader) page)->pd_lower =
+		(LocationIndex) (((char *) dir + sizeof(HnswReverseDirData)) - (char *) page);
+
+	metabuf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	dirBlkno = BufferGetBlockNumber(buf);
+	HnswPageGetMeta(BufferGetPage(metabuf))->reverseDir = dirBlkno;
+
+	MarkBufferDirty(buf);
+	MarkBufferDirty(metabuf);
+	UnlockReleaseBuffer(metabuf);
+	UnlockReleaseBuffer(buf);
+
+	return dirBlkno;
+}
+
+/*
+ * Add a page to the end of a bucket
+ *
+ * The tail buffer (if any) must be exclusively locked, and is released
+ */
+static void
+AddBucketPage(Relation index, BlockNumber dirBlkno, int bucket, Buffer tailbuf, ForkNumber forkNum, bool building)
+{
+	Buffer		dbuf;
+	Page		dpage;
+	HnswReverseDirData *dir;
+	Buffer		newbuf;
+	Page		newpage;
+	Page		tailpage = NULL;
+	GenericXLogState *state = NULL;
+
+	dbuf = ReadBufferExtended(index, forkNum, dirBlkno, RBM_NORMAL, NULL);
+	LockBuffer(dbuf, BUFFER_LOCK_EXCLUSIVE);
+
+	if (building)
+		dpage = BufferGetPage(dbuf);
+	else
+	{
+		state = GenericXLogStart(index);
+		dpage = GenericXLogRegisterBuffer(state, dbuf, 0);
+	}
+	dir = HnswPageGetReverseDir(dpage);
+
+	/* Another backend may have added the first page */
+	if (!BufferIsValid(tailbuf) && BlockNumberIsValid(dir->buckets[bucket].tail))
+	{
+		if (!building)
+			GenericXLogAbort(state);
+		UnlockReleaseBuffer(dbuf);
+		return;
+	}
+
+	/* Reuse a page removed by vacuum if possible */
+	if (BlockNumberIsValid(dir->freeHead))
+	{
+		newbuf = ReadBufferExtended(index, forkNum, dir->freeHead, RBM_NORMAL, NULL);
+		LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
+		dir->freeHead = HnswPageGetOpaque(BufferGetPage(newbuf))->nextblkno;
+	}
+	else
+	{
+		LockRelationForExtension(index, ExclusiveLock);
+		newbuf = HnswNewBuffer(index, forkNum);
+		UnlockRelationForExtension(index, ExclusiveLock);
+	}
+
+	if (building)
+		newpage = BufferGetPage(newbuf);
+	else
+		newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+	InitReversePage(newbuf, newpage);
+
+	/* Link new page */
+	if (BufferIsValid(tailbuf))
+	{
+		if (building)
+			tailpage = BufferGetPage(tailbuf);
+		else
+			tailpage = GenericXLogRegisterBuffer(state, tailbuf, 0);
+		HnswPageGetOpaque(tailpage)->nextblkno = BufferGetBlockNumber(newbuf);
+	}
+	else
+		dir->buckets[bucket].head = BufferGetBlockNumber(newbuf);
+	dir->buckets[bucket].tail = BufferGetBlockNumber(newbuf);
+
+	/* Commit */
+	if (building)
+	{
+		MarkBufferDirty(dbuf);
+		MarkBufferDirty(newbuf);
+		if (BufferIsValid(tailbuf))
+			MarkBufferDirty(tailbuf);
+	}
+	else
+		GenericXLogFinish(state);
+
+	UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(dbuf);
+	if (BufferIsValid(tailbuf))
+		UnlockReleaseBuffer(tailbuf);
+}
+
+/*
+ * Append edges to a bucket
+ */
+static void
+AppendBucketEdges(Relation index, BlockNumber dirBlkno, int bucket, HnswReverseEdge * edges, int nedges, ForkNumber forkNum, bool building)
+{
+	while (nedges > 0)
+	{
+		Buffer		dbuf;
+		Buffer		buf;
+		Page		page;
+		BlockNumber tail;
+		GenericXLogState *state;
+		int			n;
+
+		/* Get tail */
+		dbuf = ReadBufferExtended(index, forkNum, dirBlkno, RBM_NORMAL, NULL);
+		LockBuffer(dbuf, BUFFER_LOCK_SHARE);
+		tail = HnswPageGetReverseDir(BufferGetPage(dbuf))->buckets[bucket].tail;
+		LockBuffer(dbuf, BUFFER_LOCK_UNLOCK);
+
+		if (!BlockNumberIsValid(tail))
+		{
+			ReleaseBuffer(dbuf);
+			AddBucketPage(index, dirBlkno, bucket, InvalidBuffer, forkNum, building);
+			continue;
+		}
+
+		buf = ReadBufferExtended(index, forkNum, tail, RBM_NORMAL, NULL);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		/*
+		 * Check it is still the tail, which cannot change while it is locked.
+		 * Otherwise, it may have been moved to the free list by vacuum.
+		 */
+		LockBuffer(dbuf, BUFFER_LOCK_SHARE);
+		if (HnswPageGetReverseDir(BufferGetPage(dbuf))->buckets[bucket].tail != tail)
+		{
+			UnlockReleaseBuffer(dbuf);
+			UnlockReleaseBuffer(buf);
+			continue;
+		}
+		UnlockReleaseBuffer(dbuf);
+
+		n = Min(nedges, (int) (PageGetExactFreeSpace(BufferGetPage(buf)) / sizeof(HnswReverseEdge)));
+
+		/* Add a page while tail is locked so only one backend does */
+		if (n == 0)
+		{
+			AddBucketPage(index, dirBlkno, bucket, buf, forkNum, building);
+			continue;
+		}
+
+		if (building)
+		{
+			state = NULL;
+			page = BufferGetPage(buf);
+		}
+		else
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+		}
+
+		memcpy(HnswPageGetReverseEdges(page) + HnswReversePageCount(page), edges, n * sizeof(HnswReverseEdge));
+		((PageHeader) page)->pd_lower += n * sizeof(HnswReverseEdge);
+
+		/* Commit */
+		if (building)
+			MarkBufferDirty(buf);
+		else
+			GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+
+		edges += n;
+		nedges -= n;
+	}
+}
+
+/*
+ * Add reverse edges
+ */
+void
+HnswAddReverseEdges(Relation index, BlockNumber dirBlkno, HnswReverseEdge * edges, int nedges, ForkNumber forkNum, bool building)
+{
+	int			start = 0;
+
+	/* Group by bucket */
+	qsort(edges, nedges, sizeof(HnswReverseEdge), CompareReverseEdges);
+
+	while (start < nedges)
+	{
+		int			bucket = ReverseBucket(&edges[start].target);
+		int			end = start + 1;
+
+		while (end < nedges && ReverseBucket(&edges[end].target) == bucket)
+			end++;
+
+		AppendBucketEdges(index, dirBlkno, bucket, &edges[start], end - start, forkNum, building);
+
+		start = end;
+	}
+}
+
+/*
+ * Add reverse edges for the neighbors of elements in both directions
+ */
+void
+HnswAddElementReverseEdges(Relation index, BlockNumber dirBlkno, HnswElement * elements, int nelements, bool building)
+{
+	char	   *base = NULL;
+	HnswReverseEdge *edges;
+	int			nedges = 0;
+	int			maxEdges = 0;
+
+	for (int j = 0; j < nelements; j++)
+	{
+		for (int lc = elements[j]->level; lc >= 0; lc--)
+			maxEdges += HnswGetNeighbors(base, elements[j], lc)->length * 2;
+	}
+
+	if (maxEdges == 0)
+		return;
+
+	edges = palloc(maxEdges * sizeof(HnswReverseEdge));
+
+	for (int j = 0; j < nelements; j++)
+	{
+		HnswElement element = elements[j];
+		ItemPointerData tid;
+
+		ItemPointerSet(&tid, element->blkno, element->offno);
+
+		for (int lc = element->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			for (int i = 0; i < neighbors->length; i++)
+			{
+				HnswElement neighborElement = HnswPtrAccess(base, neighbors->items[i].element);
+				ItemPointerData ntid;
+
+				ItemPointerSet(&ntid, neighborElement->blkno, neighborElement->offno);
+
+				edges[nedges].target = ntid;
+				edges[nedges].source = tid;
+				nedges++;
+
+				edges[nedges].target = tid;
+				edges[nedges].source = ntid;
+				nedges++;
+			}
+		}
+	}
+
+	HnswAddReverseEdges(index, dirBlkno, edges, nedges, MAIN_FORKNUM, building);
+
+	pfree(edges);
+}
+
+/*
+ * Get the buckets with deleted elements
+ */
+static bool *
+GetDeletingBuckets(HnswTidSet * deleting)
+{
+	bool	   *buckets = palloc0(HNSW_REVERSE_BUCKETS * sizeof(bool));
+
+	for (int64 i = 0; i < deleting->length; i++)
+		buckets[ReverseBucket(&deleting->tids[i])] = true;
+
+	return buckets;
+}
+
+/*
+ * Get the directory for a bucket
+ */
+static HnswReverseBucketData
+GetBucket(Relation index, BlockNumber dirBlkno, int bucket)
+{
+	Buffer		dbuf;
+	HnswReverseBucketData data;
+
+	dbuf = ReadBuffer(index, dirBlkno);
+	LockBuffer(dbuf, BUFFER_LOCK_SHARE);
+	data = HnswPageGetReverseDir(BufferGetPage(dbuf))->buckets[bucket];
+	UnlockReleaseBuffer(dbuf);
+
+	return data;
+}
+
+/*
+ * Get elements that may point to deleted elements, sorted by TID
+ */
+ItemPointerData *
+HnswGetReverseCandidates(Relation index, BlockNumber dirBlkno, HnswTidSet * deleting, BufferAccessStrategy bas, int64 *ncandidates)
+{
+	bool	   *buckets = GetDeletingBuckets(deleting);
+	tidhash_hash *candidates = tidhash_create(CurrentMemoryContext, 256, NULL);
+	ItemPointerData *result;
+	tidhash_iterator iter;
+	TidHashEntry *entry;
+	int64		n = 0;
+
+	for (int bucket = 0; bucket < HNSW_REVERSE_BUCKETS; bucket++)
+	{
+		BlockNumber blkno;
+
+		if (!buckets[bucket])
+			continue;
+
+		blkno = GetBucket(index, dirBlkno, bucket).head;
+
+		while (BlockNumberIsValid(blkno))
+		{
+			Buffer		buf;
+			Page		page;
+			HnswReverseEdge *edges;
+			int			count;
+
+			vacuum_delay_point();
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			edges = HnswPageGetReverseEdges(page);
+			count = HnswReversePageCount(page);
+
+			for (int i = 0; i < count; i++)
+			{
+				bool		found;
+
+				if (!HnswTidSetContains(deleting, &edges[i].target))
+					continue;
+
+				/* Elements being deleted do not need repaired */
+				if (HnswTidSetContains(deleting, &edges[i].source))
+					continue;
+
+				tidhash_insert(candidates, edges[i].source, &found);
+			}
+
+			blkno = HnswPageGetOpaque(page)->nextblkno;
+
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	/* Sort to read element pages in order */
+	result = palloc(Max(candidates->members, 1) * sizeof(ItemPointerData));
+	tidhash_start_iterate(candidates, &iter);
+	while ((entry = tidhash_iterate(candidates, &iter)) != NULL)
+		result[n++] = entry->tid;
+	qsort(result, n, sizeof(ItemPointerData), CompareItemPointers);
+
+	tidhash_destroy(candidates);
+	pfree(buckets);
+
+	*ncandidates = n;
+	return result;
+}
+
+/*
+ * Remove edges for deleted elements from a page
+ *
+ * Returns true if the page was changed
+ */
+static bool
+RemoveDeletedEdges(Page page, HnswTidSet * deleting)
+{
+	HnswReverseEdge *edges = HnswPageGetReverseEdges(page);
+	int			count = HnswReversePageCount(page);
+	int			n = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (HnswTidSetContains(deleting, &edges[i].target) || HnswTidSetContains(deleting, &edges[i].source))
+			continue;
+
+		edges[n++] = edges[i];
+	}
+
+	if (n == count)
+		return false;
+
+	((PageHeader) page)->pd_lower -= (count - n) * sizeof(HnswReverseEdge);
+	return true;
+}
+
+/*
+ * Get the buckets with edges to or from deleted elements
+ *
+ * Edges are recorded in both directions, so the elements that deleted
+ * elements point to are the sources of edges to deleted elements
+ */
+static bool *
+GetCompactBuckets(Relation index, BlockNumber dirBlkno, HnswTidSet * deleting, BufferAccessStrategy bas)
+{
+	bool	   *deletingBuckets = GetDeletingBuckets(deleting);
+	bool	   *buckets = palloc_array_checked(bool, HNSW_REVERSE_BUCKETS);
+
+	memcpy(buckets, deletingBuckets, HNSW_REVERSE_BUCKETS * sizeof(bool));
+
+	for (int bucket = 0; bucket < HNSW_REVERSE_BUCKETS; bucket++)
+	{
+		BlockNumber blkno;
+
+		if (!deletingBuckets[bucket])
+			continue;
+
+		blkno = GetBucket(index, dirBlkno, bucket).head;
+
+		while (BlockNumberIsValid(blkno))
+		{
+			Buffer		buf;
+			Page		page;
+			HnswReverseEdge *edges;
+			int			count;
+
+			vacuum_delay_point();
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			edges = HnswPageGetReverseEdges(page);
+			count = HnswReversePageCount(page);
+
+			for (int i = 0; i < count; i++)
+			{
+				if (HnswTidSetContains(deleting, &edges[i].target))
+					buckets[ReverseBucket(&edges[i].source)] = true;
+			}
+
+			blkno = HnswPageGetOpaque(page)->nextblkno;
+
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	pfree(deletingBuckets);
+
+	return buckets;
+}
+
+/*
+ * Remove edges to and from deleted elements
+ *
+ * Pages that become empty are moved to the free list. The tail page of each
+ * bucket keeps its place, since concurrent inserts may be adding to it, but
+ * edges are still removed from it while it is locked.
+ */
+void
+HnswCompactReverseEdges(Relation index, BlockNumber dirBlkno, HnswTidSet * deleting, BufferAccessStrategy bas)
+{
+	bool	   *buckets = GetCompactBuckets(index, dirBlkno, deleting, bas);
+
+	for (int bucket = 0; bucket < HNSW_REVERSE_BUCKETS; bucket++)
+	{
+		HnswReverseBucketData bucketData;
+		BlockNumber prevblkno = InvalidBlockNumber;
+		BlockNumber blkno;
+
+		if (!buckets[bucket])
+			continue;
+
+		/* Only vacuum moves pages before the tail */
+		bucketData = GetBucket(index, dirBlkno, bucket);
+		blkno = bucketData.head;
+
+		while (BlockNumberIsValid(blkno))
+		{
+			Buffer		buf;
+			Buffer		pbuf = InvalidBuffer;
+			Buffer		dbuf;
+			Page		page;
+			GenericXLogState *state;
+			BlockNumber nextblkno;
+			HnswReverseDirData *dir;
+			bool		isTail = blkno == bucketData.tail;
+
+			vacuum_delay_point();
+
+			buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+			nextblkno = HnswPageGetOpaque(page)->nextblkno;
+
+			if (!RemoveDeletedEdges(page, deleting))
+			{
+				GenericXLogAbort(state);
+				UnlockReleaseBuffer(buf);
+				if (isTail)
+					break;
+				prevblkno = blkno;
+				blkno = nextblkno;
+				continue;
+			}
+
+			if (HnswReversePageCount(page) > 0 || isTail)
+			{
+				GenericXLogFinish(state);
+				UnlockReleaseBuffer(buf);
+				if (isTail)
+					break;
+				prevblkno = blkno;
+				blkno = nextblkno;
+				continue;
+			}
+
+			/* Unlink empty page, locking previous page before directory */
+			if (BlockNumberIsValid(prevblkno))
+			{
+				Page		ppage;
+
+				pbuf = ReadBufferExtended(index, MAIN_FORKNUM, prevblkno, RBM_NORMAL, bas);
+				LockBuffer(pbuf, BUFFER_LOCK_EXCLUSIVE);
+				ppage = GenericXLogRegisterBuffer(state, pbuf, 0);
+				HnswPageGetOpaque(ppage)->nextblkno = nextblkno;
+			}
+
+			dbuf = ReadBuffer(index, dirBlkno);
+			LockBuffer(dbuf, BUFFER_LOCK_EXCLUSIVE);
+			dir = HnswPageGetReverseDir(GenericXLogRegisterBuffer(state, dbuf, 0));
+
+			if (!BlockNumberIsValid(prevblkno))
+				dir->buckets[bucket].head = nextblkno;
+
+			/* Add to free list */
+			HnswPageGetOpaque(page)->nextblkno = dir->freeHead;
+			dir->freeHead = blkno;
+
+			GenericXLogFinish(state);
+			UnlockReleaseBuffer(dbuf);
+			if (BufferIsValid(pbuf))
+				UnlockReleaseBuffer(pbuf);
+			UnlockReleaseBuffer(buf);
+
+			blkno = nextblkno;
+		}
+	}
+
+	pfree(buckets);
+}
@@ -4,12 +4,18 @@
 
 #include "access/genam.h"
 #include "access/relscan.h"
+#include "common/hashfn.h"
 #include "hnsw.h"
 #include "lib/pairingheap.h"
 #include "miscadmin.h"
 #include "nodes/pg_list.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/bufmgr.h"
+#include "storage/ipc.h"
 #include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "utils/float.h"
 #include "utils/memutils.h"
 #include "utils/relcache.h"
@@ -19,25 +25,226 @@
 #include "varatt.h"
 #endif
 
+/* Indexes with the same hash share a slot */
+#define HNSW_SCAN_SLOTS 64
+
+/*
+ * Readers of the graph for an index
+ *
+ * Scans count themselves in the readers for the current epoch. To wait for
+ * in-flight scans, vacuum advances the epoch and waits for the readers of the
+ * previous epoch to finish. Scans that start after will not visit tuples
+ * about to be deleted. Avoids heavyweight locks for each scan. The last
+ * reader wakes the waiter with the condition variable, which also wakes
+ * waiters for the slot.
+ */
+typedef struct HnswScanSlot
+{
+	pg_atomic_uint32 epoch;
+	pg_atomic_uint32 readers[2];
+	pg_atomic_uint32 waiting;
+	ConditionVariable cv;
+}			HnswScanSlot;
+
+static HnswScanSlot * hnswScanSlots = NULL;
+static HnswScanSlot * heldReadSlot = NULL;
+static pg_atomic_uint32 *heldReaders = NULL;
+static HnswScanSlot * heldWaitSlot = NULL;
+
+/*
+ * Stop counting as a reader
+ */
+static void
+ReleaseReaders(void)
+{
+	/* Full barrier, so reads happen before and waiting is read after */
+	if (pg_atomic_sub_fetch_u32(heldReaders, 1) == 0 && pg_atomic_read_u32(&heldReadSlot->waiting) != 0)
+		ConditionVariableBroadcast(&heldReadSlot->cv);
+
+	heldReaders = NULL;
+	heldReadSlot = NULL;
+}
+
+/*
+ * Allow the next waiter for the slot
+ */
+static void
+ReleaseWaiting(void)
+{
+	pg_atomic_write_u32(&heldWaitSlot->waiting, 0);
+	ConditionVariableBroadcast(&heldWaitSlot->cv);
+	heldWaitSlot = NULL;
+}
+
+/*
+ * Release slots on exit (errors release them with PG_FINALLY)
+ */
+static void
+ReleaseScanSlots(int code, Datum arg)
+{
+	if (heldReaders != NULL)
+		ReleaseReaders();
+
+	if (heldWaitSlot != NULL)
+		ReleaseWaiting();
+}
+
+/*
+ * Get the slot for an index
+ *
+ * This shared memory area is very small, so we just allocate it from the
+ * "slop" that PostgreSQL reserves for small allocations like this (like the
+ * LWLock tranche ID).
+ */
+static HnswScanSlot *
+GetScanSlot(Relation index)
+{
+	uint32		hash;
+
+	if (hnswScanSlots == NULL)
+	{
+		HnswScanSlot *slots;
+		bool		found;
+
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		slots = ShmemInitStruct("hnsw scan slots",
+								sizeof(HnswScanSlot) * HNSW_SCAN_SLOTS,
+								&found);
+		if (!found)
+		{
+			for (int i = 0; i < HNSW_SCAN_SLOTS; i++)
+			{
+				pg_atomic_init_u32(&slots[i].epoch, 0);
+				pg_atomic_init_u32(&slots[i].readers[0], 0);
+				pg_atomic_init_u32(&slots[i].readers[1], 0);
+				pg_atomic_init_u32(&slots[i].waiting, 0);
+				ConditionVariableInit(&slots[i].cv);
+			}
+		}
+		LWLockRelease(AddinShmemInitLock);
+
+		before_shmem_exit(ReleaseScanSlots, 0);
+		hnswScanSlots = slots;
+	}
+
+	hash = hash_combine(murmurhash32(MyDatabaseId), murmurhash32(RelationGetRelid(index)));
+	return &hnswScanSlots[hash % HNSW_SCAN_SLOTS];
+}
+
+/*
+ * Start reading the graph
+ */
+static void
+BeginScanRead(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	HnswScanSlot *slot;
+
+	if (so->scanLock)
+		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+	slot = GetScanSlot(scan->indexRelation);
+
+	Assert(heldReaders == NULL);
+
+	for (;;)
+	{
+		uint32		epoch = pg_atomic_read_u32(&slot->epoch);
+		pg_atomic_uint32 *readers = &slot->readers[epoch % 2];
+
+		/* Full barrier, so epoch is read again after incrementing */
+		pg_atomic_fetch_add_u32(readers, 1);
+		heldReadSlot = slot;
+		heldReaders = readers;
+
+		/* Retry if vacuum advanced the epoch, since it may not see us */
+		if (pg_atomic_read_u32(&slot->epoch) == epoch)
+			return;
+
+		ReleaseReaders();
+	}
+}
+
+/*
+ * Finish reading the graph
+ */
+static void
+EndScanRead(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+	if (so->scanLock)
+		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+
+	if (heldReaders != NULL)
+		ReleaseReaders();
+}
+
+/*
+ * Wait for in-flight scans to complete
+ */
+void
+HnswWaitForScans(Relation index)
+{
+	HnswScanSlot *slot = GetScanSlot(index);
+
+	/* Scans of older indexes and scans from older libraries use the lock */
+	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+
+	/*
+	 * Allow one waiter for a slot at a time. Otherwise, advancing the epoch
+	 * again could make new scans count in the readers being waited on.
+	 */
+	ConditionVariablePrepareToSleep(&slot->cv);
+	for (;;)
+	{
+		uint32		expected = 0;
+
+		if (pg_atomic_compare_exchange_u32(&slot->waiting, &expected, 1))
+			break;
+
+		ConditionVariableSleep(&slot->cv, PG_WAIT_EXTENSION);
+	}
+
+	heldWaitSlot = slot;
+
+	PG_TRY();
+	{
+		/* Full barrier, so readers are read after */
+		uint32		epoch = pg_atomic_fetch_add_u32(&slot->epoch, 1);
+		pg_atomic_uint32 *readers = &slot->readers[epoch % 2];
+
+		while (pg_atomic_read_u32(readers) != 0)
+			ConditionVariableSleep(&slot->cv, PG_WAIT_EXTENSION);
+	}
+	PG_FINALLY();
+	{
+		ConditionVariableCancelSleep();
+		ReleaseWaiting();
+	}
+	PG_END_TRY();
+
+	/* Ensure changes to the graph happen after */
+	pg_memory_barrier();
+}
+
 /*
  * Algorithm 5 from paper
  */
 static List *
-GetScanItems(IndexScanDesc scan, Datum value)
+GetScanItems(IndexScanDesc scan, Datum value, HnswMetaPageInfo * meta)
 {
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 	Relation	index = scan->indexRelation;
 	HnswSupport *support = &so->support;
 	List	   *ep;
 	List	   *w;
-	int			m;
-	HnswElement entryPoint;
+	int			m = meta->m;
+	HnswElement entryPoint = meta->entryPoint;
 	char	   *base = NULL;
 	HnswQuery  *q = &so->q;
 
-	/* Get m and entry point */
-	HnswGetMetaPageInfo(index, &m, &entryPoint);
-
 	q->value = value;
 	so->m = m;
 
@@ -113,6 +320,50 @@ GetScanValue(IndexScanDesc scan)
 	return value;
 }
 
+/*
+ * Load the pending list
+ */
+static void
+LoadPendingList(IndexScanDesc scan, Datum value, HnswMetaPageInfo * meta)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+	so->pending = HnswScanPendingList(scan->indexRelation, &so->support, value, meta->pendingHead, &so->pendingLength);
+
+	if (so->pendingLength == 0)
+		return;
+
+	/* Remember heap TIDs to skip if also found in graph */
+	so->returnedTids = tidhash_create(CurrentMemoryContext, Max(so->pendingLength, 64), NULL);
+
+	for (int i = 0; i < so->pendingLength; i++)
+	{
+		bool		found;
+
+		tidhash_insert(so->returnedTids, so->pending[i].heaptid, &found);
+	}
+}
+
+/*
+ * Get the next tuple from the pending list if not farther than distance
+ */
+static bool
+GetNextPending(HnswScanOpaque so, double distance, ItemPointer heaptid)
+{
+	HnswPendingItem *item;
+
+	if (so->pendingIndex >= so->pendingLength)
+		return false;
+
+	item = &so->pending[so->pendingIndex];
+	if (item->distance > distance)
+		return false;
+
+	*heaptid = item->heaptid;
+	so->pendingIndex++;
+	return true;
+}
+
 #if defined(HNSW_MEMORY)
 /*
  * Show memory usage
@@ -138,6 +389,7 @@ hnswbeginscan(Relation index, int nkeys, int norderbys)
 
 	so = palloc_object(HnswScanOpaqueData);
 	so->typeInfo = HnswGetTypeInfo(index);
+	so->scanLock = false;
 
 	/* Set support functions */
 	HnswInitSupport(&so->support, index);
@@ -174,6 +426,11 @@ hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int no
 	so->discarded = NULL;
 	so->tuples = 0;
 	so->previousDistance = -get_float8_infinity();
+	/* pending and returnedTids are allocated in tmpCtx */
+	so->pending = NULL;
+	so->pendingLength = 0;
+	so->pendingIndex = 0;
+	so->returnedTids = NULL;
 	MemoryContextReset(so->tmpCtx);
 
 	if (keys && scan->numberOfKeys > 0)
@@ -222,15 +479,55 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		value = GetScanValue(scan);
 
 		/*
-		 * Get a shared lock. This allows vacuum to ensure no in-flight scans
+		 * Count as a reader. This allows vacuum to ensure no in-flight scans
 		 * before marking tuples as deleted.
 		 */
-		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+		BeginScanRead(scan);
 
-		so->w = GetScanItems(scan, value);
+		PG_TRY();
+		{
+			HnswMetaPageInfo meta;
+
+			/* Read the metapage once as a reader */
+			HnswReadMetaPageInfo(scan->indexRelation, &meta);
+
+			/*
+			 * Indexes created before shared memory counters keep the page
+			 * lock, so vacuum from a backend with an older version of the
+			 * library still waits for scans. The version does not change, so
+			 * rescans take the lock up front. Otherwise, the entry point must
+			 * be read again with the lock held.
+			 */
+			if (!so->scanLock && !HnswHasScanSlots(meta.version))
+			{
+				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+				so->scanLock = true;
+				HnswReadMetaPageInfo(scan->indexRelation, &meta);
+			}
 
-		/* Release shared lock */
-		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+			/*
+			 * Load the pending list before the graph, since a flush adds
+			 * tuples to the graph before removing them from the pending list
+			 */
+			LoadPendingList(scan, value, &meta);
+
+			/*
+			 * An element can be reachable at two locations while it is moved
+			 * by compaction, so skip heap TIDs already returned. Compaction
+			 * waits for scans after setting the flag, so checking it as a
+			 * reader is enough, except for iterative scans, which can
+			 * continue after compaction starts.
+			 */
+			if (so->returnedTids == NULL && (hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF || (meta.flags & HNSW_COMPACTING) != 0))
+				so->returnedTids = tidhash_create(CurrentMemoryContext, 64, NULL);
+
+			so->w = GetScanItems(scan, value, &meta);
+		}
+		PG_FINALLY();
+		{
+			EndScanRead(scan);
+		}
+		PG_END_TRY();
 
 		so->first = false;
 
@@ -245,6 +542,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		HnswSearchCandidate *sc;
 		HnswElement element;
 		ItemPointer heaptid;
+		bool		found;
 
 		if (list_length(so->w) == 0)
 		{
@@ -267,19 +565,25 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 			else
 			{
 				/*
-				 * Locking ensures when neighbors are read, the elements they
-				 * reference will not be deleted (and replaced) during the
-				 * iteration.
+				 * Counting as a reader ensures when neighbors are read, the
+				 * elements they reference will not be deleted (and replaced)
+				 * during the iteration.
 				 *
 				 * Elements loaded into memory on previous iterations may have
 				 * been deleted (and replaced), so when reading neighbors, the
 				 * element version must be checked.
 				 */
-				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
-
-				so->w = ResumeScanItems(scan);
-
-				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
+				BeginScanRead(scan);
+
+				PG_TRY();
+				{
+					so->w = ResumeScanItems(scan);
+				}
+				PG_FINALLY();
+				{
+					EndScanRead(scan);
+				}
+				PG_END_TRY();
 
 #if defined(HNSW_MEMORY)
 				ShowMemoryUsage(so);
@@ -293,6 +597,16 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		sc = llast(so->w);
 		element = HnswPtrAccess(base, sc->element);
 
+		/* Return tuples from the pending list that are closer */
+		if (GetNextPending(so, sc->distance, &scan->xs_heaptid))
+		{
+			MemoryContextSwitchTo(oldCtx);
+
+			scan->xs_recheck = false;
+			scan->xs_recheckorderby = false;
+			return true;
+		}
+
 		/* Move to next element if no valid heap TIDs */
 		if (element->heaptidsLength == 0)
 		{
@@ -310,6 +624,17 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		/*
+		 * Skip tuples that are returned from the pending list or were
+		 * already returned
+		 */
+		if (so->returnedTids != NULL)
+		{
+			tidhash_insert(so->returnedTids, *heaptid, &found);
+			if (found)
+				continue;
+		}
+
 		if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_STRICT)
 		{
 			if (sc->distance < so->previousDistance)
@@ -327,6 +652,15 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 	}
 
 	MemoryContextSwitchTo(oldCtx);
+
+	/* Return remaining tuples from the pending list */
+	if (GetNextPending(so, get_float8_infinity(), &scan->xs_heaptid))
+	{
+		scan->xs_recheck = false;
+		scan->xs_recheckorderby = false;
+		return true;
+	}
+
 	return false;
 }
 
@@ -106,6 +106,26 @@ hash_offset(Size offset)
 #define SH_DEFINE
 #include "lib/simplehash.h"
 
+/* Distance hash table */
+static uint32
+hash_pair(HnswPairKey key)
+{
+	return (uint32) hash_combine64(murmurhash64(key.a), murmurhash64(key.b));
+}
+
+#define SH_PREFIX		distancehash
+#define SH_ELEMENT_TYPE	DistanceHashEntry
+#define SH_KEY_TYPE		HnswPairKey
+#define	SH_KEY			key
+#define SH_HASH_KEY(tb, key)	hash_pair(key)
+#define SH_EQUAL(tb, a, b)		(a.a == b.a && a.b == b.b)
+#define	SH_SCOPE		extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* Limit memory for neighborhoods with large m */
+#define HNSW_DISTANCE_CACHE_MAX_ENTRIES	65536
+
 /*
  * Get the max number of connections in an upper layer for each element in the index
  */
@@ -134,6 +154,34 @@ HnswGetEfConstruction(Relation index)
 	return HNSW_DEFAULT_EF_CONSTRUCTION;
 }
 
+/*
+ * Get whether to use the pending list for inserts
+ */
+bool
+HnswGetFastUpdate(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return opts->fastupdate;
+
+	return false;
+}
+
+/*
+ * Get whether to track reverse edges
+ */
+bool
+HnswGetReverseEdges(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return opts->reverseEdges;
+
+	return false;
+}
+
 /*
  * Get proc
  */
@@ -155,6 +203,174 @@ HnswInitSupport(HnswSupport * support, Relation index)
 	support->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
 	support->collation = index->rd_indcollation[0];
 	support->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+	support->distances = NULL;
+	support->distancesInMemory = false;
+}
+
+/*
+ * Init the cache of distances between elements
+ *
+ * Selecting neighbors for an element and updating the connections of its
+ * neighbors compares many of the same pairs of elements, so remember them
+ * for the duration of the insert. Uses the current memory context.
+ */
+void
+HnswInitDistanceCache(HnswSupport * support, bool inMemory)
+{
+	support->distances = distancehash_create(CurrentMemoryContext, 256, NULL);
+	support->distancesInMemory = inMemory;
+}
+
+/*
+ * Free the cache of distances between elements
+ */
+void
+HnswFreeDistanceCache(HnswSupport * support)
+{
+	if (support->distances == NULL)
+		return;
+
+	distancehash_destroy(support->distances);
+	support->distances = NULL;
+}
+
+/*
+ * Get the cache key for an element
+ */
+static inline uint64
+DistanceCacheId(HnswSupport * support, HnswElement element)
+{
+	/* Address is stable within a process for in-memory elements */
+	if (support->distancesInMemory)
+		return (uint64) (uintptr_t) element;
+
+	/* On-disk elements can be loaded more than once */
+	return ((uint64) element->blkno << 16) | element->offno;
+}
+
+/*
+ * Get the cache key for a pair of elements
+ */
+static inline HnswPairKey
+DistanceCacheKey(HnswSupport * support, HnswElement a, HnswElement b)
+{
+	HnswPairKey key;
+	uint64		aid = DistanceCacheId(support, a);
+	uint64		bid = DistanceCacheId(support, b);
+
+	/* Distance functions are symmetric */
+	key.a = Min(aid, bid);
+	key.b = Max(aid, bid);
+	return key;
+}
+
+/*
+ * Get a cached distance between elements
+ */
+bool
+HnswGetCachedDistance(HnswSupport * support, HnswElement a, HnswElement b, float *distance)
+{
+	DistanceHashEntry *entry;
+
+	if (support->distances == NULL)
+		return false;
+
+	entry = distancehash_lookup(support->distances, DistanceCacheKey(support, a, b));
+	if (entry == NULL)
+		return false;
+
+	*distance = entry->distance;
+	return true;
+}
+
+/*
+ * Cache the distance between elements
+ */
+void
+HnswCacheDistance(HnswSupport * support, HnswElement a, HnswElement b, float distance)
+{
+	DistanceHashEntry *entry;
+	bool		found;
+
+	if (support->distances == NULL || support->distances->members >= HNSW_DISTANCE_CACHE_MAX_ENTRIES)
+		return;
+
+	entry = distancehash_insert(support->distances, DistanceCacheKey(support, a, b), &found);
+	entry->distance = distance;
+}
+
+/*
+ * Compare item pointers
+ */
+static int
+CompareTids(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+/*
+ * Init a set of index TIDs
+ *
+ * The limit is the number of TIDs the caller allows before starting another
+ * pass. Memory is allocated as TIDs are added.
+ */
+void
+HnswTidSetInit(HnswTidSet * set, int64 limit)
+{
+	set->tids = NULL;
+	set->length = 0;
+	set->maxLength = 0;
+	set->limit = Min(Max(limit, MaxOffsetNumber), (int64) (MaxAllocSize / sizeof(ItemPointerData)));
+}
+
+/*
+ * Add a TID to the set
+ */
+void
+HnswTidSetAdd(HnswTidSet * set, ItemPointer tid)
+{
+	if (set->length == set->maxLength)
+	{
+		set->maxLength = Max(Min(Max(set->maxLength * 2, 256), set->limit), set->length + 1);
+
+		if (set->tids == NULL)
+			set->tids = palloc(set->maxLength * sizeof(ItemPointerData));
+		else
+			set->tids = repalloc(set->tids, set->maxLength * sizeof(ItemPointerData));
+	}
+
+	set->tids[set->length++] = *tid;
+}
+
+/*
+ * Sort the set so it can be searched
+ */
+void
+HnswTidSetSort(HnswTidSet * set)
+{
+	if (set->length > 1)
+		qsort(set->tids, set->length, sizeof(ItemPointerData), CompareTids);
+}
+
+/*
+ * Check if a sorted set contains a TID
+ */
+bool
+HnswTidSetContains(HnswTidSet * set, ItemPointer tid)
+{
+	if (set->length == 0)
+		return false;
+
+	return bsearch(tid, set->tids, set->length, sizeof(ItemPointerData), CompareTids) != NULL;
+}
+
+/*
+ * Remove all TIDs from the set, keeping memory for the next pass
+ */
+void
+HnswTidSetReset(HnswTidSet * set)
+{
+	set->length = 0;
 }
 
 /*
@@ -296,7 +512,27 @@ HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno)
  * Get the metapage info
  */
 void
-HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint)
+HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint, bool *neighborDistances)
+{
+	HnswMetaPageInfo info;
+
+	HnswReadMetaPageInfo(index, &info);
+
+	if (m != NULL)
+		*m = info.m;
+
+	if (neighborDistances != NULL)
+		*neighborDistances = HnswHasNeighborDistances(info.version);
+
+	if (entryPoint != NULL)
+		*entryPoint = info.entryPoint;
+}
+
+/*
+ * Read everything needed from the metapage with a single pin and lock
+ */
+void
+HnswReadMetaPageInfo(Relation index, HnswMetaPageInfo * info)
 {
 	Buffer		buf;
 	Page		page;
@@ -310,18 +546,27 @@ HnswGetMetaPageInfo(Relation index, int *m, HnswElement * entryPoint)
 	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
 		elog(ERROR, "hnsw index is not valid");
 
-	if (m != NULL)
-		*m = metap->m;
+	info->version = metap->version;
+	info->flags = HnswPageGetOpaque(page)->flags;
+	info->m = metap->m;
 
-	if (entryPoint != NULL)
+	if (BlockNumberIsValid(metap->entryBlkno))
 	{
-		if (BlockNumberIsValid(metap->entryBlkno))
-		{
-			*entryPoint = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
-			(*entryPoint)->level = (uint8) metap->entryLevel;
-		}
-		else
-			*entryPoint = NULL;
+		info->entryPoint = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
+		info->entryPoint->level = (uint8) metap->entryLevel;
+	}
+	else
+		info->entryPoint = NULL;
+
+	if (HnswHasPendingList(metap->version))
+	{
+		info->pendingHead = metap->pendingHead;
+		info->pendingTail = metap->pendingTail;
+	}
+	else
+	{
+		info->pendingHead = InvalidBlockNumber;
+		info->pendingTail = InvalidBlockNumber;
 	}
 
 	UnlockReleaseBuffer(buf);
@@ -335,7 +580,7 @@ HnswGetEntryPoint(Relation index)
 {
 	HnswElement entryPoint;
 
-	HnswGetMetaPageInfo(index, NULL, &entryPoint);
+	HnswGetMetaPageInfo(index, NULL, &entryPoint, NULL);
 
 	return entryPoint;
 }
@@ -365,7 +610,16 @@ HnswUpdateMetaPageInfo(Page page, int updateEntry, HnswElement entryPoint, Block
 	}
 
 	if (BlockNumberIsValid(insertPage))
+	{
 		metap->insertPage = insertPage;
+
+		/* Stripes start again from the new insert page */
+		if (HnswHasInsertStripes(metap->version))
+		{
+			for (int i = 0; i < HNSW_INSERT_STRIPES; i++)
+				metap->insertPages[i] = InvalidBlockNumber;
+		}
+	}
 }
 
 /*
@@ -400,6 +654,41 @@ HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, Bloc
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Get the space available for reuse from deleted elements on a page
+ *
+ * This is recorded in the free space map, so inserts can go directly to a
+ * page with a free slot. Includes the neighbor tuple when it is on the same
+ * page. Otherwise, it may be on another page, so this is only a hint.
+ */
+Size
+HnswGetFreeSlotSpace(Page page, BlockNumber blkno)
+{
+	Size		freeSpace = PageGetExactFreeSpace(page);
+	Size		maxSpace = 0;
+	OffsetNumber maxoffno = PageGetMaxOffsetNumber(page);
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		ItemId		itemid = PageGetItemId(page, offno);
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, itemid);
+		Size		space;
+
+		if (!HnswIsElementTuple(etup) || !etup->deleted || !ItemPointerIsValid(&etup->neighbortid))
+			continue;
+
+		space = ItemIdGetLength(itemid) + freeSpace;
+
+		/* Neighbor tuple on the same page is also overwritten */
+		if (ItemPointerGetBlockNumber(&etup->neighbortid) == blkno)
+			space += ItemIdGetLength(PageGetItemId(page, ItemPointerGetOffsetNumber(&etup->neighbortid)));
+
+		maxSpace = Max(maxSpace, space);
+	}
+
+	return maxSpace;
+}
+
 /*
  * Form index value
  */
@@ -453,11 +742,14 @@ HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
  * Set neighbor tuple
  */
 void
-HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m)
+HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m, bool distances)
 {
 	int			idx = 0;
+	float	   *ndistances;
 
 	ntup->type = HNSW_NEIGHBOR_TUPLE_TYPE;
+	ntup->count = (uint16) HNSW_NEIGHBOR_COUNT(e->level, m);
+	ndistances = distances ? HnswNeighborTupleDistances(ntup) : NULL;
 
 	for (int lc = e->level; lc >= 0; lc--)
 	{
@@ -474,13 +766,19 @@ HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m)
 				HnswElement hce = HnswPtrAccess(base, hc->element);
 
 				ItemPointerSet(indextid, hce->blkno, hce->offno);
+				if (ndistances != NULL)
+					ndistances[idx - 1] = hc->distance;
 			}
 			else
+			{
 				ItemPointerSetInvalid(indextid);
+				if (ndistances != NULL)
+					ndistances[idx - 1] = 0;
+			}
 		}
 	}
 
-	ntup->count = (uint16) idx;
+	Assert(idx == ntup->count);
 	ntup->version = e->version;
 }
 
@@ -756,10 +1054,10 @@ HnswLoadUnvisitedFromMemory(char *base, HnswElement element, HnswUnvisited * unv
 }
 
 /*
- * Load neighbor index TIDs
+ * Load neighbor index TIDs and optionally distances
  */
 bool
-HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, int m, int lm, int lc)
+HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, float *distances, Relation index, int m, int lm, int lc)
 {
 	Buffer		buf;
 	Page		page;
@@ -785,6 +1083,8 @@ HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation i
 	/* Copy to minimize lock time */
 	start = mul_size((Size) (element->level - lc), (Size) m);
 	memcpy(indextids, ntup->indextids + start, mul_size(sizeof(ItemPointerData), (Size) lm));
+	if (distances != NULL)
+		memcpy(distances, HnswNeighborTupleDistances(ntup) + start, mul_size(sizeof(float), (Size) lm));
 
 	UnlockReleaseBuffer(buf);
 	return true;
@@ -800,7 +1100,7 @@ HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *u
 
 	*unvisitedLength = 0;
 
-	if (!HnswLoadNeighborTids(element, indextids, index, m, lm, lc))
+	if (!HnswLoadNeighborTids(element, indextids, NULL, index, m, lm, lc))
 		return;
 
 	for (int i = 0; i < lm; i++)
@@ -1034,6 +1334,22 @@ CompareCandidateDistancesOffset(const ListCell *a, const ListCell *b)
 	return 0;
 }
 
+/*
+ * Get the distance between elements, using the cache when available
+ */
+static float
+GetPairDistance(char *base, HnswElement a, HnswElement b, HnswSupport * support)
+{
+	float		distance;
+
+	if (HnswGetCachedDistance(support, a, b, &distance))
+		return distance;
+
+	distance = (float) HnswGetDistance(HnswGetValue(base, a), HnswGetValue(base, b), support);
+	HnswCacheDistance(support, a, b, distance);
+	return distance;
+}
+
 /*
  * Check if an element is closer to q than any element from R
  */
@@ -1041,15 +1357,13 @@ static bool
 CheckElementCloser(char *base, HnswCandidate * e, List *r, HnswSupport * support)
 {
 	HnswElement eElement = HnswPtrAccess(base, e->element);
-	Datum		eValue = HnswGetValue(base, eElement);
 	ListCell   *lc2;
 
 	foreach(lc2, r)
 	{
 		HnswCandidate *ri = lfirst(lc2);
 		HnswElement riElement = HnswPtrAccess(base, ri->element);
-		Datum		riValue = HnswGetValue(base, riElement);
-		float		distance = (float) HnswGetDistance(eValue, riValue, support);
+		float		distance = GetPairDistance(base, eElement, riElement, support);
 
 		if (distance <= e->distance)
 			return false;
@@ -1230,6 +1544,55 @@ HnswUpdateConnection(char *base, HnswNeighborArray * neighbors, HnswElement newE
 	}
 }
 
+/*
+ * Merge other candidates into neighbors, keeping the best lm
+ */
+void
+HnswMergeNeighbors(char *base, HnswNeighborArray * neighbors, HnswNeighborArray * other, int lm, HnswSupport * support)
+{
+	List	   *c = NIL;
+	List	   *r;
+	HnswCandidate *items;
+	ListCell   *lc2;
+	int			i = 0;
+	bool		closerSet = false;
+
+	if (other->length == 0)
+		return;
+
+	for (int j = 0; j < neighbors->length; j++)
+		c = lappend(c, &neighbors->items[j]);
+	for (int j = 0; j < other->length; j++)
+		c = lappend(c, &other->items[j]);
+
+	/* Order candidates desc */
+	if (base == NULL)
+		list_sort(c, CompareCandidateDistances);
+	else
+		list_sort(c, CompareCandidateDistancesOffset);
+
+	/* Copy before overwriting the candidates */
+	items = palloc_array_checked(HnswCandidate, (Size) lm);
+
+	if (list_length(c) <= lm)
+	{
+		for (int j = list_length(c) - 1; j >= 0; j--)
+			items[i++] = *((HnswCandidate *) list_nth(c, j));
+	}
+	else
+	{
+		r = SelectNeighbors(base, c, lm, support, &closerSet, NULL, NULL, false);
+
+		foreach(lc2, r)
+			items[i++] = *((HnswCandidate *) lfirst(lc2));
+	}
+
+	memcpy(neighbors->items, items, i * sizeof(HnswCandidate));
+	neighbors->length = i;
+	neighbors->closerSet = false;
+	pfree(items);
+}
+
 /*
  * Remove elements being deleted or skipped
  */
@@ -1335,6 +1698,10 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 			hc->element = sc->element;
 			hc->distance = (float) sc->distance;
 
+			/* Reused when updating connections of neighbors */
+			if (inMemory)
+				HnswCacheDistance(support, element, HnswPtrAccess(base, hc->element), hc->distance);
+
 			lw = lappend(lw, hc);
 		}
 
@@ -2,13 +2,21 @@
 
 #include "access/genam.h"
 #include "access/generic_xlog.h"
+#include "access/parallel.h"
+#include "access/xact.h"
 #include "commands/vacuum.h"
 #include "hnsw.h"
+#include "miscadmin.h"
 #include "nodes/pg_list.h"
+#include "optimizer/paths.h"
+#include "port/atomics.h"
+#include "postmaster/autovacuum.h"
 #include "storage/bufmgr.h"
+#include "storage/freespace.h"
 #include "storage/lmgr.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "vectorxlog.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -18,39 +26,73 @@
 #define vacuum_delay_point() vacuum_delay_point(false)
 #endif
 
+#if PG_VERSION_NUM >= 170000
+#define IsAutoVacuumWorkerProcess() AmAutoVacuumWorkerProcess()
+#endif
+
+#define PARALLEL_KEY_HNSW_VACUUM_SHARED	UINT64CONST(0xA000000000000004)
+
+/* Blocks claimed at a time by each participant in a parallel repair */
+#define HNSW_VACUUM_CHUNK_SIZE	16
+
+static void InitVacuumState(HnswVacuumState * vacuumstate, Relation index, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state);
+static void FreeVacuumState(HnswVacuumState * vacuumstate);
+
 /*
  * Check if deletion list contains an element
  */
 static bool
-DeletingElement(tidhash_hash * deleting, ItemPointer indextid)
+DeletingElement(HnswTidSet * deleting, ItemPointer indextid)
 {
-	return tidhash_lookup(deleting, *indextid) != NULL;
+	return HnswTidSetContains(deleting, indextid);
 }
 
 /*
- * Remove deleted heap TIDs
+ * Get the number of index TIDs that fit in vacuum memory
+ */
+static int64
+GetDeletingLimit(void)
+{
+	int			vac_work_mem = IsAutoVacuumWorkerProcess() && autovacuum_work_mem != -1 ? autovacuum_work_mem : maintenance_work_mem;
+
+	return (int64) vac_work_mem * 1024 / sizeof(ItemPointerData);
+}
+
+/*
+ * Remove deleted heap TIDs, starting at a block
+ *
+ * Stops early when the deletion list is full so the rest of the index can
+ * be handled in another pass. Pages are always processed completely, so
+ * every element without heap TIDs from this pass is in the deletion list.
+ * Returns the block to resume from, or InvalidBlockNumber when done.
  *
  * OK to remove for entry point, since always considered for searches and inserts
  */
-static void
-RemoveHeapTids(HnswVacuumState * vacuumstate)
+static BlockNumber
+RemoveHeapTids(HnswVacuumState * vacuumstate, BlockNumber blkno)
 {
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
 	HnswElement highestPoint = &vacuumstate->highestPoint;
 	HnswElement fallbackPoint = &vacuumstate->fallbackPoint;
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
 	IndexBulkDeleteResult *stats = vacuumstate->stats;
+	HnswTidSet *deleting = &vacuumstate->deleting;
 
 	/* Store separately since HnswElement level is uint8 */
-	int			highestLevel = -1;
-	int			fallbackLevel = -1;
+	int			highestLevel;
+	int			fallbackLevel;
+
+	/* Initialize highest point and fallback point on first pass */
+	if (blkno == HNSW_HEAD_BLKNO)
+	{
+		highestPoint->blkno = InvalidBlockNumber;
+		highestPoint->offno = InvalidOffsetNumber;
+		fallbackPoint->blkno = InvalidBlockNumber;
+		fallbackPoint->offno = InvalidOffsetNumber;
+	}
 
-	/* Initialize highest point and fallback point */
-	highestPoint->blkno = InvalidBlockNumber;
-	highestPoint->offno = InvalidOffsetNumber;
-	fallbackPoint->blkno = InvalidBlockNumber;
-	fallbackPoint->offno = InvalidOffsetNumber;
+	highestLevel = BlockNumberIsValid(highestPoint->blkno) ? highestPoint->level : -1;
+	fallbackLevel = BlockNumberIsValid(fallbackPoint->blkno) ? fallbackPoint->level : -1;
 
 	while (BlockNumberIsValid(blkno))
 	{
@@ -61,6 +103,10 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 		OffsetNumber maxoffno;
 		bool		updated = false;
 
+		/* Leave room for every element on the page */
+		if (deleting->length > 0 && deleting->length + MaxOffsetNumber > deleting->limit)
+			break;
+
 		vacuum_delay_point();
 
 		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
@@ -122,13 +168,10 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 			if (!ItemPointerIsValid(&etup->heaptids[0]))
 			{
 				ItemPointerData indextid;
-				bool		found;
 
 				/* Add to deletion list */
 				ItemPointerSet(&indextid, blkno, offno);
-
-				tidhash_insert(vacuumstate->deleting, indextid, &found);
-				Assert(!found);
+				HnswTidSetAdd(deleting, &indextid);
 			}
 			else if (etup->level > highestLevel)
 			{
@@ -167,9 +210,14 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 		UnlockReleaseBuffer(buf);
 	}
 
+	/* Sort for lookups */
+	HnswTidSetSort(deleting);
+
 #ifdef HNSW_MEMORY
 	elog(INFO, "memory: %zu KB", MemoryContextMemAllocated(CurrentMemoryContext, true) / 1024);
 #endif
+
+	return blkno;
 }
 
 /*
@@ -201,7 +249,7 @@ NeedsUpdated(HnswVacuumState * vacuumstate, HnswElement element)
 			continue;
 
 		/* Check if in deletion list */
-		if (DeletingElement(vacuumstate->deleting, indextid))
+		if (DeletingElement(&vacuumstate->deleting, indextid))
 		{
 			needsUpdated = true;
 			break;
@@ -234,7 +282,7 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 	int			efConstruction = vacuumstate->efConstruction;
 	BufferAccessStrategy bas = vacuumstate->bas;
 	HnswNeighborTuple ntup = vacuumstate->ntup;
-	Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+	Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m, vacuumstate->neighborDistances);
 	char	   *base = NULL;
 
 	/* Skip if element is entry point */
@@ -245,6 +293,9 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 	HnswInitNeighbors(base, element, m, NULL);
 	element->heaptidsLength = 0;
 
+	/* Remember distances between elements for this repair */
+	HnswInitDistanceCache(support, false);
+
 	/* Find neighbors for element, skipping itself */
 	HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, true);
 
@@ -253,7 +304,7 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 
 	/* Update neighbor tuple */
 	/* Do this before getting page to minimize locking */
-	HnswSetNeighborTuple(base, ntup, element, m);
+	HnswSetNeighborTuple(base, ntup, element, m, vacuumstate->neighborDistances);
 
 	/* Get neighbor page */
 	buf = ReadBufferExtended(index, MAIN_FORKNUM, element->neighborPage, RBM_NORMAL, bas);
@@ -270,7 +321,13 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 	UnlockReleaseBuffer(buf);
 
 	/* Update neighbors */
-	HnswUpdateNeighborsOnDisk(index, support, element, m, false);
+	HnswUpdateNeighborsOnDisk(index, support, element, m, vacuumstate->neighborDistances, false);
+
+	/* Record edges for later vacuums */
+	if (BlockNumberIsValid(vacuumstate->reverseDir))
+		HnswAddElementReverseEdges(index, vacuumstate->reverseDir, &element, 1, false);
+
+	HnswFreeDistanceCache(support);
 }
 
 /*
@@ -335,7 +392,7 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 
 		ItemPointerSet(&epData, entryPoint->blkno, entryPoint->offno);
 
-		if (DeletingElement(vacuumstate->deleting, &epData))
+		if (DeletingElement(&vacuumstate->deleting, &epData))
 		{
 			/*
 			 * Replace the entry point with the highest point. If highest
@@ -373,121 +430,419 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 }
 
 /*
- * Repair graph for all elements
+ * Repair graph for elements with deleted neighbors
  */
 static void
-RepairGraph(HnswVacuumState * vacuumstate)
+RepairGraphElements(HnswVacuumState * vacuumstate, List *elements)
+{
+	Relation	index = vacuumstate->index;
+	ListCell   *lc2;
+
+	/* Update neighbor pages */
+	foreach(lc2, elements)
+	{
+		HnswElement element = (HnswElement) lfirst(lc2);
+		HnswElement entryPoint;
+		LOCKMODE	lockmode = ShareLock;
+
+		/* Check if any neighbors point to deleted values */
+		if (!NeedsUpdated(vacuumstate, element))
+			continue;
+
+		/* Get a shared lock */
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		/* Refresh entry point for each element */
+		entryPoint = HnswGetEntryPoint(index);
+
+		/* Prevent concurrent inserts when likely updating entry point */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+		{
+			/* Release shared lock */
+			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+			/* Get exclusive lock */
+			lockmode = ExclusiveLock;
+			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+			/* Get latest entry point after lock is acquired */
+			entryPoint = HnswGetEntryPoint(index);
+		}
+
+		/* Repair connections */
+		RepairGraphElement(vacuumstate, element, entryPoint);
+
+		/*
+		 * Update metapage if needed. Should only happen if entry point was
+		 * replaced and highest point was outdated.
+		 */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+
+		/* Release lock */
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	}
+}
+
+/*
+ * Repair graph for elements on a page
+ */
+static BlockNumber
+RepairGraphPage(HnswVacuumState * vacuumstate, BlockNumber blkno)
 {
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	Buffer		buf;
+	Page		page;
+	OffsetNumber offno;
+	OffsetNumber maxoffno;
+	BlockNumber nextblkno;
+	List	   *elements = NIL;
+	MemoryContext oldCtx;
 
-	/*
-	 * Wait for inserts to complete. Inserts before this point may have
-	 * neighbors about to be deleted. Inserts after this point will not.
-	 */
-	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
-	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	vacuum_delay_point();
 
-	/* Repair entry point first */
-	RepairGraphEntryPoint(vacuumstate);
+	oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
-	while (BlockNumberIsValid(blkno))
+	buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	/* Skip other pages when repairing by block range */
+	if (PageIsNew(page) || (HnswPageGetOpaque(page)->flags & HNSW_REVERSE_PAGE))
+	{
+		UnlockReleaseBuffer(buf);
+		MemoryContextSwitchTo(oldCtx);
+		return InvalidBlockNumber;
+	}
+
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	/* Load items into memory to minimize locking */
+	for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+		HnswElement element;
+
+		/* Skip neighbor tuples */
+		if (!HnswIsElementTuple(etup))
+			continue;
+
+		/* Skip deleted tuples */
+		if (etup->deleted)
+			continue;
+
+		/* Skip updating neighbors if being deleted */
+		if (!ItemPointerIsValid(&etup->heaptids[0]))
+			continue;
+
+		/* Create an element */
+		element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElementFromTuple(element, etup, false, true);
+
+		elements = lappend(elements, element);
+	}
+
+	nextblkno = HnswPageGetOpaque(page)->nextblkno;
+
+	UnlockReleaseBuffer(buf);
+
+	RepairGraphElements(vacuumstate, elements);
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(vacuumstate->tmpCtx);
+
+	return nextblkno;
+}
+
+/*
+ * Repair graph for elements that may point to deleted elements
+ */
+static void
+RepairGraphReverse(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	BufferAccessStrategy bas = vacuumstate->bas;
+	ItemPointerData *candidates;
+	int64		ncandidates;
+	int64		i = 0;
+	BlockNumber nblocks;
+
+	candidates = HnswGetReverseCandidates(index, vacuumstate->reverseDir, &vacuumstate->deleting, bas, &ncandidates);
+	nblocks = RelationGetNumberOfBlocks(index);
+
+	while (i < ncandidates)
 	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&candidates[i]);
 		Buffer		buf;
 		Page		page;
-		OffsetNumber offno;
 		OffsetNumber maxoffno;
 		List	   *elements = NIL;
-		ListCell   *lc2;
 		MemoryContext oldCtx;
 
 		vacuum_delay_point();
 
+		/* Edges may be outdated if pages were truncated by compaction */
+		if (blkno >= nblocks)
+		{
+			while (i < ncandidates && ItemPointerGetBlockNumber(&candidates[i]) == blkno)
+				i++;
+			continue;
+		}
+
 		oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
 		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
 		LockBuffer(buf, BUFFER_LOCK_SHARE);
 		page = BufferGetPage(buf);
-		maxoffno = PageGetMaxOffsetNumber(page);
 
-		/* Load items into memory to minimize locking */
-		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		/* Edges may be outdated if the page was reused for other data */
+		if (PageIsNew(page) || (HnswPageGetOpaque(page)->flags & HNSW_REVERSE_PAGE))
+			maxoffno = InvalidOffsetNumber;
+		else
+			maxoffno = PageGetMaxOffsetNumber(page);
+
+		/* Load candidates on the same page */
+		for (; i < ncandidates && ItemPointerGetBlockNumber(&candidates[i]) == blkno; i++)
 		{
-			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			OffsetNumber offno = ItemPointerGetOffsetNumber(&candidates[i]);
+			ItemId		itemid;
+			HnswElementTuple etup;
 			HnswElement element;
 
-			/* Skip neighbor tuples */
-			if (!HnswIsElementTuple(etup))
+			if (offno > maxoffno)
 				continue;
 
-			/* Skip deleted tuples */
-			if (etup->deleted)
+			itemid = PageGetItemId(page, offno);
+			if (!ItemIdIsNormal(itemid))
 				continue;
 
-			/* Skip updating neighbors if being deleted */
+			etup = (HnswElementTuple) PageGetItem(page, itemid);
+
+			/* Edges may be outdated if slot was reused */
+			if (!HnswIsElementTuple(etup) || etup->deleted)
+				continue;
+
+			/* Skip if being deleted */
 			if (!ItemPointerIsValid(&etup->heaptids[0]))
 				continue;
 
-			/* Create an element */
 			element = HnswInitElementFromBlock(blkno, offno);
 			HnswLoadElementFromTuple(element, etup, false, true);
 
 			elements = lappend(elements, element);
 		}
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
-
 		UnlockReleaseBuffer(buf);
 
-		/* Update neighbor pages */
-		foreach(lc2, elements)
-		{
-			HnswElement element = (HnswElement) lfirst(lc2);
-			HnswElement entryPoint;
-			LOCKMODE	lockmode = ShareLock;
+		RepairGraphElements(vacuumstate, elements);
 
-			/* Check if any neighbors point to deleted values */
-			if (!NeedsUpdated(vacuumstate, element))
-				continue;
+		/* Reset memory context */
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(vacuumstate->tmpCtx);
+	}
 
-			/* Get a shared lock */
-			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	pfree(candidates);
+}
 
-			/* Refresh entry point for each element */
-			entryPoint = HnswGetEntryPoint(index);
+/*
+ * Repair graph for ranges of blocks claimed from shared state
+ */
+static void
+RepairGraphBlocks(HnswVacuumState * vacuumstate, HnswVacuumShared * hnswshared)
+{
+	for (;;)
+	{
+		BlockNumber startBlkno = pg_atomic_fetch_add_u32(&hnswshared->nextBlkno, HNSW_VACUUM_CHUNK_SIZE);
+		BlockNumber endBlkno;
 
-			/* Prevent concurrent inserts when likely updating entry point */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-			{
-				/* Release shared lock */
-				UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		if (startBlkno >= hnswshared->nblocks)
+			break;
 
-				/* Get exclusive lock */
-				lockmode = ExclusiveLock;
-				LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		endBlkno = Min(startBlkno + HNSW_VACUUM_CHUNK_SIZE, hnswshared->nblocks);
 
-				/* Get latest entry point after lock is acquired */
-				entryPoint = HnswGetEntryPoint(index);
-			}
+		for (BlockNumber blkno = startBlkno; blkno < endBlkno; blkno++)
+			RepairGraphPage(vacuumstate, blkno);
+	}
+}
 
-			/* Repair connections */
-			RepairGraphElement(vacuumstate, element, entryPoint);
+/*
+ * Use deletion list from shared state
+ *
+ * The list is already sorted, so search it in place instead of copying it
+ */
+static void
+LoadDeleting(HnswVacuumState * vacuumstate, HnswVacuumShared * hnswshared)
+{
+	HnswTidSet *deleting = &vacuumstate->deleting;
 
-			/*
-			 * Update metapage if needed. Should only happen if entry point
-			 * was replaced and highest point was outdated.
-			 */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-				HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+	deleting->tids = HnswVacuumSharedDeleting(hnswshared);
+	deleting->length = hnswshared->ndeleting;
+	deleting->maxLength = hnswshared->ndeleting;
+}
 
-			/* Release lock */
-			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
-		}
+/*
+ * Perform work within a launched parallel process
+ */
+void
+HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc)
+{
+	HnswVacuumShared *hnswshared;
+	HnswVacuumState vacuumstate;
+	Relation	index;
 
-		/* Reset memory context */
-		MemoryContextSwitchTo(oldCtx);
-		MemoryContextReset(vacuumstate->tmpCtx);
+	/* Look up shared state */
+	hnswshared = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, false);
+
+	/* Use lock mode known to be obtained by vacuum */
+	index = index_open(hnswshared->indexrelid, RowExclusiveLock);
+
+	InitVacuumState(&vacuumstate, index, NULL, NULL, NULL);
+	LoadDeleting(&vacuumstate, hnswshared);
+
+	/* Repair graph */
+	RepairGraphBlocks(&vacuumstate, hnswshared);
+
+	/* Deletion list is in shared memory */
+	vacuumstate.deleting.tids = NULL;
+
+	FreeVacuumState(&vacuumstate);
+
+	index_close(index, RowExclusiveLock);
+}
+
+/*
+ * Compute parallel workers
+ */
+static int
+ComputeParallelWorkers(BlockNumber nblocks)
+{
+	/*
+	 * Parallel vacuum of multiple indexes already uses workers, and workers
+	 * cannot launch workers. Postgres uses parallel vacuum by default for
+	 * tables with multiple indexes, so it must be disabled with VACUUM
+	 * (PARALLEL 0) to repair in parallel. Autovacuum does not use parallel
+	 * workers.
+	 */
+	if (IsInParallelMode() || IsAutoVacuumWorkerProcess())
+		return 0;
+
+	/* Use a worker for each min_parallel_index_scan_size of the index */
+	if (min_parallel_index_scan_size > 0)
+		return Min(nblocks / min_parallel_index_scan_size, max_parallel_maintenance_workers);
+
+	return max_parallel_maintenance_workers;
+}
+
+/*
+ * Repair graph with parallel workers, partitioned by block range
+ *
+ * This is a standalone parallel context rather than part of parallel vacuum.
+ * amparallelvacuumoptions only lets Postgres give each index to a different
+ * worker, so it cannot split the repair of one index across workers.
+ */
+static bool
+RepairGraphParallel(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	BlockNumber nblocks = RelationGetNumberOfBlocks(index);
+	int			request = ComputeParallelWorkers(nblocks);
+	ParallelContext *pcxt;
+	HnswVacuumShared *hnswshared;
+	HnswTidSet *deleting = &vacuumstate->deleting;
+	Size		estshared;
+
+	if (request == 0 || deleting->length == 0)
+		return false;
+
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	pcxt = CreateParallelContext("vector", "HnswParallelVacuumMain", request);
+
+	/* Estimate size of shared state, including deletion list */
+	estshared = add_size(MAXALIGN(sizeof(HnswVacuumShared)), mul_size(deleting->length, sizeof(ItemPointerData)));
+	shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+	shm_toc_estimate_keys(&pcxt->estimator, 1);
+
+	InitializeParallelDSM(pcxt);
+
+	/* If no DSM segment was available, back out (do serial repair) */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
+
+	/* Store shared state */
+	hnswshared = (HnswVacuumShared *) shm_toc_allocate(pcxt->toc, estshared);
+	hnswshared->indexrelid = RelationGetRelid(index);
+	hnswshared->nblocks = nblocks;
+	pg_atomic_init_u32(&hnswshared->nextBlkno, HNSW_HEAD_BLKNO);
+
+	hnswshared->ndeleting = deleting->length;
+	memcpy(HnswVacuumSharedDeleting(hnswshared), deleting->tids, deleting->length * sizeof(ItemPointerData));
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, hnswshared);
+
+	LaunchParallelWorkers(pcxt);
+
+	/* If no workers were successfully launched, back out (do serial repair) */
+	if (pcxt->nworkers_launched == 0)
+	{
+		WaitForParallelWorkersToFinish(pcxt);
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
+
+	ereport(DEBUG1, (errmsg("using %d parallel workers", pcxt->nworkers_launched)));
+
+	/* Participate as a worker */
+	RepairGraphBlocks(vacuumstate, hnswshared);
+
+	/* Wait for all launched workers */
+	WaitForParallelWorkersToFinish(pcxt);
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return true;
+}
+
+/*
+ * Repair graph for all elements
+ */
+static void
+RepairGraph(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+
+	/*
+	 * Wait for inserts to complete. Inserts before this point may have
+	 * neighbors about to be deleted. Inserts after this point will not.
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	/* Repair entry point first */
+	RepairGraphEntryPoint(vacuumstate);
+
+	/* Only repair elements that may point to deleted elements if possible */
+	if (BlockNumberIsValid(vacuumstate->reverseDir))
+	{
+		RepairGraphReverse(vacuumstate);
+		return;
+	}
+
+	/* Pages added after this point only have new elements */
+	if (RepairGraphParallel(vacuumstate))
+		return;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		blkno = RepairGraphPage(vacuumstate, blkno);
 
 #ifdef HNSW_VACUUM_PROGRESS
 		if (!BlockNumberIsValid(blkno) || (blkno - HNSW_HEAD_BLKNO) % 1000 == 0)
@@ -574,7 +929,7 @@ ConfirmRepaired(HnswVacuumState * vacuumstate)
 					continue;
 
 				/* Check if in deletion list */
-				if (DeletingElement(vacuumstate->deleting, indextid))
+				if (DeletingElement(&vacuumstate->deleting, indextid))
 					elog(ERROR, "hnsw graph not repaired");
 			}
 
@@ -598,6 +953,7 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 	BlockNumber insertPage = InvalidBlockNumber;
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
+	bool		compactWal = VectorXLogEnabled(index);
 
 	/*
 	 * Wait for inserts and index scans to complete. Inserts and scans before
@@ -609,8 +965,7 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 
 	ConfirmRepaired(vacuumstate);
 
-	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
-	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+	HnswWaitForScans(index);
 
 	while (BlockNumberIsValid(blkno))
 	{
@@ -619,6 +974,8 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 		GenericXLogState *state;
 		OffsetNumber offno;
 		OffsetNumber maxoffno;
+		BlockNumber nextblkno;
+		Size		freeSlotSpace;
 
 		vacuum_delay_point();
 
@@ -632,8 +989,16 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 		 */
 		LockBufferForCleanup(buf);
 
-		state = GenericXLogStart(index);
-		page = GenericXLogRegisterBuffer(state, buf, 0);
+		if (compactWal)
+		{
+			state = NULL;
+			page = BufferGetPage(buf);
+		}
+		else
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+		}
 		maxoffno = PageGetMaxOffsetNumber(page);
 
 		/* Update element and neighbors together */
@@ -645,6 +1010,7 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			Page		npage;
 			BlockNumber neighborPage;
 			OffsetNumber neighborOffno;
+			ItemPointerData indextid;
 
 			/* Skip neighbor tuples */
 			if (!HnswIsElementTuple(etup))
@@ -664,6 +1030,11 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			if (ItemPointerIsValid(&etup->heaptids[0]))
 				continue;
 
+			/* Skip tuples not repaired in this pass */
+			ItemPointerSet(&indextid, blkno, offno);
+			if (!DeletingElement(&vacuumstate->deleting, &indextid))
+				continue;
+
 			/* Get neighbor page */
 			neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
 			neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
@@ -677,7 +1048,23 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			{
 				nbuf = ReadBufferExtended(index, MAIN_FORKNUM, neighborPage, RBM_NORMAL, bas);
 				LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
-				npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+				if (compactWal)
+					npage = BufferGetPage(nbuf);
+				else
+					npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+			}
+
+			if (compactWal)
+			{
+				HnswXLogMarkDeleted(index, buf, offno, nbuf, neighborOffno);
+				if (nbuf != buf)
+					UnlockReleaseBuffer(nbuf);
+
+				/* Set to first free page */
+				if (!BlockNumberIsValid(insertPage))
+					insertPage = blkno;
+
+				continue;
 			}
 
 			ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, neighborOffno));
@@ -718,24 +1105,32 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			page = GenericXLogRegisterBuffer(state, buf, 0);
 		}
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+		freeSlotSpace = HnswGetFreeSlotSpace(page, blkno);
 
-		GenericXLogAbort(state);
+		if (state != NULL)
+			GenericXLogAbort(state);
 		UnlockReleaseBuffer(buf);
+
+		/* Record free slots so inserts can find them */
+		RecordPageWithFreeSpace(index, blkno, freeSlotSpace);
+
+		blkno = nextblkno;
 	}
 
 	/* Update insert page last, after everything has been marked as deleted */
 	HnswUpdateMetaPage(index, 0, NULL, insertPage, MAIN_FORKNUM, false);
+
+	/* Make free slots visible to searches of the free space map */
+	IndexFreeSpaceMapVacuum(index);
 }
 
 /*
  * Initialize the vacuum state
  */
 static void
-InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
+InitVacuumState(HnswVacuumState * vacuumstate, Relation index, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
 {
-	Relation	index = info->index;
-
 	if (stats == NULL)
 		stats = palloc0_object(IndexBulkDeleteResult);
 
@@ -753,10 +1148,11 @@ InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkD
 	HnswInitSupport(&vacuumstate->support, index);
 
 	/* Get m from metapage */
-	HnswGetMetaPageInfo(index, &vacuumstate->m, NULL);
+	HnswGetMetaPageInfo(index, &vacuumstate->m, NULL, &vacuumstate->neighborDistances);
+	vacuumstate->reverseDir = HnswGetReverseDir(index);
 
-	/* Create hash table */
-	vacuumstate->deleting = tidhash_create(CurrentMemoryContext, 256, NULL);
+	/* Create deletion list */
+	HnswTidSetInit(&vacuumstate->deleting, GetDeletingLimit());
 }
 
 /*
@@ -765,7 +1161,8 @@ InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkD
 static void
 FreeVacuumState(HnswVacuumState * vacuumstate)
 {
-	tidhash_destroy(vacuumstate->deleting);
+	if (vacuumstate->deleting.tids != NULL)
+		pfree(vacuumstate->deleting.tids);
 	FreeAccessStrategy(vacuumstate->bas);
 	pfree(vacuumstate->ntup);
 	MemoryContextDelete(vacuumstate->tmpCtx);
@@ -779,17 +1176,38 @@ hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 			   IndexBulkDeleteCallback callback, void *callback_state)
 {
 	HnswVacuumState vacuumstate;
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
 
-	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
+	InitVacuumState(&vacuumstate, info->index, stats, callback, callback_state);
 
-	/* Pass 1: Remove heap TIDs */
-	HnswBench("RemoveHeapTids", RemoveHeapTids(&vacuumstate));
+	/* Move pending tuples into graph, skipping dead tuples */
+	HnswBench("FlushPendingList", HnswFlushPendingList(info->index, &vacuumstate.support, true, callback, callback_state, vacuumstate.stats));
 
-	/* Pass 2: Repair graph */
-	HnswBench("RepairGraph", RepairGraph(&vacuumstate));
+	/* Repeat passes when the deletion list does not fit in memory */
+	for (;;)
+	{
+		/* Pass 1: Remove heap TIDs */
+		HnswBench("RemoveHeapTids", blkno = RemoveHeapTids(&vacuumstate, blkno));
+
+		/* Pass 2: Repair graph */
+		HnswBench("RepairGraph", RepairGraph(&vacuumstate));
 
-	/* Passes 3 and 4: Confirm repaired and mark as deleted */
-	HnswBench("MarkDeleted", MarkDeleted(&vacuumstate));
+		/* Passes 3 and 4: Confirm repaired and mark as deleted */
+		HnswBench("MarkDeleted", MarkDeleted(&vacuumstate));
+
+		/* Pass 5: Remove reverse edges for deleted elements */
+		if (BlockNumberIsValid(vacuumstate.reverseDir))
+			HnswBench("CompactReverseEdges", HnswCompactReverseEdges(info->index, vacuumstate.reverseDir, &vacuumstate.deleting, vacuumstate.bas));
+
+		if (!BlockNumberIsValid(blkno))
+			break;
+
+		ereport(DEBUG1,
+				(errmsg("\"%s\": deletion list full after " INT64_FORMAT " elements, starting another pass at block %u",
+						RelationGetRelationName(info->index), vacuumstate.deleting.length, blkno)));
+
+		HnswTidSetReset(&vacuumstate.deleting);
+	}
 
 	FreeVacuumState(&vacuumstate);
 
@@ -804,6 +1222,15 @@ hnswvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
 	Relation	rel = info->index;
 
+	/* Flush pending list when no tuples were deleted */
+	if (stats == NULL && (!info->analyze_only || IsAutoVacuumWorkerProcess()))
+	{
+		HnswSupport support;
+
+		HnswInitSupport(&support, rel);
+		HnswFlushPendingList(rel, &support, !info->analyze_only, NULL, NULL, NULL);
+	}
+
 	if (info->analyze_only)
 		return stats;
 
@@ -13,7 +13,6 @@
 #include "access/xact.h"
 #include "access/xloginsert.h"
 #include "catalog/index.h"
-#include "catalog/pg_operator_d.h"
 #include "catalog/pg_type_d.h"
 #include "commands/progress.h"
 #include "fmgr.h"
@@ -28,7 +27,6 @@
 #include "utils/rel.h"
 #include "utils/sampling.h"
 #include "utils/snapmgr.h"
-#include "utils/tuplesort.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -46,9 +44,10 @@
 #endif
 
 #define PARALLEL_KEY_IVFFLAT_SHARED		UINT64CONST(0xA000000000000001)
-#define PARALLEL_KEY_TUPLESORT			UINT64CONST(0xA000000000000002)
+#define PARALLEL_KEY_IVFFLAT_SPOOL		UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_IVFFLAT_CENTERS	UINT64CONST(0xA000000000000003)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000004)
+#define PARALLEL_KEY_IVFFLAT_CODEBOOKS	UINT64CONST(0xA000000000000005)
 
 /*
  * Add sample
@@ -150,22 +149,132 @@ SampleRows(IvfflatBuildState * buildstate)
 									 false, false, false, targblock, 1, SampleCallback, (void *) buildstate, NULL);
 	}
 
+	/* Product quantization trains on values before they are normalized for k-means */
+	if (buildstate->pqSamples != NULL)
+	{
+		VectorArray pqSamples = buildstate->pqSamples;
+
+		while (pqSamples->length < pqSamples->maxlen && pqSamples->length < buildstate->samples->length)
+		{
+			VectorArraySet(pqSamples, pqSamples->length, VectorArrayGet(buildstate->samples, pqSamples->length));
+			pqSamples->length++;
+		}
+	}
+
 	/* Normalize if needed */
 	if (buildstate->kmeansnormprocinfo != NULL)
 		IvfflatNormVectors(buildstate->typeInfo, buildstate->collation, buildstate->samples, buildstate->tmpCtx);
 }
 
 /*
- * Add tuple to sort
+ * Add tuple to spool for a list
+ */
+static void
+SpoolTuple(IvfflatBuildState * buildstate, ItemPointer tid, Datum value, int closestCenter, double minDistance)
+{
+	VectorArray centers = buildstate->centers;
+
+#ifdef IVFFLAT_KMEANS_DEBUG
+	buildstate->inertia += minDistance;
+	buildstate->listSums[closestCenter] += minDistance;
+	buildstate->listCounts[closestCenter]++;
+#endif
+
+	/* Encode with product quantization */
+	if (buildstate->pqSubvectors > 0)
+		value = PointerGetDatum(IvfpqEncode(buildstate->pqCentroids, buildstate->pqSubvectors, DatumGetVector(value), (Vector *) VectorArrayGet(centers, closestCenter)));
+
+	/* Add tuple to spool, which copies the value */
+	IvfflatSpoolPut(buildstate->spool, closestCenter, tid, DatumGetPointer(value));
+
+	buildstate->indtuples++;
+}
+
+/*
+ * Set up batched assignment if the distance kernel supports the opclass
+ */
+static void
+InitAssignBatch(IvfflatBuildState * buildstate)
+{
+	IvfflatKernel *kernel = IvfflatKernelCreate(buildstate->procinfo, buildstate->dimensions);
+	int			numCenters = buildstate->centers->length;
+
+	if (kernel == NULL)
+		return;
+
+	IvfflatKernelSetCenters(kernel, buildstate->centers, palloc_extended(IvfflatKernelCentersSize(kernel, numCenters), MCXT_ALLOC_HUGE));
+
+	buildstate->kernel = kernel;
+	buildstate->batch = VectorArrayInit(IVFFLAT_KERNEL_MAX_VALUES, buildstate->dimensions, buildstate->itemsize);
+	buildstate->batchTids = palloc_array_checked(ItemPointerData, IVFFLAT_KERNEL_MAX_VALUES);
+	buildstate->batchDistances = palloc_array_checked(float, mul_size(IVFFLAT_KERNEL_MAX_VALUES, (Size) numCenters));
+}
+
+/*
+ * Assign a batch of tuples to lists and add them to spool
  */
 static void
-AddTupleToSort(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
+FlushBatch(IvfflatBuildState * buildstate)
+{
+	VectorArray batch = buildstate->batch;
+	int			numCenters = buildstate->centers->length;
+	Pointer		values[IVFFLAT_KERNEL_MAX_VALUES];
+
+	for (int i = 0; i < batch->length; i++)
+		values[i] = VectorArrayGet(batch, i);
+
+	/* Compute distances to all centers at once */
+	IvfflatKernelDistances(buildstate->kernel, values, batch->length, 0, numCenters, buildstate->batchDistances);
+
+	for (int i = 0; i < batch->length; i++)
+	{
+		float	   *distances = buildstate->batchDistances + (Size) i * numCenters;
+		float		minDistance = FLT_MAX;
+		int			closestCenter = 0;
+
+		/* Find the list that minimizes the distance */
+		for (int j = 0; j < numCenters; j++)
+		{
+			if (distances[j] < minDistance)
+			{
+				minDistance = distances[j];
+				closestCenter = j;
+			}
+		}
+
+		SpoolTuple(buildstate, &buildstate->batchTids[i], PointerGetDatum(values[i]), closestCenter, minDistance);
+	}
+
+	batch->length = 0;
+}
+
+/*
+ * Add remaining tuples in batch to spool
+ */
+static void
+FinishBatch(IvfflatBuildState * buildstate)
+{
+	MemoryContext oldCtx;
+
+	if (buildstate->batch == NULL || buildstate->batch->length == 0)
+		return;
+
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+	FlushBatch(buildstate);
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Add tuple to spool
+ */
+static void
+AddTupleToSpool(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
 {
 	double		distance;
 	double		minDistance = DBL_MAX;
 	int			closestCenter = 0;
 	VectorArray centers = buildstate->centers;
-	TupleTableSlot *slot = buildstate->slot;
 
 	/* Detoast once for all calls */
 	Datum		value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
@@ -179,6 +288,21 @@ AddTupleToSort(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
 		value = IvfflatNormValue(buildstate->typeInfo, buildstate->collation, value);
 	}
 
+	/* Assign lists in batches when possible */
+	if (buildstate->kernel != NULL)
+	{
+		VectorArray batch = buildstate->batch;
+
+		buildstate->batchTids[batch->length] = *tid;
+		VectorArraySet(batch, batch->length, DatumGetPointer(value));
+		batch->length++;
+
+		if (batch->length == batch->maxlen)
+			FlushBatch(buildstate);
+
+		return;
+	}
+
 	/* Find the list that minimizes the distance */
 	for (int i = 0; i < centers->length; i++)
 	{
@@ -191,31 +315,7 @@ AddTupleToSort(ItemPointer tid, Datum *values, IvfflatBuildState * buildstate)
 		}
 	}
 
-#ifdef IVFFLAT_KMEANS_DEBUG
-	buildstate->inertia += minDistance;
-	buildstate->listSums[closestCenter] += minDistance;
-	buildstate->listCounts[closestCenter]++;
-#endif
-
-	/* Create a virtual tuple */
-	ExecClearTuple(slot);
-	slot->tts_values[0] = Int32GetDatum(closestCenter);
-	slot->tts_isnull[0] = false;
-	slot->tts_values[1] = PointerGetDatum(tid);
-	slot->tts_isnull[1] = false;
-	slot->tts_values[2] = value;
-	slot->tts_isnull[2] = false;
-	ExecStoreVirtualTuple(slot);
-
-	/*
-	 * Add tuple to sort
-	 *
-	 * tuplesort_puttupleslot comment: Input data is always copied; the caller
-	 * need not save it.
-	 */
-	tuplesort_puttupleslot(buildstate->sortstate, slot);
-
-	buildstate->indtuples++;
+	SpoolTuple(buildstate, tid, value, closestCenter, minDistance);
 }
 
 /*
@@ -235,8 +335,8 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 	/* Use memory context since detoast can allocate */
 	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
 
-	/* Add tuple to sort */
-	AddTupleToSort(tid, values, buildstate);
+	/* Add tuple to spool */
+	AddTupleToSpool(tid, values, buildstate);
 
 	/* Reset memory context */
 	MemoryContextSwitchTo(oldCtx);
@@ -244,25 +344,80 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 }
 
 /*
- * Get index tuple from sort state
+ * Get next tuple from spool
+ *
+ * The value and TID are valid until the next call
  */
 static inline void
-GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list)
+GetNextTuple(IvfflatSpoolReader * reader, Pointer *value, ItemPointer *tid, int *list)
 {
-	if (tuplesort_gettupleslot(sortstate, true, false, slot, NULL))
-	{
-		Datum		value;
-		bool		isnull;
+	if (!IvfflatSpoolGetTuple(reader, list, tid, value))
+		*list = -1;
+}
 
-		*list = DatumGetInt32(slot_getattr(slot, 1, &isnull));
-		value = slot_getattr(slot, 3, &isnull);
+/*
+ * Compare list sizes
+ */
+static int
+CompareListSizes(const void *a, const void *b)
+{
+	int64		sa = *((const int64 *) a);
+	int64		sb = *((const int64 *) b);
 
-		/* Form the index tuple */
-		*itup = index_form_tuple(tupdesc, &value, &isnull);
-		(*itup)->t_tid = *((ItemPointer) DatumGetPointer(slot_getattr(slot, 2, &isnull)));
-	}
-	else
-		*list = -1;
+	if (sa < sb)
+		return -1;
+
+	if (sa > sb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get a percentile of sorted list sizes
+ */
+static inline int64
+ListSizePercentile(int64 *listSizes, int lists, double percentile)
+{
+	return listSizes[(int) ((lists - 1) * percentile)];
+}
+
+/*
+ * Report the distribution of list sizes
+ *
+ * Scans read whole lists, so the largest lists determine tail latency
+ */
+static void
+ReportListSizes(int64 *listSizes, int lists)
+{
+	qsort(listSizes, lists, sizeof(int64), CompareListSizes);
+
+	ereport(DEBUG1,
+			(errmsg("list sizes: min " INT64_FORMAT ", p50 " INT64_FORMAT ", p90 " INT64_FORMAT ", p99 " INT64_FORMAT ", max " INT64_FORMAT,
+					listSizes[0],
+					ListSizePercentile(listSizes, lists, 0.5),
+					ListSizePercentile(listSizes, lists, 0.9),
+					ListSizePercentile(listSizes, lists, 0.99),
+					listSizes[lists - 1])));
+}
+
+/*
+ * Record the end of the entry pages in the metapage
+ */
+static void
+SetEntryEnd(Relation index, ForkNumber forkNum)
+{
+	BlockNumber entryEnd = RelationGetNumberOfBlocksInFork(index, forkNum);
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatPageGetMeta(page)->entryEnd = entryEnd;
+	IvfflatCommitBuffer(buf, state);
 }
 
 /*
@@ -272,17 +427,27 @@ static void
 InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 {
 	int			list;
-	IndexTuple	itup = NULL;	/* silence compiler warning */
+	Pointer		value = NULL;	/* silence compiler warning */
+	ItemPointer tid = NULL;		/* silence compiler warning */
 	int64		inserted = 0;
+	Size		itemsize;
+	IvfflatSpoolReader *reader;
+	int64	   *listSizes = palloc0_array_checked(int64, (Size) buildstate->centers->length);
 
-	TupleTableSlot *slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsMinimalTuple);
-	TupleDesc	tupdesc = buildstate->tupdesc;
+	/* Codes are stored instead of values with product quantization */
+	if (buildstate->pqSubvectors > 0)
+		itemsize = MAXALIGN(IVFPQ_CODE_SIZE(buildstate->pqSubvectors));
+	else
+		itemsize = IvfflatPackedItemSize(buildstate->typeInfo, buildstate->dimensions);
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_LOAD);
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, (int64) buildstate->indtuples);
 
-	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+	/* Participants have written their tuples to files in parallel builds */
+	reader = IvfflatSpoolBeginRead(buildstate->spool, buildstate->ivfleader ? buildstate->ivfleader->sharedspool : NULL, buildstate->centers->length);
+
+	GetNextTuple(reader, &value, &tid, &list);
 
 	for (int i = 0; i < buildstate->centers->length; i++)
 	{
@@ -298,6 +463,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 		buf = IvfflatNewBuffer(index, forkNum);
 		IvfflatInitRegisterPage(index, &buf, &page, &state);
+		IvfflatPageGetOpaque(page)->itemsize = (uint16) itemsize;
 
 		startPage = BufferGetBlockNumber(buf);
 
@@ -305,20 +471,16 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 		while (list == i)
 		{
 			/* Check for free space */
-			Size		itemsz = MAXALIGN(IndexTupleSize(itup));
-
-			if (PageGetFreeSpace(page) < itemsz)
+			if (!IvfflatPackedHasSpace(page))
 				IvfflatAppendPage(index, &buf, &page, &state, forkNum);
 
 			/* Add the item */
-			if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
-				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
-
-			pfree(itup);
+			IvfflatPackedAddItem(page, tid, value);
 
 			pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
+			listSizes[i]++;
 
-			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+			GetNextTuple(reader, &value, &tid, &list);
 		}
 
 		insertPage = BufferGetBlockNumber(buf);
@@ -328,6 +490,14 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 		/* Set the start and insert pages */
 		IvfflatUpdateList(index, buildstate->listInfo[i], insertPage, InvalidBlockNumber, startPage, forkNum);
 	}
+
+	IvfflatSpoolEndRead(reader);
+
+	/* Chains are contiguous up to here, which list streams use */
+	SetEntryEnd(index, forkNum);
+
+	ReportListSizes(listSizes, buildstate->centers->length);
+	pfree(listSizes);
 }
 
 /*
@@ -343,6 +513,7 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	buildstate->tupdesc = RelationGetDescr(index);
 
 	buildstate->lists = IvfflatGetLists(index);
+	buildstate->pqSubvectors = IvfpqGetSubvectors(index);
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
 
 	/* Disallow varbit since require fixed dimensions */
@@ -377,16 +548,17 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("dimensions must be greater than one for this opclass")));
 
-	/* Create tuple description for sorting */
-	buildstate->sortdesc = CreateTemplateTupleDesc(3);
-	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 1, "list", INT4OID, -1, 0);
-	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
-	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "vector", TupleDescAttr(buildstate->tupdesc, 0)->atttypid, -1, 0);
-#if PG_VERSION_NUM >= 190000
-	TupleDescFinalize(buildstate->sortdesc);
-#endif
+	/* Check product quantization */
+	if (buildstate->pqSubvectors > 0)
+	{
+		/* Errors for unsupported opclasses */
+		(void) IvfpqGetMetric(index);
 
-	buildstate->slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsVirtual);
+		if (buildstate->dimensions % buildstate->pqSubvectors != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("dimensions must be a multiple of pq_subvectors")));
+	}
 
 	buildstate->memoryUsed = 0;
 	buildstate->itemsize = buildstate->typeInfo->itemSize(buildstate->dimensions);
@@ -398,6 +570,16 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	/* TODO Move allocation to page creation */
 	buildstate->listInfo = palloc_array_checked(ListInfo, (Size) buildstate->lists);
 
+	buildstate->pqSamples = NULL;
+	buildstate->pqCentroids = NULL;
+
+	buildstate->spool = NULL;
+
+	buildstate->kernel = NULL;
+	buildstate->batch = NULL;
+	buildstate->batchTids = NULL;
+	buildstate->batchDistances = NULL;
+
 	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 											   "Ivfflat build temporary context",
 											   ALLOCSET_DEFAULT_SIZES);
@@ -420,6 +602,16 @@ FreeBuildState(IvfflatBuildState * buildstate)
 	VectorArrayFree(buildstate->centers);
 	pfree(buildstate->listInfo);
 
+	if (buildstate->pqCentroids != NULL)
+		pfree(buildstate->pqCentroids);
+
+	if (buildstate->batch != NULL)
+	{
+		VectorArrayFree(buildstate->batch);
+		pfree(buildstate->batchTids);
+		pfree(buildstate->batchDistances);
+	}
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	pfree(buildstate->listSums);
 	pfree(buildstate->listCounts);
@@ -435,6 +627,7 @@ static void
 ComputeCenters(IvfflatBuildState * buildstate)
 {
 	int			numSamples;
+	int			parallel_workers = 0;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_KMEANS);
 
@@ -459,6 +652,17 @@ ComputeCenters(IvfflatBuildState * buildstate)
 	buildstate->memoryUsed = add_size(buildstate->memoryUsed, VECTOR_ARRAY_SIZE(numSamples, buildstate->itemsize));
 	IvfflatCheckMemoryUsage(buildstate->memoryUsed);
 	buildstate->samples = VectorArrayInit(numSamples, buildstate->dimensions, buildstate->itemsize);
+
+	/* Keep a subset of samples to train codebooks */
+	if (buildstate->pqSubvectors > 0)
+	{
+		int			numPqSamples = Min(numSamples, IVFPQ_MAX_TRAIN_SAMPLES);
+
+		buildstate->memoryUsed = add_size(buildstate->memoryUsed, VECTOR_ARRAY_SIZE(numPqSamples, buildstate->itemsize));
+		IvfflatCheckMemoryUsage(buildstate->memoryUsed);
+		buildstate->pqSamples = VectorArrayInit(numPqSamples, buildstate->dimensions, buildstate->itemsize);
+	}
+
 	if (buildstate->heap != NULL)
 	{
 		IvfflatBench("sample rows", SampleRows(buildstate));
@@ -472,11 +676,26 @@ ComputeCenters(IvfflatBuildState * buildstate)
 		}
 	}
 
+	/* Calculate parallel workers */
+	if (buildstate->heap != NULL)
+		parallel_workers = plan_create_index_workers(RelationGetRelid(buildstate->heap), RelationGetRelid(buildstate->index));
+
 	/* Calculate centers */
-	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, buildstate->memoryUsed));
+	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, buildstate->memoryUsed, parallel_workers, buildstate->indexInfo->ii_Concurrent));
 
 	/* Free samples before we allocate more memory */
 	VectorArrayFree(buildstate->samples);
+
+	/* Train codebooks */
+	if (buildstate->pqSamples != NULL)
+	{
+		buildstate->memoryUsed -= VECTOR_ARRAY_SIZE(numSamples, buildstate->itemsize);
+
+		IvfflatBench("product quantization", IvfpqTrain(buildstate));
+
+		VectorArrayFree(buildstate->pqSamples);
+		buildstate->pqSamples = NULL;
+	}
 }
 
 /*
@@ -499,6 +718,10 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
 	metap->version = IVFFLAT_VERSION;
 	metap->dimensions = (uint16) dimensions;
 	metap->lists = (uint16) lists;
+	metap->pqSubvectors = 0;
+	metap->unused = 0;
+	metap->codebookPage = InvalidBlockNumber;
+	metap->entryEnd = InvalidBlockNumber;
 	((PageHeader) page)->pd_lower =
 		(LocationIndex) (((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page);
 
@@ -600,20 +823,6 @@ PrintKmeansMetrics(IvfflatBuildState * buildstate)
 }
 #endif
 
-/*
- * Initialize build sort state
- */
-static Tuplesortstate *
-InitBuildSortState(TupleDesc tupdesc, int memory, SortCoordinate coordinate)
-{
-	AttrNumber	attNums[] = {1};
-	Oid			sortOperators[] = {Int4LessOperator};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
-
-	return tuplesort_begin_heap(tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, memory, coordinate, false);
-}
-
 /*
  * Within leader, wait for end of heap scan
  */
@@ -621,14 +830,14 @@ static double
 ParallelHeapScan(IvfflatBuildState * buildstate)
 {
 	IvfflatShared *ivfshared = buildstate->ivfleader->ivfshared;
-	int			nparticipanttuplesorts;
+	int			nparticipants;
 	double		reltuples;
 
-	nparticipanttuplesorts = buildstate->ivfleader->nparticipanttuplesorts;
+	nparticipants = buildstate->ivfleader->nparticipants;
 	for (;;)
 	{
 		SpinLockAcquire(&ivfshared->mutex);
-		if (ivfshared->nparticipantsdone == nparticipanttuplesorts)
+		if (ivfshared->nparticipantsdone == nparticipants)
 		{
 			buildstate->indtuples = ivfshared->indtuples;
 			reltuples = ivfshared->reltuples;
@@ -650,43 +859,44 @@ ParallelHeapScan(IvfflatBuildState * buildstate)
 }
 
 /*
- * Perform a worker's portion of a parallel sort
+ * Perform a worker's portion of a parallel build
  */
 static void
-IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, Sharedsort *sharedsort, char *ivfcenters, int sortmem, bool progress)
+IvfflatParallelScanAndSpool(Relation heap, Relation index, IvfflatShared * ivfshared, IvfflatSharedSpool * sharedspool, char *ivfcenters, float *pqcentroids, int participant, bool progress)
 {
-	SortCoordinate coordinate;
 	IvfflatBuildState buildstate;
 	TableScanDesc scan;
 	double		reltuples;
 	IndexInfo  *indexInfo;
-
-	/* Initialize local tuplesort coordination state */
-	coordinate = palloc0_object(SortCoordinateData);
-	coordinate->isWorker = true;
-	coordinate->nParticipants = -1;
-	coordinate->sharedsort = sharedsort;
+	Size		spoolmem;
 
 	/* Join parallel scan */
-	indexInfo = BuildIndexInfo(ivfspool->index);
+	indexInfo = BuildIndexInfo(index);
 	indexInfo->ii_Concurrent = ivfshared->isconcurrent;
-	InitBuildState(&buildstate, ivfspool->heap, ivfspool->index, indexInfo);
+	InitBuildState(&buildstate, heap, index, indexInfo);
 	memcpy(buildstate.centers->items, ivfcenters, mul_size(buildstate.centers->itemsize, (Size) buildstate.centers->maxlen));
 	buildstate.centers->length = buildstate.centers->maxlen;
-	ivfspool->sortstate = InitBuildSortState(buildstate.sortdesc, sortmem, coordinate);
-	buildstate.sortstate = ivfspool->sortstate;
-	scan = table_beginscan_parallel(ivfspool->heap,
+	if (buildstate.pqSubvectors > 0)
+	{
+		buildstate.pqCentroids = palloc_array_checked(float, IVFPQ_CODEBOOK_LENGTH(buildstate.dimensions));
+		memcpy(buildstate.pqCentroids, pqcentroids, mul_size(IVFPQ_CODEBOOK_LENGTH(buildstate.dimensions), sizeof(float)));
+	}
+	spoolmem = (Size) maintenance_work_mem * 1024 / ivfshared->nspools;
+	buildstate.spool = IvfflatSpoolBegin(buildstate.lists, spoolmem, sharedspool, participant);
+	InitAssignBatch(&buildstate);
+	scan = table_beginscan_parallel(heap,
 									ParallelTableScanFromIvfflatShared(ivfshared)
 #if PG_VERSION_NUM >= 190000
 									,SO_NONE
 #endif
 		);
-	reltuples = table_index_build_scan(ivfspool->heap, ivfspool->index, indexInfo,
+	reltuples = table_index_build_scan(heap, index, indexInfo,
 									   true, progress, BuildCallback,
 									   (void *) &buildstate, scan);
+	FinishBatch(&buildstate);
 
-	/* Execute this worker's part of the sort */
-	tuplesort_performsort(ivfspool->sortstate);
+	/* Write this participant's tuples for the leader */
+	IvfflatSpoolFinish(buildstate.spool);
 
 	/* Record statistics */
 	SpinLockAcquire(&ivfshared->mutex);
@@ -707,8 +917,7 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, S
 	/* Notify leader */
 	ConditionVariableSignal(&ivfshared->workersdonecv);
 
-	/* We can end tuplesorts immediately */
-	tuplesort_end(ivfspool->sortstate);
+	IvfflatSpoolEnd(buildstate.spool);
 
 	FreeBuildState(&buildstate);
 }
@@ -720,15 +929,14 @@ void
 IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 {
 	char	   *sharedquery;
-	IvfflatSpool *ivfspool;
 	IvfflatShared *ivfshared;
-	Sharedsort *sharedsort;
+	IvfflatSharedSpool *sharedspool;
 	char	   *ivfcenters;
+	float	   *pqcentroids;
 	Relation	heapRel;
 	Relation	indexRel;
 	LOCKMODE	heapLockmode;
 	LOCKMODE	indexLockmode;
-	int			sortmem;
 
 	/* Set debug_query_string for individual workers first */
 	sharedquery = shm_toc_lookup(toc, PARALLEL_KEY_QUERY_TEXT, true);
@@ -756,20 +964,15 @@ IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	heapRel = table_open(ivfshared->heaprelid, heapLockmode);
 	indexRel = index_open(ivfshared->indexrelid, indexLockmode);
 
-	/* Initialize worker's own spool */
-	ivfspool = palloc0_object(IvfflatSpool);
-	ivfspool->heap = heapRel;
-	ivfspool->index = indexRel;
-
-	/* Look up shared state private to tuplesort.c */
-	sharedsort = shm_toc_lookup(toc, PARALLEL_KEY_TUPLESORT, false);
-	tuplesort_attach_shared(sharedsort, seg);
+	/* Look up shared spool */
+	sharedspool = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_SPOOL, false);
+	IvfflatSharedSpoolAttach(sharedspool, seg);
 
 	ivfcenters = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_CENTERS, false);
+	pqcentroids = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_CODEBOOKS, true);
 
-	/* Perform sorting */
-	sortmem = maintenance_work_mem / ivfshared->scantuplesortstates;
-	IvfflatParallelScanAndSort(ivfspool, ivfshared, sharedsort, ivfcenters, sortmem, false);
+	/* Perform spooling */
+	IvfflatParallelScanAndSpool(heapRel, indexRel, ivfshared, sharedspool, ivfcenters, pqcentroids, ParallelWorkerNumber, false);
 
 	/* Close relations within worker */
 	index_close(indexRel, indexLockmode);
@@ -808,19 +1011,12 @@ static void
 IvfflatLeaderParticipateAsWorker(IvfflatBuildState * buildstate)
 {
 	IvfflatLeader *ivfleader = buildstate->ivfleader;
-	IvfflatSpool *leaderworker;
-	int			sortmem;
-
-	/* Allocate memory and initialize private spool */
-	leaderworker = palloc0_object(IvfflatSpool);
-	leaderworker->heap = buildstate->heap;
-	leaderworker->index = buildstate->index;
-
-	/* Perform work common to all participants */
-	sortmem = maintenance_work_mem / ivfleader->nparticipanttuplesorts;
-	IvfflatParallelScanAndSort(leaderworker, ivfleader->ivfshared,
-							   ivfleader->sharedsort, ivfleader->ivfcenters,
-							   sortmem, true);
+	IvfflatShared *ivfshared = ivfleader->ivfshared;
+
+	/* Perform work common to all participants, using the last spool */
+	IvfflatParallelScanAndSpool(buildstate->heap, buildstate->index, ivfshared,
+								ivfleader->sharedspool, ivfleader->ivfcenters,
+								ivfleader->pqcentroids, ivfshared->nspools - 1, true);
 }
 
 /*
@@ -830,14 +1026,16 @@ static void
 IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int request)
 {
 	ParallelContext *pcxt;
-	int			scantuplesortstates;
+	int			nspools;
 	Snapshot	snapshot;
 	Size		estivfshared;
-	Size		estsort;
+	Size		estspool;
 	Size		estcenters;
+	Size		estcodebooks = 0;
 	IvfflatShared *ivfshared;
-	Sharedsort *sharedsort;
+	IvfflatSharedSpool *sharedspool;
 	char	   *ivfcenters;
+	float	   *pqcentroids = NULL;
 	IvfflatLeader *ivfleader = palloc0_object(IvfflatLeader);
 	bool		leaderparticipates = true;
 	Size		querylen;
@@ -851,7 +1049,7 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	Assert(request > 0);
 	pcxt = CreateParallelContext("vector", "IvfflatParallelBuildMain", request);
 
-	scantuplesortstates = leaderparticipates ? request + 1 : request;
+	nspools = leaderparticipates ? request + 1 : request;
 
 	/* Get snapshot for table scan */
 	if (!isconcurrent)
@@ -862,12 +1060,20 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	/* Estimate size of workspaces */
 	estivfshared = ParallelEstimateShared(buildstate->heap, snapshot);
 	shm_toc_estimate_chunk(&pcxt->estimator, estivfshared);
-	estsort = tuplesort_estimate_shared(scantuplesortstates);
-	shm_toc_estimate_chunk(&pcxt->estimator, estsort);
+	estspool = IvfflatSharedSpoolEstimate(nspools);
+	shm_toc_estimate_chunk(&pcxt->estimator, estspool);
 	estcenters = mul_size(buildstate->centers->itemsize, (Size) buildstate->centers->maxlen);
 	shm_toc_estimate_chunk(&pcxt->estimator, estcenters);
 	shm_toc_estimate_keys(&pcxt->estimator, 3);
 
+	/* Estimate space for codebooks */
+	if (buildstate->pqSubvectors > 0)
+	{
+		estcodebooks = mul_size(IVFPQ_CODEBOOK_LENGTH(buildstate->dimensions), sizeof(float));
+		shm_toc_estimate_chunk(&pcxt->estimator, estcodebooks);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+
 	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
 	if (debug_query_string)
 	{
@@ -897,7 +1103,7 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	ivfshared->heaprelid = RelationGetRelid(buildstate->heap);
 	ivfshared->indexrelid = RelationGetRelid(buildstate->index);
 	ivfshared->isconcurrent = isconcurrent;
-	ivfshared->scantuplesortstates = scantuplesortstates;
+	ivfshared->nspools = nspools;
 	ConditionVariableInit(&ivfshared->workersdonecv);
 	SpinLockInit(&ivfshared->mutex);
 	/* Initialize mutable state */
@@ -911,18 +1117,25 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 								  ParallelTableScanFromIvfflatShared(ivfshared),
 								  snapshot);
 
-	/* Store shared tuplesort-private state, for which we reserved space */
-	sharedsort = (Sharedsort *) shm_toc_allocate(pcxt->toc, estsort);
-	tuplesort_initialize_shared(sharedsort, scantuplesortstates,
-								pcxt->seg);
+	/* Store shared spool, for which we reserved space */
+	sharedspool = (IvfflatSharedSpool *) shm_toc_allocate(pcxt->toc, estspool);
+	IvfflatSharedSpoolInit(sharedspool, nspools, pcxt->seg);
 
 	ivfcenters = shm_toc_allocate(pcxt->toc, estcenters);
 	memcpy(ivfcenters, buildstate->centers->items, estcenters);
 
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_SHARED, ivfshared);
-	shm_toc_insert(pcxt->toc, PARALLEL_KEY_TUPLESORT, sharedsort);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_SPOOL, sharedspool);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_CENTERS, ivfcenters);
 
+	/* Store codebooks for workers */
+	if (buildstate->pqSubvectors > 0)
+	{
+		pqcentroids = (float *) shm_toc_allocate(pcxt->toc, estcodebooks);
+		memcpy(pqcentroids, buildstate->pqCentroids, estcodebooks);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_CODEBOOKS, pqcentroids);
+	}
+
 	/* Store query string for workers */
 	if (debug_query_string)
 	{
@@ -936,13 +1149,14 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	/* Launch workers, saving status for leader/caller */
 	LaunchParallelWorkers(pcxt);
 	ivfleader->pcxt = pcxt;
-	ivfleader->nparticipanttuplesorts = pcxt->nworkers_launched;
+	ivfleader->nparticipants = pcxt->nworkers_launched;
 	if (leaderparticipates)
-		ivfleader->nparticipanttuplesorts++;
+		ivfleader->nparticipants++;
 	ivfleader->ivfshared = ivfshared;
-	ivfleader->sharedsort = sharedsort;
+	ivfleader->sharedspool = sharedspool;
 	ivfleader->snapshot = snapshot;
 	ivfleader->ivfcenters = ivfcenters;
+	ivfleader->pqcentroids = pqcentroids;
 
 	/* If no workers were successfully launched, back out (do serial build) */
 	if (pcxt->nworkers_launched == 0)
@@ -972,7 +1186,6 @@ static void
 AssignTuples(IvfflatBuildState * buildstate)
 {
 	int			parallel_workers = 0;
-	SortCoordinate coordinate = NULL;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_ASSIGN);
 
@@ -984,26 +1197,22 @@ AssignTuples(IvfflatBuildState * buildstate)
 	if (parallel_workers > 0)
 		IvfflatBeginParallel(buildstate, buildstate->indexInfo->ii_Concurrent, parallel_workers);
 
-	/* Set up coordination state if at least one worker launched */
-	if (buildstate->ivfleader)
-	{
-		coordinate = palloc0_object(SortCoordinateData);
-		coordinate->isWorker = false;
-		coordinate->nParticipants = buildstate->ivfleader->nparticipanttuplesorts;
-		coordinate->sharedsort = buildstate->ivfleader->sharedsort;
-	}
-
-	/* Begin serial/leader tuplesort */
-	buildstate->sortstate = InitBuildSortState(buildstate->sortdesc, maintenance_work_mem, coordinate);
+	/* Begin serial spool, since participants have their own */
+	if (!buildstate->ivfleader)
+		buildstate->spool = IvfflatSpoolBegin(buildstate->lists, (Size) maintenance_work_mem * 1024, NULL, 0);
 
-	/* Add tuples to sort */
+	/* Add tuples to spool */
 	if (buildstate->heap != NULL)
 	{
 		if (buildstate->ivfleader)
 			buildstate->reltuples = ParallelHeapScan(buildstate);
 		else
+		{
+			InitAssignBatch(buildstate);
 			buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
 														   true, true, BuildCallback, (void *) buildstate, NULL);
+			FinishBatch(buildstate);
+		}
 
 #ifdef IVFFLAT_KMEANS_DEBUG
 		PrintKmeansMetrics(buildstate);
@@ -1020,14 +1229,12 @@ CreateEntryPages(IvfflatBuildState * buildstate, ForkNumber forkNum)
 	/* Assign */
 	IvfflatBench("assign tuples", AssignTuples(buildstate));
 
-	/* Sort */
-	IvfflatBench("sort tuples", tuplesort_performsort(buildstate->sortstate));
-
 	/* Load */
 	IvfflatBench("load tuples", InsertTuples(buildstate->index, buildstate, forkNum));
 
-	/* End sort */
-	tuplesort_end(buildstate->sortstate);
+	/* End spool */
+	if (buildstate->spool != NULL)
+		IvfflatSpoolEnd(buildstate->spool);
 
 	/* End parallel build */
 	if (buildstate->ivfleader)
@@ -1048,6 +1255,8 @@ BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 	/* Create pages */
 	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, forkNum);
 	CreateListPages(index, buildstate->centers, buildstate->lists, forkNum, &buildstate->listInfo);
+	if (buildstate->pqSubvectors > 0)
+		IvfpqCreateCodebookPages(index, buildstate->pqCentroids, buildstate->dimensions, buildstate->pqSubvectors, forkNum);
 	CreateEntryPages(buildstate, forkNum);
 
 	/* Write WAL for initialization fork since GenericXLog functions do not */
@@ -10,6 +10,7 @@
 #include "fmgr.h"
 #include "ivfflat.h"
 #include "nodes/pg_list.h"
+#include "optimizer/planmain.h"
 #include "utils/float.h"
 #include "utils/guc.h"
 #include "utils/relcache.h"
@@ -17,6 +18,12 @@
 #include "utils/spccache.h"
 #include "vector.h"
 
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain.h"
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
+
 #if PG_VERSION_NUM < 150000
 #define MarkGUCPrefixReserved(x) EmitWarningsOnPlaceholders(x)
 #endif
@@ -24,6 +31,10 @@
 int			ivfflat_probes;
 int			ivfflat_iterative_scan;
 int			ivfflat_max_probes;
+int			ivfflat_center_cache_size;
+bool		ivfflat_pq_rerank;
+double		ivfflat_adaptive_probes;
+int			ivfflat_group_probes;
 static relopt_kind ivfflat_relopt_kind;
 
 static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
@@ -32,6 +43,33 @@ static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
 	{NULL, 0, false}
 };
 
+#if PG_VERSION_NUM >= 180000
+static explain_per_node_hook_type prev_explain_per_node_hook = NULL;
+
+/*
+ * Show the number of lists probed for EXPLAIN ANALYZE
+ */
+static void
+IvfflatExplainPerNode(PlanState *planstate, List *ancestors, const char *relationship, const char *plan_name, ExplainState *es)
+{
+	if (prev_explain_per_node_hook)
+		prev_explain_per_node_hook(planstate, ancestors, relationship, plan_name, es);
+
+	if (es->analyze && IsA(planstate, IndexScanState))
+	{
+		IndexScanDesc scan = ((IndexScanState *) planstate)->iss_ScanDesc;
+
+		/* Only the leader's scan is available for parallel scans */
+		if (scan != NULL && scan->indexRelation->rd_indam->ambeginscan == ivfflatbeginscan)
+		{
+			IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+			ExplainPropertyInteger("Lists Probed", NULL, so->listsProbed, es);
+		}
+	}
+}
+#endif
+
 /*
  * Initialize index options and variables
  */
@@ -41,6 +79,10 @@ IvfflatInit(void)
 	ivfflat_relopt_kind = add_reloption_kind();
 	add_int_reloption(ivfflat_relopt_kind, "lists", "Number of inverted lists",
 					  IVFFLAT_DEFAULT_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, AccessExclusiveLock);
+	add_int_reloption(ivfflat_relopt_kind, "pq_subvectors", "Number of subvectors for product quantization",
+					  IVFFLAT_DEFAULT_PQ_SUBVECTORS, 0, IVFFLAT_MAX_DIM, AccessExclusiveLock);
+	add_bool_reloption(ivfflat_relopt_kind, "balance_lists", "Splits oversized lists after k-means",
+					   false, AccessExclusiveLock);
 
 	DefineCustomIntVariable("ivfflat.probes", "Sets the number of probes",
 							"Valid range is 1..lists.", &ivfflat_probes,
@@ -55,7 +97,31 @@ IvfflatInit(void)
 							NULL, &ivfflat_max_probes,
 							IVFFLAT_MAX_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	/* Zero disables the cache */
+	DefineCustomIntVariable("ivfflat.center_cache_size", "Sets the max size of centers to cache for each index",
+							"Each connection keeps its own copy of the centers for each index it uses.", &ivfflat_center_cache_size,
+							IVFFLAT_DEFAULT_CENTER_CACHE_SIZE, 0, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("ivfflat.pq_rerank", "Sets whether to rerank product quantization results with exact distances",
+							 NULL, &ivfflat_pq_rerank,
+							 true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* One disables adaptive probes */
+	DefineCustomRealVariable("ivfflat.adaptive_probes", "Sets the max ratio of list distance to closest list distance for additional probes",
+							 "Uses squared distance for L2. Additional probes are limited by ivfflat.max_probes.", &ivfflat_adaptive_probes,
+							 1, 1, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	/* Zero searches all centers */
+	DefineCustomIntVariable("ivfflat.group_probes", "Sets the number of groups of lists to search for the closest lists",
+							"Requires the list locations and group centers to fit into ivfflat.center_cache_size.", &ivfflat_group_probes,
+							0, 0, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("ivfflat");
+
+#if PG_VERSION_NUM >= 180000
+	prev_explain_per_node_hook = explain_per_node_hook;
+	explain_per_node_hook = IvfflatExplainPerNode;
+#endif
 }
 
 /*
@@ -79,6 +145,28 @@ ivfflatbuildphasename(int64 phasenum)
 	}
 }
 
+/*
+ * Get the number of participants a parallel scan is divided among
+ *
+ * Same as get_parallel_divisor in the planner, where the leader contributes
+ * less as it spends more time reading tuples from workers
+ */
+static double
+GetParallelDivisor(int parallelWorkers)
+{
+	double		parallelDivisor = parallelWorkers;
+
+	if (parallel_leader_participation)
+	{
+		double		leaderContribution = 1.0 - (0.3 * parallelWorkers);
+
+		if (leaderContribution > 0)
+			parallelDivisor += leaderContribution;
+	}
+
+	return parallelDivisor;
+}
+
 /*
  * Estimate the cost of an index scan
  */
@@ -143,6 +231,15 @@ ivfflatcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 		costs.indexStartupCost -= (startupPages - path->indexinfo->rel->pages) * spc_seq_page_cost;
 	}
 
+	/* Lists are divided among participants */
+	if (path->path.parallel_workers > 0)
+	{
+		double		parallelDivisor = GetParallelDivisor(path->path.parallel_workers);
+
+		costs.indexStartupCost /= parallelDivisor;
+		costs.indexTotalCost /= parallelDivisor;
+	}
+
 	*indexStartupCost = costs.indexStartupCost;
 	*indexTotalCost = costs.indexTotalCost;
 	*indexSelectivity = costs.indexSelectivity;
@@ -158,6 +255,8 @@ ivfflatoptions(Datum reloptions, bool validate)
 {
 	static const relopt_parse_elt tab[] = {
 		{"lists", RELOPT_TYPE_INT, offsetof(IvfflatOptions, lists)},
+		{"pq_subvectors", RELOPT_TYPE_INT, offsetof(IvfflatOptions, pqSubvectors)},
+		{"balance_lists", RELOPT_TYPE_BOOL, offsetof(IvfflatOptions, balanceLists)},
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
@@ -204,7 +303,7 @@ ivfflathandler(PG_FUNCTION_ARGS)
 		.amstorage = false,
 		.amclusterable = false,
 		.ampredlocks = false,
-		.amcanparallel = false,
+		.amcanparallel = true,
 		.amcanbuildparallel = true,
 		.amcaninclude = false,
 		.amusemaintenanceworkmem = false,
@@ -233,9 +332,9 @@ ivfflathandler(PG_FUNCTION_ARGS)
 		.amendscan = ivfflatendscan,
 		.ammarkpos = NULL,
 		.amrestrpos = NULL,
-		.amestimateparallelscan = NULL,
-		.aminitparallelscan = NULL,
-		.amparallelrescan = NULL,
+		.amestimateparallelscan = ivfflatestimateparallelscan,
+		.aminitparallelscan = ivfflatinitparallelscan,
+		.amparallelrescan = ivfflatparallelrescan,
 		.amtranslatestrategy = NULL,
 		.amtranslatecmptype = NULL,
 	};
@@ -263,7 +362,7 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amstorage = false;
 	amroutine->amclusterable = false;
 	amroutine->ampredlocks = false;
-	amroutine->amcanparallel = false;
+	amroutine->amcanparallel = true;
 #if PG_VERSION_NUM >= 170000
 	amroutine->amcanbuildparallel = true;
 #endif
@@ -305,9 +404,9 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amrestrpos = NULL;
 
 	/* Interface functions to support parallel index scans */
-	amroutine->amestimateparallelscan = NULL;
-	amroutine->aminitparallelscan = NULL;
-	amroutine->amparallelrescan = NULL;
+	amroutine->amestimateparallelscan = ivfflatestimateparallelscan;
+	amroutine->aminitparallelscan = ivfflatinitparallelscan;
+	amroutine->amparallelrescan = ivfflatparallelrescan;
 
 #if PG_VERSION_NUM >= 180000
 	amroutine->amtranslatestrategy = NULL;
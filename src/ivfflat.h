@@ -9,7 +9,9 @@
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
+#include "storage/buffile.h"
 #include "storage/condition_variable.h"
+#include "storage/sharedfileset.h"
 #include "utils/sampling.h"
 #include "utils/tuplesort.h"
 #include "vector.h"
@@ -22,6 +24,10 @@
 #include "common/pg_prng.h"
 #endif
 
+#if PG_VERSION_NUM >= 170000
+#include "storage/read_stream.h"
+#endif
+
 #if PG_VERSION_NUM < 190000
 #include "storage/shmem.h"		/* for add_size()/mul_size() in some versions */
 #endif
@@ -43,7 +49,8 @@ typedef Pointer Item;
 #define IVFFLAT_KMEANS_NORM_PROC 4
 #define IVFFLAT_TYPE_INFO_PROC 5
 
-#define IVFFLAT_VERSION	1
+/* Version 2 stores entry pages in the packed format */
+#define IVFFLAT_VERSION	2
 #define IVFFLAT_MAGIC_NUMBER 0x14FF1A7
 #define IVFFLAT_PAGE_ID	0xFF84
 
@@ -56,6 +63,23 @@ typedef Pointer Item;
 #define IVFFLAT_MIN_LISTS		1
 #define IVFFLAT_MAX_LISTS		32768
 #define IVFFLAT_DEFAULT_PROBES	1
+#define IVFFLAT_DEFAULT_CENTER_CACHE_SIZE	(4 * 1024)
+#define IVFFLAT_GROUPS(lists)	((int) ceil(sqrt((double) (lists))))
+#define IVFFLAT_GROUP_ITERATIONS	4
+#define IVFFLAT_DEFAULT_PQ_SUBVECTORS	0
+
+/* Max ratio of list size to average list size with balance_lists */
+#define IVFFLAT_BALANCE_MAX_RATIO	2.0
+
+/* Distance kernel parameters */
+#define IVFFLAT_KERNEL_TILE				4
+#define IVFFLAT_KERNEL_CENTER_BLOCK		64
+#define IVFFLAT_KERNEL_MAX_VALUES		64
+
+/* Product quantization parameters */
+#define IVFPQ_CENTROIDS			256
+#define IVFPQ_MAX_TRAIN_SAMPLES	(IVFPQ_CENTROIDS * 20)
+#define IVFPQ_KMEANS_ITERATIONS	10
 
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
@@ -64,10 +88,21 @@ typedef Pointer Item;
 #define PROGRESS_IVFFLAT_PHASE_LOAD		4
 
 #define IVFFLAT_LIST_SIZE(size)	add_size(offsetof(IvfflatListData, center), size)
+#define IVFPQ_CODE_SIZE(_subvectors)	(offsetof(IvfpqCode, codes) + (_subvectors))
+#define IVFPQ_CODEBOOK_LENGTH(_dim)	mul_size(IVFPQ_CENTROIDS, (Size) (_dim))
 
 #define IvfflatPageGetOpaque(page)	((IvfflatPageOpaque) PageGetSpecialPointer(page))
 #define IvfflatPageGetMeta(page)	((IvfflatMetaPageData *) PageGetContents(page))
 
+/*
+ * Packed entry pages store heap TIDs in an array after the page header and
+ * values with a fixed stride before the special space, so pd_lower and
+ * pd_upper still mark the free space in the middle. Entry pages from older
+ * indexes store index tuples and have a stride of zero.
+ */
+#define IvfflatPageIsPacked(page)	(IvfflatPageGetOpaque(page)->itemsize != 0)
+#define IvfflatPackedGetTids(page)	((ItemPointer) ((char *) (page) + SizeOfPageHeaderData))
+
 #ifdef IVFFLAT_BENCH
 #define IvfflatBench(name, code) \
 	do { \
@@ -110,6 +145,10 @@ typedef Pointer Item;
 extern int	ivfflat_probes;
 extern int	ivfflat_iterative_scan;
 extern int	ivfflat_max_probes;
+extern int	ivfflat_center_cache_size;
+extern bool ivfflat_pq_rerank;
+extern double ivfflat_adaptive_probes;
+extern int	ivfflat_group_probes;
 
 typedef enum IvfflatIterativeScanMode
 {
@@ -139,22 +178,109 @@ typedef struct IvfflatOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			lists;			/* number of lists */
+	int			pqSubvectors;	/* number of subvectors for product quantization */
+	bool		balanceLists;	/* split oversized lists after k-means */
 }			IvfflatOptions;
 
+/* Location of the tuples for a list in a run of a spool file */
+typedef struct IvfflatSpoolRun
+{
+	int			fileno;
+	off_t		offset;
+	int64		count;
+}			IvfflatSpoolRun;
+
+/* Spool file of a participant in a parallel build */
+typedef struct IvfflatSpoolFileInfo
+{
+	int			nruns;			/* zero if there is no file */
+	int			fileno;			/* location of the runs */
+	off_t		offset;
+}			IvfflatSpoolFileInfo;
+
+typedef struct IvfflatSharedSpool
+{
+	SharedFileSet fileset;
+	int			nspools;
+	IvfflatSpoolFileInfo files[FLEXIBLE_ARRAY_MEMBER];
+}			IvfflatSharedSpool;
+
+/* Header of a spooled tuple, followed by the value */
+typedef struct IvfflatSpoolTuple
+{
+	int32		list;
+	uint32		size;			/* size of value */
+	ItemPointerData tid;
+}			IvfflatSpoolTuple;
+
+#define IvfflatSpoolTupleValue(tuple) ((Pointer) (tuple) + MAXALIGN(sizeof(IvfflatSpoolTuple)))
+
+/*
+ * Groups index tuples by list without sorting them. Tuples are buffered in
+ * memory and written to a temporary file one list at a time when memory
+ * runs out, so each spill adds a run with a segment for every list.
+ */
 typedef struct IvfflatSpool
 {
-	Tuplesortstate *sortstate;
-	Relation	heap;
-	Relation	index;
+	int			lists;
+	Size		memoryLimit;
+	Size		memoryUsed;
+	MemoryContext context;
+	MemoryContext tupleCtx;
+
+	/* Buffered tuples */
+	IvfflatSpoolTuple **tuples;
+	int64		ntuples;
+	int64		maxtuples;
+	char	   *block;
+	Size		blockFree;
+
+	/* Spilled tuples */
+	BufFile    *file;
+	IvfflatSpoolRun *runs;
+	int			nruns;
+
+	/* Parallel builds */
+	IvfflatSharedSpool *shared;
+	int			participant;
 }			IvfflatSpool;
 
+typedef struct IvfflatSpoolSource
+{
+	BufFile    *file;
+	bool		owned;
+	IvfflatSpoolRun *runs;
+	int			nruns;
+}			IvfflatSpoolSource;
+
+/* Returns spooled tuples list by list */
+typedef struct IvfflatSpoolReader
+{
+	int			lists;
+	int			list;
+
+	/* Buffered tuples sorted by list */
+	IvfflatSpoolTuple **tuples;
+	int64	   *listStarts;
+	int64		tupleIndex;
+
+	/* Spilled tuples */
+	IvfflatSpoolSource *sources;
+	int			nsources;
+	int			source;
+	int			run;
+	int64		remaining;
+	IvfflatSpoolTuple *buffer;
+	Size		bufferSize;
+}			IvfflatSpoolReader;
+
 typedef struct IvfflatShared
 {
 	/* Immutable state */
 	Oid			heaprelid;
 	Oid			indexrelid;
 	bool		isconcurrent;
-	int			scantuplesortstates;
+	int			nspools;
 
 	/* Worker progress */
 	ConditionVariable workersdonecv;
@@ -178,13 +304,93 @@ typedef struct IvfflatShared
 typedef struct IvfflatLeader
 {
 	ParallelContext *pcxt;
-	int			nparticipanttuplesorts;
+	int			nparticipants;
 	IvfflatShared *ivfshared;
-	Sharedsort *sharedsort;
+	IvfflatSharedSpool *sharedspool;
 	Snapshot	snapshot;
 	char	   *ivfcenters;
+	float	   *pqcentroids;
 }			IvfflatLeader;
 
+typedef enum IvfflatKmeansTask
+{
+	IVFFLAT_KMEANS_TASK_INIT_DISTANCES,
+	IVFFLAT_KMEANS_TASK_INIT_ASSIGN,
+	IVFFLAT_KMEANS_TASK_CENTER_DISTANCES,
+	IVFFLAT_KMEANS_TASK_CENTER_MIN,
+	IVFFLAT_KMEANS_TASK_ASSIGN,
+	IVFFLAT_KMEANS_TASK_UPDATE_BOUNDS
+}			IvfflatKmeansTask;
+
+/*
+ * The leader runs the serial steps of each k-means iteration and starts
+ * tasks that all participants split into chunks of samples or centers
+ */
+typedef struct IvfflatKmeansShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	bool		isconcurrent;
+	int			numSamples;
+	int			numCenters;
+	int			dimensions;
+	Size		itemsize;
+	int			participants;
+	bool		hamerly;
+
+	/* Task progress */
+	ConditionVariable taskcv;
+	ConditionVariable donecv;
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	int			generation;
+	IvfflatKmeansTask task;
+	int			taskArg;
+	int			nextChunk;
+	int			chunksDone;
+	int			totalChunks;
+	int64		changes;
+	bool		finished;
+}			IvfflatKmeansShared;
+
+typedef enum IvfflatKernelMetric
+{
+	IVFFLAT_KERNEL_L2_SQUARED,
+	IVFFLAT_KERNEL_L2,
+	IVFFLAT_KERNEL_NEGATIVE_INNER_PRODUCT,
+	IVFFLAT_KERNEL_SPHERICAL,
+	IVFFLAT_KERNEL_HAMMING
+}			IvfflatKernelMetric;
+
+typedef enum IvfflatKernelType
+{
+	IVFFLAT_KERNEL_VECTOR,
+	IVFFLAT_KERNEL_HALFVEC,
+	IVFFLAT_KERNEL_BIT
+}			IvfflatKernelType;
+
+/*
+ * Computes distances between a tile of values and a block of centers at a
+ * time, with centers stored contiguously (as floats or packed bits)
+ */
+typedef struct IvfflatKernel
+{
+	IvfflatKernelMetric metric;
+	IvfflatKernelType type;
+	int			dimensions;
+	Size		rowSize;
+
+	/* Centers */
+	int			numCenters;
+	char	   *centers;
+
+	/* Values converted to floats */
+	float	   *scratch;
+}			IvfflatKernel;
+
 typedef struct IvfflatTypeInfo
 {
 	int			maxDimensions;
@@ -206,6 +412,7 @@ typedef struct IvfflatBuildState
 	/* Settings */
 	int			dimensions;
 	int			lists;
+	int			pqSubvectors;
 
 	/* Statistics */
 	double		indtuples;
@@ -223,6 +430,10 @@ typedef struct IvfflatBuildState
 	ListInfo   *listInfo;
 	Size		itemsize;
 
+	/* Product quantization */
+	VectorArray pqSamples;
+	float	   *pqCentroids;
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	double		inertia;
 	double	   *listSums;
@@ -235,10 +446,14 @@ typedef struct IvfflatBuildState
 	double		samplerows;
 	double		rowstoskip;
 
-	/* Sorting */
-	Tuplesortstate *sortstate;
-	TupleDesc	sortdesc;
-	TupleTableSlot *slot;
+	/* Spooling */
+	IvfflatSpool *spool;
+
+	/* Batched assignment */
+	IvfflatKernel *kernel;
+	VectorArray batch;
+	ItemPointerData *batchTids;
+	float	   *batchDistances;
 
 	/* Memory */
 	Size		memoryUsed;
@@ -254,6 +469,10 @@ typedef struct IvfflatMetaPageData
 	uint32		version;
 	uint16		dimensions;
 	uint16		lists;
+	uint16		pqSubvectors;	/* zero if values are stored as is */
+	uint16		unused;
+	BlockNumber codebookPage;
+	BlockNumber entryEnd;		/* first block after entry pages from the build */
 }			IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
@@ -261,7 +480,7 @@ typedef IvfflatMetaPageData * IvfflatMetaPage;
 typedef struct IvfflatPageOpaqueData
 {
 	BlockNumber nextblkno;
-	uint16		unused;
+	uint16		itemsize;		/* stride of values on packed entry pages */
 	uint16		page_id;		/* for identification of IVFFlat indexes */
 }			IvfflatPageOpaqueData;
 
@@ -276,24 +495,121 @@ typedef struct IvfflatListData
 
 typedef IvfflatListData * IvfflatList;
 
+/*
+ * Centers and start pages do not change after the index is built, so each
+ * backend can keep a copy in rd_amcache. The relcache entry is invalidated
+ * when the index is rebuilt.
+ */
+typedef struct IvfflatCenterCache
+{
+	int			lists;
+	Size		itemsize;
+	ListInfo   *listInfo;
+	BlockNumber *startPages;
+	BlockNumber *sortedStartPages;
+	BlockNumber entryEnd;
+	int			dimensions;
+	char	   *centers;		/* NULL when the centers are too large */
+	float	   *codebooks;		/* NULL without product quantization */
+	Size		size;			/* size needed to cache the centers */
+
+	/* Groups of nearby lists, built on first use */
+	bool		groupsBuilt;
+	bool		groupsNoticed;
+	int			groups;
+	char	   *groupCenters;
+	int		   *groupStarts;	/* offset of each group in groupLists */
+	int		   *groupLists;
+}			IvfflatCenterCache;
+
+#define IvfflatCenterCacheGet(cache, i) \
+	PointerGetDatum((cache)->centers + (Size) (i) * (cache)->itemsize)
+#define IvfflatGroupCenterGet(cache, g) \
+	PointerGetDatum((cache)->groupCenters + (Size) (g) * (cache)->itemsize)
+
+/*
+ * With product quantization, entry pages store a code for each value
+ * instead of the value. The code has the closest centroid for each
+ * subvector of the residual (the value minus the list center) and the
+ * distance between the residual and its reconstruction, which bounds the
+ * error of the estimated distance.
+ */
+typedef struct IvfpqCode
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	float		error;
+	uint8		codes[FLEXIBLE_ARRAY_MEMBER];
+}			IvfpqCode;
+
+typedef enum IvfpqMetric
+{
+	IVFPQ_METRIC_L2,
+	IVFPQ_METRIC_INNER_PRODUCT,
+	IVFPQ_METRIC_COSINE
+}			IvfpqMetric;
+
+typedef struct IvfpqScanData
+{
+	IvfpqMetric metric;
+	int			dimensions;
+	int			subvectors;
+	bool		rerank;
+
+	/* Codebooks */
+	float	   *centroids;
+	float	   *norms;
+
+	/* Lookup table for the current list */
+	float	   *table;
+	bool		tableReady;
+	double		listDistance;
+	double		centerNorm;
+	double		queryNorm;
+}			IvfpqScanData;
+
 typedef struct IvfflatScanList
 {
 	pairingheap_node ph_node;
 	BlockNumber startPage;
+	ListInfo	listInfo;
+	int			list;			/* index in the center cache or -1 */
 	double		distance;
 }			IvfflatScanList;
 
+typedef struct IvfflatScanGroup
+{
+	int			group;
+	double		distance;
+}			IvfflatScanGroup;
+
+typedef struct IvfflatScanItem
+{
+	double		distance;
+	ItemPointerData heaptid;
+}			IvfflatScanItem;
+
 typedef struct IvfflatScanOpaqueData
 {
 	const		IvfflatTypeInfo *typeInfo;
 	int			probes;
+	int			firstProbes;
+	int			totalProbes;
 	int			maxProbes;
+	int64		listsProbed;
 	int			dimensions;
 	bool		first;
 	Datum		value;
 	MemoryContext tmpCtx;
 
-	/* Sorting */
+	/* Items */
+	IvfflatScanItem *items;
+	int64		itemCount;
+	int64		maxItems;
+	int64		itemIndex;
+	int64		sortedCount;
+
+	/* Sorting when items exceed work_mem */
+	bool		useSort;
 	Tuplesortstate *sortstate;
 	TupleDesc	tupdesc;
 	TupleTableSlot *vslot;
@@ -309,12 +625,91 @@ typedef struct IvfflatScanOpaqueData
 	/* Lists */
 	pairingheap *listQueue;
 	BlockNumber *listPages;
+	ListInfo   *listInfos;
+	int		   *listIds;
 	int			listIndex;
 	IvfflatScanList *lists;
+	BlockNumber *startPages;	/* sorted start pages of all lists */
+	int			startPageCount;
+	int			maxStartPages;
+	BlockNumber entryEnd;
+
+	/* Product quantization */
+	IvfpqScanData *pq;
 }			IvfflatScanOpaqueData;
 
 typedef IvfflatScanOpaqueData * IvfflatScanOpaque;
 
+typedef struct IvfflatVacuumLists
+{
+	int			lists;
+	int			nextList;
+	BlockNumber *startPages;
+	BlockNumber *sortedStartPages;
+	ListInfo   *listInfos;
+}			IvfflatVacuumLists;
+
+typedef struct IvfflatScanBatch
+{
+	IndexScanDesc scan;
+	int			probes;
+}			IvfflatScanBatch;
+
+/*
+ * Each participant in a parallel scan finds the same lists to probe and
+ * claims them from a shared counter, so Gather Merge can combine results
+ */
+typedef struct IvfflatParallelScanData
+{
+	slock_t		mutex;
+	int			nextList;
+}			IvfflatParallelScanData;
+
+typedef IvfflatParallelScanData * IvfflatParallelScan;
+
+#if PG_VERSION_NUM >= 180000
+#define IvfflatGetParallelScan(pscan)	((IvfflatParallelScan) OffsetToPointer(pscan, (pscan)->ps_offset_am))
+#else
+#define IvfflatGetParallelScan(pscan)	((IvfflatParallelScan) OffsetToPointer(pscan, (pscan)->ps_offset))
+#endif
+
+/* Returns the id of the next list to read and its start page, or -1 */
+typedef int (*IvfflatNextListCallback) (void *arg, BlockNumber *startPage);
+
+/*
+ * Reads the entry pages of a sequence of lists
+ *
+ * The next block of a chain is only known after reading a page, so the read
+ * stream only reads the blocks the build wrote for each chain, which are
+ * consecutive. Pages added by inserts are read directly.
+ */
+typedef struct IvfflatListStream
+{
+	Relation	index;
+	BufferAccessStrategy bas;
+	IvfflatNextListCallback nextlist;
+	void	   *arg;
+	bool		done;
+
+	/* Lists in the order they are read */
+	int		   *listIds;
+	BlockNumber *listStarts;
+	int			listCount;
+	int			maxLists;
+	int			listPos;
+
+#if PG_VERSION_NUM >= 170000
+	ReadStream *stream;
+	BlockNumber *startPages;	/* sorted start pages of all lists */
+	int			lists;
+	BlockNumber entryEnd;
+	BlockNumber listEnd;
+	int			streamPos;
+	BlockNumber streamNext;
+	BlockNumber streamEnd;
+#endif
+}			IvfflatListStream;
+
 #define VECTOR_ARRAY_SIZE(_length, _size) add_size(sizeof(VectorArrayData), mul_size((Size) (_length), MAXALIGN(_size)))
 
 /* Use functions instead of macros to avoid double evaluation */
@@ -341,26 +736,95 @@ VectorArraySet(VectorArray arr, int offset, Pointer val)
 	memcpy(VectorArrayGet(arr, offset), val, size);
 }
 
+/*
+ * Get the number of items on a packed entry page
+ */
+static inline int
+IvfflatPackedCount(Page page)
+{
+	return (((PageHeader) page)->pd_lower - SizeOfPageHeaderData) / sizeof(ItemPointerData);
+}
+
+/*
+ * Get a value on a packed entry page
+ */
+static inline Pointer
+IvfflatPackedGetValue(Page page, int i)
+{
+	return (char *) page + ((PageHeader) page)->pd_special - (Size) (i + 1) * IvfflatPageGetOpaque(page)->itemsize;
+}
+
+/*
+ * Check if a packed entry page has space for another item
+ */
+static inline bool
+IvfflatPackedHasSpace(Page page)
+{
+	PageHeader	phdr = (PageHeader) page;
+
+	return (Size) (phdr->pd_upper - phdr->pd_lower) >= sizeof(ItemPointerData) + IvfflatPageGetOpaque(page)->itemsize;
+}
+
 /* Methods */
 VectorArray VectorArrayInit(int maxlen, int dimensions, Size itemsize);
 void		VectorArrayFree(VectorArray arr);
-void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed);
+void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed, int parallelWorkers, bool isconcurrent);
 FmgrInfo   *IvfflatOptionalProcInfo(Relation index, uint16 procnum);
 Datum		IvfflatNormValue(const IvfflatTypeInfo * typeInfo, Oid collation, Datum value);
 bool		IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 void		IvfflatNormVectors(const IvfflatTypeInfo * typeInfo, Oid collation, VectorArray arr, MemoryContext tmpCtx);
 void		IvfflatCheckMemoryUsage(Size totalSize);
 int			IvfflatGetLists(Relation index);
+bool		IvfflatGetBalanceLists(Relation index);
 void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions);
+BlockNumber IvfflatGetEntryEnd(Relation index);
+IvfflatCenterCache *IvfflatGetCenterCache(Relation index);
+IvfflatCenterCache *IvfflatGetGroupCache(Relation index);
+void		IvfflatBuildCenterGroups(Relation index, IvfflatCenterCache * cache);
+Datum		IvfflatGetListCenter(Relation index, ListInfo listInfo);
+IvfflatListStream *IvfflatBeginListStream(Relation index, BufferAccessStrategy bas, BlockNumber *startPages, int lists, BlockNumber entryEnd, IvfflatNextListCallback nextlist, void *arg, bool maintenance);
+int			IvfflatListStreamNextList(IvfflatListStream * ls);
+Buffer		IvfflatListStreamReadBuffer(IvfflatListStream * ls, BlockNumber blkno);
+void		IvfflatEndListStream(IvfflatListStream * ls);
+int			IvfflatCompareBlockNumbers(const void *a, const void *b);
 void		IvfflatUpdateList(Relation index, ListInfo listInfo, BlockNumber insertPage, BlockNumber originalInsertPage, BlockNumber startPage, ForkNumber forkNum);
 void		IvfflatCommitBuffer(Buffer buf, GenericXLogState *state);
 void		IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum);
 Buffer		IvfflatNewBuffer(Relation index, ForkNumber forkNum);
 void		IvfflatInitPage(Buffer buf, Page page);
+Size		IvfflatPackedItemSize(const IvfflatTypeInfo * typeInfo, int dimensions);
+void		IvfflatPackedAddItem(Page page, ItemPointer heaptid, Pointer value);
 void		IvfflatInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state);
 void		IvfflatInit(void);
+IvfflatKernel *IvfflatKernelCreate(FmgrInfo *procinfo, int dimensions);
+Size		IvfflatKernelCentersSize(IvfflatKernel * kernel, int numCenters);
+void		IvfflatKernelSetCenters(IvfflatKernel * kernel, VectorArray centers, char *ptr);
+void		IvfflatKernelAttachCenters(IvfflatKernel * kernel, int numCenters, char *ptr);
+void		IvfflatKernelDistances(IvfflatKernel * kernel, Pointer *values, int numValues, int centerStart, int centerEnd, float *distances);
+IvfflatSpool *IvfflatSpoolBegin(int lists, Size memoryLimit, IvfflatSharedSpool * shared, int participant);
+void		IvfflatSpoolPut(IvfflatSpool * spool, int list, ItemPointer tid, Pointer value);
+void		IvfflatSpoolFinish(IvfflatSpool * spool);
+void		IvfflatSpoolEnd(IvfflatSpool * spool);
+Size		IvfflatSharedSpoolEstimate(int nspools);
+void		IvfflatSharedSpoolInit(IvfflatSharedSpool * shared, int nspools, dsm_segment *seg);
+void		IvfflatSharedSpoolAttach(IvfflatSharedSpool * shared, dsm_segment *seg);
+IvfflatSpoolReader *IvfflatSpoolBeginRead(IvfflatSpool * spool, IvfflatSharedSpool * shared, int lists);
+bool		IvfflatSpoolGetTuple(IvfflatSpoolReader * reader, int *list, ItemPointer *tid, Pointer *value);
+void		IvfflatSpoolEndRead(IvfflatSpoolReader * reader);
+int			IvfpqGetSubvectors(Relation index);
+IvfpqMetric IvfpqGetMetric(Relation index);
+void		IvfpqGetMetaPageInfo(Relation index, int *subvectors, BlockNumber *codebookPage);
+void		IvfpqTrain(IvfflatBuildState * buildstate);
+void		IvfpqCreateCodebookPages(Relation index, const float *centroids, int dimensions, int subvectors, ForkNumber forkNum);
+void		IvfpqReadCodebooks(Relation index, BlockNumber blkno, float *centroids, Size length);
+const float *IvfpqGetCodebooks(Relation index);
+Pointer		IvfpqEncode(const float *centroids, int subvectors, Vector * value, Vector * center);
+IvfpqScanData *IvfpqBeginScan(Relation index, int dimensions, int subvectors);
+void		IvfpqPrepareList(IvfpqScanData * pq, Vector * center, Vector * query, double listDistance);
+double		IvfpqDistance(IvfpqScanData * pq, Pointer code);
 const		IvfflatTypeInfo *IvfflatGetTypeInfo(Relation index);
 PGDLLEXPORT void IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
 IndexBuildResult *ivfflatbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -377,5 +841,14 @@ IndexScanDesc ivfflatbeginscan(Relation index, int nkeys, int norderbys);
 void		ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
 bool		ivfflatgettuple(IndexScanDesc scan, ScanDirection dir);
 void		ivfflatendscan(IndexScanDesc scan);
+#if PG_VERSION_NUM >= 180000
+Size		ivfflatestimateparallelscan(Relation indexRelation, int nkeys, int norderbys);
+#elif PG_VERSION_NUM >= 170000
+Size		ivfflatestimateparallelscan(int nkeys, int norderbys);
+#else
+Size		ivfflatestimateparallelscan(void);
+#endif
+void		ivfflatinitparallelscan(void *target);
+void		ivfflatparallelrescan(IndexScanDesc scan);
 
 #endif
@@ -12,6 +12,7 @@
 #include "storage/lmgr.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "vectorxlog.h"
 
 /*
  * Find the list that minimizes the distance function
@@ -23,6 +24,7 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
 	FmgrInfo   *procinfo;
 	Oid			collation;
+	IvfflatCenterCache *cache;
 
 	/* Avoid compiler warning */
 	listInfo->blkno = nextblkno;
@@ -31,6 +33,39 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
 	collation = index->rd_indcollation[0];
 
+	/* Use cached centers to avoid reading every list page */
+	cache = IvfflatGetCenterCache(index);
+	if (cache != NULL)
+	{
+		int			closest = 0;
+		Buffer		cbuf;
+		Page		cpage;
+		IvfflatList list;
+
+		for (int i = 0; i < cache->lists; i++)
+		{
+			double		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, values[0], IvfflatCenterCacheGet(cache, i)));
+
+			if (distance < minDistance || i == 0)
+			{
+				closest = i;
+				minDistance = distance;
+			}
+		}
+
+		*listInfo = cache->listInfo[closest];
+
+		/* Insert page can change, so read it from the list */
+		cbuf = ReadBuffer(index, listInfo->blkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, listInfo->offno));
+		*insertPage = list->insertPage;
+		UnlockReleaseBuffer(cbuf);
+
+		return;
+	}
+
 	/* Search all list pages */
 	while (BlockNumberIsValid(nextblkno))
 	{
@@ -66,6 +101,18 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 	}
 }
 
+/*
+ * Check if a page has space for an item
+ */
+static bool
+PageHasSpace(Page page, Size itemsz)
+{
+	if (IvfflatPageIsPacked(page))
+		return IvfflatPackedHasSpace(page);
+
+	return PageGetFreeSpace(page) >= itemsz;
+}
+
 /*
  * Insert a tuple into the index
  */
@@ -80,9 +127,12 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 	Page		page;
 	GenericXLogState *state;
 	Size		itemsz;
+	Pointer		item;
+	int			subvectors;
 	BlockNumber insertPage = InvalidBlockNumber;
 	ListInfo	listInfo;
 	BlockNumber originalInsertPage;
+	bool		compactWal = VectorXLogEnabled(index);
 
 	/* Detoast once for all calls */
 	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
@@ -101,12 +151,23 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 
 	/* Ensure index is valid */
 	IvfflatGetMetaPageInfo(index, NULL, NULL);
+	IvfpqGetMetaPageInfo(index, &subvectors, NULL);
 
 	/* Find the insert page - sets the page and list info */
 	FindInsertPage(index, &value, &insertPage, &listInfo);
 	Assert(BlockNumberIsValid(insertPage));
 	originalInsertPage = insertPage;
 
+	/* Store a code instead of the value with product quantization */
+	if (subvectors > 0)
+	{
+		Datum		center = IvfflatGetListCenter(index, listInfo);
+
+		item = IvfpqEncode(IvfpqGetCodebooks(index), subvectors, DatumGetVector(value), DatumGetVector(center));
+	}
+	else
+		item = DatumGetPointer(value);
+
 	/* Form tuple */
 	itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
 	itup->t_tid = *heap_tid;
@@ -121,10 +182,18 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 		buf = ReadBuffer(index, insertPage);
 		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 
+		/* Use a compact record when the tuple fits on an existing page */
+		if (compactWal && PageHasSpace(BufferGetPage(buf), itemsz))
+		{
+			state = NULL;
+			page = BufferGetPage(buf);
+			break;
+		}
+
 		state = GenericXLogStart(index);
 		page = GenericXLogRegisterBuffer(state, buf, 0);
 
-		if (PageGetFreeSpace(page) >= itemsz)
+		if (PageHasSpace(page, itemsz))
 			break;
 
 		insertPage = IvfflatPageGetOpaque(page)->nextblkno;
@@ -145,9 +214,10 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 			newbuf = IvfflatNewBuffer(index, MAIN_FORKNUM);
 			UnlockRelationForExtension(index, ExclusiveLock);
 
-			/* Init new page */
+			/* Init new page with the same format */
 			newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
 			IvfflatInitPage(newbuf, newpage);
+			IvfflatPageGetOpaque(newpage)->itemsize = IvfflatPageGetOpaque(page)->itemsize;
 
 			/* Update insert page */
 			insertPage = BufferGetBlockNumber(newbuf);
@@ -169,11 +239,24 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
 		}
 	}
 
-	/* Add to next offset */
-	if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
-		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	/* Add the item */
+	if (state == NULL)
+	{
+		if (IvfflatPageIsPacked(page))
+			IvfflatXLogPackedAddItem(index, buf, heap_tid, item);
+		else
+			VectorXLogAddItem(index, buf, (Pointer) itup, itemsz);
+		UnlockReleaseBuffer(buf);
+	}
+	else
+	{
+		if (IvfflatPageIsPacked(page))
+			IvfflatPackedAddItem(page, heap_tid, item);
+		else if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
 
-	IvfflatCommitBuffer(buf, state);
+		IvfflatCommitBuffer(buf, state);
+	}
 
 	/* Update the insert page */
 	if (insertPage != originalInsertPage)
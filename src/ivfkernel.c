@@ -0,0 +1,344 @@
+#include "postgres.h"
+
+#include <math.h>
+
+#include "bitutils.h"
+#include "fmgr.h"
+#include "halfutils.h"
+#include "halfvec.h"
+#include "ivfflat.h"
+#include "utils/varbit.h"
+#include "vector.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define KERNEL_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define KERNEL_TARGET_CLONES
+#endif
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum l2_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_spherical_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_spherical_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum hamming_distance(PG_FUNCTION_ARGS);
+
+/*
+ * Get the metric and type for a distance function
+ *
+ * Returns false if the function is not supported
+ */
+static bool
+GetKernelMetric(FmgrInfo *procinfo, IvfflatKernelMetric * metric, IvfflatKernelType * type)
+{
+	PGFunction	fn = procinfo->fn_addr;
+
+	if (fn == vector_l2_squared_distance || fn == l2_distance || fn == vector_negative_inner_product || fn == vector_spherical_distance)
+		*type = IVFFLAT_KERNEL_VECTOR;
+	else if (fn == halfvec_l2_squared_distance || fn == halfvec_l2_distance || fn == halfvec_negative_inner_product || fn == halfvec_spherical_distance)
+		*type = IVFFLAT_KERNEL_HALFVEC;
+	else if (fn == hamming_distance)
+		*type = IVFFLAT_KERNEL_BIT;
+	else
+		return false;
+
+	if (fn == vector_l2_squared_distance || fn == halfvec_l2_squared_distance)
+		*metric = IVFFLAT_KERNEL_L2_SQUARED;
+	else if (fn == l2_distance || fn == halfvec_l2_distance)
+		*metric = IVFFLAT_KERNEL_L2;
+	else if (fn == vector_negative_inner_product || fn == halfvec_negative_inner_product)
+		*metric = IVFFLAT_KERNEL_NEGATIVE_INNER_PRODUCT;
+	else if (fn == vector_spherical_distance || fn == halfvec_spherical_distance)
+		*metric = IVFFLAT_KERNEL_SPHERICAL;
+	else
+		*metric = IVFFLAT_KERNEL_HAMMING;
+
+	return true;
+}
+
+/*
+ * Create a kernel for a distance function
+ *
+ * Returns NULL if the distance function is not supported, in which case
+ * distances should be computed with the function
+ */
+IvfflatKernel *
+IvfflatKernelCreate(FmgrInfo *procinfo, int dimensions)
+{
+	IvfflatKernel *kernel;
+	IvfflatKernelMetric metric;
+	IvfflatKernelType type;
+
+	if (!GetKernelMetric(procinfo, &metric, &type))
+		return NULL;
+
+	kernel = palloc0_object(IvfflatKernel);
+	kernel->metric = metric;
+	kernel->type = type;
+	kernel->dimensions = dimensions;
+
+	if (type == IVFFLAT_KERNEL_BIT)
+		kernel->rowSize = MAXALIGN(VARBITTOTALLEN(dimensions) - VARHDRSZ - VARBITHDRSZ);
+	else
+		kernel->rowSize = MAXALIGN(mul_size(sizeof(float), (Size) dimensions));
+
+	/* Scratch space to convert halfvec values */
+	if (type == IVFFLAT_KERNEL_HALFVEC)
+		kernel->scratch = palloc_array_checked(float, mul_size(IVFFLAT_KERNEL_MAX_VALUES, (Size) dimensions));
+
+	return kernel;
+}
+
+/*
+ * Get the size of the centers
+ */
+Size
+IvfflatKernelCentersSize(IvfflatKernel * kernel, int numCenters)
+{
+	return mul_size(kernel->rowSize, (Size) numCenters);
+}
+
+/*
+ * Use centers that were already set in another process
+ */
+void
+IvfflatKernelAttachCenters(IvfflatKernel * kernel, int numCenters, char *ptr)
+{
+	kernel->numCenters = numCenters;
+	kernel->centers = ptr;
+}
+
+/*
+ * Get a float row for a value
+ */
+static const float *
+GetFloatRow(IvfflatKernel * kernel, Pointer value, float *scratch)
+{
+	HalfVector *vec;
+
+	if (kernel->type == IVFFLAT_KERNEL_VECTOR)
+		return ((Vector *) value)->x;
+
+	Assert(scratch != NULL);
+	vec = (HalfVector *) value;
+	for (int i = 0; i < kernel->dimensions; i++)
+		scratch[i] = HalfToFloat4(vec->x[i]);
+
+	return scratch;
+}
+
+/*
+ * Convert centers to rows
+ */
+void
+IvfflatKernelSetCenters(IvfflatKernel * kernel, VectorArray centers, char *ptr)
+{
+	IvfflatKernelAttachCenters(kernel, centers->length, ptr);
+
+	for (int i = 0; i < centers->length; i++)
+	{
+		Pointer		center = VectorArrayGet(centers, i);
+		char	   *row = kernel->centers + kernel->rowSize * i;
+
+		if (kernel->type == IVFFLAT_KERNEL_BIT)
+			memcpy(row, VARBITS((VarBit *) center), VARBITBYTES((VarBit *) center));
+		else
+		{
+			const float *x = GetFloatRow(kernel, center, (float *) row);
+
+			if (x != (float *) row)
+				memcpy(row, x, sizeof(float) * kernel->dimensions);
+		}
+	}
+}
+
+/*
+ * Get inner products for a tile of rows and a single center
+ *
+ * Loads of the center are shared by all rows in the tile, which must match
+ * IVFFLAT_KERNEL_TILE
+ */
+KERNEL_TARGET_CLONES static void
+DotTile(int dim, const float *a0, const float *a1, const float *a2, const float *a3, const float *cx, float *out)
+{
+	float		s0 = 0.0;
+	float		s1 = 0.0;
+	float		s2 = 0.0;
+	float		s3 = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		c = cx[i];
+
+		s0 += a0[i] * c;
+		s1 += a1[i] * c;
+		s2 += a2[i] * c;
+		s3 += a3[i] * c;
+	}
+
+	out[0] = s0;
+	out[1] = s1;
+	out[2] = s2;
+	out[3] = s3;
+}
+
+/*
+ * Get squared L2 distances for a tile of rows and a single center
+ *
+ * Differences are accumulated directly instead of expanding to norms and
+ * inner products, which loses precision when values are close to centers
+ */
+KERNEL_TARGET_CLONES static void
+L2SquaredTile(int dim, const float *a0, const float *a1, const float *a2, const float *a3, const float *cx, float *out)
+{
+	float		s0 = 0.0;
+	float		s1 = 0.0;
+	float		s2 = 0.0;
+	float		s3 = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		c = cx[i];
+		float		d0 = a0[i] - c;
+		float		d1 = a1[i] - c;
+		float		d2 = a2[i] - c;
+		float		d3 = a3[i] - c;
+
+		s0 += d0 * d0;
+		s1 += d1 * d1;
+		s2 += d2 * d2;
+		s3 += d3 * d3;
+	}
+
+	out[0] = s0;
+	out[1] = s1;
+	out[2] = s2;
+	out[3] = s3;
+}
+
+/*
+ * Turn an inner product or squared L2 distance into a distance
+ */
+static inline float
+FinishDistance(IvfflatKernelMetric metric, float result)
+{
+	double		distance;
+
+	if (metric == IVFFLAT_KERNEL_L2_SQUARED)
+		return result;
+
+	if (metric == IVFFLAT_KERNEL_L2)
+		return (float) sqrt((double) result);
+
+	if (metric == IVFFLAT_KERNEL_NEGATIVE_INNER_PRODUCT)
+		return -result;
+
+	/* Spherical */
+	distance = (double) result;
+
+	/* Prevent NaN with acos with loss of precision */
+	if (distance > 1)
+		distance = 1;
+	else if (distance < -1)
+		distance = -1;
+
+	return (float) (acos(distance) / M_PI);
+}
+
+/*
+ * Compute distances for bit values
+ */
+static void
+BitDistances(IvfflatKernel * kernel, Pointer *values, int numValues, int centerStart, int centerEnd, float *distances)
+{
+	int			numColumns = centerEnd - centerStart;
+	uint32		bytes = (uint32) ((kernel->dimensions + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+
+	for (int blockStart = centerStart; blockStart < centerEnd; blockStart += IVFFLAT_KERNEL_CENTER_BLOCK)
+	{
+		int			blockEnd = Min(blockStart + IVFFLAT_KERNEL_CENTER_BLOCK, centerEnd);
+
+		for (int i = 0; i < numValues; i++)
+		{
+			unsigned char *ax = VARBITS((VarBit *) values[i]);
+			float	   *row = distances + (Size) i * numColumns;
+
+			for (int j = blockStart; j < blockEnd; j++)
+			{
+				unsigned char *bx = (unsigned char *) (kernel->centers + kernel->rowSize * j);
+
+				row[j - centerStart] = (float) BitHammingDistance(bytes, ax, bx, 0);
+			}
+		}
+	}
+}
+
+/*
+ * Compute distances between values and a range of centers
+ *
+ * Distances are stored by row for each value. Centers are processed in
+ * blocks that stay in cache while all values are compared to them, a tile
+ * of values at a time.
+ */
+void
+IvfflatKernelDistances(IvfflatKernel * kernel, Pointer *values, int numValues, int centerStart, int centerEnd, float *distances)
+{
+	int			dim = kernel->dimensions;
+	int			numColumns = centerEnd - centerStart;
+	bool		l2 = kernel->metric == IVFFLAT_KERNEL_L2_SQUARED || kernel->metric == IVFFLAT_KERNEL_L2;
+	const float *a[IVFFLAT_KERNEL_MAX_VALUES + IVFFLAT_KERNEL_TILE];
+
+	Assert(numValues <= IVFFLAT_KERNEL_MAX_VALUES);
+
+	if (kernel->type == IVFFLAT_KERNEL_BIT)
+	{
+		BitDistances(kernel, values, numValues, centerStart, centerEnd, distances);
+		return;
+	}
+
+	/* Prepare rows once */
+	for (int i = 0; i < numValues; i++)
+	{
+		float	   *scratch = kernel->scratch != NULL ? kernel->scratch + (Size) i * dim : NULL;
+
+		a[i] = GetFloatRow(kernel, values[i], scratch);
+	}
+
+	/* Repeat last row for partial tiles */
+	for (int i = numValues; i < numValues + IVFFLAT_KERNEL_TILE; i++)
+		a[i] = a[numValues - 1];
+
+	for (int blockStart = centerStart; blockStart < centerEnd; blockStart += IVFFLAT_KERNEL_CENTER_BLOCK)
+	{
+		int			blockEnd = Min(blockStart + IVFFLAT_KERNEL_CENTER_BLOCK, centerEnd);
+
+		for (int tileStart = 0; tileStart < numValues; tileStart += IVFFLAT_KERNEL_TILE)
+		{
+			int			tileSize = Min(IVFFLAT_KERNEL_TILE, numValues - tileStart);
+			const float **ta = a + tileStart;
+
+			for (int j = blockStart; j < blockEnd; j++)
+			{
+				const float *cx = (const float *) (kernel->centers + kernel->rowSize * j);
+				float		results[IVFFLAT_KERNEL_TILE];
+
+				if (l2)
+					L2SquaredTile(dim, ta[0], ta[1], ta[2], ta[3], cx, results);
+				else
+					DotTile(dim, ta[0], ta[1], ta[2], ta[3], cx, results);
+
+				for (int t = 0; t < tileSize; t++)
+					distances[(Size) (tileStart + t) * numColumns + (j - centerStart)] = FinishDistance(kernel->metric, results[t]);
+			}
+		}
+	}
+}
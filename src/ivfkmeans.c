@@ -5,80 +5,930 @@
 #include <math.h>
 
 #include "access/genam.h"
+#include "access/parallel.h"
 #include "fmgr.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
+#include "storage/condition_variable.h"
+#include "storage/spin.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
 #include "utils/relcache.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
 #endif
 
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#else
+#include "pgstat.h"
+#endif
+
 /*
- * Initialize with kmeans++
- *
- * https://theory.stanford.edu/~sergei/papers/kMeansPP-soda.pdf
+ * Norm centers
+ */
+static void
+NormCenters(const IvfflatTypeInfo * typeInfo, Oid collation, VectorArray centers)
+{
+	MemoryContext normCtx = AllocSetContextCreate(CurrentMemoryContext,
+												  "Ivfflat norm temporary context",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	IvfflatNormVectors(typeInfo, collation, centers, normCtx);
+	MemoryContextDelete(normCtx);
+}
+
+/*
+ * Quick approach if we have no data
+ */
+static void
+RandomCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+{
+	int			dimensions = centers->dim;
+	FmgrInfo   *normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	float	   *x = palloc_array_checked(float, (Size) dimensions);
+
+	/* Fill with random data */
+	while (centers->length < centers->maxlen)
+	{
+		Pointer		center = VectorArrayGet(centers, centers->length);
+
+		for (int i = 0; i < dimensions; i++)
+			x[i] = (float) RandomDouble();
+
+		typeInfo->updateCenter(center, dimensions, x);
+
+		centers->length++;
+	}
+
+	if (normprocinfo != NULL)
+		NormCenters(typeInfo, collation, centers);
+}
+
+#ifdef IVFFLAT_MEMORY
+/*
+ * Show memory usage
  */
 static void
-InitCenters(Relation index, VectorArray samples, VectorArray centers, float *lowerBound)
+ShowMemoryUsage(MemoryContext context, Size estimatedSize)
+{
+	elog(INFO, "total memory: %zu MB",
+		 MemoryContextMemAllocated(context, true) / (1024 * 1024));
+	elog(INFO, "estimated memory: %zu MB", estimatedSize / (1024 * 1024));
+}
+#endif
+
+#define PARALLEL_KEY_KMEANS_SHARED		UINT64CONST(0xA000000000000011)
+#define PARALLEL_KEY_KMEANS_SAMPLES		UINT64CONST(0xA000000000000012)
+#define PARALLEL_KEY_KMEANS_CENTERS		UINT64CONST(0xA000000000000013)
+#define PARALLEL_KEY_KMEANS_ARRAYS		UINT64CONST(0xA000000000000014)
+
+/* Chunks per participant for dynamic load balancing */
+#define KMEANS_CHUNKS_PER_PARTICIPANT	16
+
+/* Iterations of 2-means when splitting a list */
+#define KMEANS_SPLIT_ITERATIONS			10
+
+typedef struct IvfflatKmeansState
 {
+	/* Support functions */
 	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
 	Oid			collation;
-	float	   *weight = palloc_array_checked(float, (Size) samples->length);
-	int			numCenters = centers->maxlen;
-	int			numSamples = samples->length;
+	const		IvfflatTypeInfo *typeInfo;
 
-	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
-	collation = index->rd_indcollation[0];
+	/* Sizes */
+	int			numSamples;
+	int			numCenters;
+	int			dimensions;
+	int			participants;
+	int			sampleChunks;
+	int			centerChunks;
 
-	/* Choose an initial center uniformly at random */
-	VectorArraySet(centers, 0, VectorArrayGet(samples, (int) ((uint32) RandomInt() % (uint32) samples->length)));
-	centers->length++;
+	/* Use a single lower bound per sample */
+	bool		hamerly;
 
-	for (int i = 0; i < numSamples; i++)
-		weight[i] = FLT_MAX;
+	/* Split oversized lists after converging */
+	bool		balance;
 
-	for (int i = 0; i < numCenters; i++)
+	/* Arrays */
+	VectorArray samples;
+	VectorArray centers;
+	VectorArray newCenters;
+	float	   *lowerBound;
+	float	   *upperBound;
+	int		   *closestCenters;
+	float	   *halfcdist;
+	float	   *s;
+	float	   *newcdist;
+	float	   *agg;
+	int		   *centerCounts;
+	float	   *weight;
+	double	   *chunkSums;
+
+	/* Distance kernel (NULL if not supported) */
+	IvfflatKernel *kernel;
+	Size		kernelCentersSize;
+	char	   *kernelCenters;
+	float	   *tileDistances;
+
+	/* Parallel state */
+	IvfflatKmeansShared *shared;
+	int			participant;
+}			IvfflatKmeansState;
+
+/*
+ * Get the size of arrays
+ */
+static Size
+KmeansArraysSize(int numSamples, int numCenters, int dimensions, Size itemsize, int participants, int sampleChunks, bool hamerly, Size kernelCentersSize)
+{
+	Size		size = 0;
+
+	/* New centers */
+	size = add_size(size, MAXALIGN(mul_size((Size) numCenters, itemsize)));
+	/* Lower bounds (one per center for Elkan, one per sample for Hamerly) */
+	size = add_size(size, MAXALIGN(mul_size(sizeof(float), mul_size((Size) numSamples, hamerly ? 1 : (Size) numCenters))));
+	/* Upper bound */
+	size = add_size(size, MAXALIGN(mul_size(sizeof(float), (Size) numSamples)));
+	/* Closest centers */
+	size = add_size(size, MAXALIGN(mul_size(sizeof(int), (Size) numSamples)));
+	/* Half center distances (Elkan only) */
+	if (!hamerly)
+		size = add_size(size, MAXALIGN(mul_size(sizeof(float), mul_size((Size) numCenters, (Size) numCenters))));
+	/* s and new center distances */
+	size = add_size(size, mul_size(MAXALIGN(mul_size(sizeof(float), (Size) numCenters)), 2));
+	/* Sums and counts for each participant */
+	size = add_size(size, MAXALIGN(mul_size(sizeof(float), mul_size((Size) participants, mul_size((Size) numCenters, (Size) dimensions)))));
+	size = add_size(size, MAXALIGN(mul_size(sizeof(int), mul_size((Size) participants, (Size) numCenters))));
+	/* Weights and chunk sums for kmeans++ */
+	size = add_size(size, MAXALIGN(mul_size(sizeof(float), (Size) numSamples)));
+	size = add_size(size, MAXALIGN(mul_size(sizeof(double), (Size) sampleChunks)));
+	/* Centers for distance kernel */
+	size = add_size(size, MAXALIGN(kernelCentersSize));
+
+	return size;
+}
+
+/*
+ * Set arrays from a single allocation
+ */
+static void
+SetKmeansArrays(IvfflatKmeansState * state, char *ptr, Size itemsize)
+{
+	Size		numSamples = state->numSamples;
+	Size		numCenters = state->numCenters;
+
+	state->newCenters = palloc_object(VectorArrayData);
+	state->newCenters->length = state->numCenters;
+	state->newCenters->maxlen = state->numCenters;
+	state->newCenters->dim = state->dimensions;
+	state->newCenters->itemsize = itemsize;
+	state->newCenters->items = ptr;
+	ptr += MAXALIGN(numCenters * itemsize);
+
+	state->lowerBound = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * numSamples * (state->hamerly ? 1 : numCenters));
+	state->upperBound = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * numSamples);
+	state->closestCenters = (int *) ptr;
+	ptr += MAXALIGN(sizeof(int) * numSamples);
+	if (state->hamerly)
+		state->halfcdist = NULL;
+	else
 	{
-		int			j;
-		double		sum;
-		double		choice;
+		state->halfcdist = (float *) ptr;
+		ptr += MAXALIGN(sizeof(float) * numCenters * numCenters);
+	}
+	state->s = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * numCenters);
+	state->newcdist = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * numCenters);
+	state->agg = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * state->participants * numCenters * state->dimensions);
+	state->centerCounts = (int *) ptr;
+	ptr += MAXALIGN(sizeof(int) * state->participants * numCenters);
+	state->weight = (float *) ptr;
+	ptr += MAXALIGN(sizeof(float) * numSamples);
+	state->chunkSums = (double *) ptr;
+	ptr += MAXALIGN(sizeof(double) * state->sampleChunks);
+	state->kernelCenters = ptr;
+
+	/* Centers are set by the leader */
+	if (state->kernel != NULL)
+		IvfflatKernelAttachCenters(state->kernel, state->numCenters, state->kernelCenters);
+}
 
-		CHECK_FOR_INTERRUPTS();
+/*
+ * Create a vector array for existing items
+ */
+static VectorArray
+KmeansVectorArray(int length, int dimensions, Size itemsize, char *items)
+{
+	VectorArray arr = palloc_object(VectorArrayData);
 
-		sum = 0.0;
+	arr->length = length;
+	arr->maxlen = length;
+	arr->dim = dimensions;
+	arr->itemsize = itemsize;
+	arr->items = items;
 
-		for (j = 0; j < numSamples; j++)
-		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(samples, j));
-			double		distance;
+	return arr;
+}
+
+/*
+ * Set the number of participants
+ */
+static void
+SetKmeansParticipants(IvfflatKmeansState * state, int participants)
+{
+	state->participants = participants;
+	state->sampleChunks = Max(Min(state->numSamples, participants * KMEANS_CHUNKS_PER_PARTICIPANT), 1);
+	state->centerChunks = Max(Min(state->numCenters, participants * KMEANS_CHUNKS_PER_PARTICIPANT), 1);
+}
 
-			/* Only need to compute distance for new center */
-			/* TODO Use triangle inequality to reduce distance calculations */
-			distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, i))));
+/*
+ * Initialize state
+ */
+static void
+InitKmeansState(IvfflatKmeansState * state, Relation index, const IvfflatTypeInfo * typeInfo, int numSamples, int numCenters, int dimensions, int participants, bool hamerly)
+{
+	state->procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	state->normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	state->collation = index->rd_indcollation[0];
+	state->typeInfo = typeInfo;
+	state->numSamples = numSamples;
+	state->numCenters = numCenters;
+	state->dimensions = dimensions;
+	SetKmeansParticipants(state, participants);
+	state->hamerly = hamerly;
+	state->balance = IvfflatGetBalanceLists(index);
+	state->kernel = IvfflatKernelCreate(state->procinfo, dimensions);
+	state->kernelCentersSize = 0;
+	state->tileDistances = NULL;
+	if (state->kernel != NULL)
+	{
+		state->kernelCentersSize = IvfflatKernelCentersSize(state->kernel, numCenters);
+		state->tileDistances = palloc_array_checked(float, mul_size(IVFFLAT_KERNEL_TILE, (Size) numCenters));
+	}
+	state->shared = NULL;
+	state->participant = 0;
+}
 
+/*
+ * Get the range of a chunk
+ */
+static inline void
+GetChunkRange(int total, int chunks, int chunk, int *start, int *end)
+{
+	*start = (int) ((int64) total * chunk / chunks);
+	*end = (int) ((int64) total * (chunk + 1) / chunks);
+}
+
+/*
+ * Compute the distance from samples to a new center for kmeans++
+ *
+ * Returns the sum of weights
+ */
+static double
+InitDistances(IvfflatKmeansState * state, int center, int start, int end)
+{
+	Datum		centerDatum = PointerGetDatum(VectorArrayGet(state->centers, center));
+	double		sum = 0.0;
+
+	for (int j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->samples, j));
+		double		distance;
+
+		/* Only need to compute distance for new center */
+		/* TODO Use triangle inequality to reduce distance calculations */
+		distance = DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, centerDatum));
+
+		if (state->hamerly)
+		{
+			/* Track the closest and second closest centers */
+			if (distance < state->upperBound[j])
+			{
+				state->lowerBound[j] = state->upperBound[j];
+				state->upperBound[j] = (float) distance;
+				state->closestCenters[j] = center;
+			}
+			else if (distance < state->lowerBound[j])
+				state->lowerBound[j] = (float) distance;
+		}
+		else
+		{
 			/* Set lower bound */
-			lowerBound[(Size) j * (Size) numCenters + (Size) i] = (float) distance;
+			state->lowerBound[(Size) j * (Size) state->numCenters + (Size) center] = (float) distance;
+		}
+
+		/* Use distance squared for weighted probability distribution */
+		distance *= distance;
 
-			/* Use distance squared for weighted probability distribution */
-			distance *= distance;
+		if (distance < state->weight[j])
+			state->weight[j] = (float) distance;
 
-			if (distance < weight[j])
-				weight[j] = (float) distance;
+		sum += state->weight[j];
+	}
+
+	return sum;
+}
+
+/*
+ * Assign each sample to its closest initial center
+ */
+static void
+InitAssign(IvfflatKmeansState * state, int start, int end)
+{
+	int			numCenters = state->numCenters;
+
+	for (int j = start; j < end; j++)
+	{
+		float		minDistance = FLT_MAX;
+		int			closestCenter = 0;
+
+		/* Find closest center */
+		for (int k = 0; k < numCenters; k++)
+		{
+			/* TODO Use Lemma 1 in k-means++ initialization */
+			float		distance = state->lowerBound[(Size) j * (Size) numCenters + (Size) k];
 
-			sum += weight[j];
+			if (distance < minDistance)
+			{
+				minDistance = distance;
+				closestCenter = k;
+			}
 		}
 
+		state->upperBound[j] = minDistance;
+		state->closestCenters[j] = closestCenter;
+	}
+}
+
+/*
+ * Get distances from a tile of centers to centers with the kernel
+ */
+static float *
+GetTileDistances(IvfflatKmeansState * state, int tileStart, int tileEnd, int centerStart)
+{
+	Pointer		values[IVFFLAT_KERNEL_TILE];
+
+	for (int j = tileStart; j < tileEnd; j++)
+		values[j - tileStart] = VectorArrayGet(state->centers, j);
+
+	IvfflatKernelDistances(state->kernel, values, tileEnd - tileStart, centerStart, state->numCenters, state->tileDistances);
+
+	return state->tileDistances;
+}
+
+/*
+ * Compute half the distance between centers
+ */
+static void
+ComputeCenterDistances(IvfflatKmeansState * state, int start, int end)
+{
+	int			numCenters = state->numCenters;
+
+	if (state->kernel != NULL)
+	{
+		for (int tileStart = start; tileStart < end; tileStart += IVFFLAT_KERNEL_TILE)
+		{
+			int			tileEnd = Min(tileStart + IVFFLAT_KERNEL_TILE, end);
+			int			centerStart = tileStart + 1;
+			int			numColumns = numCenters - centerStart;
+			float	   *distances;
+
+			if (numColumns <= 0)
+				break;
+
+			/* Only need distances above the diagonal */
+			distances = GetTileDistances(state, tileStart, tileEnd, centerStart);
+
+			for (int j = tileStart; j < tileEnd; j++)
+			{
+				for (int k = j + 1; k < numCenters; k++)
+				{
+					float		distance = 0.5f * distances[(Size) (j - tileStart) * numColumns + (k - centerStart)];
+
+					state->halfcdist[(Size) j * (Size) numCenters + (Size) k] = distance;
+					state->halfcdist[(Size) k * (Size) numCenters + (Size) j] = distance;
+				}
+			}
+		}
+
+		return;
+	}
+
+	for (int j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->centers, j));
+
+		for (int k = j + 1; k < numCenters; k++)
+		{
+			float		distance = (float) (0.5 * DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k)))));
+
+			state->halfcdist[(Size) j * (Size) numCenters + (Size) k] = distance;
+			state->halfcdist[(Size) k * (Size) numCenters + (Size) j] = distance;
+		}
+	}
+}
+
+/*
+ * For all centers c, compute s(c)
+ */
+static void
+ComputeCenterMin(IvfflatKmeansState * state, int start, int end)
+{
+	int			numCenters = state->numCenters;
+
+	/* Hamerly does not store distances between centers */
+	if (state->hamerly && state->kernel != NULL)
+	{
+		for (int tileStart = start; tileStart < end; tileStart += IVFFLAT_KERNEL_TILE)
+		{
+			int			tileEnd = Min(tileStart + IVFFLAT_KERNEL_TILE, end);
+			float	   *distances = GetTileDistances(state, tileStart, tileEnd, 0);
+
+			for (int j = tileStart; j < tileEnd; j++)
+			{
+				float	   *row = distances + (Size) (j - tileStart) * numCenters;
+				float		minDistance = FLT_MAX;
+
+				for (int k = 0; k < numCenters; k++)
+				{
+					if (k != j && row[k] < minDistance)
+						minDistance = row[k];
+				}
+
+				state->s[j] = minDistance == FLT_MAX ? FLT_MAX : 0.5f * minDistance;
+			}
+		}
+
+		return;
+	}
+
+	for (int j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->centers, j));
+		float		minDistance = FLT_MAX;
+
+		for (int k = 0; k < numCenters; k++)
+		{
+			float		distance;
+
+			if (j == k)
+				continue;
+
+			/* Hamerly does not store distances between centers */
+			if (state->hamerly)
+				distance = (float) (0.5 * DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k)))));
+			else
+				distance = state->halfcdist[(Size) j * (Size) numCenters + (Size) k];
+			if (distance < minDistance)
+				minDistance = distance;
+		}
+
+		state->s[j] = minDistance;
+	}
+}
+
+/*
+ * Assign samples to the closest center and add them to the sums
+ *
+ * Returns the number of changes
+ */
+static int64
+AssignSamples(IvfflatKmeansState * state, bool rjreset, int start, int end)
+{
+	int			numCenters = state->numCenters;
+	float	   *lowerBound = state->lowerBound;
+	float	   *upperBound = state->upperBound;
+	int		   *closestCenters = state->closestCenters;
+	float	   *halfcdist = state->halfcdist;
+	float	   *agg = state->agg + (Size) state->participant * (Size) numCenters * (Size) state->dimensions;
+	int		   *centerCounts = state->centerCounts + (Size) state->participant * (Size) numCenters;
+	int64		changes = 0;
+
+	for (int j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->samples, j));
+		bool		rj;
+
+		/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
+		if (upperBound[j] <= state->s[closestCenters[j]])
+			goto sum;
+
+		rj = rjreset;
+
+		for (int k = 0; k < numCenters; k++)
+		{
+			float		dxcx;
+
+			/* Step 3: For all remaining points x and centers c */
+			if (k == closestCenters[j])
+				continue;
+
+			if (upperBound[j] <= lowerBound[(Size) j * (Size) numCenters + (Size) k])
+				continue;
+
+			if (upperBound[j] <= halfcdist[(Size) closestCenters[j] * (Size) numCenters + (Size) k])
+				continue;
+
+			/* Step 3a */
+			if (rj)
+			{
+				dxcx = (float) DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, closestCenters[j]))));
+
+				/* d(x,c(x)) computed, which is a form of d(x,c) */
+				lowerBound[(Size) j * (Size) numCenters + (Size) closestCenters[j]] = dxcx;
+				upperBound[j] = dxcx;
+
+				rj = false;
+			}
+			else
+				dxcx = upperBound[j];
+
+			/* Step 3b */
+			if (dxcx > lowerBound[(Size) j * (Size) numCenters + (Size) k] || dxcx > halfcdist[(Size) closestCenters[j] * (Size) numCenters + (Size) k])
+			{
+				float		dxc = (float) DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k))));
+
+				/* d(x,c) calculated */
+				lowerBound[(Size) j * (Size) numCenters + (Size) k] = dxc;
+
+				if (dxc < dxcx)
+				{
+					closestCenters[j] = k;
+
+					/* c(x) changed */
+					upperBound[j] = dxc;
+
+					changes++;
+				}
+			}
+		}
+
+sum:
+		/* Increment sum and count of closest center */
+		state->typeInfo->sumCenter(DatumGetPointer(vec), agg + (Size) closestCenters[j] * (Size) state->dimensions);
+		centerCounts[closestCenters[j]]++;
+	}
+
+	return changes;
+}
+
+/*
+ * Assign samples to the closest center with Hamerly bounds
+ *
+ * Returns the number of changes
+ */
+static int64
+HamerlyAssignSamples(IvfflatKmeansState * state, int start, int end)
+{
+	int			numCenters = state->numCenters;
+	float	   *lowerBound = state->lowerBound;
+	float	   *upperBound = state->upperBound;
+	int		   *closestCenters = state->closestCenters;
+	float	   *agg = state->agg + (Size) state->participant * (Size) numCenters * (Size) state->dimensions;
+	int		   *centerCounts = state->centerCounts + (Size) state->participant * (Size) numCenters;
+	int64		changes = 0;
+
+	for (int j = start; j < end; j++)
+	{
+		Datum		vec = PointerGetDatum(VectorArrayGet(state->samples, j));
+		float		m = Max(state->s[closestCenters[j]], lowerBound[j]);
+		float		minDistance;
+		float		secondDistance;
+		int			closestCenter;
+
+		if (upperBound[j] <= m)
+			goto sum;
+
+		/* Tighten upper bound */
+		upperBound[j] = (float) DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, closestCenters[j]))));
+
+		if (upperBound[j] <= m)
+			goto sum;
+
+		/* Find the closest and second closest centers */
+		minDistance = FLT_MAX;
+		secondDistance = FLT_MAX;
+		closestCenter = closestCenters[j];
+
+		if (state->kernel != NULL)
+		{
+			Pointer		value = DatumGetPointer(vec);
+
+			IvfflatKernelDistances(state->kernel, &value, 1, 0, numCenters, state->tileDistances);
+		}
+
+		for (int k = 0; k < numCenters; k++)
+		{
+			float		distance;
+
+			if (k == closestCenters[j])
+				distance = upperBound[j];
+			else if (state->kernel != NULL)
+				distance = state->tileDistances[k];
+			else
+				distance = (float) DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, vec, PointerGetDatum(VectorArrayGet(state->centers, k))));
+
+			if (distance < minDistance)
+			{
+				secondDistance = minDistance;
+				minDistance = distance;
+				closestCenter = k;
+			}
+			else if (distance < secondDistance)
+				secondDistance = distance;
+		}
+
+		if (closestCenter != closestCenters[j])
+		{
+			closestCenters[j] = closestCenter;
+			changes++;
+		}
+
+		upperBound[j] = minDistance;
+		lowerBound[j] = secondDistance;
+
+sum:
+		/* Increment sum and count of closest center */
+		state->typeInfo->sumCenter(DatumGetPointer(vec), agg + (Size) closestCenters[j] * (Size) state->dimensions);
+		centerCounts[closestCenters[j]]++;
+	}
+
+	return changes;
+}
+
+/*
+ * Update Hamerly bounds after centers move
+ */
+static void
+HamerlyUpdateBounds(IvfflatKmeansState * state, int start, int end)
+{
+	float		maxDistance = 0;
+	float		secondDistance = 0;
+	int			maxCenter = -1;
+
+	/* Find the two centers that moved the most */
+	for (int k = 0; k < state->numCenters; k++)
+	{
+		float		distance = state->newcdist[k];
+
+		if (distance > maxDistance)
+		{
+			secondDistance = maxDistance;
+			maxDistance = distance;
+			maxCenter = k;
+		}
+		else if (distance > secondDistance)
+			secondDistance = distance;
+	}
+
+	for (int j = start; j < end; j++)
+	{
+		int			closestCenter = state->closestCenters[j];
+
+		state->upperBound[j] += state->newcdist[closestCenter];
+		state->lowerBound[j] -= closestCenter == maxCenter ? secondDistance : maxDistance;
+	}
+}
+
+/*
+ * Update bounds after centers move (steps 5 and 6)
+ */
+static void
+UpdateBounds(IvfflatKmeansState * state, int start, int end)
+{
+	int			numCenters = state->numCenters;
+
+	if (state->hamerly)
+	{
+		HamerlyUpdateBounds(state, start, end);
+		return;
+	}
+
+	for (int j = start; j < end; j++)
+	{
+		for (int k = 0; k < numCenters; k++)
+		{
+			float		distance = state->lowerBound[(Size) j * (Size) numCenters + (Size) k] - state->newcdist[k];
+
+			if (distance < 0)
+				distance = 0;
+
+			state->lowerBound[(Size) j * (Size) numCenters + (Size) k] = distance;
+		}
+
+		/* We reset r(x) before Step 3 in the next iteration */
+		state->upperBound[j] += state->newcdist[state->closestCenters[j]];
+	}
+}
+
+/*
+ * Run a chunk of a task
+ */
+static int64
+RunKmeansChunk(IvfflatKmeansState * state, IvfflatKmeansTask task, int taskArg, int chunk)
+{
+	int			start;
+	int			end;
+
+	CHECK_FOR_INTERRUPTS();
+
+	switch (task)
+	{
+		case IVFFLAT_KMEANS_TASK_INIT_DISTANCES:
+			GetChunkRange(state->numSamples, state->sampleChunks, chunk, &start, &end);
+			state->chunkSums[chunk] = InitDistances(state, taskArg, start, end);
+			break;
+		case IVFFLAT_KMEANS_TASK_INIT_ASSIGN:
+			GetChunkRange(state->numSamples, state->sampleChunks, chunk, &start, &end);
+			InitAssign(state, start, end);
+			break;
+		case IVFFLAT_KMEANS_TASK_CENTER_DISTANCES:
+			GetChunkRange(state->numCenters, state->centerChunks, chunk, &start, &end);
+			ComputeCenterDistances(state, start, end);
+			break;
+		case IVFFLAT_KMEANS_TASK_CENTER_MIN:
+			GetChunkRange(state->numCenters, state->centerChunks, chunk, &start, &end);
+			ComputeCenterMin(state, start, end);
+			break;
+		case IVFFLAT_KMEANS_TASK_ASSIGN:
+			GetChunkRange(state->numSamples, state->sampleChunks, chunk, &start, &end);
+			if (state->hamerly)
+				return HamerlyAssignSamples(state, start, end);
+			return AssignSamples(state, taskArg != 0, start, end);
+		case IVFFLAT_KMEANS_TASK_UPDATE_BOUNDS:
+			GetChunkRange(state->numSamples, state->sampleChunks, chunk, &start, &end);
+			UpdateBounds(state, start, end);
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Claim and run chunks of the current task
+ */
+static void
+ParticipateInKmeansTask(IvfflatKmeansState * state, int generation, IvfflatKmeansTask task, int taskArg)
+{
+	IvfflatKmeansShared *shared = state->shared;
+
+	for (;;)
+	{
+		int			chunk = -1;
+		int64		changes;
+		bool		done;
+
+		SpinLockAcquire(&shared->mutex);
+		if (shared->generation == generation && shared->nextChunk < shared->totalChunks)
+			chunk = shared->nextChunk++;
+		SpinLockRelease(&shared->mutex);
+
+		if (chunk < 0)
+			break;
+
+		changes = RunKmeansChunk(state, task, taskArg, chunk);
+
+		SpinLockAcquire(&shared->mutex);
+		shared->changes += changes;
+		shared->chunksDone++;
+		done = shared->chunksDone == shared->totalChunks;
+		SpinLockRelease(&shared->mutex);
+
+		if (done)
+			ConditionVariableSignal(&shared->donecv);
+	}
+}
+
+/*
+ * Run a task over all samples or centers
+ *
+ * Returns the number of changes for assignment
+ */
+static int64
+RunKmeansTask(IvfflatKmeansState * state, IvfflatKmeansTask task, int taskArg)
+{
+	IvfflatKmeansShared *shared = state->shared;
+	bool		centerTask = task == IVFFLAT_KMEANS_TASK_CENTER_DISTANCES || task == IVFFLAT_KMEANS_TASK_CENTER_MIN;
+	int			chunks = centerTask ? state->centerChunks : state->sampleChunks;
+	int			generation;
+	int64		changes = 0;
+
+	if (shared == NULL)
+	{
+		for (int chunk = 0; chunk < chunks; chunk++)
+			changes += RunKmeansChunk(state, task, taskArg, chunk);
+
+		return changes;
+	}
+
+	/* Start task */
+	SpinLockAcquire(&shared->mutex);
+	generation = ++shared->generation;
+	shared->task = task;
+	shared->taskArg = taskArg;
+	shared->nextChunk = 0;
+	shared->chunksDone = 0;
+	shared->totalChunks = chunks;
+	shared->changes = 0;
+	SpinLockRelease(&shared->mutex);
+
+	ConditionVariableBroadcast(&shared->taskcv);
+
+	/* Participate as a worker */
+	ParticipateInKmeansTask(state, generation, task, taskArg);
+
+	/* Wait for other participants */
+	for (;;)
+	{
+		bool		done;
+
+		SpinLockAcquire(&shared->mutex);
+		done = shared->chunksDone == shared->totalChunks;
+		changes = shared->changes;
+		SpinLockRelease(&shared->mutex);
+
+		if (done)
+			break;
+
+		ConditionVariableSleep(&shared->donecv, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+	}
+
+	ConditionVariableCancelSleep();
+
+	return changes;
+}
+
+/*
+ * Initialize with kmeans++
+ *
+ * https://theory.stanford.edu/~sergei/papers/kMeansPP-soda.pdf
+ */
+static void
+InitCenters(IvfflatKmeansState * state)
+{
+	VectorArray samples = state->samples;
+	VectorArray centers = state->centers;
+	int			numCenters = state->numCenters;
+	int			numSamples = state->numSamples;
+
+	/* Choose an initial center uniformly at random */
+	VectorArraySet(centers, 0, VectorArrayGet(samples, (int) ((uint32) RandomInt() % (uint32) samples->length)));
+	centers->length++;
+
+	for (int i = 0; i < numSamples; i++)
+	{
+		state->weight[i] = FLT_MAX;
+
+		if (state->hamerly)
+		{
+			state->upperBound[i] = FLT_MAX;
+			state->lowerBound[i] = FLT_MAX;
+			state->closestCenters[i] = 0;
+		}
+	}
+
+	for (int i = 0; i < numCenters; i++)
+	{
+		int			chunk;
+		int			j;
+		int			start;
+		int			end;
+		double		sum;
+		double		choice;
+
+		RunKmeansTask(state, IVFFLAT_KMEANS_TASK_INIT_DISTANCES, i);
+
 		/* Only compute lower bound on last iteration */
 		if (i + 1 == numCenters)
 			break;
 
+		sum = 0.0;
+		for (chunk = 0; chunk < state->sampleChunks; chunk++)
+			sum += state->chunkSums[chunk];
+
 		/* Choose new center using weighted probability distribution. */
+		/* Find the chunk first to avoid scanning all weights */
 		choice = sum * RandomDouble();
-		for (j = 0; j < numSamples - 1; j++)
+		for (chunk = 0; chunk < state->sampleChunks - 1; chunk++)
 		{
-			choice -= weight[j];
+			if (choice - state->chunkSums[chunk] <= 0)
+				break;
+
+			choice -= state->chunkSums[chunk];
+		}
+
+		GetChunkRange(numSamples, state->sampleChunks, chunk, &start, &end);
+		for (j = start; j < numSamples - 1; j++)
+		{
+			choice -= state->weight[j];
 			if (choice <= 0)
 				break;
 		}
@@ -87,152 +937,347 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 		centers->length++;
 	}
 
-	pfree(weight);
+	/* Assign each x to its closest initial center c(x) = argmin d(x,c) */
+	/* Hamerly tracks the closest centers while computing distances */
+	if (!state->hamerly)
+		RunKmeansTask(state, IVFFLAT_KMEANS_TASK_INIT_ASSIGN, 0);
 }
 
 /*
- * Norm centers
+ * Compute new centers from the sums of all participants
+ */
+static void
+ComputeNewCenters(IvfflatKmeansState * state)
+{
+	VectorArray newCenters = state->newCenters;
+	int			dimensions = state->dimensions;
+	int			numCenters = state->numCenters;
+	Size		aggLength = (Size) numCenters * (Size) dimensions;
+	float	   *agg = state->agg;
+	int		   *centerCounts = state->centerCounts;
+
+	/* Combine sums and counts */
+	for (int p = 1; p < state->participants; p++)
+	{
+		float	   *pagg = agg + (Size) p * aggLength;
+		int		   *pcounts = centerCounts + (Size) p * (Size) numCenters;
+
+		for (Size i = 0; i < aggLength; i++)
+			agg[i] += pagg[i];
+
+		for (int i = 0; i < numCenters; i++)
+			centerCounts[i] += pcounts[i];
+	}
+
+	/* Divide sum by count */
+	for (int i = 0; i < numCenters; i++)
+	{
+		float	   *x = agg + ((Size) i * (Size) dimensions);
+
+		if (centerCounts[i] > 0)
+		{
+			/* Double avoids overflow, but requires more memory */
+			/* TODO Update bounds */
+			for (int j = 0; j < dimensions; j++)
+			{
+				if (isinf(x[j]))
+					x[j] = x[j] > 0 ? FLT_MAX : -FLT_MAX;
+			}
+
+			for (int j = 0; j < dimensions; j++)
+				x[j] /= (float) centerCounts[i];
+		}
+		else
+		{
+			/* TODO Handle empty centers properly */
+			for (int j = 0; j < dimensions; j++)
+				x[j] = (float) RandomDouble();
+		}
+	}
+
+	/* Set new centers */
+	for (int i = 0; i < numCenters; i++)
+		state->typeInfo->updateCenter(VectorArrayGet(newCenters, i), dimensions, agg + ((Size) i * (Size) dimensions));
+
+	/* Normalize if needed */
+	if (state->normprocinfo != NULL)
+		NormCenters(state->typeInfo, state->collation, newCenters);
+}
+
+/*
+ * Update centers for the distance kernel
+ */
+static void
+SetKernelCenters(IvfflatKmeansState * state)
+{
+	if (state->kernel != NULL)
+		IvfflatKernelSetCenters(state->kernel, state->centers, state->kernelCenters);
+}
+
+/*
+ * Get the distance between a sample and a center
+ */
+static inline double
+SampleDistance(IvfflatKmeansState * state, int sample, int center)
+{
+	return DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, PointerGetDatum(VectorArrayGet(state->samples, sample)), PointerGetDatum(VectorArrayGet(state->centers, center))));
+}
+
+/*
+ * Find two distinct samples of a list to start a split
+ *
+ * Returns false if all samples are the same
  */
-static void
-NormCenters(const IvfflatTypeInfo * typeInfo, Oid collation, VectorArray centers)
+static bool
+FindSplitSamples(IvfflatKmeansState * state, int *head, int *next, int center, int *first, int *second)
 {
-	MemoryContext normCtx = AllocSetContextCreate(CurrentMemoryContext,
-												  "Ivfflat norm temporary context",
-												  ALLOCSET_DEFAULT_SIZES);
+	VectorArray samples = state->samples;
+	double		maxDistance = 0;
 
-	IvfflatNormVectors(typeInfo, collation, centers, normCtx);
-	MemoryContextDelete(normCtx);
+	*first = head[center];
+	*second = -1;
+
+	/* Use the farthest sample from the first one */
+	for (int i = next[*first]; i != -1; i = next[i])
+	{
+		double		distance = DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, PointerGetDatum(VectorArrayGet(samples, *first)), PointerGetDatum(VectorArrayGet(samples, i))));
+
+		if (distance > maxDistance)
+		{
+			maxDistance = distance;
+			*second = i;
+		}
+	}
+
+	return *second != -1;
 }
 
 /*
- * Quick approach if we have no data
+ * Move the samples of a list to their closest other lists
  */
 static void
-RandomCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+MergeCenter(IvfflatKmeansState * state, int *head, int *next, int *counts, int center, int exclude)
 {
-	int			dimensions = centers->dim;
-	FmgrInfo   *normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
-	Oid			collation = index->rd_indcollation[0];
-	float	   *x = palloc_array_checked(float, (Size) dimensions);
+	int			i = head[center];
 
-	/* Fill with random data */
-	while (centers->length < centers->maxlen)
+	while (i != -1)
 	{
-		Pointer		center = VectorArrayGet(centers, centers->length);
+		int			nextSample = next[i];
+		double		minDistance = DBL_MAX;
+		int			closestCenter = -1;
 
-		for (int i = 0; i < dimensions; i++)
-			x[i] = (float) RandomDouble();
+		for (int j = 0; j < state->numCenters; j++)
+		{
+			double		distance;
 
-		typeInfo->updateCenter(center, dimensions, x);
+			if (j == center || j == exclude)
+				continue;
 
-		centers->length++;
+			distance = SampleDistance(state, i, j);
+			if (distance < minDistance)
+			{
+				minDistance = distance;
+				closestCenter = j;
+			}
+		}
+
+		state->closestCenters[i] = closestCenter;
+		next[i] = head[closestCenter];
+		head[closestCenter] = i;
+		counts[closestCenter]++;
+
+		i = nextSample;
 	}
 
-	if (normprocinfo != NULL)
-		NormCenters(typeInfo, collation, centers);
+	head[center] = -1;
+	counts[center] = 0;
 }
 
-#ifdef IVFFLAT_MEMORY
 /*
- * Show memory usage
+ * Set a center to the mean of its samples
  */
 static void
-ShowMemoryUsage(MemoryContext context, Size estimatedSize)
+SetSplitCenter(IvfflatKmeansState * state, int center, float *x, int count)
 {
-	elog(INFO, "total memory: %zu MB",
-		 MemoryContextMemAllocated(context, true) / (1024 * 1024));
-	elog(INFO, "estimated memory: %zu MB", estimatedSize / (1024 * 1024));
+	Pointer		v = VectorArrayGet(state->centers, center);
+
+	if (count == 0)
+		return;
+
+	for (int j = 0; j < state->dimensions; j++)
+		x[j] /= (float) count;
+
+	state->typeInfo->updateCenter(v, state->dimensions, x);
+
+	/* Normalize if needed */
+	if (state->normprocinfo != NULL)
+		VectorArraySet(state->centers, center, DatumGetPointer(IvfflatNormValue(state->typeInfo, state->collation, PointerGetDatum(v))));
 }
-#endif
 
 /*
- * Sum centers
+ * Split a list into itself and an empty list with 2-means
  */
 static void
-SumCenters(VectorArray samples, float *agg, int *closestCenters, const IvfflatTypeInfo * typeInfo)
+SplitCenter(IvfflatKmeansState * state, int *head, int *next, int *counts, int center, int target, int first, int second)
 {
-	for (int i = 0; i < samples->length; i++)
+	int			dimensions = state->dimensions;
+	float	   *x = palloc_array_checked(float, (Size) dimensions);
+	float	   *y = palloc_array_checked(float, (Size) dimensions);
+	int			members = head[center];
+
+	VectorArraySet(state->centers, center, VectorArrayGet(state->samples, first));
+	VectorArraySet(state->centers, target, VectorArrayGet(state->samples, second));
+
+	for (int iteration = 0; iteration < KMEANS_SPLIT_ITERATIONS; iteration++)
 	{
-		float	   *x = agg + ((Size) closestCenters[i] * (Size) samples->dim);
+		int			count = 0;
+		int			targetCount = 0;
+		bool		changed = false;
+
+		for (int j = 0; j < dimensions; j++)
+		{
+			x[j] = 0;
+			y[j] = 0;
+		}
+
+		/* Assign samples to the closer center */
+		for (int i = members; i != -1; i = next[i])
+		{
+			Pointer		sample = VectorArrayGet(state->samples, i);
+			int			closestCenter = SampleDistance(state, i, target) < SampleDistance(state, i, center) ? target : center;
+
+			if (state->closestCenters[i] != closestCenter)
+			{
+				state->closestCenters[i] = closestCenter;
+				changed = true;
+			}
 
-		typeInfo->sumCenter(VectorArrayGet(samples, i), x);
+			if (closestCenter == target)
+			{
+				state->typeInfo->sumCenter(sample, y);
+				targetCount++;
+			}
+			else
+			{
+				state->typeInfo->sumCenter(sample, x);
+				count++;
+			}
+		}
+
+		if (!changed && iteration != 0)
+			break;
+
+		SetSplitCenter(state, center, x, count);
+		SetSplitCenter(state, target, y, targetCount);
 	}
-}
 
-/*
- * Update centers
- */
-static void
-UpdateCenters(float *agg, VectorArray centers, const IvfflatTypeInfo * typeInfo)
-{
-	for (int i = 0; i < centers->length; i++)
+	/* Rebuild both lists */
+	head[center] = -1;
+	counts[center] = 0;
+	while (members != -1)
 	{
-		float	   *x = agg + ((Size) i * (Size) centers->dim);
+		int			nextSample = next[members];
+		int			closestCenter = state->closestCenters[members];
 
-		typeInfo->updateCenter(VectorArrayGet(centers, i), centers->dim, x);
+		next[members] = head[closestCenter];
+		head[closestCenter] = members;
+		counts[closestCenter]++;
+
+		members = nextSample;
 	}
+
+	pfree(x);
+	pfree(y);
 }
 
 /*
- * Compute new centers
+ * Split lists with many more samples than average
+ *
+ * Each split replaces the smallest list, whose samples move to their
+ * closest other lists, and divides the samples of the largest list with
+ * 2-means. This trades some inertia for more even list sizes, since the
+ * largest lists dominate query latency.
  */
 static void
-ComputeNewCenters(VectorArray samples, float *agg, VectorArray newCenters, int *centerCounts, int *closestCenters, FmgrInfo *normprocinfo, Oid collation, const IvfflatTypeInfo * typeInfo)
+BalanceCenters(IvfflatKmeansState * state)
 {
-	int			dimensions = newCenters->dim;
-	int			numCenters = newCenters->length;
-	int			numSamples = samples->length;
-
-	/* Reset sum and count */
-	for (int i = 0; i < numCenters; i++)
-	{
-		float	   *x = agg + ((Size) i * (Size) dimensions);
-
-		for (int j = 0; j < dimensions; j++)
-			x[j] = 0.0;
+	int			numCenters = state->numCenters;
+	int			numSamples = state->numSamples;
+	double		maxSize = IVFFLAT_BALANCE_MAX_RATIO * numSamples / numCenters;
+	int		   *head;
+	int		   *next;
+	int		   *counts;
+	bool	   *unsplittable;
+	int			splits = 0;
+
+	/* Need a list to merge into */
+	if (numCenters < 3)
+		return;
 
-		centerCounts[i] = 0;
-	}
+	head = palloc_array_checked(int, (Size) numCenters);
+	next = palloc_array_checked(int, (Size) numSamples);
+	counts = palloc0_array_checked(int, (Size) numCenters);
+	unsplittable = palloc0_array_checked(bool, (Size) numCenters);
 
-	/* Increment sum of closest center */
-	SumCenters(samples, agg, closestCenters, typeInfo);
+	/* Link samples of each list */
+	for (int j = 0; j < numCenters; j++)
+		head[j] = -1;
 
-	/* Increment count of closest center */
 	for (int i = 0; i < numSamples; i++)
-		centerCounts[closestCenters[i]] += 1;
+	{
+		int			closestCenter = state->closestCenters[i];
 
-	/* Divide sum by count */
-	for (int i = 0; i < numCenters; i++)
+		next[i] = head[closestCenter];
+		head[closestCenter] = i;
+		counts[closestCenter]++;
+	}
+
+	for (int iteration = 0; iteration < numCenters; iteration++)
 	{
-		float	   *x = agg + ((Size) i * (Size) dimensions);
+		int			largest = -1;
+		int			smallest = -1;
+		int			first;
+		int			second;
 
-		if (centerCounts[i] > 0)
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		for (int j = 0; j < numCenters; j++)
 		{
-			/* Double avoids overflow, but requires more memory */
-			/* TODO Update bounds */
-			for (int j = 0; j < dimensions; j++)
-			{
-				if (isinf(x[j]))
-					x[j] = x[j] > 0 ? FLT_MAX : -FLT_MAX;
-			}
+			if (!unsplittable[j] && (largest == -1 || counts[j] > counts[largest]))
+				largest = j;
+		}
 
-			for (int j = 0; j < dimensions; j++)
-				x[j] /= (float) centerCounts[i];
+		if (largest == -1 || counts[largest] <= maxSize)
+			break;
+
+		for (int j = 0; j < numCenters; j++)
+		{
+			if (j != largest && (smallest == -1 || counts[j] < counts[smallest]))
+				smallest = j;
 		}
-		else
+
+		/* Stop if the split would not reduce the largest list */
+		if (counts[smallest] * 2 >= counts[largest])
+			break;
+
+		if (!FindSplitSamples(state, head, next, largest, &first, &second))
 		{
-			/* TODO Handle empty centers properly */
-			for (int j = 0; j < dimensions; j++)
-				x[j] = (float) RandomDouble();
+			unsplittable[largest] = true;
+			continue;
 		}
+
+		MergeCenter(state, head, next, counts, smallest, largest);
+		SplitCenter(state, head, next, counts, largest, smallest, first, second);
+		splits++;
 	}
 
-	/* Set new centers */
-	UpdateCenters(agg, newCenters, typeInfo);
+	ereport(DEBUG1, (errmsg("split %d lists to balance list sizes", splits)));
 
-	/* Normalize if needed */
-	if (normprocinfo != NULL)
-		NormCenters(typeInfo, collation, newCenters);
+	pfree(head);
+	pfree(next);
+	pfree(counts);
+	pfree(unsplittable);
 }
 
 /*
@@ -242,246 +1287,318 @@ ComputeNewCenters(VectorArray samples, float *agg, VectorArray newCenters, int *
  * and angular distance for inner product and cosine distance
  *
  * https://www.aaai.org/Papers/ICML/2003/ICML03-022.pdf
+ *
+ * Elkan needs a lower bound for each sample and center, so use Hamerly when
+ * that does not fit in maintenance_work_mem. It keeps a single lower bound
+ * per sample and does not store distances between centers.
+ *
+ * https://epubs.siam.org/doi/10.1137/1.9781611972801.12
  */
 static void
-ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed)
+RunKmeans(IvfflatKmeansState * state)
 {
-	FmgrInfo   *procinfo;
-	FmgrInfo   *normprocinfo;
-	Oid			collation;
-	int			dimensions = centers->dim;
-	int			numCenters = centers->maxlen;
-	int			numSamples = samples->length;
-	VectorArray newCenters;
-	float	   *agg;
-	int		   *centerCounts;
-	int		   *closestCenters;
-	float	   *lowerBound;
-	float	   *upperBound;
-	float	   *s;
-	float	   *halfcdist;
-	float	   *newcdist;
-
-	/* Calculate allocation sizes */
-	Size		newCentersSize = VECTOR_ARRAY_SIZE(numCenters, centers->itemsize);
-	Size		aggSize = mul_size(sizeof(float), mul_size((Size) numCenters, (Size) dimensions));
-	Size		centerCountsSize = mul_size(sizeof(int), (Size) numCenters);
-	Size		closestCentersSize = mul_size(sizeof(int), (Size) numSamples);
-	Size		lowerBoundSize = mul_size(sizeof(float), mul_size((Size) numSamples, (Size) numCenters));
-	Size		upperBoundSize = mul_size(sizeof(float), (Size) numSamples);
-	Size		sSize = mul_size(sizeof(float), (Size) numCenters);
-	Size		halfcdistSize = mul_size(sizeof(float), mul_size((Size) numCenters, (Size) numCenters));
-	Size		newcdistSize = mul_size(sizeof(float), (Size) numCenters);
-
-	/* Calculate total size */
-	Size		totalSize = memoryUsed;
-
-	totalSize = add_size(totalSize, newCentersSize);
-	totalSize = add_size(totalSize, aggSize);
-	totalSize = add_size(totalSize, centerCountsSize);
-	totalSize = add_size(totalSize, closestCentersSize);
-	totalSize = add_size(totalSize, lowerBoundSize);
-	totalSize = add_size(totalSize, upperBoundSize);
-	totalSize = add_size(totalSize, sSize);
-	totalSize = add_size(totalSize, halfcdistSize);
-	totalSize = add_size(totalSize, newcdistSize);
-
-	/* Check memory requirements */
-	IvfflatCheckMemoryUsage(totalSize);
+	int			numCenters = state->numCenters;
 
 	/* Ensure indexing does not overflow */
-	if (numCenters > INT_MAX / numCenters)
+	if (!state->hamerly && numCenters > INT_MAX / numCenters)
 		elog(ERROR, "Indexing overflow detected. Please report a bug.");
 
-	/* Set support functions */
-	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
-	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
-	collation = index->rd_indcollation[0];
-
-	/* Allocate space */
-	/* Use float instead of double to save memory */
-	agg = palloc(aggSize);
-	centerCounts = palloc(centerCountsSize);
-	closestCenters = palloc(closestCentersSize);
-	lowerBound = palloc_extended(lowerBoundSize, MCXT_ALLOC_HUGE);
-	upperBound = palloc(upperBoundSize);
-	s = palloc(sSize);
-	halfcdist = palloc_extended(halfcdistSize, MCXT_ALLOC_HUGE);
-	newcdist = palloc(newcdistSize);
-
-	/* Initialize new centers */
-	newCenters = VectorArrayInit(numCenters, dimensions, centers->itemsize);
-	newCenters->length = numCenters;
-
-#ifdef IVFFLAT_MEMORY
-	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), totalSize);
-#endif
-
 	/* Pick initial centers */
-	InitCenters(index, samples, centers, lowerBound);
-
-	/* Assign each x to its closest initial center c(x) = argmin d(x,c) */
-	for (int j = 0; j < numSamples; j++)
-	{
-		float		minDistance = FLT_MAX;
-		int			closestCenter = 0;
-
-		/* Find closest center */
-		for (int k = 0; k < numCenters; k++)
-		{
-			/* TODO Use Lemma 1 in k-means++ initialization */
-			float		distance = lowerBound[(Size) j * (Size) numCenters + (Size) k];
-
-			if (distance < minDistance)
-			{
-				minDistance = distance;
-				closestCenter = k;
-			}
-		}
-
-		upperBound[j] = minDistance;
-		closestCenters[j] = closestCenter;
-	}
+	InitCenters(state);
+	SetKernelCenters(state);
 
 	/* Give 500 iterations to converge */
 	for (int iteration = 0; iteration < 500; iteration++)
 	{
-		int			changes = 0;
-		bool		rjreset;
+		int64		changes;
 
 		/* Can take a while, so ensure we can interrupt */
 		CHECK_FOR_INTERRUPTS();
 
 		/* Step 1: For all centers, compute distance */
-		for (int j = 0; j < numCenters; j++)
-		{
-			Datum		vec = PointerGetDatum(VectorArrayGet(centers, j));
+		if (!state->hamerly)
+			RunKmeansTask(state, IVFFLAT_KMEANS_TASK_CENTER_DISTANCES, 0);
 
-			for (int k = j + 1; k < numCenters; k++)
-			{
-				float		distance = (float) (0.5 * DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k)))));
+		/* For all centers c, compute s(c) */
+		RunKmeansTask(state, IVFFLAT_KMEANS_TASK_CENTER_MIN, 0);
 
-				halfcdist[(Size) j * (Size) numCenters + (Size) k] = distance;
-				halfcdist[(Size) k * (Size) numCenters + (Size) j] = distance;
-			}
-		}
+		/* Reset sums and counts */
+		memset(state->agg, 0, sizeof(float) * (Size) state->participants * (Size) numCenters * (Size) state->dimensions);
+		memset(state->centerCounts, 0, sizeof(int) * (Size) state->participants * (Size) numCenters);
 
-		/* For all centers c, compute s(c) */
+		/* Steps 2 and 3, and sums for step 4 */
+		changes = RunKmeansTask(state, IVFFLAT_KMEANS_TASK_ASSIGN, iteration != 0);
+
+		/* Step 4: For each center c, let m(c) be mean of all points assigned */
+		ComputeNewCenters(state);
+
+		/* Step 5 */
 		for (int j = 0; j < numCenters; j++)
-		{
-			float		minDistance = FLT_MAX;
+			state->newcdist[j] = (float) DatumGetFloat8(FunctionCall2Coll(state->procinfo, state->collation, PointerGetDatum(VectorArrayGet(state->centers, j)), PointerGetDatum(VectorArrayGet(state->newCenters, j))));
 
-			for (int k = 0; k < numCenters; k++)
-			{
-				float		distance;
+		/* Steps 5 and 6 */
+		RunKmeansTask(state, IVFFLAT_KMEANS_TASK_UPDATE_BOUNDS, 0);
+
+		/* Step 7 */
+		for (int j = 0; j < numCenters; j++)
+			VectorArraySet(state->centers, j, VectorArrayGet(state->newCenters, j));
+		SetKernelCenters(state);
 
-				if (j == k)
-					continue;
+		if (changes == 0 && iteration != 0)
+			break;
+	}
 
-				distance = halfcdist[(Size) j * (Size) numCenters + (Size) k];
-				if (distance < minDistance)
-					minDistance = distance;
-			}
+	/* Split oversized lists */
+	if (state->balance)
+		BalanceCenters(state);
+}
 
-			s[j] = minDistance;
-		}
+/*
+ * Choose the algorithm and get the size of arrays
+ */
+static Size
+ChooseKmeansAlgorithm(IvfflatKmeansState * state, Size itemsize, Size memoryUsed)
+{
+	Size		arraysSize = KmeansArraysSize(state->numSamples, state->numCenters, state->dimensions, itemsize, state->participants, state->sampleChunks, false, state->kernelCentersSize);
 
-		rjreset = iteration != 0;
+	/* Use Hamerly if Elkan does not fit in maintenance_work_mem */
+	if (add_size(memoryUsed, arraysSize) / 1024 > (Size) maintenance_work_mem)
+	{
+		state->hamerly = true;
+		arraysSize = KmeansArraysSize(state->numSamples, state->numCenters, state->dimensions, itemsize, state->participants, state->sampleChunks, true, state->kernelCentersSize);
 
-		for (int j = 0; j < numSamples; j++)
-		{
-			bool		rj;
+		ereport(DEBUG1, (errmsg("using Hamerly k-means to reduce memory")));
+	}
 
-			/* Step 2: Identify all points x such that u(x) <= s(c(x)) */
-			if (upperBound[j] <= s[closestCenters[j]])
-				continue;
+	return arraysSize;
+}
 
-			rj = rjreset;
+/*
+ * Run k-means in a single process
+ */
+static void
+SerialKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed)
+{
+	IvfflatKmeansState state;
+	Size		arraysSize;
 
-			for (int k = 0; k < numCenters; k++)
-			{
-				Datum		vec;
-				float		dxcx;
+	InitKmeansState(&state, index, typeInfo, samples->length, centers->maxlen, centers->dim, 1, false);
+	arraysSize = ChooseKmeansAlgorithm(&state, centers->itemsize, memoryUsed);
 
-				/* Step 3: For all remaining points x and centers c */
-				if (k == closestCenters[j])
-					continue;
+	/* Check memory requirements */
+	IvfflatCheckMemoryUsage(add_size(memoryUsed, arraysSize));
 
-				if (upperBound[j] <= lowerBound[(Size) j * (Size) numCenters + (Size) k])
-					continue;
+	/* Use float instead of double to save memory */
+	SetKmeansArrays(&state, palloc_extended(arraysSize, MCXT_ALLOC_HUGE), centers->itemsize);
+	state.samples = samples;
+	state.centers = centers;
 
-				if (upperBound[j] <= halfcdist[(Size) closestCenters[j] * (Size) numCenters + (Size) k])
-					continue;
+#ifdef IVFFLAT_MEMORY
+	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), add_size(memoryUsed, arraysSize));
+#endif
 
-				vec = PointerGetDatum(VectorArrayGet(samples, j));
+	RunKmeans(&state);
+}
 
-				/* Step 3a */
-				if (rj)
-				{
-					dxcx = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, closestCenters[j]))));
+/*
+ * Run k-means with parallel workers
+ *
+ * Returns false if workers could not be launched or there is not enough
+ * maintenance_work_mem for the shared copies and each participant's sums
+ */
+static bool
+ParallelKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed, int request, bool isconcurrent)
+{
+	ParallelContext *pcxt;
+	IvfflatKmeansState state;
+	IvfflatKmeansShared *shared;
+	Size		samplesSize = mul_size((Size) samples->length, samples->itemsize);
+	Size		centersSize = mul_size((Size) centers->maxlen, centers->itemsize);
+	Size		arraysSize;
+	char	   *sharedSamples;
+	char	   *sharedCenters;
+	char	   *sharedArrays;
+
+	/* Samples and centers are copied to shared memory */
+	memoryUsed = add_size(memoryUsed, add_size(samplesSize, centersSize));
+
+	/* Leader participates */
+	InitKmeansState(&state, index, typeInfo, samples->length, centers->maxlen, centers->dim, request + 1, false);
+
+	/* Use fewer workers if the sums for each participant do not fit */
+	while (request > 0 && add_size(memoryUsed, KmeansArraysSize(state.numSamples, state.numCenters, state.dimensions, centers->itemsize, state.participants, state.sampleChunks, true, state.kernelCentersSize)) / 1024 > (Size) maintenance_work_mem)
+	{
+		request--;
+		SetKmeansParticipants(&state, request + 1);
+	}
 
-					/* d(x,c(x)) computed, which is a form of d(x,c) */
-					lowerBound[(Size) j * (Size) numCenters + (Size) closestCenters[j]] = dxcx;
-					upperBound[j] = dxcx;
+	/* Do serial k-means if parallel k-means does not fit */
+	if (request == 0)
+	{
+		ereport(DEBUG1, (errmsg("not enough maintenance_work_mem for parallel k-means")));
+		return false;
+	}
 
-					rj = false;
-				}
-				else
-					dxcx = upperBound[j];
+	arraysSize = ChooseKmeansAlgorithm(&state, centers->itemsize, memoryUsed);
 
-				/* Step 3b */
-				if (dxcx > lowerBound[(Size) j * (Size) numCenters + (Size) k] || dxcx > halfcdist[(Size) closestCenters[j] * (Size) numCenters + (Size) k])
-				{
-					float		dxc = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
+	/* Check memory requirements */
+	IvfflatCheckMemoryUsage(add_size(memoryUsed, arraysSize));
 
-					/* d(x,c) calculated */
-					lowerBound[(Size) j * (Size) numCenters + (Size) k] = dxc;
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	pcxt = CreateParallelContext("vector", "IvfflatParallelKmeansMain", request);
 
-					if (dxc < dxcx)
-					{
-						closestCenters[j] = k;
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(IvfflatKmeansShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, samplesSize);
+	shm_toc_estimate_chunk(&pcxt->estimator, centersSize);
+	shm_toc_estimate_chunk(&pcxt->estimator, arraysSize);
+	shm_toc_estimate_keys(&pcxt->estimator, 4);
 
-						/* c(x) changed */
-						upperBound[j] = dxc;
+	InitializeParallelDSM(pcxt);
 
-						changes++;
-					}
-				}
-			}
-		}
+	/* If no DSM segment was available, back out (do serial k-means) */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
 
-		/* Step 4: For each center c, let m(c) be mean of all points assigned */
-		ComputeNewCenters(samples, agg, newCenters, centerCounts, closestCenters, normprocinfo, collation, typeInfo);
+	shared = (IvfflatKmeansShared *) shm_toc_allocate(pcxt->toc, sizeof(IvfflatKmeansShared));
+	/* Initialize immutable state */
+	shared->indexrelid = RelationGetRelid(index);
+	shared->isconcurrent = isconcurrent;
+	shared->numSamples = state.numSamples;
+	shared->numCenters = state.numCenters;
+	shared->dimensions = state.dimensions;
+	shared->itemsize = centers->itemsize;
+	shared->participants = state.participants;
+	shared->hamerly = state.hamerly;
+	ConditionVariableInit(&shared->taskcv);
+	ConditionVariableInit(&shared->donecv);
+	SpinLockInit(&shared->mutex);
+	/* Initialize mutable state */
+	shared->generation = 0;
+	shared->task = IVFFLAT_KMEANS_TASK_INIT_DISTANCES;
+	shared->taskArg = 0;
+	shared->nextChunk = 0;
+	shared->chunksDone = 0;
+	shared->totalChunks = 0;
+	shared->changes = 0;
+	shared->finished = false;
+
+	sharedSamples = shm_toc_allocate(pcxt->toc, samplesSize);
+	memcpy(sharedSamples, samples->items, samplesSize);
+	sharedCenters = shm_toc_allocate(pcxt->toc, centersSize);
+	sharedArrays = shm_toc_allocate(pcxt->toc, arraysSize);
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_SHARED, shared);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_SAMPLES, sharedSamples);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_CENTERS, sharedCenters);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_ARRAYS, sharedArrays);
+
+	/* Launch workers */
+	LaunchParallelWorkers(pcxt);
+
+	/* If no workers were successfully launched, back out (do serial k-means) */
+	if (pcxt->nworkers_launched == 0)
+	{
+		WaitForParallelWorkersToFinish(pcxt);
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
 
-		/* Step 5 */
-		for (int j = 0; j < numCenters; j++)
-			newcdist[j] = (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, PointerGetDatum(VectorArrayGet(centers, j)), PointerGetDatum(VectorArrayGet(newCenters, j))));
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers for k-means", pcxt->nworkers_launched)));
+
+	state.samples = KmeansVectorArray(state.numSamples, state.dimensions, samples->itemsize, sharedSamples);
+	state.centers = KmeansVectorArray(0, state.dimensions, centers->itemsize, sharedCenters);
+	state.centers->maxlen = state.numCenters;
+	SetKmeansArrays(&state, sharedArrays, centers->itemsize);
+	state.shared = shared;
+
+	RunKmeans(&state);
+
+	/* Let workers exit */
+	SpinLockAcquire(&shared->mutex);
+	shared->finished = true;
+	SpinLockRelease(&shared->mutex);
+	ConditionVariableBroadcast(&shared->taskcv);
+
+	/* Copy centers before the segment is detached */
+	memcpy(centers->items, sharedCenters, centersSize);
+	centers->length = state.centers->length;
+
+	WaitForParallelWorkersToFinish(pcxt);
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return true;
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc)
+{
+	IvfflatKmeansShared *shared;
+	IvfflatKmeansState state;
+	Relation	indexRel;
+	LOCKMODE	indexLockmode;
+	int			generation = 0;
+
+	/* Look up shared state */
+	shared = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_SHARED, false);
+
+	/* Open index using lock mode known to be obtained by index.c */
+	indexLockmode = shared->isconcurrent ? RowExclusiveLock : AccessExclusiveLock;
+	indexRel = index_open(shared->indexrelid, indexLockmode);
+
+	InitKmeansState(&state, indexRel, IvfflatGetTypeInfo(indexRel), shared->numSamples, shared->numCenters, shared->dimensions, shared->participants, shared->hamerly);
+	state.samples = KmeansVectorArray(state.numSamples, state.dimensions, shared->itemsize, shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_SAMPLES, false));
+	state.centers = KmeansVectorArray(state.numCenters, state.dimensions, shared->itemsize, shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_CENTERS, false));
+	SetKmeansArrays(&state, shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_ARRAYS, false), shared->itemsize);
+	state.shared = shared;
+	state.participant = ParallelWorkerNumber + 1;
+
+	for (;;)
+	{
+		IvfflatKmeansTask task;
+		int			taskArg;
+		bool		finished;
 
-		for (int j = 0; j < numSamples; j++)
+		/* Wait for the next task */
+		for (;;)
 		{
-			for (int k = 0; k < numCenters; k++)
+			SpinLockAcquire(&shared->mutex);
+			finished = shared->finished;
+			task = shared->task;
+			taskArg = shared->taskArg;
+			if (!finished && shared->generation != generation)
 			{
-				float		distance = lowerBound[(Size) j * (Size) numCenters + (Size) k] - newcdist[k];
+				generation = shared->generation;
+				SpinLockRelease(&shared->mutex);
+				break;
+			}
+			SpinLockRelease(&shared->mutex);
 
-				if (distance < 0)
-					distance = 0;
+			if (finished)
+				break;
 
-				lowerBound[(Size) j * (Size) numCenters + (Size) k] = distance;
-			}
+			ConditionVariableSleep(&shared->taskcv, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
 		}
 
-		/* Step 6 */
-		/* We reset r(x) before Step 3 in the next iteration */
-		for (int j = 0; j < numSamples; j++)
-			upperBound[j] += newcdist[closestCenters[j]];
-
-		/* Step 7 */
-		for (int j = 0; j < numCenters; j++)
-			VectorArraySet(centers, j, VectorArrayGet(newCenters, j));
+		ConditionVariableCancelSleep();
 
-		if (changes == 0 && iteration != 0)
+		if (finished)
 			break;
+
+		ParticipateInKmeansTask(&state, generation, task, taskArg);
 	}
+
+	index_close(indexRel, indexLockmode);
 }
 
 /*
@@ -551,7 +1668,7 @@ CheckCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeIn
  * We use spherical k-means for inner product and cosine
  */
 void
-IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed)
+IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, Size memoryUsed, int parallelWorkers, bool isconcurrent)
 {
 	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
 													"Ivfflat kmeans temporary context",
@@ -560,8 +1677,8 @@ IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const Iv
 
 	if (samples->length == 0)
 		RandomCenters(index, centers, typeInfo);
-	else
-		ElkanKmeans(index, samples, centers, typeInfo, memoryUsed);
+	else if (parallelWorkers == 0 || !ParallelKmeans(index, samples, centers, typeInfo, memoryUsed, parallelWorkers, isconcurrent))
+		SerialKmeans(index, samples, centers, typeInfo, memoryUsed);
 
 	CheckCenters(index, centers, typeInfo);
 
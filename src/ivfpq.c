@@ -0,0 +1,609 @@
+#include "postgres.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "access/genam.h"
+#include "access/generic_xlog.h"
+#include "fmgr.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+/* Relative margin for rounding when bounding distances */
+#define IVFPQ_BOUND_EPSILON	1e-3
+
+#define IVFPQ_PAGE_FLOATS	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData))) / sizeof(float))
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
+/*
+ * Get the number of subvectors in the index options
+ */
+int
+IvfpqGetSubvectors(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts)
+		return opts->pqSubvectors;
+
+	return IVFFLAT_DEFAULT_PQ_SUBVECTORS;
+}
+
+/*
+ * Get the distance metric
+ *
+ * Estimated distances are computed from the codes, so this must match the
+ * distance function of the operator class
+ */
+IvfpqMetric
+IvfpqGetMetric(Relation index)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		return IVFPQ_METRIC_L2;
+
+	if (procinfo->fn_addr == vector_negative_inner_product)
+	{
+		/* Cosine distance normalizes values */
+		if (IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC) != NULL)
+			return IVFPQ_METRIC_COSINE;
+
+		return IVFPQ_METRIC_INNER_PRODUCT;
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("operator class not supported for product quantization")));
+}
+
+/*
+ * Get the product quantization info from the metapage
+ */
+void
+IvfpqGetMetaPageInfo(Relation index, int *subvectors, BlockNumber *codebookPage)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != IVFFLAT_MAGIC_NUMBER))
+		elog(ERROR, "ivfflat index is not valid");
+
+	/* Older versions do not have these fields */
+	if (metap->version < 2)
+	{
+		*subvectors = 0;
+		if (codebookPage != NULL)
+			*codebookPage = InvalidBlockNumber;
+	}
+	else
+	{
+		*subvectors = metap->pqSubvectors;
+		if (codebookPage != NULL)
+			*codebookPage = metap->codebookPage;
+	}
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Get the squared L2 distance between subvectors
+ */
+static inline float
+SubvectorL2SquaredDistance(int dim, const float *ax, const float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = ax[i] - bx[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+/*
+ * Get the inner product of subvectors
+ */
+static inline float
+SubvectorInnerProduct(int dim, const float *ax, const float *bx)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += ax[i] * bx[i];
+
+	return distance;
+}
+
+/*
+ * Find the closest centroid for a subvector
+ */
+static int
+ClosestCentroid(const float *centroids, int numCentroids, int subdim, const float *x, float *minDistance)
+{
+	int			closest = 0;
+
+	*minDistance = FLT_MAX;
+
+	for (int k = 0; k < numCentroids; k++)
+	{
+		float		distance = SubvectorL2SquaredDistance(subdim, x, centroids + (Size) k * subdim);
+
+		if (distance < *minDistance)
+		{
+			*minDistance = distance;
+			closest = k;
+		}
+	}
+
+	return closest;
+}
+
+/*
+ * Run k-means for one subspace of the residuals
+ *
+ * Centroids are initialized with random residuals, which works well for
+ * the small number of dimensions in each subspace
+ */
+static void
+TrainSubspace(const float *residuals, int numSamples, int dimensions, int offset, int subdim, float *centroids)
+{
+	int			numCentroids = Min(numSamples, IVFPQ_CENTROIDS);
+	int		   *assignments = palloc_array_checked(int, (Size) numSamples);
+	int		   *counts = palloc_array_checked(int, IVFPQ_CENTROIDS);
+	int		   *order = palloc_array_checked(int, (Size) numSamples);
+
+	/* Choose distinct samples with a partial shuffle */
+	for (int i = 0; i < numSamples; i++)
+		order[i] = i;
+
+	for (int k = 0; k < numCentroids; k++)
+	{
+		int			j = k + (int) ((uint32) RandomInt() % (uint32) (numSamples - k));
+		int			tmp = order[k];
+
+		order[k] = order[j];
+		order[j] = tmp;
+
+		memcpy(centroids + (Size) k * subdim, residuals + (Size) order[k] * dimensions + offset, subdim * sizeof(float));
+	}
+
+	for (int iteration = 0; iteration < IVFPQ_KMEANS_ITERATIONS; iteration++)
+	{
+		bool		changed = false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Assign samples */
+		for (int i = 0; i < numSamples; i++)
+		{
+			float		distance;
+			int			closest = ClosestCentroid(centroids, numCentroids, subdim, residuals + (Size) i * dimensions + offset, &distance);
+
+			if (iteration == 0 || assignments[i] != closest)
+				changed = true;
+
+			assignments[i] = closest;
+		}
+
+		if (!changed)
+			break;
+
+		/* Update centroids */
+		memset(counts, 0, IVFPQ_CENTROIDS * sizeof(int));
+		memset(centroids, 0, (Size) numCentroids * subdim * sizeof(float));
+
+		for (int i = 0; i < numSamples; i++)
+		{
+			float	   *centroid = centroids + (Size) assignments[i] * subdim;
+			const float *x = residuals + (Size) i * dimensions + offset;
+
+			for (int d = 0; d < subdim; d++)
+				centroid[d] += x[d];
+
+			counts[assignments[i]]++;
+		}
+
+		for (int k = 0; k < numCentroids; k++)
+		{
+			float	   *centroid = centroids + (Size) k * subdim;
+
+			/* Reinitialize empty centroids */
+			if (counts[k] == 0)
+			{
+				int			i = (int) ((uint32) RandomInt() % (uint32) numSamples);
+
+				memcpy(centroid, residuals + (Size) i * dimensions + offset, subdim * sizeof(float));
+				continue;
+			}
+
+			for (int d = 0; d < subdim; d++)
+				centroid[d] /= counts[k];
+		}
+	}
+
+	/* Fill unused centroids so every code is valid */
+	for (int k = numCentroids; k < IVFPQ_CENTROIDS; k++)
+	{
+		float	   *centroid = centroids + (Size) k * subdim;
+
+		if (numCentroids > 0)
+			memcpy(centroid, centroids + (Size) (k % numCentroids) * subdim, subdim * sizeof(float));
+		else
+			memset(centroid, 0, subdim * sizeof(float));
+	}
+
+	pfree(assignments);
+	pfree(counts);
+	pfree(order);
+}
+
+/*
+ * Train codebooks on the residuals of the samples
+ */
+void
+IvfpqTrain(IvfflatBuildState * buildstate)
+{
+	VectorArray samples = buildstate->pqSamples;
+	VectorArray centers = buildstate->centers;
+	int			dimensions = buildstate->dimensions;
+	int			subvectors = buildstate->pqSubvectors;
+	int			subdim = dimensions / subvectors;
+	int			numSamples = samples->length;
+	float	   *residuals;
+
+	buildstate->memoryUsed = add_size(buildstate->memoryUsed, mul_size(mul_size((Size) numSamples, (Size) dimensions), sizeof(float)));
+	buildstate->memoryUsed = add_size(buildstate->memoryUsed, mul_size(IVFPQ_CODEBOOK_LENGTH(dimensions), sizeof(float)));
+	IvfflatCheckMemoryUsage(buildstate->memoryUsed);
+
+	residuals = palloc_extended(mul_size(mul_size((Size) numSamples, (Size) dimensions), sizeof(float)), MCXT_ALLOC_HUGE);
+	buildstate->pqCentroids = palloc_array_checked(float, IVFPQ_CODEBOOK_LENGTH(dimensions));
+
+	/* Train on values as they are stored */
+	if (buildstate->normprocinfo != NULL)
+		IvfflatNormVectors(buildstate->typeInfo, buildstate->collation, samples, buildstate->tmpCtx);
+
+	/* Get residuals to the closest center */
+	for (int i = 0; i < numSamples; i++)
+	{
+		Datum		value = PointerGetDatum(VectorArrayGet(samples, i));
+		Vector	   *vec = (Vector *) DatumGetPointer(value);
+		double		minDistance = DBL_MAX;
+		Vector	   *center = NULL;
+
+		for (int j = 0; j < centers->length; j++)
+		{
+			double		distance = DatumGetFloat8(FunctionCall2Coll(buildstate->procinfo, buildstate->collation, value, PointerGetDatum(VectorArrayGet(centers, j))));
+
+			if (distance < minDistance || center == NULL)
+			{
+				minDistance = distance;
+				center = (Vector *) VectorArrayGet(centers, j);
+			}
+		}
+
+		for (int d = 0; d < dimensions; d++)
+			residuals[(Size) i * dimensions + d] = vec->x[d] - center->x[d];
+	}
+
+	/* Run k-means for each subspace */
+	for (int j = 0; j < subvectors; j++)
+		TrainSubspace(residuals, numSamples, dimensions, j * subdim, subdim, buildstate->pqCentroids + (Size) j * IVFPQ_CENTROIDS * subdim);
+
+	pfree(residuals);
+}
+
+/*
+ * Encode a value
+ */
+Pointer
+IvfpqEncode(const float *centroids, int subvectors, Vector * value, Vector * center)
+{
+	int			dimensions = value->dim;
+	int			subdim = dimensions / subvectors;
+	IvfpqCode  *code = palloc0(IVFPQ_CODE_SIZE(subvectors));
+	float	   *residual = palloc_array_checked(float, (Size) dimensions);
+	double		error = 0.0;
+
+	SET_VARSIZE(code, IVFPQ_CODE_SIZE(subvectors));
+
+	for (int d = 0; d < dimensions; d++)
+		residual[d] = value->x[d] - center->x[d];
+
+	for (int j = 0; j < subvectors; j++)
+	{
+		float		distance;
+
+		code->codes[j] = (uint8) ClosestCentroid(centroids + (Size) j * IVFPQ_CENTROIDS * subdim, IVFPQ_CENTROIDS, subdim, residual + j * subdim, &distance);
+		error += distance;
+	}
+
+	code->error = (float) sqrt(error);
+
+	pfree(residual);
+
+	return (Pointer) code;
+}
+
+/*
+ * Create codebook pages and add them to the metapage
+ */
+void
+IvfpqCreateCodebookPages(Relation index, const float *centroids, int dimensions, int subvectors, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber codebookPage;
+	IvfflatMetaPage metap;
+	Size		length = IVFPQ_CODEBOOK_LENGTH(dimensions);
+	Size		offset = 0;
+
+	buf = IvfflatNewBuffer(index, forkNum);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+	codebookPage = BufferGetBlockNumber(buf);
+
+	for (;;)
+	{
+		Size		count = Min(length - offset, IVFPQ_PAGE_FLOATS);
+
+		memcpy(PageGetContents(page), centroids + offset, count * sizeof(float));
+		((PageHeader) page)->pd_lower = (LocationIndex) (MAXALIGN(SizeOfPageHeaderData) + count * sizeof(float));
+		offset += count;
+
+		if (offset == length)
+			break;
+
+		IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+	}
+
+	IvfflatCommitBuffer(buf, state);
+
+	/* Update the metapage */
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	metap = IvfflatPageGetMeta(page);
+	metap->pqSubvectors = (uint16) subvectors;
+	metap->codebookPage = codebookPage;
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Read codebooks from pages
+ */
+void
+IvfpqReadCodebooks(Relation index, BlockNumber blkno, float *centroids, Size length)
+{
+	Size		offset = 0;
+
+	while (offset < length)
+	{
+		Buffer		buf;
+		Page		page;
+		Size		count;
+
+		/* Safety check */
+		if (!BlockNumberIsValid(blkno))
+			elog(ERROR, "ivfflat index is not valid");
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		count = (((PageHeader) page)->pd_lower - MAXALIGN(SizeOfPageHeaderData)) / sizeof(float);
+
+		/* Safety check */
+		if (count > length - offset)
+			elog(ERROR, "ivfflat index is not valid");
+
+		memcpy(centroids + offset, PageGetContents(page), count * sizeof(float));
+		offset += count;
+
+		blkno = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Get the codebooks for an index
+ *
+ * Uses the codebooks cached in rd_amcache, which are kept even when the
+ * centers do not fit, so the result should not be kept after the next cache
+ * invalidation
+ */
+const float *
+IvfpqGetCodebooks(Relation index)
+{
+	IvfflatCenterCache *cache;
+	int			dimensions;
+	int			subvectors;
+	BlockNumber codebookPage;
+	float	   *centroids;
+
+	(void) IvfflatGetCenterCache(index);
+	cache = (IvfflatCenterCache *) index->rd_amcache;
+	if (cache != NULL && cache->codebooks != NULL)
+		return cache->codebooks;
+
+	IvfflatGetMetaPageInfo(index, NULL, &dimensions);
+	IvfpqGetMetaPageInfo(index, &subvectors, &codebookPage);
+
+	centroids = palloc_extended(mul_size(IVFPQ_CODEBOOK_LENGTH(dimensions), sizeof(float)), MCXT_ALLOC_HUGE);
+	IvfpqReadCodebooks(index, codebookPage, centroids, IVFPQ_CODEBOOK_LENGTH(dimensions));
+
+	return centroids;
+}
+
+/*
+ * Prepare for scoring codes
+ */
+IvfpqScanData *
+IvfpqBeginScan(Relation index, int dimensions, int subvectors)
+{
+	IvfpqScanData *pq = palloc0_object(IvfpqScanData);
+	int			subdim = dimensions / subvectors;
+	Size		length = IVFPQ_CODEBOOK_LENGTH(dimensions);
+
+	pq->metric = IvfpqGetMetric(index);
+	pq->dimensions = dimensions;
+	pq->subvectors = subvectors;
+	pq->rerank = ivfflat_pq_rerank;
+
+	/* Copy since the cache can be invalidated during the scan */
+	pq->centroids = palloc_extended(mul_size(length, sizeof(float)), MCXT_ALLOC_HUGE);
+	memcpy(pq->centroids, IvfpqGetCodebooks(index), mul_size(length, sizeof(float)));
+
+	/* Norms are used to bound inner products */
+	if (pq->metric != IVFPQ_METRIC_L2)
+	{
+		pq->norms = palloc_array_checked(float, (Size) subvectors * IVFPQ_CENTROIDS);
+		for (int k = 0; k < subvectors * IVFPQ_CENTROIDS; k++)
+		{
+			float	   *centroid = pq->centroids + (Size) k * subdim;
+
+			pq->norms[k] = SubvectorInnerProduct(subdim, centroid, centroid);
+		}
+	}
+
+	pq->table = palloc_array_checked(float, (Size) subvectors * IVFPQ_CENTROIDS);
+	pq->tableReady = false;
+
+	return pq;
+}
+
+/*
+ * Build the lookup table for a list
+ *
+ * For L2 distance, the table has the distance from the query residual to
+ * each centroid. For inner product, the table has the inner product of the
+ * query with each centroid and does not depend on the list.
+ */
+void
+IvfpqPrepareList(IvfpqScanData * pq, Vector * center, Vector * query, double listDistance)
+{
+	int			subdim = pq->dimensions / pq->subvectors;
+
+	if (pq->metric == IVFPQ_METRIC_L2)
+	{
+		float	   *residual = palloc_array_checked(float, (Size) pq->dimensions);
+
+		for (int d = 0; d < pq->dimensions; d++)
+			residual[d] = query->x[d] - center->x[d];
+
+		for (int j = 0; j < pq->subvectors; j++)
+		{
+			for (int k = 0; k < IVFPQ_CENTROIDS; k++)
+			{
+				Size		idx = (Size) j * IVFPQ_CENTROIDS + k;
+
+				pq->table[idx] = SubvectorL2SquaredDistance(subdim, residual + j * subdim, pq->centroids + idx * subdim);
+			}
+		}
+
+		pfree(residual);
+		return;
+	}
+
+	if (!pq->tableReady)
+	{
+		for (int j = 0; j < pq->subvectors; j++)
+		{
+			for (int k = 0; k < IVFPQ_CENTROIDS; k++)
+			{
+				Size		idx = (Size) j * IVFPQ_CENTROIDS + k;
+
+				pq->table[idx] = SubvectorInnerProduct(subdim, query->x + j * subdim, pq->centroids + idx * subdim);
+			}
+		}
+
+		pq->queryNorm = sqrt(SubvectorInnerProduct(pq->dimensions, query->x, query->x));
+		pq->tableReady = true;
+	}
+
+	/* Negative inner product with the center */
+	pq->listDistance = listDistance;
+	pq->centerNorm = sqrt(SubvectorInnerProduct(pq->dimensions, center->x, center->x));
+}
+
+/*
+ * Get the distance for a code
+ *
+ * Without reranking, this is the estimated distance in the units of the
+ * distance support function. With reranking, this is a lower bound on the
+ * distance in the units of the operator, so the executor can reorder rows
+ * by their exact distances.
+ */
+double
+IvfpqDistance(IvfpqScanData * pq, Pointer code)
+{
+	IvfpqCode  *pqcode = (IvfpqCode *) code;
+	const float *table = pq->table;
+	double		error = pqcode->error;
+	double		sum = 0.0;
+
+	for (int j = 0; j < pq->subvectors; j++)
+		sum += table[j * IVFPQ_CENTROIDS + pqcode->codes[j]];
+
+	if (pq->metric == IVFPQ_METRIC_L2)
+	{
+		double		estimate;
+		double		bound;
+
+		if (!pq->rerank)
+			return sum;
+
+		/* Triangle inequality */
+		estimate = sqrt(Max(sum, 0.0));
+		bound = estimate - error - IVFPQ_BOUND_EPSILON * (estimate + error);
+
+		return Max(bound, 0.0);
+	}
+	else
+	{
+		double		distance = pq->listDistance - sum;
+		double		residualNorm;
+		double		bound;
+
+		if (!pq->rerank)
+			return distance;
+
+		/* Cauchy-Schwarz inequality */
+		residualNorm = 0.0;
+		for (int j = 0; j < pq->subvectors; j++)
+			residualNorm += pq->norms[j * IVFPQ_CENTROIDS + pqcode->codes[j]];
+		residualNorm = sqrt(residualNorm);
+
+		bound = distance - pq->queryNorm * error;
+		bound -= IVFPQ_BOUND_EPSILON * pq->queryNorm * (pq->centerNorm + residualNorm + error);
+
+		/* Cosine distance is one minus the inner product of unit vectors */
+		if (pq->metric == IVFPQ_METRIC_COSINE)
+			bound += 1.0;
+
+		return bound;
+	}
+}
@@ -1,6 +1,7 @@
 #include "postgres.h"
 
 #include <float.h>
+#include <math.h>
 
 #include "access/genam.h"
 #include "access/itup.h"
@@ -23,9 +24,14 @@
 #include "varatt.h"
 #endif
 
+/* Items sorted at a time for the first batch */
+#define IVFFLAT_SORT_CHUNK_SIZE	32
+
 #define GetScanList(ptr) pairingheap_container(IvfflatScanList, ph_node, ptr)
 #define GetScanListConst(ptr) pairingheap_const_container(IvfflatScanList, ph_node, ptr)
 
+static Tuplesortstate *InitScanSortState(TupleDesc tupdesc);
+
 /*
  * Compare list distances
  */
@@ -41,6 +47,166 @@ CompareLists(const pairingheap_node *a, const pairingheap_node *b, void *arg)
 	return 0;
 }
 
+/*
+ * Add a list if it is one of the closest
+ */
+static inline void
+AddScanList(IvfflatScanOpaque so, BlockNumber startPage, ListInfo listInfo, int list, double distance, int *listCount, double *maxDistance)
+{
+	IvfflatScanList *scanlist;
+
+	if (*listCount < so->maxProbes)
+	{
+		scanlist = &so->lists[*listCount];
+		scanlist->startPage = startPage;
+		scanlist->listInfo = listInfo;
+		scanlist->list = list;
+		scanlist->distance = distance;
+		(*listCount)++;
+
+		/* Add to heap */
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Calculate max distance */
+		if (*listCount == so->maxProbes)
+			*maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
+	}
+	else if (distance < *maxDistance)
+	{
+		/* Remove */
+		scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+
+		/* Reuse */
+		scanlist->startPage = startPage;
+		scanlist->listInfo = listInfo;
+		scanlist->list = list;
+		scanlist->distance = distance;
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Update max distance */
+		*maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
+	}
+}
+
+/*
+ * Compare group distances
+ */
+static int
+CompareGroups(const void *a, const void *b)
+{
+	const IvfflatScanGroup *ga = (const IvfflatScanGroup *) a;
+	const IvfflatScanGroup *gb = (const IvfflatScanGroup *) b;
+
+	if (ga->distance < gb->distance)
+		return -1;
+
+	if (ga->distance > gb->distance)
+		return 1;
+
+	/* Keep order deterministic for parallel scans */
+	return ga->group - gb->group;
+}
+
+/*
+ * Compare lists by location
+ */
+static int
+CompareListLocations(const void *a, const void *b, void *arg)
+{
+	const ListInfo *listInfo = (const ListInfo *) arg;
+	const ListInfo *la = &listInfo[*((const int *) a)];
+	const ListInfo *lb = &listInfo[*((const int *) b)];
+
+	if (la->blkno != lb->blkno)
+		return la->blkno < lb->blkno ? -1 : 1;
+
+	return (int) la->offno - (int) lb->offno;
+}
+
+/*
+ * Add lists from the closest groups
+ *
+ * Centers of lists are read from list pages when they are not cached.
+ */
+static void
+AddGroupScanLists(IndexScanDesc scan, IvfflatCenterCache * cache, Datum value, int *listCount, double *maxDistance)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatScanGroup *groups = palloc_array_checked(IvfflatScanGroup, cache->groups);
+	int		   *candidates = palloc_array_checked(int, Max(cache->lists, 1));
+	int			candidateCount = 0;
+	int			minCandidates = so->probes;
+
+	/* Iterative scans can search up to max probes lists */
+	if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF)
+		minCandidates = so->maxProbes;
+
+	for (int g = 0; g < cache->groups; g++)
+	{
+		groups[g].group = g;
+		groups[g].distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, IvfflatGroupCenterGet(cache, g), value));
+	}
+
+	qsort(groups, cache->groups, sizeof(IvfflatScanGroup), CompareGroups);
+
+	/* Search enough groups to find the lists */
+	for (int g = 0; g < cache->groups && (g < ivfflat_group_probes || candidateCount < minCandidates); g++)
+	{
+		int			group = groups[g].group;
+
+		for (int j = cache->groupStarts[group]; j < cache->groupStarts[group + 1]; j++)
+			candidates[candidateCount++] = cache->groupLists[j];
+	}
+
+	if (cache->centers != NULL)
+	{
+		for (int j = 0; j < candidateCount; j++)
+		{
+			int			i = candidates[j];
+			double		distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, IvfflatCenterCacheGet(cache, i), value));
+
+			AddScanList(so, cache->startPages[i], cache->listInfo[i], i, distance, listCount, maxDistance);
+		}
+	}
+	else
+	{
+		Buffer		cbuf = InvalidBuffer;
+		Page		cpage = NULL;
+
+		/* Read each list page once */
+		qsort_arg(candidates, candidateCount, sizeof(int), CompareListLocations, cache->listInfo);
+
+		for (int j = 0; j < candidateCount; j++)
+		{
+			int			i = candidates[j];
+			ListInfo	listInfo = cache->listInfo[i];
+			IvfflatList list;
+			double		distance;
+
+			if (!BufferIsValid(cbuf) || BufferGetBlockNumber(cbuf) != listInfo.blkno)
+			{
+				if (BufferIsValid(cbuf))
+					UnlockReleaseBuffer(cbuf);
+
+				cbuf = ReadBuffer(scan->indexRelation, listInfo.blkno);
+				LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+				cpage = BufferGetPage(cbuf);
+			}
+
+			list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, listInfo.offno));
+			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
+
+			AddScanList(so, cache->startPages[i], listInfo, i, distance, listCount, maxDistance);
+		}
+
+		if (BufferIsValid(cbuf))
+			UnlockReleaseBuffer(cbuf);
+	}
+
+	pfree(groups);
+	pfree(candidates);
+}
+
 /*
  * Get lists and sort by distance
  */
@@ -48,9 +214,51 @@ static void
 GetScanLists(IndexScanDesc scan, Datum value)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatCenterCache *cache = IvfflatGetCenterCache(scan->indexRelation);
 	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
 	int			listCount = 0;
 	double		maxDistance = DBL_MAX;
+	double	   *distances;
+	bool		readPages;
+
+	so->startPageCount = 0;
+
+	/* Only search lists in the closest groups (maxStartPages is the number of lists) */
+	if (ivfflat_group_probes > 0 && ivfflat_group_probes < IVFFLAT_GROUPS(so->maxStartPages))
+	{
+		IvfflatCenterCache *groupCache = IvfflatGetGroupCache(scan->indexRelation);
+
+		if (groupCache != NULL)
+		{
+			AddGroupScanLists(scan, groupCache, value, &listCount, &maxDistance);
+
+			so->startPageCount = Min(groupCache->lists, so->maxStartPages);
+			memcpy(so->startPages, groupCache->sortedStartPages, so->startPageCount * sizeof(BlockNumber));
+			so->entryEnd = groupCache->entryEnd;
+
+			nextblkno = InvalidBlockNumber;
+		}
+	}
+
+	/* Use cached centers to avoid reading list pages */
+	if (cache != NULL && BlockNumberIsValid(nextblkno))
+	{
+		for (int i = 0; i < cache->lists; i++)
+		{
+			/* Use procinfo from the index instead of scan key for performance */
+			double		distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, IvfflatCenterCacheGet(cache, i), value));
+
+			AddScanList(so, cache->startPages[i], cache->listInfo[i], i, distance, &listCount, &maxDistance);
+		}
+
+		so->startPageCount = Min(cache->lists, so->maxStartPages);
+		memcpy(so->startPages, cache->sortedStartPages, so->startPageCount * sizeof(BlockNumber));
+		so->entryEnd = cache->entryEnd;
+
+		nextblkno = InvalidBlockNumber;
+	}
+
+	readPages = BlockNumberIsValid(nextblkno);
 
 	/* Search all list pages */
 	while (BlockNumberIsValid(nextblkno))
@@ -68,53 +276,335 @@ GetScanLists(IndexScanDesc scan, Datum value)
 		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 		{
 			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			ListInfo	listInfo = {nextblkno, offno};
 			double		distance;
 
 			/* Use procinfo from the index instead of scan key for performance */
 			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
 
-			if (listCount < so->maxProbes)
-			{
-				IvfflatScanList *scanlist;
+			AddScanList(so, list->startPage, listInfo, -1, distance, &listCount, &maxDistance);
 
-				scanlist = &so->lists[listCount];
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				listCount++;
+			if (so->startPageCount < so->maxStartPages)
+				so->startPages[so->startPageCount++] = list->startPage;
+		}
 
-				/* Add to heap */
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
 
-				/* Calculate max distance */
-				if (listCount == so->maxProbes)
-					maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
-			}
-			else if (distance < maxDistance)
-			{
-				IvfflatScanList *scanlist;
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	/* Sort start pages to find where chains end */
+	if (readPages)
+	{
+		qsort(so->startPages, so->startPageCount, sizeof(BlockNumber), IvfflatCompareBlockNumbers);
+		so->entryEnd = IvfflatGetEntryEnd(scan->indexRelation);
+	}
+
+	distances = palloc_array_checked(double, Max(listCount, 1));
+
+	for (int i = listCount - 1; i >= 0; i--)
+	{
+		IvfflatScanList *scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+
+		so->listPages[i] = scanlist->startPage;
+		so->listInfos[i] = scanlist->listInfo;
+		so->listIds[i] = scanlist->list;
+		distances[i] = scanlist->distance;
+	}
+
+	Assert(pairingheap_is_empty(so->listQueue));
+
+	so->firstProbes = Min(so->probes, listCount);
+
+	/* Add lists almost as close as the closest list */
+	if (ivfflat_adaptive_probes > 1 && listCount > 0)
+	{
+		/* Distances can be negative for inner product */
+		double		maxDistance = distances[0] + (ivfflat_adaptive_probes - 1) * fabs(distances[0]);
 
-				/* Remove */
-				scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+		while (so->firstProbes < listCount && distances[so->firstProbes] <= maxDistance)
+			so->firstProbes++;
+	}
+
+	/* Only search more lists for iterative scans */
+	if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF)
+		so->totalProbes = listCount;
+	else
+		so->totalProbes = so->firstProbes;
+
+	pfree(distances);
+}
 
-				/* Reuse */
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
+/*
+ * Compare distances, with NaN last like float8 sorting
+ */
+static inline int
+CompareDistances(double a, double b)
+{
+	if (isnan(a))
+		return isnan(b) ? 0 : 1;
 
-				/* Update max distance */
-				maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
+	if (isnan(b))
+		return -1;
+
+	if (a < b)
+		return -1;
+
+	if (a > b)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Compare scan items
+ */
+static int
+CompareScanItems(const void *a, const void *b)
+{
+	return CompareDistances(((const IvfflatScanItem *) a)->distance, ((const IvfflatScanItem *) b)->distance);
+}
+
+/*
+ * Move the k closest items to the front (quickselect)
+ */
+static void
+SelectScanItems(IvfflatScanItem * items, int64 n, int64 k)
+{
+	int64		lo = 0;
+	int64		hi = n - 1;
+
+	while (lo < hi)
+	{
+		double		pivot = items[lo + (hi - lo) / 2].distance;
+		int64		i = lo;
+		int64		j = hi;
+
+		while (i <= j)
+		{
+			while (i <= hi && CompareDistances(items[i].distance, pivot) < 0)
+				i++;
+
+			while (j >= lo && CompareDistances(items[j].distance, pivot) > 0)
+				j--;
+
+			if (i <= j)
+			{
+				IvfflatScanItem tmp = items[i];
+
+				items[i] = items[j];
+				items[j] = tmp;
+				i++;
+				j--;
 			}
 		}
 
-		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+		if (k - 1 <= j)
+			hi = j;
+		else if (k - 1 >= i)
+			lo = i;
+		else
+			break;
+	}
+}
 
-		UnlockReleaseBuffer(cbuf);
+/*
+ * Sort the next closest items
+ *
+ * Most queries only need the first few items, so sort a small number at a
+ * time and double it each time more are needed
+ */
+static void
+SortNextItems(IvfflatScanOpaque so)
+{
+	IvfflatScanItem *items = &so->items[so->sortedCount];
+	int64		remaining = so->itemCount - so->sortedCount;
+	int64		count = Min(Max(so->sortedCount, IVFFLAT_SORT_CHUNK_SIZE), remaining);
+
+	if (count < remaining)
+		SelectScanItems(items, remaining, count);
+
+	qsort(items, count, sizeof(IvfflatScanItem), CompareScanItems);
+	so->sortedCount += count;
+}
+
+/*
+ * Move items to tuplesort when they exceed work_mem
+ */
+static void
+SpillScanItems(IvfflatScanOpaque so)
+{
+	TupleTableSlot *slot = so->vslot;
+
+	if (so->sortstate == NULL)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+		so->sortstate = InitScanSortState(so->tupdesc);
+		MemoryContextSwitchTo(oldCtx);
 	}
+	else
+		tuplesort_reset(so->sortstate);
 
-	for (int i = listCount - 1; i >= 0; i--)
-		so->listPages[i] = GetScanList(pairingheap_remove_first(so->listQueue))->startPage;
+	for (int64 i = 0; i < so->itemCount; i++)
+	{
+		ExecClearTuple(slot);
+		slot->tts_values[0] = Float8GetDatum(so->items[i].distance);
+		slot->tts_isnull[0] = false;
+		slot->tts_values[1] = PointerGetDatum(&so->items[i].heaptid);
+		slot->tts_isnull[1] = false;
+		ExecStoreVirtualTuple(slot);
+
+		tuplesort_puttupleslot(so->sortstate, slot);
+	}
 
-	Assert(pairingheap_is_empty(so->listQueue));
+	so->itemCount = 0;
+	so->useSort = true;
+}
+
+/*
+ * Add an item
+ */
+static inline void
+AddScanItem(IvfflatScanOpaque so, Datum distance, ItemPointer heaptid)
+{
+	if (so->useSort)
+	{
+		TupleTableSlot *slot = so->vslot;
+
+		ExecClearTuple(slot);
+		slot->tts_values[0] = distance;
+		slot->tts_isnull[0] = false;
+		slot->tts_values[1] = PointerGetDatum(heaptid);
+		slot->tts_isnull[1] = false;
+		ExecStoreVirtualTuple(slot);
+
+		tuplesort_puttupleslot(so->sortstate, slot);
+		return;
+	}
+
+	if (so->itemCount == so->maxItems)
+	{
+		int64		maxItems = (int64) work_mem * 1024 / sizeof(IvfflatScanItem);
+
+		if (so->maxItems >= maxItems)
+		{
+			SpillScanItems(so);
+			AddScanItem(so, distance, heaptid);
+			return;
+		}
+
+		so->maxItems = Min(so->maxItems * 2, maxItems);
+		so->items = repalloc_huge(so->items, so->maxItems * sizeof(IvfflatScanItem));
+	}
+
+	so->items[so->itemCount].distance = DatumGetFloat8(distance);
+	so->items[so->itemCount].heaptid = *heaptid;
+	so->itemCount++;
+}
+
+/*
+ * Get the next list to search
+ *
+ * Returns -1 when there are no more lists below the limit
+ */
+static int
+GetNextList(IndexScanDesc scan, int limit)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	int			listIndex = -1;
+
+	/* Claim lists from a shared counter for parallel scans */
+	if (scan->parallel_scan != NULL)
+	{
+		IvfflatParallelScan pscan = IvfflatGetParallelScan(scan->parallel_scan);
+
+		SpinLockAcquire(&pscan->mutex);
+		if (pscan->nextList < limit)
+			listIndex = pscan->nextList++;
+		SpinLockRelease(&pscan->mutex);
+
+		return listIndex;
+	}
+
+	if (so->listIndex < limit)
+		listIndex = so->listIndex++;
+
+	return listIndex;
+}
+
+/*
+ * Check if there are more lists to search
+ */
+static bool
+HasMoreLists(IndexScanDesc scan)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	bool		result;
+
+	if (scan->parallel_scan != NULL)
+	{
+		IvfflatParallelScan pscan = IvfflatGetParallelScan(scan->parallel_scan);
+
+		SpinLockAcquire(&pscan->mutex);
+		result = pscan->nextList < so->totalProbes;
+		SpinLockRelease(&pscan->mutex);
+
+		return result;
+	}
+
+	return so->listIndex < so->totalProbes;
+}
+
+/*
+ * Claim the next list for a batch
+ */
+static int
+GetNextBatchList(void *arg, BlockNumber *startPage)
+{
+	IvfflatScanBatch *batch = (IvfflatScanBatch *) arg;
+	IvfflatScanOpaque so = (IvfflatScanOpaque) batch->scan->opaque;
+	int			listIndex;
+
+	if (batch->probes == (so->first ? so->firstProbes : so->probes))
+		return -1;
+
+	/* The first batch is the closest lists across all participants */
+	listIndex = GetNextList(batch->scan, so->first ? so->firstProbes : so->totalProbes);
+	if (listIndex < 0)
+		return -1;
+
+	batch->probes++;
+	so->listsProbed++;
+	*startPage = so->listPages[listIndex];
+	return listIndex;
+}
+
+/*
+ * Prepare to score codes for a list
+ */
+static void
+PrepareScanList(IndexScanDesc scan, int listIndex, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatCenterCache *cache = IvfflatGetCenterCache(scan->indexRelation);
+	int			list = so->listIds[listIndex];
+	bool		cached = cache != NULL && list >= 0 && list < cache->lists;
+	Datum		center;
+	double		listDistance;
+
+	/* Use the cached center to avoid reading the list page */
+	if (cached)
+		center = IvfflatCenterCacheGet(cache, list);
+	else
+		center = IvfflatGetListCenter(scan->indexRelation, so->listInfos[listIndex]);
+
+	listDistance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, center, value));
+
+	IvfpqPrepareList(so->pq, DatumGetVector(center), DatumGetVector(value), listDistance);
+
+	if (!cached)
+		pfree(DatumGetPointer(center));
 }
 
 /*
@@ -125,15 +615,26 @@ GetScanItems(IndexScanDesc scan, Datum value)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
-	TupleTableSlot *slot = so->vslot;
-	int			batchProbes = 0;
+	bool		usePq = so->pq != NULL && DatumGetPointer(value) != NULL;
+	IvfflatScanBatch batch = {scan, 0};
+	IvfflatListStream *ls;
+	int			listIndex;
+
+	so->itemCount = 0;
+	so->itemIndex = 0;
+	so->sortedCount = 0;
+	so->useSort = false;
 
-	tuplesort_reset(so->sortstate);
+	ls = IvfflatBeginListStream(scan->indexRelation, so->bas, so->startPages, so->startPageCount, so->entryEnd, GetNextBatchList, &batch, false);
 
 	/* Search closest probes lists */
-	while (so->listIndex < so->maxProbes && (++batchProbes) <= so->probes)
+	while ((listIndex = IvfflatListStreamNextList(ls)) >= 0)
 	{
-		BlockNumber searchPage = so->listPages[so->listIndex++];
+		BlockNumber searchPage = so->listPages[listIndex];
+
+		/* Build the lookup table for codes in the list */
+		if (usePq)
+			PrepareScanList(scan, listIndex, value);
 
 		/* Search all entry pages for list */
 		while (BlockNumberIsValid(searchPage))
@@ -142,9 +643,38 @@ GetScanItems(IndexScanDesc scan, Datum value)
 			Page		page;
 			OffsetNumber maxoffno;
 
-			buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, searchPage, RBM_NORMAL, so->bas);
+			buf = IvfflatListStreamReadBuffer(ls, searchPage);
 			LockBuffer(buf, BUFFER_LOCK_SHARE);
 			page = BufferGetPage(buf);
+
+			if (IvfflatPageIsPacked(page))
+			{
+				ItemPointer tids = IvfflatPackedGetTids(page);
+				int			count = IvfflatPackedCount(page);
+
+				if (usePq)
+				{
+					/* Score codes with the lookup table */
+					for (int i = 0; i < count; i++)
+						AddScanItem(so, Float8GetDatum(IvfpqDistance(so->pq, IvfflatPackedGetValue(page, i))), &tids[i]);
+				}
+				else
+				{
+					/* Values are contiguous and stored in place */
+					for (int i = 0; i < count; i++)
+					{
+						Datum		datum = PointerGetDatum(IvfflatPackedGetValue(page, i));
+
+						AddScanItem(so, so->distfunc(so->procinfo, so->collation, datum, value), &tids[i]);
+					}
+				}
+
+				searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+				UnlockReleaseBuffer(buf);
+				continue;
+			}
+
 			maxoffno = PageGetMaxOffsetNumber(page);
 
 			for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
@@ -158,19 +688,10 @@ GetScanItems(IndexScanDesc scan, Datum value)
 				datum = index_getattr(itup, 1, tupdesc, &isnull);
 
 				/*
-				 * Add virtual tuple
-				 *
 				 * Use procinfo from the index instead of scan key for
 				 * performance
 				 */
-				ExecClearTuple(slot);
-				slot->tts_values[0] = so->distfunc(so->procinfo, so->collation, datum, value);
-				slot->tts_isnull[0] = false;
-				slot->tts_values[1] = PointerGetDatum(&itup->t_tid);
-				slot->tts_isnull[1] = false;
-				ExecStoreVirtualTuple(slot);
-
-				tuplesort_puttupleslot(so->sortstate, slot);
+				AddScanItem(so, so->distfunc(so->procinfo, so->collation, datum, value), &itup->t_tid);
 			}
 
 			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
@@ -179,13 +700,45 @@ GetScanItems(IndexScanDesc scan, Datum value)
 		}
 	}
 
-	tuplesort_performsort(so->sortstate);
+	IvfflatEndListStream(ls);
+
+	if (so->useSort)
+		tuplesort_performsort(so->sortstate);
 
 #if defined(IVFFLAT_MEMORY)
 	elog(INFO, "memory: %zu MB", MemoryContextMemAllocated(CurrentMemoryContext, true) / (1024 * 1024));
 #endif
 }
 
+/*
+ * Get the next item
+ */
+static bool
+GetNextItem(IvfflatScanOpaque so, ItemPointer heaptid, double *distance)
+{
+	if (so->useSort)
+	{
+		bool		isnull;
+
+		if (!tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
+			return false;
+
+		*distance = DatumGetFloat8(slot_getattr(so->mslot, 1, &isnull));
+		*heaptid = *((ItemPointer) DatumGetPointer(slot_getattr(so->mslot, 2, &isnull)));
+		return true;
+	}
+
+	if (so->itemIndex == so->itemCount)
+		return false;
+
+	if (so->itemIndex == so->sortedCount)
+		SortNextItems(so);
+
+	*distance = so->items[so->itemIndex].distance;
+	*heaptid = so->items[so->itemIndex++].heaptid;
+	return true;
+}
+
 /*
  * Zero distance
  */
@@ -258,6 +811,7 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	int			dimensions;
 	int			probes = ivfflat_probes;
 	int			maxProbes;
+	int			subvectors;
 	MemoryContext oldCtx;
 
 	scan = RelationGetIndexScan(index, nkeys, norderbys);
@@ -265,7 +819,7 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	/* Get lists and dimensions from metapage */
 	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
 
-	if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF)
+	if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF || ivfflat_adaptive_probes > 1)
 		maxProbes = Max(ivfflat_max_probes, probes);
 	else
 		maxProbes = probes;
@@ -280,7 +834,10 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	so->typeInfo = IvfflatGetTypeInfo(index);
 	so->first = true;
 	so->probes = probes;
+	so->firstProbes = probes;
+	so->totalProbes = probes;
 	so->maxProbes = maxProbes;
+	so->listsProbed = 0;
 	so->dimensions = dimensions;
 	so->value = PointerGetDatum(NULL);
 
@@ -303,8 +860,16 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	TupleDescFinalize(so->tupdesc);
 #endif
 
-	/* Prep sort */
-	so->sortstate = InitScanSortState(so->tupdesc);
+	/* Sort state is only created if items exceed work_mem */
+	so->sortstate = NULL;
+	so->useSort = false;
+
+	/* Prep items */
+	so->maxItems = 1024;
+	so->items = palloc_array_checked(IvfflatScanItem, (Size) so->maxItems);
+	so->itemCount = 0;
+	so->itemIndex = 0;
+	so->sortedCount = 0;
 
 	/* Need separate slots for puttuple and gettuple */
 	so->vslot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
@@ -319,8 +884,28 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 
 	so->listQueue = pairingheap_allocate(CompareLists, scan);
 	so->listPages = palloc_array_checked(BlockNumber, (Size) maxProbes);
+	so->listInfos = palloc_array_checked(ListInfo, (Size) maxProbes);
+	so->listIds = palloc_array_checked(int, (Size) maxProbes);
 	so->listIndex = 0;
 	so->lists = palloc_array_checked(IvfflatScanList, (Size) maxProbes);
+	so->startPages = palloc_array_checked(BlockNumber, (Size) lists);
+	so->maxStartPages = lists;
+
+	/* Prepare product quantization */
+	IvfpqGetMetaPageInfo(index, &subvectors, NULL);
+	if (subvectors > 0)
+	{
+		so->pq = IvfpqBeginScan(index, dimensions, subvectors);
+
+		/* Lower bounds are returned for reranking */
+		if (so->pq->rerank && norderbys > 0)
+		{
+			scan->xs_orderbyvals = palloc0_array_checked(Datum, (Size) norderbys);
+			scan->xs_orderbynulls = palloc_array_checked(bool, (Size) norderbys);
+		}
+	}
+	else
+		so->pq = NULL;
 
 	MemoryContextSwitchTo(oldCtx);
 
@@ -341,6 +926,10 @@ ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int
 	pairingheap_reset(so->listQueue);
 	so->listIndex = 0;
 
+	/* Lookup table depends on the query */
+	if (so->pq != NULL)
+		so->pq->tableReady = false;
+
 	if (so->normprocinfo != NULL && DatumGetPointer(so->value) != NULL)
 	{
 		pfree(DatumGetPointer(so->value));
@@ -361,8 +950,8 @@ bool
 ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
-	ItemPointer heaptid;
-	bool		isnull;
+	ItemPointerData heaptid;
+	double		distance;
 
 	/*
 	 * Index can be used to scan backward, but Postgres doesn't support
@@ -397,19 +986,26 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 		so->value = value;
 	}
 
-	while (!tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
+	while (!GetNextItem(so, &heaptid, &distance))
 	{
-		if (so->listIndex == so->maxProbes)
+		if (!HasMoreLists(scan))
 			return false;
 
 		IvfflatBench("GetScanItems", GetScanItems(scan, so->value));
 	}
 
-	heaptid = (ItemPointer) DatumGetPointer(slot_getattr(so->mslot, 2, &isnull));
-
-	scan->xs_heaptid = *heaptid;
+	scan->xs_heaptid = heaptid;
 	scan->xs_recheck = false;
 	scan->xs_recheckorderby = false;
+
+	/* Let the executor reorder rows by exact distance */
+	if (so->pq != NULL && so->pq->rerank && DatumGetPointer(so->value) != NULL)
+	{
+		scan->xs_orderbyvals[0] = Float8GetDatum(distance);
+		scan->xs_orderbynulls[0] = false;
+		scan->xs_recheckorderby = true;
+	}
+
 	return true;
 }
 
@@ -422,10 +1018,53 @@ ivfflatendscan(IndexScanDesc scan)
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
 	/* Free any temporary files */
-	tuplesort_end(so->sortstate);
+	if (so->sortstate != NULL)
+		tuplesort_end(so->sortstate);
 
 	MemoryContextDelete(so->tmpCtx);
 
 	pfree(so);
 	scan->opaque = NULL;
 }
+
+/*
+ * Estimate the size of shared memory for a parallel scan
+ */
+#if PG_VERSION_NUM >= 180000
+Size
+ivfflatestimateparallelscan(Relation indexRelation, int nkeys, int norderbys)
+#elif PG_VERSION_NUM >= 170000
+Size
+ivfflatestimateparallelscan(int nkeys, int norderbys)
+#else
+Size
+ivfflatestimateparallelscan(void)
+#endif
+{
+	return sizeof(IvfflatParallelScanData);
+}
+
+/*
+ * Initialize shared memory for a parallel scan
+ */
+void
+ivfflatinitparallelscan(void *target)
+{
+	IvfflatParallelScan pscan = (IvfflatParallelScan) target;
+
+	SpinLockInit(&pscan->mutex);
+	pscan->nextList = 0;
+}
+
+/*
+ * Reset shared memory before restarting a parallel scan
+ */
+void
+ivfflatparallelrescan(IndexScanDesc scan)
+{
+	IvfflatParallelScan pscan = IvfflatGetParallelScan(scan->parallel_scan);
+
+	SpinLockAcquire(&pscan->mutex);
+	pscan->nextList = 0;
+	SpinLockRelease(&pscan->mutex);
+}
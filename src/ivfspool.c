@@ -0,0 +1,557 @@
+#include "postgres.h"
+
+#include <fcntl.h>
+
+#include "commands/tablespace.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/buffile.h"
+#include "storage/sharedfileset.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#define IVFFLAT_SPOOL_BLOCK_SIZE (64 * 1024)
+#define IVFFLAT_SPOOL_INITIAL_TUPLES 1024
+
+/*
+ * Get memory for the tuple array
+ *
+ * Includes space to sort the array
+ */
+#define SPOOL_ARRAY_SIZE(maxtuples) mul_size(2 * sizeof(IvfflatSpoolTuple *), (Size) (maxtuples))
+
+/*
+ * Get the name of the spool file for a participant
+ */
+static void
+SpoolFileName(char *name, int participant)
+{
+	snprintf(name, MAXPGPATH, "ivfflat-spool-%d", participant);
+}
+
+/*
+ * Read from a spool file
+ */
+static void
+SpoolRead(BufFile *file, void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+	BufFileReadExact(file, ptr, size);
+#else
+	if (BufFileRead(file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from ivfflat spool temporary file")));
+#endif
+}
+
+/*
+ * Seek in a spool file
+ */
+static void
+SpoolSeek(BufFile *file, int fileno, off_t offset)
+{
+	if (BufFileSeek(file, fileno, offset, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in ivfflat spool temporary file")));
+}
+
+/*
+ * Create the spool file
+ */
+static BufFile *
+CreateSpoolFile(IvfflatSpool * spool)
+{
+	char		name[MAXPGPATH];
+
+	if (spool->shared == NULL)
+	{
+		PrepareTempTablespaces();
+		return BufFileCreateTemp(false);
+	}
+
+	SpoolFileName(name, spool->participant);
+#if PG_VERSION_NUM >= 150000
+	return BufFileCreateFileSet(&spool->shared->fileset.fs, name);
+#else
+	return BufFileCreateShared(&spool->shared->fileset, name);
+#endif
+}
+
+/*
+ * Open the spool file of another participant
+ */
+static BufFile *
+OpenSpoolFile(IvfflatSharedSpool * shared, int participant)
+{
+	char		name[MAXPGPATH];
+
+	SpoolFileName(name, participant);
+#if PG_VERSION_NUM >= 150000
+	return BufFileOpenFileSet(&shared->fileset.fs, name, O_RDONLY, false);
+#elif PG_VERSION_NUM >= 140000
+	return BufFileOpenShared(&shared->fileset, name, O_RDONLY);
+#else
+	return BufFileOpenShared(&shared->fileset, name);
+#endif
+}
+
+/*
+ * Sort tuples by list with a counting sort
+ *
+ * listStarts must have space for lists + 1 entries
+ */
+static void
+SortSpoolTuples(IvfflatSpoolTuple * *tuples, int64 ntuples, int lists, IvfflatSpoolTuple * *sorted, int64 *listStarts)
+{
+	int64	   *positions = palloc0_array_checked(int64, (Size) lists);
+
+	for (int64 i = 0; i < ntuples; i++)
+		positions[tuples[i]->list]++;
+
+	listStarts[0] = 0;
+	for (int i = 0; i < lists; i++)
+	{
+		listStarts[i + 1] = listStarts[i] + positions[i];
+		positions[i] = listStarts[i];
+	}
+
+	for (int64 i = 0; i < ntuples; i++)
+		sorted[positions[tuples[i]->list]++] = tuples[i];
+
+	pfree(positions);
+}
+
+/*
+ * Write buffered tuples to the spool file as a new run
+ */
+static void
+FlushSpool(IvfflatSpool * spool)
+{
+	MemoryContext oldCtx = MemoryContextSwitchTo(spool->context);
+	IvfflatSpoolTuple **sorted;
+	int64	   *listStarts;
+	IvfflatSpoolRun *runs;
+
+	if (spool->file == NULL)
+		spool->file = CreateSpoolFile(spool);
+
+	sorted = MemoryContextAllocHuge(spool->context, mul_size(sizeof(IvfflatSpoolTuple *), (Size) spool->ntuples));
+	listStarts = palloc_array_checked(int64, (Size) spool->lists + 1);
+	SortSpoolTuples(spool->tuples, spool->ntuples, spool->lists, sorted, listStarts);
+
+	/* Add run */
+	if (spool->runs == NULL)
+		spool->runs = palloc_extended(mul_size(sizeof(IvfflatSpoolRun), (Size) spool->lists), MCXT_ALLOC_HUGE);
+	else
+		spool->runs = repalloc_huge(spool->runs, mul_size(sizeof(IvfflatSpoolRun), mul_size((Size) spool->nruns + 1, (Size) spool->lists)));
+	runs = spool->runs + (Size) spool->nruns * spool->lists;
+	spool->nruns++;
+
+	/* Write one list at a time */
+	for (int i = 0; i < spool->lists; i++)
+	{
+		BufFileTell(spool->file, &runs[i].fileno, &runs[i].offset);
+		runs[i].count = listStarts[i + 1] - listStarts[i];
+
+		for (int64 j = listStarts[i]; j < listStarts[i + 1]; j++)
+		{
+			IvfflatSpoolTuple *tuple = sorted[j];
+
+			BufFileWrite(spool->file, (void *) tuple, sizeof(IvfflatSpoolTuple));
+			BufFileWrite(spool->file, (void *) IvfflatSpoolTupleValue(tuple), tuple->size);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	pfree(sorted);
+	pfree(listStarts);
+
+	/* Release buffered tuples */
+	MemoryContextReset(spool->tupleCtx);
+	spool->ntuples = 0;
+	spool->block = NULL;
+	spool->blockFree = 0;
+	spool->memoryUsed = SPOOL_ARRAY_SIZE(spool->maxtuples);
+
+	MemoryContextSwitchTo(oldCtx);
+}
+
+/*
+ * Begin a spool
+ *
+ * Parallel participants pass the shared spool, where their file is
+ * recorded when finished
+ */
+IvfflatSpool *
+IvfflatSpoolBegin(int lists, Size memoryLimit, IvfflatSharedSpool * shared, int participant)
+{
+	IvfflatSpool *spool = palloc0_object(IvfflatSpool);
+
+	spool->lists = lists;
+	spool->memoryLimit = memoryLimit;
+	spool->context = CurrentMemoryContext;
+	spool->tupleCtx = AllocSetContextCreate(CurrentMemoryContext,
+											"Ivfflat spool tuple context",
+											ALLOCSET_DEFAULT_SIZES);
+
+	spool->maxtuples = IVFFLAT_SPOOL_INITIAL_TUPLES;
+	spool->tuples = palloc_array_checked(IvfflatSpoolTuple *, (Size) spool->maxtuples);
+	spool->memoryUsed = SPOOL_ARRAY_SIZE(spool->maxtuples);
+
+	spool->shared = shared;
+	spool->participant = participant;
+
+	return spool;
+}
+
+/*
+ * Add a tuple to the spool
+ *
+ * The value is copied
+ */
+void
+IvfflatSpoolPut(IvfflatSpool * spool, int list, ItemPointer tid, Pointer value)
+{
+	Size		valueSize = VARSIZE_ANY(value);
+	Size		tupleSize = MAXALIGN(sizeof(IvfflatSpoolTuple)) + MAXALIGN(valueSize);
+	Size		needed = 0;
+	IvfflatSpoolTuple *tuple;
+
+	Assert(list >= 0 && list < spool->lists);
+
+	/* Spill when the tuple does not fit in memory */
+	if (spool->blockFree < tupleSize)
+		needed = add_size(needed, Max(IVFFLAT_SPOOL_BLOCK_SIZE, tupleSize));
+	if (spool->ntuples == spool->maxtuples)
+		needed = add_size(needed, SPOOL_ARRAY_SIZE(spool->maxtuples));
+
+	if (spool->ntuples > 0 && add_size(spool->memoryUsed, needed) > spool->memoryLimit)
+		FlushSpool(spool);
+
+	/* Grow tuple array */
+	if (spool->ntuples == spool->maxtuples)
+	{
+		spool->memoryUsed = add_size(spool->memoryUsed, SPOOL_ARRAY_SIZE(spool->maxtuples));
+		spool->maxtuples *= 2;
+		spool->tuples = repalloc_huge(spool->tuples, mul_size(sizeof(IvfflatSpoolTuple *), (Size) spool->maxtuples));
+	}
+
+	/* Allocate block */
+	if (spool->blockFree < tupleSize)
+	{
+		Size		blockSize = Max(IVFFLAT_SPOOL_BLOCK_SIZE, tupleSize);
+
+		spool->block = MemoryContextAlloc(spool->tupleCtx, blockSize);
+		spool->blockFree = blockSize;
+		spool->memoryUsed = add_size(spool->memoryUsed, blockSize);
+	}
+
+	tuple = (IvfflatSpoolTuple *) spool->block;
+	tuple->list = list;
+	tuple->size = (uint32) valueSize;
+	tuple->tid = *tid;
+	memcpy(IvfflatSpoolTupleValue(tuple), value, valueSize);
+
+	spool->block += tupleSize;
+	spool->blockFree -= tupleSize;
+	spool->tuples[spool->ntuples++] = tuple;
+}
+
+/*
+ * Finish adding tuples
+ *
+ * Parallel participants write all tuples to their file and record it for
+ * the leader. Serial builds keep buffered tuples in memory.
+ */
+void
+IvfflatSpoolFinish(IvfflatSpool * spool)
+{
+	IvfflatSpoolFileInfo *info;
+
+	if (spool->shared == NULL)
+		return;
+
+	info = &spool->shared->files[spool->participant];
+
+	if (spool->ntuples > 0)
+		FlushSpool(spool);
+
+	if (spool->file == NULL)
+		return;
+
+	/* Write runs at the end of the file */
+	BufFileTell(spool->file, &info->fileno, &info->offset);
+	BufFileWrite(spool->file, (void *) spool->runs, mul_size(sizeof(IvfflatSpoolRun), mul_size((Size) spool->nruns, (Size) spool->lists)));
+	info->nruns = spool->nruns;
+
+	/* Make the file available to the leader */
+#if PG_VERSION_NUM >= 150000
+	BufFileExportFileSet(spool->file);
+#else
+	BufFileExportShared(spool->file);
+#endif
+	BufFileClose(spool->file);
+	spool->file = NULL;
+}
+
+/*
+ * End a spool
+ */
+void
+IvfflatSpoolEnd(IvfflatSpool * spool)
+{
+	if (spool->file != NULL)
+		BufFileClose(spool->file);
+
+	if (spool->runs != NULL)
+		pfree(spool->runs);
+
+	MemoryContextDelete(spool->tupleCtx);
+	pfree(spool->tuples);
+	pfree(spool);
+}
+
+/*
+ * Get the size of the shared spool
+ */
+Size
+IvfflatSharedSpoolEstimate(int nspools)
+{
+	return add_size(offsetof(IvfflatSharedSpool, files), mul_size(sizeof(IvfflatSpoolFileInfo), (Size) nspools));
+}
+
+/*
+ * Initialize the shared spool
+ */
+void
+IvfflatSharedSpoolInit(IvfflatSharedSpool * shared, int nspools, dsm_segment *seg)
+{
+	SharedFileSetInit(&shared->fileset, seg);
+	shared->nspools = nspools;
+
+	for (int i = 0; i < nspools; i++)
+		shared->files[i].nruns = 0;
+}
+
+/*
+ * Attach to the shared spool within a worker
+ */
+void
+IvfflatSharedSpoolAttach(IvfflatSharedSpool * shared, dsm_segment *seg)
+{
+	SharedFileSetAttach(&shared->fileset, seg);
+}
+
+/*
+ * Add a source of spilled tuples
+ */
+static void
+AddSource(IvfflatSpoolReader * reader, BufFile *file, bool owned, IvfflatSpoolRun * runs, int nruns)
+{
+	IvfflatSpoolSource *source = &reader->sources[reader->nsources++];
+
+	source->file = file;
+	source->owned = owned;
+	source->runs = runs;
+	source->nruns = nruns;
+}
+
+/*
+ * Begin reading tuples
+ *
+ * Reads the tuples of a serial spool and the spool files of parallel
+ * participants, if any
+ */
+IvfflatSpoolReader *
+IvfflatSpoolBeginRead(IvfflatSpool * spool, IvfflatSharedSpool * shared, int lists)
+{
+	IvfflatSpoolReader *reader = palloc0_object(IvfflatSpoolReader);
+	int			maxsources = (spool != NULL ? 1 : 0) + (shared != NULL ? shared->nspools : 0);
+
+	reader->lists = lists;
+	reader->list = -1;
+	reader->sources = palloc0_array_checked(IvfflatSpoolSource, (Size) Max(maxsources, 1));
+	reader->listStarts = palloc0_array_checked(int64, (Size) lists + 1);
+
+	if (spool != NULL)
+	{
+		/* Sort buffered tuples by list */
+		if (spool->ntuples > 0)
+		{
+			reader->tuples = MemoryContextAllocHuge(CurrentMemoryContext, mul_size(sizeof(IvfflatSpoolTuple *), (Size) spool->ntuples));
+			SortSpoolTuples(spool->tuples, spool->ntuples, lists, reader->tuples, reader->listStarts);
+		}
+
+		if (spool->file != NULL)
+			AddSource(reader, spool->file, false, spool->runs, spool->nruns);
+	}
+
+	if (shared != NULL)
+	{
+		for (int i = 0; i < shared->nspools; i++)
+		{
+			IvfflatSpoolFileInfo *info = &shared->files[i];
+			BufFile    *file;
+			IvfflatSpoolRun *runs;
+			Size		runsSize;
+
+			if (info->nruns == 0)
+				continue;
+
+			file = OpenSpoolFile(shared, i);
+			runsSize = mul_size(sizeof(IvfflatSpoolRun), mul_size((Size) info->nruns, (Size) lists));
+			runs = palloc_extended(runsSize, MCXT_ALLOC_HUGE);
+			SpoolSeek(file, info->fileno, info->offset);
+			SpoolRead(file, runs, runsSize);
+
+			AddSource(reader, file, true, runs, info->nruns);
+		}
+	}
+
+	return reader;
+}
+
+/*
+ * Move to the next segment of spilled tuples for the current list
+ *
+ * Returns false if there are no more segments for the list
+ */
+static bool
+NextSegment(IvfflatSpoolReader * reader)
+{
+	while (reader->source < reader->nsources)
+	{
+		IvfflatSpoolSource *source = &reader->sources[reader->source];
+
+		while (reader->run < source->nruns)
+		{
+			IvfflatSpoolRun *run = &source->runs[(Size) reader->run * reader->lists + reader->list];
+
+			reader->run++;
+
+			if (run->count > 0)
+			{
+				SpoolSeek(source->file, run->fileno, run->offset);
+				reader->remaining = run->count;
+				return true;
+			}
+		}
+
+		reader->source++;
+		reader->run = 0;
+	}
+
+	return false;
+}
+
+/*
+ * Read a spilled tuple
+ */
+static IvfflatSpoolTuple *
+ReadSpilledTuple(IvfflatSpoolReader * reader)
+{
+	BufFile    *file = reader->sources[reader->source].file;
+	IvfflatSpoolTuple header;
+	Size		tupleSize;
+
+	SpoolRead(file, &header, sizeof(IvfflatSpoolTuple));
+
+	tupleSize = MAXALIGN(sizeof(IvfflatSpoolTuple)) + header.size;
+	if (tupleSize > reader->bufferSize)
+	{
+		if (reader->buffer != NULL)
+			pfree(reader->buffer);
+
+		reader->bufferSize = Max(tupleSize, IVFFLAT_SPOOL_BLOCK_SIZE);
+		reader->buffer = palloc(reader->bufferSize);
+	}
+
+	*reader->buffer = header;
+	SpoolRead(file, IvfflatSpoolTupleValue(reader->buffer), header.size);
+	reader->remaining--;
+
+	return reader->buffer;
+}
+
+/*
+ * Get the next tuple in list order
+ *
+ * The value and TID are valid until the next call. Returns false when
+ * there are no more tuples.
+ */
+bool
+IvfflatSpoolGetTuple(IvfflatSpoolReader * reader, int *list, ItemPointer *tid, Pointer *value)
+{
+	IvfflatSpoolTuple *tuple;
+
+	for (;;)
+	{
+		if (reader->list >= 0)
+		{
+			/* Buffered tuples first */
+			if (reader->tuples != NULL && reader->tupleIndex < reader->listStarts[reader->list + 1])
+			{
+				tuple = reader->tuples[reader->tupleIndex++];
+				break;
+			}
+
+			/* Then spilled tuples */
+			if (reader->remaining > 0 || NextSegment(reader))
+			{
+				tuple = ReadSpilledTuple(reader);
+				break;
+			}
+		}
+
+		/* Move to next list */
+		reader->list++;
+		if (reader->list >= reader->lists)
+			return false;
+
+		reader->tupleIndex = reader->listStarts[reader->list];
+		reader->source = 0;
+		reader->run = 0;
+		reader->remaining = 0;
+	}
+
+	Assert(tuple->list == reader->list);
+
+	*list = tuple->list;
+	*tid = &tuple->tid;
+	*value = IvfflatSpoolTupleValue(tuple);
+	return true;
+}
+
+/*
+ * End reading tuples
+ */
+void
+IvfflatSpoolEndRead(IvfflatSpoolReader * reader)
+{
+	for (int i = 0; i < reader->nsources; i++)
+	{
+		IvfflatSpoolSource *source = &reader->sources[i];
+
+		if (source->owned)
+		{
+			BufFileClose(source->file);
+			pfree(source->runs);
+		}
+	}
+
+	if (reader->tuples != NULL)
+		pfree(reader->tuples);
+
+	if (reader->buffer != NULL)
+		pfree(reader->buffer);
+
+	pfree(reader->sources);
+	pfree(reader->listStarts);
+	pfree(reader);
+}
@@ -1,5 +1,8 @@
 #include "postgres.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "access/genam.h"
 #include "access/generic_xlog.h"
 #include "fmgr.h"
@@ -9,6 +12,7 @@
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/varbit.h"
 #include "vector.h"
@@ -65,6 +69,20 @@ IvfflatGetLists(Relation index)
 	return IVFFLAT_DEFAULT_LISTS;
 }
 
+/*
+ * Get whether to balance lists
+ */
+bool
+IvfflatGetBalanceLists(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts)
+		return opts->balanceLists;
+
+	return false;
+}
+
 /*
  * Get proc
  */
@@ -149,9 +167,59 @@ IvfflatInitPage(Buffer buf, Page page)
 {
 	PageInit(page, BufferGetPageSize(buf), sizeof(IvfflatPageOpaqueData));
 	IvfflatPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+	IvfflatPageGetOpaque(page)->itemsize = 0;
 	IvfflatPageGetOpaque(page)->page_id = IVFFLAT_PAGE_ID;
 }
 
+/*
+ * Get the stride of values on packed entry pages
+ */
+Size
+IvfflatPackedItemSize(const IvfflatTypeInfo * typeInfo, int dimensions)
+{
+	Size		itemsize = MAXALIGN(typeInfo->itemSize(dimensions));
+
+	/* Safety check */
+	if (itemsize > BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData)) - sizeof(ItemPointerData))
+		elog(ERROR, "item too large for ivfflat page");
+
+	return itemsize;
+}
+
+/*
+ * Add an item to a packed entry page
+ */
+void
+IvfflatPackedAddItem(Page page, ItemPointer heaptid, Pointer value)
+{
+	PageHeader	phdr = (PageHeader) page;
+	Size		itemsize = IvfflatPageGetOpaque(page)->itemsize;
+	int			count = IvfflatPackedCount(page);
+	Size		size = VARSIZE_ANY_EXHDR(value);
+	Pointer		dst;
+
+	/* Values from tuplesort can have short headers */
+	Assert(!VARATT_IS_EXTERNAL(value) && !VARATT_IS_COMPRESSED(value));
+
+	/* Safety check */
+	if (!IvfflatPackedHasSpace(page) || VARHDRSZ + size > itemsize)
+		elog(ERROR, "failed to add packed item");
+
+	IvfflatPackedGetTids(page)[count] = *heaptid;
+	phdr->pd_lower += sizeof(ItemPointerData);
+	phdr->pd_upper -= itemsize;
+
+	dst = IvfflatPackedGetValue(page, count);
+	Assert(dst == (char *) page + phdr->pd_upper);
+
+	/* Store with a regular header so values can be used in place */
+	SET_VARSIZE(dst, VARHDRSZ + size);
+	memcpy(VARDATA(dst), VARDATA_ANY(value), size);
+
+	/* Zero padding so pages are deterministic */
+	memset(dst + VARHDRSZ + size, 0, itemsize - VARHDRSZ - size);
+}
+
 /*
  * Init and register page
  */
@@ -188,8 +256,9 @@ IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **st
 	/* Update the previous buffer */
 	IvfflatPageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(newbuf);
 
-	/* Init new page */
+	/* Init new page with the same format */
 	IvfflatInitPage(newbuf, newpage);
+	IvfflatPageGetOpaque(newpage)->itemsize = IvfflatPageGetOpaque(*page)->itemsize;
 
 	/* Commit */
 	GenericXLogFinish(*state);
@@ -229,6 +298,676 @@ IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Get the first block after the entry pages written by the build
+ *
+ * Returns InvalidBlockNumber for indexes built by earlier versions
+ */
+BlockNumber
+IvfflatGetEntryEnd(Relation index)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+	BlockNumber entryEnd = InvalidBlockNumber;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	if (((PageHeader) page)->pd_lower >= ((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page)
+		entryEnd = metap->entryEnd;
+
+	UnlockReleaseBuffer(buf);
+
+	return entryEnd;
+}
+
+/*
+ * Load the codebooks into the relcache entry
+ */
+static float *
+LoadCodebooks(Relation index, int dimensions, BlockNumber codebookPage)
+{
+	float	   *codebooks;
+
+	codebooks = MemoryContextAllocExtended(index->rd_indexcxt, mul_size(IVFPQ_CODEBOOK_LENGTH(dimensions), sizeof(float)), MCXT_ALLOC_HUGE);
+	IvfpqReadCodebooks(index, codebookPage, codebooks, IVFPQ_CODEBOOK_LENGTH(dimensions));
+	return codebooks;
+}
+
+/*
+ * Read the location, start page, and optionally center of each list
+ */
+static void
+LoadListPages(Relation index, IvfflatCenterCache * cache, int lists)
+{
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	int			i = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+
+			/* Safety check */
+			if (i >= lists || VARSIZE_ANY(&list->center) > cache->itemsize)
+				elog(ERROR, "ivfflat index is not valid");
+
+			cache->listInfo[i].blkno = nextblkno;
+			cache->listInfo[i].offno = offno;
+			cache->startPages[i] = list->startPage;
+			if (cache->centers != NULL)
+				memcpy(cache->centers + (Size) i * cache->itemsize, &list->center, VARSIZE_ANY(&list->center));
+			i++;
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	cache->lists = i;
+
+	/* Sort start pages to find where chains end */
+	memcpy(cache->sortedStartPages, cache->startPages, i * sizeof(BlockNumber));
+	qsort(cache->sortedStartPages, i, sizeof(BlockNumber), IvfflatCompareBlockNumbers);
+}
+
+/*
+ * Get the cached centers for an index
+ *
+ * Returns NULL if the centers are larger than ivfflat.center_cache_size.
+ * In that case, rd_amcache has a cache without centers, which keeps the
+ * size needed and the codebooks so the metapage is not read each time.
+ * It also keeps the list locations when they fit, so groups can be used.
+ */
+IvfflatCenterCache *
+IvfflatGetCenterCache(Relation index)
+{
+	IvfflatCenterCache *cache = (IvfflatCenterCache *) index->rd_amcache;
+	float	   *codebooks = NULL;
+	int			lists;
+	int			dimensions;
+	int			groups;
+	Size		itemsize;
+	Size		listInfoSize;
+	Size		startPagesSize;
+	Size		groupsSize;
+	Size		listsSize;
+	Size		totalSize;
+	int			subvectors;
+	BlockNumber codebookPage;
+	bool		cacheCenters;
+	char	   *ptr;
+
+	if (cache != NULL)
+	{
+		if (cache->centers != NULL)
+			return cache;
+
+		if (cache->size / 1024 > (Size) ivfflat_center_cache_size)
+			return NULL;
+
+		/* Keep the codebooks if the centers now fit */
+		codebooks = cache->codebooks;
+	}
+
+	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
+	IvfpqGetMetaPageInfo(index, &subvectors, &codebookPage);
+
+	if (subvectors > 0 && codebooks == NULL)
+		codebooks = LoadCodebooks(index, dimensions, codebookPage);
+
+	groups = IVFFLAT_GROUPS(lists);
+	itemsize = MAXALIGN(IvfflatGetTypeInfo(index)->itemSize(dimensions));
+	listInfoSize = MAXALIGN(mul_size(lists, sizeof(ListInfo)));
+	startPagesSize = MAXALIGN(mul_size(lists, sizeof(BlockNumber)));
+	groupsSize = add_size(MAXALIGN(mul_size(add_size(lists, groups + 1), sizeof(int))), mul_size(groups, itemsize));
+	listsSize = add_size(add_size(add_size(MAXALIGN(sizeof(IvfflatCenterCache)), listInfoSize), mul_size(startPagesSize, 2)), groupsSize);
+	totalSize = add_size(listsSize, mul_size(lists, itemsize));
+	cacheCenters = ivfflat_center_cache_size > 0 && totalSize / 1024 <= (Size) ivfflat_center_cache_size;
+
+	/* Cache the result so queries and inserts do not check each time */
+	if (!cacheCenters && (cache != NULL || ivfflat_center_cache_size == 0 || listsSize / 1024 > (Size) ivfflat_center_cache_size))
+	{
+		if (cache == NULL)
+		{
+			cache = MemoryContextAllocZero(index->rd_indexcxt, sizeof(IvfflatCenterCache));
+			cache->codebooks = codebooks;
+			cache->size = totalSize;
+			index->rd_amcache = cache;
+		}
+
+		return NULL;
+	}
+
+	/* Allocate in a single chunk that lives as long as the relcache entry */
+	if (cache != NULL)
+	{
+		index->rd_amcache = NULL;
+		pfree(cache);
+	}
+	ptr = MemoryContextAllocExtended(index->rd_indexcxt, cacheCenters ? totalSize : listsSize, MCXT_ALLOC_HUGE);
+	cache = (IvfflatCenterCache *) ptr;
+	ptr += MAXALIGN(sizeof(IvfflatCenterCache));
+	cache->listInfo = (ListInfo *) ptr;
+	ptr += listInfoSize;
+	cache->startPages = (BlockNumber *) ptr;
+	ptr += startPagesSize;
+	cache->sortedStartPages = (BlockNumber *) ptr;
+	ptr += startPagesSize;
+	cache->entryEnd = IvfflatGetEntryEnd(index);
+	cache->codebooks = codebooks;
+	cache->size = totalSize;
+	cache->dimensions = dimensions;
+	cache->groupsBuilt = false;
+	cache->groupsNoticed = false;
+	cache->groups = 0;
+	cache->groupLists = (int *) ptr;
+	cache->groupStarts = cache->groupLists + lists;
+	ptr += MAXALIGN(mul_size(add_size(lists, groups + 1), sizeof(int)));
+	cache->groupCenters = ptr;
+	ptr += mul_size(groups, itemsize);
+	cache->centers = cacheCenters ? ptr : NULL;
+	cache->itemsize = itemsize;
+
+	LoadListPages(index, cache, lists);
+
+	index->rd_amcache = cache;
+
+	return cacheCenters ? cache : NULL;
+}
+
+/*
+ * Get the cached groups for an index
+ *
+ * Returns NULL if the list locations and group centers do not fit into
+ * ivfflat.center_cache_size. The centers of lists may not be cached.
+ */
+IvfflatCenterCache *
+IvfflatGetGroupCache(Relation index)
+{
+	IvfflatCenterCache *cache;
+
+	(void) IvfflatGetCenterCache(index);
+
+	cache = (IvfflatCenterCache *) index->rd_amcache;
+	if (cache == NULL || cache->listInfo == NULL)
+	{
+		/* Only notify once for each relcache entry */
+		if (cache == NULL || !cache->groupsNoticed)
+		{
+			ereport(NOTICE,
+					(errmsg("ivfflat.group_probes is ignored for \"%s\"", RelationGetRelationName(index)),
+					 errdetail("Groups require the list locations to fit into ivfflat.center_cache_size."),
+					 errhint("Increase ivfflat.center_cache_size.")));
+
+			if (cache != NULL)
+				cache->groupsNoticed = true;
+		}
+
+		return NULL;
+	}
+
+	IvfflatBuildCenterGroups(index, cache);
+
+	return cache;
+}
+
+/*
+ * Assign a list to the closest group center
+ */
+static inline void
+AssignGroup(FmgrInfo *procinfo, Oid collation, VectorArray groupCenters, Datum center, int *assignment, const IvfflatTypeInfo * typeInfo, float *agg, int *counts)
+{
+	double		minDistance = DBL_MAX;
+	int			closest = 0;
+
+	for (int g = 0; g < groupCenters->length; g++)
+	{
+		double		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, center, PointerGetDatum(VectorArrayGet(groupCenters, g))));
+
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			closest = g;
+		}
+	}
+
+	*assignment = closest;
+	counts[closest]++;
+
+	if (agg != NULL)
+		typeInfo->sumCenter(DatumGetPointer(center), agg + (Size) closest * groupCenters->dim);
+}
+
+/*
+ * Assign each list to the closest group center
+ *
+ * Reads list pages when the centers are not cached. Adds the centers of
+ * each group to agg when it is not NULL.
+ */
+static void
+AssignGroups(Relation index, IvfflatCenterCache * cache, VectorArray groupCenters, int *assignments, float *agg, int *counts)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	const IvfflatTypeInfo *typeInfo = IvfflatGetTypeInfo(index);
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	int			i = 0;
+
+	memset(counts, 0, groupCenters->length * sizeof(int));
+	if (agg != NULL)
+		memset(agg, 0, (Size) groupCenters->length * groupCenters->dim * sizeof(float));
+
+	if (cache->centers != NULL)
+	{
+		for (i = 0; i < cache->lists; i++)
+			AssignGroup(procinfo, collation, groupCenters, IvfflatCenterCacheGet(cache, i), &assignments[i], typeInfo, agg, counts);
+
+		return;
+	}
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno && i < cache->lists; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+
+			AssignGroup(procinfo, collation, groupCenters, PointerGetDatum(&list->center), &assignments[i++], typeInfo, agg, counts);
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+}
+
+/*
+ * Group nearby lists so the closest lists can be found without computing
+ * the distance to every center
+ *
+ * Group centers start from evenly spaced lists and are refined with a few
+ * iterations of k-means over the list centers. This only depends on the
+ * centers, so all participants in a parallel scan get the same groups.
+ */
+void
+IvfflatBuildCenterGroups(Relation index, IvfflatCenterCache * cache)
+{
+	const IvfflatTypeInfo *typeInfo = IvfflatGetTypeInfo(index);
+	FmgrInfo   *normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	int			lists = cache->lists;
+	int			dimensions = cache->dimensions;
+	int			groups = Min(IVFFLAT_GROUPS(lists), lists);
+	VectorArray groupCenters;
+	int		   *assignments;
+	int		   *counts;
+	float	   *agg;
+	int		   *offsets;
+	MemoryContext normCtx = NULL;
+
+	if (cache->groupsBuilt)
+		return;
+
+	if (groups == 0)
+	{
+		cache->groups = 0;
+		cache->groupStarts[0] = 0;
+		cache->groupsBuilt = true;
+		return;
+	}
+
+	groupCenters = VectorArrayInit(groups, dimensions, cache->itemsize);
+	assignments = palloc_array_checked(int, lists);
+	counts = palloc_array_checked(int, groups);
+	agg = palloc_array_checked(float, (Size) groups * dimensions);
+	offsets = palloc0_array_checked(int, groups + 1);
+
+	if (normprocinfo != NULL)
+		normCtx = AllocSetContextCreate(CurrentMemoryContext,
+										"Ivfflat group norm temporary context",
+										ALLOCSET_DEFAULT_SIZES);
+
+	/* Start from evenly spaced lists */
+	for (int g = 0; g < groups; g++)
+	{
+		int			i = (int) ((int64) g * lists / groups);
+
+		if (cache->centers != NULL)
+			VectorArraySet(groupCenters, g, DatumGetPointer(IvfflatCenterCacheGet(cache, i)));
+		else
+		{
+			Datum		center = IvfflatGetListCenter(index, cache->listInfo[i]);
+
+			VectorArraySet(groupCenters, g, DatumGetPointer(center));
+			pfree(DatumGetPointer(center));
+		}
+	}
+	groupCenters->length = groups;
+
+	/* Refine group centers, keeping the assignments from the last pass */
+	for (int iteration = 0; iteration < IVFFLAT_GROUP_ITERATIONS; iteration++)
+	{
+		bool		last = iteration == IVFFLAT_GROUP_ITERATIONS - 1;
+
+		AssignGroups(index, cache, groupCenters, assignments, last ? NULL : agg, counts);
+
+		if (last)
+			break;
+
+		for (int g = 0; g < groups; g++)
+		{
+			float	   *x = agg + (Size) g * dimensions;
+
+			/* Keep the previous center for empty groups */
+			if (counts[g] == 0)
+				continue;
+
+			for (int j = 0; j < dimensions; j++)
+				x[j] /= (float) counts[g];
+
+			typeInfo->updateCenter(VectorArrayGet(groupCenters, g), dimensions, x);
+		}
+
+		if (normprocinfo != NULL)
+			IvfflatNormVectors(typeInfo, collation, groupCenters, normCtx);
+	}
+
+	/* Order lists by group */
+	for (int g = 0; g < groups; g++)
+		offsets[g + 1] = offsets[g] + counts[g];
+
+	memcpy(cache->groupStarts, offsets, (groups + 1) * sizeof(int));
+
+	for (int i = 0; i < lists; i++)
+		cache->groupLists[offsets[assignments[i]]++] = i;
+
+	for (int g = 0; g < groups; g++)
+		memcpy(cache->groupCenters + (Size) g * cache->itemsize, VectorArrayGet(groupCenters, g), cache->itemsize);
+
+	cache->groups = groups;
+	cache->groupsBuilt = true;
+
+	if (normCtx != NULL)
+		MemoryContextDelete(normCtx);
+	VectorArrayFree(groupCenters);
+	pfree(assignments);
+	pfree(counts);
+	pfree(agg);
+	pfree(offsets);
+}
+
+/*
+ * Get a copy of the center of a list
+ */
+Datum
+IvfflatGetListCenter(Relation index, ListInfo listInfo)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatList list;
+	Datum		center;
+
+	buf = ReadBuffer(index, listInfo.blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	list = (IvfflatList) PageGetItem(page, PageGetItemId(page, listInfo.offno));
+	center = PointerGetDatum(PG_DETOAST_DATUM_COPY(PointerGetDatum(&list->center)));
+	UnlockReleaseBuffer(buf);
+
+	return center;
+}
+
+/*
+ * Compare block numbers
+ */
+int
+IvfflatCompareBlockNumbers(const void *a, const void *b)
+{
+	BlockNumber ba = *((const BlockNumber *) a);
+	BlockNumber bb = *((const BlockNumber *) b);
+
+	if (ba < bb)
+		return -1;
+
+	if (ba > bb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get the next list for a list stream
+ */
+static bool
+ListStreamAddList(IvfflatListStream * ls)
+{
+	BlockNumber startPage;
+	int			id;
+
+	if (ls->done)
+		return false;
+
+	id = ls->nextlist(ls->arg, &startPage);
+	if (id < 0)
+	{
+		ls->done = true;
+		return false;
+	}
+
+	if (ls->listCount == ls->maxLists)
+	{
+		ls->maxLists *= 2;
+		ls->listIds = repalloc(ls->listIds, ls->maxLists * sizeof(int));
+		ls->listStarts = repalloc(ls->listStarts, ls->maxLists * sizeof(BlockNumber));
+	}
+
+	ls->listIds[ls->listCount] = id;
+	ls->listStarts[ls->listCount] = startPage;
+	ls->listCount++;
+
+	return true;
+}
+
+#if PG_VERSION_NUM >= 170000
+/*
+ * Get the end of the blocks the build wrote for a chain
+ *
+ * The build writes each chain to consecutive blocks, so a chain ends at the
+ * next start page or the end of the entry pages. Pages added by inserts
+ * are only known after reading the page before them.
+ */
+static BlockNumber
+ListStreamChainEnd(IvfflatListStream * ls, BlockNumber startPage)
+{
+	int			lo = 0;
+	int			hi = ls->lists;
+
+	/* Find the first start page after this one */
+	while (lo < hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+
+		if (ls->startPages[mid] <= startPage)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < ls->lists)
+		return ls->startPages[lo];
+
+	/* Only the start page is known for indexes built by earlier versions */
+	if (BlockNumberIsValid(ls->entryEnd) && startPage < ls->entryEnd)
+		return ls->entryEnd;
+
+	return startPage + 1;
+}
+
+/*
+ * Get the next block for a list stream
+ */
+static BlockNumber
+ListStreamNextBlock(ReadStream *stream, void *callback_private_data, void *per_buffer_data)
+{
+	IvfflatListStream *ls = (IvfflatListStream *) callback_private_data;
+	BlockNumber blkno;
+
+	/* Continue with the next list */
+	while (!BlockNumberIsValid(ls->streamNext))
+	{
+		if (ls->streamPos + 1 == ls->listCount && !ListStreamAddList(ls))
+			return InvalidBlockNumber;
+
+		ls->streamPos++;
+		ls->streamNext = ls->listStarts[ls->streamPos];
+		ls->streamEnd = ListStreamChainEnd(ls, ls->streamNext);
+	}
+
+	blkno = ls->streamNext;
+	*((int *) per_buffer_data) = ls->streamPos;
+
+	ls->streamNext = blkno + 1 < ls->streamEnd ? blkno + 1 : InvalidBlockNumber;
+
+	return blkno;
+}
+#endif
+
+/*
+ * Begin reading the entry pages of lists
+ *
+ * startPages must be sorted and is only used to find where chains end
+ */
+IvfflatListStream *
+IvfflatBeginListStream(Relation index, BufferAccessStrategy bas, BlockNumber *startPages, int lists, BlockNumber entryEnd, IvfflatNextListCallback nextlist, void *arg, bool maintenance)
+{
+	IvfflatListStream *ls = palloc0_object(IvfflatListStream);
+
+	ls->index = index;
+	ls->bas = bas;
+	ls->nextlist = nextlist;
+	ls->arg = arg;
+	ls->maxLists = 16;
+	ls->listIds = palloc_array_checked(int, ls->maxLists);
+	ls->listStarts = palloc_array_checked(BlockNumber, ls->maxLists);
+	ls->listPos = -1;
+
+#if PG_VERSION_NUM >= 170000
+	ls->startPages = startPages;
+	ls->lists = lists;
+	ls->entryEnd = entryEnd;
+	ls->streamPos = -1;
+	ls->streamNext = InvalidBlockNumber;
+	ls->stream = read_stream_begin_relation(maintenance ? READ_STREAM_MAINTENANCE : READ_STREAM_DEFAULT, bas, index, MAIN_FORKNUM, ListStreamNextBlock, ls, sizeof(int));
+#endif
+
+	return ls;
+}
+
+/*
+ * Move to the next list
+ *
+ * Returns the id of the list, or -1 when there are no more lists
+ */
+int
+IvfflatListStreamNextList(IvfflatListStream * ls)
+{
+	if (ls->listPos + 1 == ls->listCount && !ListStreamAddList(ls))
+		return -1;
+
+	ls->listPos++;
+
+#if PG_VERSION_NUM >= 170000
+	ls->listEnd = ListStreamChainEnd(ls, ls->listStarts[ls->listPos]);
+#endif
+
+	return ls->listIds[ls->listPos];
+}
+
+/*
+ * Read a block of the current list
+ */
+Buffer
+IvfflatListStreamReadBuffer(IvfflatListStream * ls, BlockNumber blkno)
+{
+#if PG_VERSION_NUM >= 170000
+	BlockNumber startPage = ls->listStarts[ls->listPos];
+
+	if (blkno >= startPage && blkno < ls->listEnd)
+	{
+		for (;;)
+		{
+			void	   *per_buffer_data;
+			Buffer		buf = read_stream_next_buffer(ls->stream, &per_buffer_data);
+			int			pos;
+
+			if (!BufferIsValid(buf))
+				break;
+
+			pos = *((int *) per_buffer_data);
+			if (pos == ls->listPos && BufferGetBlockNumber(buf) == blkno)
+				return buf;
+
+			ReleaseBuffer(buf);
+
+			/* Skip the rest of lists that were not read to the end */
+			if (pos < ls->listPos)
+				continue;
+
+			break;
+		}
+
+		/* Chain was not laid out as expected, so restart after the block */
+		read_stream_reset(ls->stream);
+		ls->streamPos = ls->listPos;
+		ls->streamNext = blkno + 1 < ls->listEnd ? blkno + 1 : InvalidBlockNumber;
+		ls->streamEnd = ls->listEnd;
+	}
+#endif
+
+	/* Pages added by inserts are read directly */
+	return ReadBufferExtended(ls->index, MAIN_FORKNUM, blkno, RBM_NORMAL, ls->bas);
+}
+
+/*
+ * End reading lists
+ */
+void
+IvfflatEndListStream(IvfflatListStream * ls)
+{
+#if PG_VERSION_NUM >= 170000
+	read_stream_end(ls->stream);
+#endif
+
+	pfree(ls->listIds);
+	pfree(ls->listStarts);
+	pfree(ls);
+}
+
 /*
  * Update the start or insert page of a list
  */
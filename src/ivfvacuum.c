@@ -13,28 +13,79 @@
 #endif
 
 /*
- * Bulk delete tuples from the index
+ * Remove deleted items from a packed entry page
+ *
+ * Returns the number of items removed
  */
-IndexBulkDeleteResult *
-ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
-				  IndexBulkDeleteCallback callback, void *callback_state)
+static int
+RemovePackedItems(Page page, IndexBulkDeleteCallback callback, void *callback_state, IndexBulkDeleteResult *stats)
+{
+	PageHeader	phdr = (PageHeader) page;
+	ItemPointer tids = IvfflatPackedGetTids(page);
+	Size		itemsize = IvfflatPageGetOpaque(page)->itemsize;
+	int			count = IvfflatPackedCount(page);
+	int			n = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (callback(&tids[i], callback_state))
+		{
+			stats->tuples_removed++;
+			continue;
+		}
+
+		stats->num_index_tuples++;
+
+		/* Keep remaining items contiguous */
+		if (n != i)
+		{
+			tids[n] = tids[i];
+			memcpy(IvfflatPackedGetValue(page, n), IvfflatPackedGetValue(page, i), itemsize);
+		}
+		n++;
+	}
+
+	phdr->pd_lower = SizeOfPageHeaderData + n * sizeof(ItemPointerData);
+	phdr->pd_upper = phdr->pd_special - n * itemsize;
+
+	return count - n;
+}
+
+/*
+ * Get the next list to vacuum
+ */
+static int
+GetNextVacuumList(void *arg, BlockNumber *startPage)
+{
+	IvfflatVacuumLists *vl = (IvfflatVacuumLists *) arg;
+
+	if (vl->nextList == vl->lists)
+		return -1;
+
+	*startPage = vl->startPages[vl->nextList];
+	return vl->nextList++;
+}
+
+/*
+ * Get the start page and location of each list
+ */
+static void
+GetVacuumLists(Relation index, IvfflatVacuumLists * vl)
 {
-	Relation	index = info->index;
 	BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
-	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	int			maxLists = 16;
 
-	if (stats == NULL)
-		stats = palloc0_object(IndexBulkDeleteResult);
+	vl->lists = 0;
+	vl->nextList = 0;
+	vl->startPages = palloc_array_checked(BlockNumber, maxLists);
+	vl->listInfos = palloc_array_checked(ListInfo, maxLists);
 
 	/* Iterate over list pages */
 	while (BlockNumberIsValid(blkno))
 	{
 		Buffer		cbuf;
 		Page		cpage;
-		OffsetNumber coffno;
 		OffsetNumber cmaxoffno;
-		BlockNumber listPages[MaxOffsetNumber];
-		ListInfo	listInfo;
 
 		cbuf = ReadBuffer(index, blkno);
 		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
@@ -43,51 +94,97 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 		cmaxoffno = PageGetMaxOffsetNumber(cpage);
 
 		/* Iterate over lists */
-		for (coffno = FirstOffsetNumber; coffno <= cmaxoffno; coffno = OffsetNumberNext(coffno))
+		for (OffsetNumber coffno = FirstOffsetNumber; coffno <= cmaxoffno; coffno = OffsetNumberNext(coffno))
 		{
 			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, coffno));
 
-			listPages[coffno - FirstOffsetNumber] = list->startPage;
+			if (vl->lists == maxLists)
+			{
+				maxLists *= 2;
+				vl->startPages = repalloc(vl->startPages, maxLists * sizeof(BlockNumber));
+				vl->listInfos = repalloc(vl->listInfos, maxLists * sizeof(ListInfo));
+			}
+
+			vl->startPages[vl->lists] = list->startPage;
+			vl->listInfos[vl->lists].blkno = blkno;
+			vl->listInfos[vl->lists].offno = coffno;
+			vl->lists++;
 		}
 
-		listInfo.blkno = blkno;
 		blkno = IvfflatPageGetOpaque(cpage)->nextblkno;
 
 		UnlockReleaseBuffer(cbuf);
+	}
 
-		for (coffno = FirstOffsetNumber; coffno <= cmaxoffno; coffno = OffsetNumberNext(coffno))
+	/* Sort start pages to find where chains end */
+	vl->sortedStartPages = palloc_array_checked(BlockNumber, Max(vl->lists, 1));
+	memcpy(vl->sortedStartPages, vl->startPages, vl->lists * sizeof(BlockNumber));
+	qsort(vl->sortedStartPages, vl->lists, sizeof(BlockNumber), IvfflatCompareBlockNumbers);
+}
+
+/*
+ * Bulk delete tuples from the index
+ */
+IndexBulkDeleteResult *
+ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+				  IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	IvfflatVacuumLists vl;
+	IvfflatListStream *ls;
+	int			listId;
+
+	if (stats == NULL)
+		stats = palloc0_object(IndexBulkDeleteResult);
+
+	GetVacuumLists(index, &vl);
+
+	/* Read entry pages of all lists in order */
+	ls = IvfflatBeginListStream(index, bas, vl.sortedStartPages, vl.lists, IvfflatGetEntryEnd(index), GetNextVacuumList, &vl, true);
+
+	/* Iterate over lists */
+	while ((listId = IvfflatListStreamNextList(ls)) >= 0)
+	{
+		BlockNumber searchPage = vl.startPages[listId];
+		BlockNumber insertPage = InvalidBlockNumber;
+
+		/* Iterate over entry pages */
+		while (BlockNumberIsValid(searchPage))
 		{
-			BlockNumber searchPage = listPages[coffno - FirstOffsetNumber];
-			BlockNumber insertPage = InvalidBlockNumber;
+			Buffer		buf;
+			Page		page;
+			GenericXLogState *state;
+			OffsetNumber offno;
+			OffsetNumber maxoffno;
+			OffsetNumber deletable[MaxOffsetNumber];
+			int			ndeletable;
+			bool		packed;
 
-			/* Iterate over entry pages */
-			while (BlockNumberIsValid(searchPage))
-			{
-				Buffer		buf;
-				Page		page;
-				GenericXLogState *state;
-				OffsetNumber offno;
-				OffsetNumber maxoffno;
-				OffsetNumber deletable[MaxOffsetNumber];
-				int			ndeletable;
+			vacuum_delay_point();
 
-				vacuum_delay_point();
+			buf = IvfflatListStreamReadBuffer(ls, searchPage);
 
-				buf = ReadBufferExtended(index, MAIN_FORKNUM, searchPage, RBM_NORMAL, bas);
+			/*
+			 * ambulkdelete cannot delete entries from pages that are pinned
+			 * by other backends
+			 *
+			 * https://www.postgresql.org/docs/current/index-locking.html
+			 */
+			LockBufferForCleanup(buf);
 
-				/*
-				 * ambulkdelete cannot delete entries from pages that are
-				 * pinned by other backends
-				 *
-				 * https://www.postgresql.org/docs/current/index-locking.html
-				 */
-				LockBufferForCleanup(buf);
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buf, 0);
 
-				state = GenericXLogStart(index);
-				page = GenericXLogRegisterBuffer(state, buf, 0);
+			packed = IvfflatPageIsPacked(page);
+			ndeletable = 0;
 
+			/* Remove deleted tuples in place for packed pages */
+			if (packed)
+				ndeletable = RemovePackedItems(page, callback, callback_state, stats);
+			else
+			{
 				maxoffno = PageGetMaxOffsetNumber(page);
-				ndeletable = 0;
 
 				/* Find deleted tuples */
 				for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
@@ -103,40 +200,39 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 					else
 						stats->num_index_tuples++;
 				}
+			}
 
-				/* Set to first free page */
-				/* Must be set before searchPage is updated */
-				if (!BlockNumberIsValid(insertPage) && ndeletable > 0)
-					insertPage = searchPage;
+			/* Set to first free page */
+			/* Must be set before searchPage is updated */
+			if (!BlockNumberIsValid(insertPage) && ndeletable > 0)
+				insertPage = searchPage;
 
-				searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
 
-				if (ndeletable > 0)
-				{
-					/* Delete tuples */
+			if (ndeletable > 0)
+			{
+				/* Delete tuples */
+				if (!packed)
 					PageIndexMultiDelete(page, deletable, ndeletable);
-					GenericXLogFinish(state);
-				}
-				else
-					GenericXLogAbort(state);
-
-				UnlockReleaseBuffer(buf);
+				GenericXLogFinish(state);
 			}
+			else
+				GenericXLogAbort(state);
 
-			/*
-			 * Update after all tuples deleted.
-			 *
-			 * We don't add or delete items from lists pages, so offset won't
-			 * change.
-			 */
-			if (BlockNumberIsValid(insertPage))
-			{
-				listInfo.offno = coffno;
-				IvfflatUpdateList(index, listInfo, insertPage, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM);
-			}
+			UnlockReleaseBuffer(buf);
 		}
+
+		/*
+		 * Update after all tuples deleted.
+		 *
+		 * We don't add or delete items from lists pages, so offset won't
+		 * change.
+		 */
+		if (BlockNumberIsValid(insertPage))
+			IvfflatUpdateList(index, vl.listInfos[listId], insertPage, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM);
 	}
 
+	IvfflatEndListStream(ls);
 	FreeAccessStrategy(bas);
 
 	return stats;
@@ -21,6 +21,7 @@
 #include "utils/lsyscache.h"
 #include "utils/varbit.h"
 #include "vector.h"
+#include "vectorxlog.h"
 
 #if PG_VERSION_NUM >= 160000
 #include "varatt.h"
@@ -62,6 +63,7 @@ _PG_init(void)
 	HalfvecInit();
 	HnswInit();
 	IvfflatInit();
+	VectorXLogInit();
 }
 
 /*
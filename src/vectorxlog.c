@@ -0,0 +1,502 @@
+#include "postgres.h"
+
+#include "hnsw.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "utils/rel.h"
+#include "vectorxlog.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "access/bufmask.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "access/xlogutils.h"
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+static bool vector_rmgr_registered = false;
+
+/*
+ * Mark an element tuple as deleted
+ */
+static void
+MarkElementDeleted(Page page, OffsetNumber offno, uint8 version)
+{
+	HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+	/* Use memset instead of MemSet to keep clang-tidy happy */
+	etup->deleted = 1;
+	memset(&etup->data, 0, VARSIZE_ANY(&etup->data));
+	etup->version = version;
+}
+
+/*
+ * Clear the neighbors of a deleted element
+ */
+static void
+MarkNeighborsDeleted(Page page, OffsetNumber offno, uint8 version)
+{
+	HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+	for (int i = 0; i < ntup->count; i++)
+		ItemPointerSetInvalid(&ntup->indextids[i]);
+
+	ntup->version = version;
+}
+
+/*
+ * Set a neighbor slot
+ */
+static void
+SetNeighbor(Page page, xl_hnsw_set_neighbor * xlrec)
+{
+	HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, xlrec->offno));
+
+	ntup->indextids[xlrec->idx] = xlrec->indextid;
+	if (xlrec->hasDistance)
+		HnswNeighborTupleDistances(ntup)[xlrec->idx] = xlrec->distance;
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Redo adding an item
+ */
+static void
+RedoAddItem(XLogReaderState *record)
+{
+	XLogRecPtr	lsn = record->EndRecPtr;
+	xl_vector_add_item *xlrec = (xl_vector_add_item *) XLogRecGetData(record);
+	Buffer		buf;
+
+	if (XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buf);
+		Size		size;
+		char	   *item = XLogRecGetBlockData(record, 0, &size);
+
+		if (PageAddItem(page, (Item) item, size, xlrec->offno, false, false) != xlrec->offno)
+			elog(PANIC, "failed to add index item");
+
+		PageSetLSN(page, lsn);
+		MarkBufferDirty(buf);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Redo setting a neighbor
+ */
+static void
+RedoSetNeighbor(XLogReaderState *record)
+{
+	XLogRecPtr	lsn = record->EndRecPtr;
+	xl_hnsw_set_neighbor *xlrec = (xl_hnsw_set_neighbor *) XLogRecGetData(record);
+	Buffer		buf;
+
+	if (XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buf);
+
+		SetNeighbor(page, xlrec);
+
+		PageSetLSN(page, lsn);
+		MarkBufferDirty(buf);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Redo marking an element as deleted
+ */
+static void
+RedoMarkDeleted(XLogReaderState *record)
+{
+	XLogRecPtr	lsn = record->EndRecPtr;
+	xl_hnsw_mark_deleted *xlrec = (xl_hnsw_mark_deleted *) XLogRecGetData(record);
+	bool		samePage = !XLogRecHasBlockRef(record, 1);
+	Buffer		buf;
+	Buffer		nbuf = InvalidBuffer;
+
+	if (XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buf);
+
+		MarkElementDeleted(page, xlrec->offno, xlrec->version);
+		if (samePage)
+			MarkNeighborsDeleted(page, xlrec->neighborOffno, xlrec->version);
+
+		PageSetLSN(page, lsn);
+		MarkBufferDirty(buf);
+	}
+
+	if (!samePage && XLogReadBufferForRedo(record, 1, &nbuf) == BLK_NEEDS_REDO)
+	{
+		Page		npage = BufferGetPage(nbuf);
+
+		MarkNeighborsDeleted(npage, xlrec->neighborOffno, xlrec->version);
+
+		PageSetLSN(npage, lsn);
+		MarkBufferDirty(nbuf);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+	if (BufferIsValid(nbuf))
+		UnlockReleaseBuffer(nbuf);
+}
+
+/*
+ * Redo adding a value to a packed page
+ */
+static void
+RedoPackedAddItem(XLogReaderState *record)
+{
+	XLogRecPtr	lsn = record->EndRecPtr;
+	xl_ivfflat_packed_add_item *xlrec = (xl_ivfflat_packed_add_item *) XLogRecGetData(record);
+	Buffer		buf;
+
+	if (XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buf);
+		Size		size;
+		char	   *data = XLogRecGetBlockData(record, 0, &size);
+		Pointer		value = palloc(size);
+
+		/* Copy since block data may not be aligned */
+		memcpy(value, data, size);
+
+		if (IvfflatPackedCount(page) != xlrec->count)
+			elog(PANIC, "failed to add packed item");
+
+		IvfflatPackedAddItem(page, &xlrec->heaptid, value);
+		pfree(value);
+
+		PageSetLSN(page, lsn);
+		MarkBufferDirty(buf);
+	}
+
+	if (BufferIsValid(buf))
+		UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Redo a record
+ */
+static void
+vector_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+	switch (info)
+	{
+		case XLOG_VECTOR_ADD_ITEM:
+			RedoAddItem(record);
+			break;
+		case XLOG_HNSW_SET_NEIGHBOR:
+			RedoSetNeighbor(record);
+			break;
+		case XLOG_HNSW_MARK_DELETED:
+			RedoMarkDeleted(record);
+			break;
+		case XLOG_IVFFLAT_PACKED_ADD_ITEM:
+			RedoPackedAddItem(record);
+			break;
+		default:
+			elog(PANIC, "vector_redo: unknown op code %u", info);
+	}
+}
+
+/*
+ * Describe a record
+ */
+static void
+vector_desc(StringInfo buf, XLogReaderState *record)
+{
+	char	   *rec = XLogRecGetData(record);
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+	switch (info)
+	{
+		case XLOG_VECTOR_ADD_ITEM:
+			{
+				xl_vector_add_item *xlrec = (xl_vector_add_item *) rec;
+
+				appendStringInfo(buf, "off: %u", xlrec->offno);
+				break;
+			}
+		case XLOG_HNSW_SET_NEIGHBOR:
+			{
+				xl_hnsw_set_neighbor *xlrec = (xl_hnsw_set_neighbor *) rec;
+
+				appendStringInfo(buf, "off: %u, idx: %u, neighbor: (%u,%u)",
+								 xlrec->offno, xlrec->idx,
+								 ItemPointerGetBlockNumberNoCheck(&xlrec->indextid),
+								 ItemPointerGetOffsetNumberNoCheck(&xlrec->indextid));
+				break;
+			}
+		case XLOG_HNSW_MARK_DELETED:
+			{
+				xl_hnsw_mark_deleted *xlrec = (xl_hnsw_mark_deleted *) rec;
+
+				appendStringInfo(buf, "off: %u, neighbor off: %u, version: %u",
+								 xlrec->offno, xlrec->neighborOffno, xlrec->version);
+				break;
+			}
+		case XLOG_IVFFLAT_PACKED_ADD_ITEM:
+			{
+				xl_ivfflat_packed_add_item *xlrec = (xl_ivfflat_packed_add_item *) rec;
+
+				appendStringInfo(buf, "slot: %u, heap tid: (%u,%u)",
+								 xlrec->count,
+								 ItemPointerGetBlockNumberNoCheck(&xlrec->heaptid),
+								 ItemPointerGetOffsetNumberNoCheck(&xlrec->heaptid));
+				break;
+			}
+	}
+}
+
+/*
+ * Identify a record
+ */
+static const char *
+vector_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_VECTOR_ADD_ITEM:
+			return "ADD_ITEM";
+		case XLOG_HNSW_SET_NEIGHBOR:
+			return "HNSW_SET_NEIGHBOR";
+		case XLOG_HNSW_MARK_DELETED:
+			return "HNSW_MARK_DELETED";
+		case XLOG_IVFFLAT_PACKED_ADD_ITEM:
+			return "IVFFLAT_PACKED_ADD_ITEM";
+	}
+
+	return NULL;
+}
+
+/*
+ * Mask a page for consistency checking
+ */
+static void
+vector_mask(char *pagedata, BlockNumber blkno)
+{
+	mask_page_lsn_and_checksum(pagedata);
+	mask_unused_space(pagedata);
+}
+
+static const RmgrData vector_rmgr = {
+	.rm_name = VECTOR_RMGR_NAME,
+	.rm_redo = vector_redo,
+	.rm_desc = vector_desc,
+	.rm_identify = vector_identify,
+	.rm_mask = vector_mask
+};
+#endif
+
+/*
+ * Register the resource manager
+ */
+void
+VectorXLogInit(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RegisterCustomRmgr(VECTOR_RMGR_ID, &vector_rmgr);
+	vector_rmgr_registered = true;
+#endif
+}
+
+/*
+ * Check if compact records can be used for an index
+ */
+bool
+VectorXLogEnabled(Relation index)
+{
+	return vector_rmgr_registered && RelationNeedsWAL(index);
+}
+
+/*
+ * Add an item to the next offset of a page
+ */
+OffsetNumber
+VectorXLogAddItem(Relation index, Buffer buf, Pointer item, Size size)
+{
+	Page		page = BufferGetPage(buf);
+	xl_vector_add_item xlrec;
+
+	Assert(VectorXLogEnabled(index));
+
+	/* Do not write padding to WAL */
+	memset(&xlrec, 0, sizeof(xlrec));
+
+	xlrec.offno = OffsetNumberNext(PageGetMaxOffsetNumber(page));
+
+	START_CRIT_SECTION();
+
+	if (PageAddItem(page, (Item) item, size, xlrec.offno, false, false) != xlrec.offno)
+		elog(PANIC, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	MarkBufferDirty(buf);
+
+#if PG_VERSION_NUM >= 150000
+	{
+		XLogRecPtr	recptr;
+
+		XLogBeginInsert();
+		XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+		XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+		XLogRegisterBufData(0, (char *) item, size);
+		recptr = XLogInsert(VECTOR_RMGR_ID, XLOG_VECTOR_ADD_ITEM);
+		PageSetLSN(page, recptr);
+	}
+#endif
+
+	END_CRIT_SECTION();
+
+	return xlrec.offno;
+}
+
+/*
+ * Set a neighbor slot
+ */
+void
+HnswXLogSetNeighbor(Relation index, Buffer buf, OffsetNumber offno, int idx, BlockNumber blkno, OffsetNumber neighborOffno, bool hasDistance, float distance)
+{
+	Page		page = BufferGetPage(buf);
+	xl_hnsw_set_neighbor xlrec;
+
+	Assert(VectorXLogEnabled(index));
+
+	/* Do not write padding to WAL */
+	memset(&xlrec, 0, sizeof(xlrec));
+
+	xlrec.offno = offno;
+	xlrec.idx = (uint16) idx;
+	ItemPointerSet(&xlrec.indextid, blkno, neighborOffno);
+	xlrec.hasDistance = hasDistance;
+	xlrec.distance = hasDistance ? distance : 0;
+
+	START_CRIT_SECTION();
+
+	SetNeighbor(page, &xlrec);
+	MarkBufferDirty(buf);
+
+#if PG_VERSION_NUM >= 150000
+	{
+		XLogRecPtr	recptr;
+
+		XLogBeginInsert();
+		XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+		XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+		recptr = XLogInsert(VECTOR_RMGR_ID, XLOG_HNSW_SET_NEIGHBOR);
+		PageSetLSN(page, recptr);
+	}
+#endif
+
+	END_CRIT_SECTION();
+}
+
+/*
+ * Mark an element as deleted
+ */
+void
+HnswXLogMarkDeleted(Relation index, Buffer buf, OffsetNumber offno, Buffer nbuf, OffsetNumber neighborOffno)
+{
+	Page		page = BufferGetPage(buf);
+	Page		npage = BufferGetPage(nbuf);
+	HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+	xl_hnsw_mark_deleted xlrec;
+
+	Assert(VectorXLogEnabled(index));
+
+	/* Do not write padding to WAL */
+	memset(&xlrec, 0, sizeof(xlrec));
+
+	xlrec.offno = offno;
+	xlrec.neighborOffno = neighborOffno;
+
+	/* Increment version */
+	/* This is used to avoid incorrect reads for iterative scans */
+	/* Reserve some bits for future use */
+	xlrec.version = etup->version + 1;
+	if (xlrec.version > 15)
+		xlrec.version = 1;
+
+	START_CRIT_SECTION();
+
+	MarkElementDeleted(page, offno, xlrec.version);
+	MarkNeighborsDeleted(npage, neighborOffno, xlrec.version);
+
+	MarkBufferDirty(buf);
+	if (nbuf != buf)
+		MarkBufferDirty(nbuf);
+
+#if PG_VERSION_NUM >= 150000
+	{
+		XLogRecPtr	recptr;
+
+		XLogBeginInsert();
+		XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+		XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+		if (nbuf != buf)
+			XLogRegisterBuffer(1, nbuf, REGBUF_STANDARD);
+		recptr = XLogInsert(VECTOR_RMGR_ID, XLOG_HNSW_MARK_DELETED);
+		PageSetLSN(page, recptr);
+		if (nbuf != buf)
+			PageSetLSN(npage, recptr);
+	}
+#endif
+
+	END_CRIT_SECTION();
+}
+
+/*
+ * Add a value to the next slot of a packed page
+ */
+void
+IvfflatXLogPackedAddItem(Relation index, Buffer buf, ItemPointer heaptid, Pointer value)
+{
+	Page		page = BufferGetPage(buf);
+	xl_ivfflat_packed_add_item xlrec;
+
+	Assert(VectorXLogEnabled(index));
+
+	/* Do not write padding to WAL */
+	memset(&xlrec, 0, sizeof(xlrec));
+
+	xlrec.heaptid = *heaptid;
+	xlrec.count = (uint16) IvfflatPackedCount(page);
+
+	START_CRIT_SECTION();
+
+	IvfflatPackedAddItem(page, heaptid, value);
+	MarkBufferDirty(buf);
+
+#if PG_VERSION_NUM >= 150000
+	{
+		XLogRecPtr	recptr;
+
+		XLogBeginInsert();
+		XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+		XLogRegisterBuffer(0, buf, REGBUF_STANDARD);
+		XLogRegisterBufData(0, value, VARSIZE_ANY(value));
+		recptr = XLogInsert(VECTOR_RMGR_ID, XLOG_IVFFLAT_PACKED_ADD_ITEM);
+		PageSetLSN(page, recptr);
+	}
+#endif
+
+	END_CRIT_SECTION();
+}
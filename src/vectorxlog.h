@@ -0,0 +1,75 @@
+#ifndef VECTORXLOG_H
+#define VECTORXLOG_H
+
+#include "postgres.h"
+
+#include "access/xlogreader.h"
+#include "lib/stringinfo.h"
+#include "storage/block.h"
+#include "storage/buf.h"
+#include "storage/itemptr.h"
+#include "storage/off.h"
+#include "utils/relcache.h"
+
+/*
+ * Custom WAL resource manager
+ *
+ * Only available when the library is loaded with shared_preload_libraries,
+ * since the resource manager must be registered at startup. Any server that
+ * replays the WAL (standbys and point-in-time recovery) must also preload
+ * the library, or replay fails at the first record with an unknown
+ * resource manager.
+ *
+ * Uses the experimental ID until a permanent one is reserved. The ID is
+ * stored in the WAL, so it must not change once a permanent one is used.
+ */
+#if PG_VERSION_NUM >= 150000
+#define VECTOR_RMGR_ID			RM_EXPERIMENTAL_ID
+#endif
+#define VECTOR_RMGR_NAME		"pgvector"
+
+/* Record types */
+#define XLOG_VECTOR_ADD_ITEM		0x00
+#define XLOG_HNSW_SET_NEIGHBOR		0x10
+#define XLOG_HNSW_MARK_DELETED		0x20
+#define XLOG_IVFFLAT_PACKED_ADD_ITEM	0x30
+
+/* Add an item to the next offset of block 0 */
+typedef struct xl_vector_add_item
+{
+	OffsetNumber offno;
+}			xl_vector_add_item;
+
+/* Set a neighbor slot on block 0 */
+typedef struct xl_hnsw_set_neighbor
+{
+	OffsetNumber offno;
+	uint16		idx;
+	ItemPointerData indextid;
+	bool		hasDistance;
+	float		distance;
+}			xl_hnsw_set_neighbor;
+
+/* Mark an element on block 0 as deleted (neighbors on block 1 if different) */
+typedef struct xl_hnsw_mark_deleted
+{
+	OffsetNumber offno;
+	OffsetNumber neighborOffno;
+	uint8		version;
+}			xl_hnsw_mark_deleted;
+
+/* Add a value to the next slot of a packed page on block 0 */
+typedef struct xl_ivfflat_packed_add_item
+{
+	ItemPointerData heaptid;
+	uint16		count;
+}			xl_ivfflat_packed_add_item;
+
+void		VectorXLogInit(void);
+bool		VectorXLogEnabled(Relation index);
+OffsetNumber VectorXLogAddItem(Relation index, Buffer buf, Pointer item, Size size);
+void		HnswXLogSetNeighbor(Relation index, Buffer buf, OffsetNumber offno, int idx, BlockNumber blkno, OffsetNumber neighborOffno, bool hasDistance, float distance);
+void		HnswXLogMarkDeleted(Relation index, Buffer buf, OffsetNumber offno, Buffer nbuf, OffsetNumber neighborOffno);
+void		IvfflatXLogPackedAddItem(Relation index, Buffer buf, ItemPointer heaptid, Pointer value);
+
+#endif
@@ -88,6 +88,36 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- fastupdate
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (fastupdate = on);
+
+INSERT INTO t (val) VALUES ('[1,2,4]'), (NULL);
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+SELECT hnsw_clean_pending_list('t_val_idx');
+SELECT hnsw_clean_pending_list('t_val_idx');
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- compact
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+
+DELETE FROM t WHERE val = '[1,1,1]';
+VACUUM t;
+
+SELECT hnsw_compact('t_val_idx');
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
@@ -113,6 +143,8 @@ SHOW hnsw.scan_mem_multiplier;
 SET hnsw.scan_mem_multiplier = 0;
 SET hnsw.scan_mem_multiplier = 1001;
 
+SHOW hnsw.pending_list_limit;
+
 -- dimensions
 
 CREATE TABLE t (val vector(2000));
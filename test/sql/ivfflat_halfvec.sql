@@ -44,6 +44,12 @@ SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <=> (SELECT NULL::halfvec)) t
 
 DROP TABLE t;
 
+-- product quantization
+
+CREATE TABLE t (val halfvec(3));
+CREATE INDEX ON t USING ivfflat (val halfvec_l2_ops) WITH (pq_subvectors = 3);
+DROP TABLE t;
+
 -- dimensions
 
 CREATE TABLE t (val halfvec(4000));
@@ -67,6 +67,71 @@ RESET ivfflat.iterative_scan;
 RESET ivfflat.max_probes;
 DROP TABLE t;
 
+-- center cache
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3);
+
+SET ivfflat.probes = 3;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+SET ivfflat.center_cache_size = 0;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+RESET ivfflat.center_cache_size;
+REINDEX TABLE t;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+RESET ivfflat.probes;
+DROP TABLE t;
+
+-- work_mem
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT ARRAY[i, i, i] FROM generate_series(1, 5000) i;
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1);
+
+SET work_mem = '64kB';
+SELECT * FROM t ORDER BY val <-> '[3.1,3.1,3.1]' LIMIT 3;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[3,3,3]') t2;
+
+RESET work_mem;
+DROP TABLE t;
+
+-- product quantization
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, pq_subvectors = 3);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING ivfflat (val vector_ip_ops) WITH (lists = 1, pq_subvectors = 3);
+SELECT * FROM t ORDER BY val <#> '[3,3,3]';
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, pq_subvectors = 2);
+
+DROP TABLE t;
+
+-- balance lists
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3, balance_lists = on);
+
+SET ivfflat.probes = 3;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+RESET ivfflat.probes;
+DROP TABLE t;
+
 -- unlogged
 
 CREATE UNLOGGED TABLE t (val vector(3));
@@ -82,6 +147,8 @@ DROP TABLE t;
 CREATE TABLE t (val vector(3));
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 0);
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 32769);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (pq_subvectors = -1);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (pq_subvectors = 2001);
 DROP TABLE t;
 
 SHOW ivfflat.probes;
@@ -95,6 +162,18 @@ SHOW ivfflat.max_probes;
 SET ivfflat.max_probes = 0;
 SET ivfflat.max_probes = 32769;
 
+SHOW ivfflat.center_cache_size;
+
+SHOW ivfflat.pq_rerank;
+
+SHOW ivfflat.adaptive_probes;
+SET ivfflat.adaptive_probes = 0.5;
+SET ivfflat.adaptive_probes = 1001;
+
+SHOW ivfflat.group_probes;
+SET ivfflat.group_probes = -1;
+SET ivfflat.group_probes = 32769;
+
 -- dimensions
 
 CREATE TABLE t (val vector(2000));
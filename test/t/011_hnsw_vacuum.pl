@@ -28,7 +28,8 @@ $node->safe_psql("postgres",
 $node->safe_psql("postgres", "CREATE INDEX ON tst USING hnsw (v vector_l2_ops);");
 
 # Get size
-my $size = $node->safe_psql("postgres", "SELECT pg_total_relation_size('tst_v_idx');");
+# Use main fork since free space map is created by vacuum
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx');");
 
 # Delete all, vacuum, and insert same data
 $node->safe_psql("postgres", "DELETE FROM tst;");
@@ -39,9 +40,75 @@ $node->safe_psql("postgres",
 
 # Check size
 # May increase some due to different levels
-my $new_size = $node->safe_psql("postgres", "SELECT pg_total_relation_size('tst_v_idx');");
+my $new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx');");
 cmp_ok($new_size, "<=", $size * 1.02, "size does not increase too much");
 
+# Delete some, vacuum, and insert same data multiple times
+for my $i (1 .. 3)
+{
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 10 = $i;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i WHERE i % 10 = $i;"
+	);
+}
+
+# Check size
+$new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx');");
+cmp_ok($new_size, "<=", $size * 1.02, "size does not increase too much with churn");
+
+# Test parallel repair
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 0;");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = debug1;
+	SET max_parallel_maintenance_workers = 2;
+	SET min_parallel_index_scan_size = 0;
+	VACUUM tst;
+));
+is($ret, 0, "parallel vacuum succeeds");
+like($stderr, qr/using \d+ parallel workers/);
+
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 10) t WHERE i % 3 != 0;
+));
+is($count, 10, "finds elements after parallel repair");
+
+# Test parallel vacuum of multiple indexes
+$node->safe_psql("postgres", "CREATE INDEX ON tst (i);");
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 1;");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = debug1;
+	SET max_parallel_maintenance_workers = 2;
+	SET min_parallel_index_scan_size = 0;
+	VACUUM tst;
+));
+is($ret, 0, "parallel vacuum of multiple indexes succeeds");
+unlike($stderr, qr/using \d+ parallel workers/, "repair is serial in parallel vacuum");
+
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 10) t WHERE i % 3 = 2;
+));
+is($count, 10, "finds elements after parallel vacuum of multiple indexes");
+
+# Test parallel repair with multiple indexes
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 5 = 0;");
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = debug1;
+	SET max_parallel_maintenance_workers = 2;
+	SET min_parallel_index_scan_size = 0;
+	VACUUM (PARALLEL 0) tst;
+));
+is($ret, 0, "parallel repair with multiple indexes succeeds");
+like($stderr, qr/using \d+ parallel workers/);
+
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 10) t WHERE i % 3 = 2 AND i % 5 != 0;
+));
+is($count, 10, "finds elements after parallel repair with multiple indexes");
+
 # Delete all but one
 $node->safe_psql("postgres", "DELETE FROM tst WHERE i != 123;");
 $node->safe_psql("postgres", "VACUUM tst;");
@@ -0,0 +1,104 @@
+# Test custom WAL records work for index replication and recovery.
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 32;
+
+my $node_primary;
+my $node_replica;
+
+# Run few queries on both primary and replica and check their results match.
+sub test_index_replay
+{
+	my ($test_name) = @_;
+
+	# Wait for replica to catch up
+	my $applname = $node_replica->name;
+	my $caughtup_query = "SELECT pg_current_wal_lsn() <= replay_lsn FROM pg_stat_replication WHERE application_name = '$applname';";
+	$node_primary->poll_query_until('postgres', $caughtup_query)
+	  or die "Timed out while waiting for replica to catch up";
+
+	my @r = ();
+	for (1 .. $dim)
+	{
+		push(@r, rand());
+	}
+	my $sql = join(",", @r);
+
+	for my $table (("tst_hnsw", "tst_ivfflat"))
+	{
+		my $queries = qq(
+			SET enable_seqscan = off;
+			SELECT * FROM $table ORDER BY v <-> '[$sql]' LIMIT 10;
+		);
+
+		# Run test queries and compare their result
+		my $primary_result = $node_primary->safe_psql("postgres", $queries);
+		my $replica_result = $node_replica->safe_psql("postgres", $queries);
+
+		is($primary_result, $replica_result, "$test_name: $table query result matches");
+	}
+	return;
+}
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize primary node with custom resource manager (Postgres 15+)
+$node_primary = PostgreSQL::Test::Cluster->new('primary');
+$node_primary->init(allows_streaming => 1);
+$node_primary->append_conf('postgresql.conf', qq(shared_preload_libraries = 'vector'));
+$node_primary->start;
+
+my $version = $node_primary->safe_psql("postgres", "SHOW server_version_num;");
+if ($version < 150000)
+{
+	plan skip_all => "Custom WAL resource managers require Postgres 15+";
+}
+
+my $backup_name = 'my_backup';
+
+# Take backup
+$node_primary->backup($backup_name);
+
+# Create streaming replica linking to primary
+$node_replica = PostgreSQL::Test::Cluster->new('replica');
+$node_replica->init_from_backup($node_primary, $backup_name, has_streaming => 1);
+$node_replica->start;
+
+# Create indexes on primary
+$node_primary->safe_psql("postgres", "CREATE EXTENSION vector;");
+for my $table (("tst_hnsw", "tst_ivfflat"))
+{
+	$node_primary->safe_psql("postgres", "CREATE TABLE $table (i int4, v vector($dim));");
+	$node_primary->safe_psql("postgres",
+		"INSERT INTO $table SELECT i % 10, ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+	);
+}
+$node_primary->safe_psql("postgres", "CREATE INDEX ON tst_hnsw USING hnsw (v vector_l2_ops);");
+$node_primary->safe_psql("postgres", "CREATE INDEX ON tst_ivfflat USING ivfflat (v vector_l2_ops) WITH (lists = 10);");
+
+test_index_replay('initial');
+
+for my $i (1 .. 5)
+{
+	for my $table (("tst_hnsw", "tst_ivfflat"))
+	{
+		$node_primary->safe_psql("postgres", "DELETE FROM $table WHERE i = $i;");
+		$node_primary->safe_psql("postgres", "VACUUM $table;");
+		my ($start, $end) = (1001 + ($i - 1) * 100, 1000 + $i * 100);
+		$node_primary->safe_psql("postgres",
+			"INSERT INTO $table SELECT i % 10, ARRAY[$array_sql] FROM generate_series($start, $end) i;"
+		);
+	}
+	test_index_replay("cycle $i");
+}
+
+# Check crash recovery replays records
+$node_replica->stop('immediate');
+$node_replica->start;
+test_index_replay('after restart');
+
+done_testing();
@@ -0,0 +1,66 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector($dim));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (fastupdate = on);");
+$node->safe_psql("postgres", "ALTER SYSTEM SET hnsw.pending_list_limit = 64;");
+$node->reload;
+
+# Test concurrent inserts and flushes
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=1000",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent INSERTs, DELETEs, SELECTs, and VACUUM",
+	{
+		"050_hnsw_pending_list_insert\@500" => "INSERT INTO tst (v) VALUES (ARRAY[$array_sql]);",
+		"050_hnsw_pending_list_delete\@100" => "DELETE FROM tst WHERE i = (SELECT i FROM tst LIMIT 1);",
+		"050_hnsw_pending_list_select\@20" => "SELECT i FROM tst ORDER BY v <-> (SELECT ARRAY[$array_sql]::vector) LIMIT 10;",
+		"050_hnsw_pending_list_vacuum\@1" => "VACUUM tst;"
+	}
+);
+
+# Test closest tuple found in pending list
+$node->safe_psql("postgres", "INSERT INTO tst (v) VALUES ('[0,0,0]');");
+my $result = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT v FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 1;
+));
+is($result, "[0,0,0]");
+
+# Test flush moves tuples into graph
+$node->safe_psql("postgres", "SELECT hnsw_clean_pending_list('idx');");
+$result = $node->safe_psql("postgres", "SELECT hnsw_clean_pending_list('idx');");
+is($result, 0);
+
+$result = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT v FROM tst ORDER BY v <-> '[0,0,0]' LIMIT 1;
+));
+is($result, "[0,0,0]");
+
+# Test vacuum flushes pending list
+$node->safe_psql("postgres", "INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 100) i;");
+$node->safe_psql("postgres", "VACUUM tst;");
+$result = $node->safe_psql("postgres", "SELECT hnsw_clean_pending_list('idx');");
+is($result, 0);
+
+done_testing();
@@ -0,0 +1,121 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+sub test_recall
+{
+	my ($min, $ef_search, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.ef_search = $ef_search;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector($dim));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (m = 4, ef_construction = 8, reverse_edges = on);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Delete some, vacuum, and insert multiple times
+for my $i (1 .. 3)
+{
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 10 = $i;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+	);
+
+	get_expected();
+	test_recall(0.95, 100, "cycle $i");
+}
+
+# Delete most and vacuum
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 4 != 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+get_expected();
+test_recall(0.95, 100, "after vacuum");
+
+# Test no "hnsw graph not repaired" errors
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=1000",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent INSERTs, DELETEs, SELECTs, and VACUUM",
+	{
+		"051_hnsw_reverse_edges_insert\@500" => "INSERT INTO tst (v) VALUES (ARRAY[$array_sql]);",
+		"051_hnsw_reverse_edges_delete\@500" => "DELETE FROM tst WHERE i = (SELECT i FROM tst LIMIT 1);",
+		"051_hnsw_reverse_edges_select\@20" => "SELECT i FROM tst ORDER BY v <-> (SELECT ARRAY[$array_sql]::vector) LIMIT 10;",
+		"051_hnsw_reverse_edges_vacuum\@1" => "VACUUM tst;"
+	}
+);
+
+$node->safe_psql("postgres", "VACUUM tst;");
+
+get_expected();
+test_recall(0.95, 100, "after concurrent vacuum");
+
+done_testing();
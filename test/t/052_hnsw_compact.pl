@@ -0,0 +1,184 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.ef_search = 100;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		is(scalar(@actual_ids), scalar(keys %actual_set), "$test_name: no duplicates");
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+sub test_duplicates
+{
+	my ($test_name) = @_;
+
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.iterative_scan = relaxed_order;
+		SELECT COUNT(*) - COUNT(DISTINCT i) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 100000) t;
+	));
+	is($res, 0, "$test_name: no duplicates");
+}
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+for my $options (("m = 16", "m = 16, reverse_edges = on"))
+{
+	# Create table and index
+	$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector($dim));");
+	$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+	);
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH ($options);");
+
+	# Delete some from the start and most from the end
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE (i <= 5000 AND i % 2 = 0) OR (i > 5000 AND i % 10 != 0);");
+	$node->safe_psql("postgres", "VACUUM tst;");
+
+	my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+
+	# Test compact truncates pages
+	my $truncated = $node->safe_psql("postgres", "SELECT hnsw_compact('idx');");
+	cmp_ok($truncated, ">", 0, "$options: truncates pages");
+
+	my $new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+	cmp_ok($new_size, "<", $size, "$options: size decreases");
+
+	get_expected();
+	test_recall(0.95, "$options: after compact");
+
+	# Test inserts and vacuum after compact
+	$node->safe_psql("postgres",
+		"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+	);
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 0;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+
+	get_expected();
+	test_recall(0.95, "$options: after vacuum");
+
+	# Test concurrent scans
+	$node->pgbench(
+		"--no-vacuum --client=5 --transactions=100",
+		0,
+		[qr{actually processed}],
+		[qr{^$}],
+		"$options: concurrent SELECTs and compact",
+		{
+			"052_hnsw_compact_select\@20" => "SELECT i FROM tst ORDER BY v <-> (SELECT ARRAY[$array_sql]::vector) LIMIT 10;",
+			"052_hnsw_compact_delete\@5" => "DELETE FROM tst WHERE i = (SELECT i FROM tst LIMIT 1);",
+			"052_hnsw_compact_vacuum\@1" => "VACUUM tst;",
+			"052_hnsw_compact_compact\@1" => "SELECT hnsw_compact('idx');"
+		}
+	);
+
+	get_expected();
+	test_recall(0.95, "$options: after concurrent compact");
+
+	$node->safe_psql("postgres", "DROP TABLE tst;");
+}
+
+# Test cancel
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector($dim));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 50000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i > 10000 AND i % 10 != 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+my $canceled = 0;
+for (my $timeout = 1; ; $timeout *= 2)
+{
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET statement_timeout = $timeout;
+		SELECT hnsw_compact('idx');
+	));
+	last if $ret == 0;
+
+	like($stderr, qr/canceling statement due to statement timeout/);
+	test_duplicates("cancel after $timeout ms");
+	$canceled++;
+}
+cmp_ok($canceled, ">", 0, "cancels compact");
+
+# Test next compact frees copies from canceled ones
+$node->safe_psql("postgres", "SELECT hnsw_compact('idx');");
+test_duplicates("after cancel");
+
+get_expected();
+test_recall(0.95, "after cancel");
+
+$node->safe_psql("postgres", "DROP TABLE tst;");
+
+# Test not hnsw index
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres", "CREATE INDEX btree_idx ON tst (i);");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_compact('btree_idx');");
+like($stderr, qr/is not an hnsw index/);
+
+done_testing();
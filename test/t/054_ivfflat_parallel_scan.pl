@@ -0,0 +1,63 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+my $parallel_sql = qq(
+	SET enable_seqscan = off;
+	SET parallel_setup_cost = 0;
+	SET parallel_tuple_cost = 0;
+	SET min_parallel_table_scan_size = 0;
+	SET min_parallel_index_scan_size = 0;
+	SET max_parallel_workers_per_gather = 2;
+	SET ivfflat.probes = 10;
+);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);");
+
+my $query = "SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 100";
+
+# Check plan
+my $explain = $node->safe_psql("postgres", qq(
+	$parallel_sql
+	EXPLAIN (COSTS OFF) $query;
+));
+like($explain, qr/Gather Merge/);
+like($explain, qr/Parallel Index Scan using tst_v_idx on tst/);
+
+# Check results match a serial scan when all lists are probed
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 10;
+	$query;
+));
+my $actual = $node->safe_psql("postgres", qq(
+	$parallel_sql
+	$query;
+));
+is($actual, $expected);
+
+# Check rescans
+$actual = $node->safe_psql("postgres", qq(
+	$parallel_sql
+	SET enable_hashjoin = off;
+	SET enable_mergejoin = off;
+	SELECT COUNT(*) FROM generate_series(1, 3) g, LATERAL ($query) t;
+));
+is($actual, 300);
+
+done_testing();
@@ -0,0 +1,67 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector($dim));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);");
+
+# Add pages to the end of chains so they are no longer contiguous
+for (1 .. 5)
+{
+	$node->safe_psql("postgres",
+		"INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+	);
+}
+
+# Remove tuples from every list
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 3 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+my $count = $node->safe_psql("postgres", "SELECT COUNT(*) FROM tst;");
+
+for my $cache_size ("0", "1MB")
+{
+	# Check all tuples are found when all lists are probed
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.center_cache_size = '$cache_size';
+		SET ivfflat.probes = 10;
+		SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 20000) t;
+	));
+	is($actual, $count, "center_cache_size = $cache_size");
+}
+
+# Check each page is read at most once
+my $nblocks = $node->safe_psql("postgres", "SELECT pg_relation_size('tst_v_idx') / current_setting('block_size')::int;");
+my $fetched = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 10;
+	BEGIN;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 20000) t;
+	SELECT pg_stat_get_xact_blocks_fetched('tst_v_idx'::regclass) AS before \\gset
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 20000) t;
+	SELECT pg_stat_get_xact_blocks_fetched('tst_v_idx'::regclass) - :before;
+	COMMIT;
+));
+my @lines = split("\n", $fetched);
+
+# Metapage and entry pages, since centers are cached
+cmp_ok($lines[-1], "<=", $nblocks - 1, "no extra reads");
+
+done_testing();
@@ -0,0 +1,63 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 20);");
+
+my $query = "SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 10000) t";
+
+sub count_rows
+{
+	my ($settings) = @_;
+	return $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		$settings
+		$query;
+	));
+}
+
+# Check additional lists are searched
+my $fixed = count_rows("SET ivfflat.probes = 1;");
+my $adaptive = count_rows("SET ivfflat.probes = 1; SET ivfflat.adaptive_probes = 1000;");
+is($adaptive, 10000);
+cmp_ok($fixed, "<", $adaptive);
+
+# Check max probes
+my $capped = count_rows("SET ivfflat.probes = 1; SET ivfflat.adaptive_probes = 1000; SET ivfflat.max_probes = 1;");
+is($capped, $fixed);
+
+# Check probes is a minimum
+my $minimum = count_rows("SET ivfflat.probes = 20; SET ivfflat.adaptive_probes = 1;");
+is($minimum, 10000);
+
+# Check EXPLAIN
+my $version = $node->safe_psql("postgres", "SHOW server_version_num;");
+if ($version >= 180000)
+{
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 1;
+		SET ivfflat.adaptive_probes = 1000;
+		SET ivfflat.max_probes = 5;
+		EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) $query;
+	));
+	like($explain, qr/Lists Probed: 5/);
+}
+
+done_testing();
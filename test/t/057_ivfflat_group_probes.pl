@@ -0,0 +1,104 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+sub test_recall
+{
+	my ($group_probes, $min, $cache_size) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = 10;
+			SET ivfflat.group_probes = $group_probes;
+			SET ivfflat.center_cache_size = '$cache_size';
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %expected_set = map { $_ => 1 } split("\n", $expected[$i]);
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, "group_probes $group_probes, center_cache_size $cache_size");
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 100);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my @r = map { rand() } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Get results with all centers
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 10;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+# Same lists when groups cover all lists
+test_recall(10, 1.00, '4MB');
+test_recall(3, 0.80, '4MB');
+test_recall(1, 0.50, '4MB');
+
+# Groups without cached centers
+test_recall(3, 0.80, '3kB');
+
+# Notice when groups are not available
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.group_probes = 3;
+	SET ivfflat.center_cache_size = 0;
+	SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+));
+like($stderr, qr/ivfflat.group_probes is ignored/);
+
+# Iterative scans search lists outside the closest groups
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 1;
+	SET ivfflat.group_probes = 1;
+	SET ivfflat.iterative_scan = relaxed_order;
+	SELECT COUNT(*) FROM (SELECT i FROM tst WHERE i % 2 = 0 ORDER BY v <-> '$queries[0]' LIMIT 20000) t;
+));
+is($count, 10000);
+
+done_testing();
@@ -0,0 +1,120 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+sub test_recall
+{
+	my ($min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = 10;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %expected_set = map { $_ => 1 } split("\n", $expected[$i]);
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $operator);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my @r = map { rand() } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Check each index type
+my @operators = ("<->", "<#>", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_ip_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+
+	# Build index with parallel k-means
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET min_parallel_table_scan_size = 1;
+		CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = 100);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/using \d+ parallel workers for k-means/);
+
+	if ($operator eq "<#>")
+	{
+		# TODO Fix test (uniform random vectors all have similar inner product)
+		test_recall(0.70, $operator);
+	}
+	else
+	{
+		test_recall(0.90, $operator);
+	}
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+# Sums for each participant use 2 MB for 500 lists and 1000 dimensions
+$node->safe_psql("postgres", "CREATE TABLE tst2 (v vector(1000));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst2 SELECT array_agg(random())::vector FROM generate_series(1, 1000 * 1000) i GROUP BY i % 1000;"
+);
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET min_parallel_table_scan_size = 1;
+	SET maintenance_work_mem = '12MB';
+	CREATE INDEX ON tst2 USING ivfflat (v vector_l2_ops) WITH (lists = 500);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/not enough maintenance_work_mem for parallel k-means/);
+unlike($stderr, qr/using \d+ parallel workers for k-means/);
+
+done_testing();
@@ -0,0 +1,101 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $lists = 20;
+my $count = 100000;
+my $array_sql = join(",", ('random()') x $dim);
+
+sub test_index
+{
+	my ($operator, $desc) = @_;
+
+	# All tuples are in the index
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = $lists;
+		SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $count) t;
+	));
+	is($actual, $count, "$operator $desc count");
+
+	# Exact results when all lists are probed
+	for my $i (0 .. $#queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = $lists;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		is($res, $expected[$i], "$operator $desc query $i");
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, $count) i;"
+);
+
+# Generate queries
+for (1 .. 5)
+{
+	my @r = map { rand() } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Check each index type
+my @operators = ("<->", "<#>", "<=>");
+my @opclasses = ("vector_l2_ops", "vector_ip_ops", "vector_cosine_ops");
+
+for my $i (0 .. $#operators)
+{
+	my $operator = $operators[$i];
+	my $opclass = $opclasses[$i];
+
+	# Get exact results
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+
+	# Build index with tuples spilled to disk
+	$node->safe_psql("postgres", qq(
+		SET maintenance_work_mem = '1MB';
+		SET max_parallel_maintenance_workers = 0;
+		CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = $lists);
+	));
+	test_index($operator, "serial");
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Build index in parallel with tuples spilled to disk
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET maintenance_work_mem = '1MB';
+		SET min_parallel_table_scan_size = 1;
+		CREATE INDEX idx ON tst USING ivfflat (v $opclass) WITH (lists = $lists);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/using \d+ parallel workers/);
+	test_index($operator, "parallel");
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+done_testing();
@@ -0,0 +1,105 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $dim = 3;
+my $lists = 20;
+my $count = 10000;
+my $array_sql = join(",", ('random()') x $dim);
+my $dense_sql = join(",", ('random() * 0.01') x $dim);
+
+sub test_recall
+{
+	my ($min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET ivfflat.probes = 5;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %expected_set = map { $_ => 1 } split("\n", $expected[$i]);
+
+		foreach (@actual_ids)
+		{
+			if (exists($expected_set{$_}))
+			{
+				$correct++;
+			}
+		}
+
+		$total += $limit;
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $operator);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table with most rows in a small region
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$dense_sql] FROM generate_series(1, 8000) i;"
+);
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(8001, $count) i;"
+);
+
+# Generate queries from both regions
+for (1 .. 10)
+{
+	my @r = map { rand() * 0.01 } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+for (1 .. 10)
+{
+	my @r = map { rand() } (1 .. $dim);
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Get exact results
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+for my $workers (0, 2)
+{
+	# Build index with balanced lists
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET max_parallel_maintenance_workers = $workers;
+		SET min_parallel_table_scan_size = 1;
+		CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = $lists, balance_lists = on);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/split \d+ lists to balance list sizes/);
+
+	# Check the largest list
+	ok($stderr =~ /list sizes: min \d+, p50 \d+, p90 \d+, p99 \d+, max (\d+)/, "list sizes");
+	cmp_ok($1, "<=", 3 * $count / $lists, "max list size with $workers workers");
+
+	test_recall(0.90, "<->");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+done_testing();